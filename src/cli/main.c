@@ -76,10 +76,15 @@ fprintf(stderr, "darktable %s\n"
                 "  darktable-cli [IMAGE_FILE | IMAGE_FOLDER]\n"
                 "                [XMP_FILE] DIR [OPTIONS]\n"
                 "                [--core DARKTABLE_OPTIONS]\n"
+                "  darktable-cli --batch MANIFEST_FILE [OPTIONS]\n"
+                "                [--core DARKTABLE_OPTIONS]\n"
                 "\n"
                 "Options:\n"
                 "   --apply-custom-presets <0|1|false|true>, default: true\n"
                 "                          disable for multiple instances\n"
+                "   --batch <file>  export all lines of the manifest file, each line being\n"
+                "                   <input><TAB><xmp or - or empty><TAB><output file>\n"
+                "                   the output extension selects the format\n"
                 "   --bpp <bpp>, unsupported\n"
                 "   --export_masks <0|1|false|true>, default: false\n"
 
@@ -99,6 +104,9 @@ fprintf(stderr, "darktable %s\n"
                 "   --icc-file <file> specify icc filename, default to NONE\n"
                 "   --icc-intent <intent> specify icc intent, default to LAST\n"
                 "                     use --help icc-intent for list of supported intents\n"
+                "   --jobs <n>      export n images in parallel, default: 1\n"
+                "                   with --jobs or --batch a line per image is printed:\n"
+                "                   <ok|failed><TAB><number><TAB><seconds><TAB><input>\n"
                 "   --verbose\n"
                 "   -h, --help [option]\n"
                 "   -v, --version\n",
@@ -197,6 +205,351 @@ static dt_iop_color_intent_t get_icc_intent(const char* option)
 }
 #undef ICC_INTENT_FROM_STR
 
+// one image to be exported, either from the command line inputs or
+// from one line of a --batch manifest
+typedef struct _cli_task_t
+{
+  int line;                           // manifest line or running number
+  int num;                            // sequence number passed to the storage
+  dt_imgid_t imgid;
+  gchar *input;
+  gchar *xmp;                         // only set in batch mode
+  dt_imageio_module_format_t *format;
+  dt_imageio_module_data_t *fdata;    // template, copied by the workers
+  dt_imageio_module_data_t *sdata;    // owned by the task in batch mode
+} _cli_task_t;
+
+typedef struct _cli_pool_t
+{
+  GPtrArray *tasks;
+  dt_imageio_module_storage_t *storage;
+  gboolean high_quality, upscale, export_masks;
+  dt_colorspaces_color_profile_type_t icc_type;
+  const gchar *icc_filename;
+  dt_iop_color_intent_t icc_intent;
+  gboolean report;
+  int omp_threads;
+
+  dt_pthread_mutex_t lock;
+  pthread_cond_t cond;
+  gboolean *started;
+  GHashTable *busy;                   // images currently in a pipe
+  int res;
+} _cli_pool_t;
+
+static gchar *_format_name_from_ext(const char *ext)
+{
+  if(!strcmp(ext, "jpg")) return g_strdup("jpeg");
+  if(!strcmp(ext, "tif")) return g_strdup("tiff");
+  if(!strcmp(ext, "jxl")) return g_strdup("jpegxl");
+  return g_strdup(ext);
+}
+
+static dt_imgid_t _import_file(const gchar *input)
+{
+  dt_film_t film;
+  gchar *directory = g_path_get_dirname(input);
+  const dt_filmid_t filmid = dt_film_new(&film, directory);
+  const dt_imgid_t id = dt_image_import(filmid, input, TRUE, TRUE);
+  g_free(directory);
+  return id;
+}
+
+static gboolean _attach_xmp(const dt_imgid_t id, const char *xmp_filename)
+{
+  dt_image_t *image = dt_image_cache_get(darktable.image_cache, id, 'w');
+  const gboolean failed = dt_exif_xmp_read(image, xmp_filename, 1);
+  // don't write new xmp:
+  dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_RELAXED);
+  return failed;
+}
+
+// bring back the history the image got on import, from its own sidecar if
+// there is one. an earlier line of a manifest may have attached another xmp.
+static gboolean _restore_history(const dt_imgid_t id)
+{
+  char sidecar[PATH_MAX] = { 0 };
+  gboolean from_cache = FALSE;
+  dt_image_full_path(id, sidecar, sizeof(sidecar), &from_cache);
+  g_strlcat(sidecar, ".xmp", sizeof(sidecar));
+  if(g_file_test(sidecar, G_FILE_TEST_EXISTS))
+    return _attach_xmp(id, sidecar);
+
+  // there is no develop to reload here, so only drop the history and let
+  // the auto-applied presets come back like on import
+  dt_history_delete_on_image_ext(id, FALSE, FALSE);
+  dt_image_t *image = dt_image_cache_get(darktable.image_cache, id, 'w');
+  image->flags &= ~DT_IMAGE_AUTO_PRESETS_APPLIED;
+  dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_RELAXED);
+  return FALSE;
+}
+
+static void _setup_fdata(dt_imageio_module_storage_t *storage,
+                         dt_imageio_module_data_t *sdata,
+                         dt_imageio_module_format_t *format,
+                         dt_imageio_module_data_t *fdata,
+                         const int width,
+                         const int height,
+                         const char *style,
+                         const gboolean style_overwrite)
+{
+  uint32_t w, h, fw, fh, sw, sh;
+  fw = fh = sw = sh = 0;
+  storage->dimension(storage, sdata, &sw, &sh);
+  format->dimension(format, fdata, &fw, &fh);
+
+  if(sw == 0 || fw == 0)
+    w = sw > fw ? sw : fw;
+  else
+    w = sw < fw ? sw : fw;
+
+  if(sh == 0 || fh == 0)
+    h = sh > fh ? sh : fh;
+  else
+    h = sh < fh ? sh : fh;
+
+  fdata->max_width = width;
+  fdata->max_height = height;
+  fdata->max_width = (w != 0 && fdata->max_width > w) ? w : fdata->max_width;
+  fdata->max_height = (h != 0 && fdata->max_height > h) ? h : fdata->max_height;
+  fdata->style[0] = '\0';
+  fdata->style_append = 1; // make append the default and override with --style-overwrite
+
+  if(style)
+  {
+    g_strlcpy((char *)fdata->style, style, DT_MAX_STYLE_NAME_LENGTH);
+    fdata->style[127] = '\0';
+    if(style_overwrite)
+      fdata->style_append = 0;
+  }
+}
+
+static void _free_task(gpointer data)
+{
+  _cli_task_t *task = (_cli_task_t *)data;
+  g_free(task->input);
+  g_free(task->xmp);
+  g_free(task);
+}
+
+// pick the first task not started yet whose image isn't processed by
+// another worker, a manifest may list the same image with different xmps
+static _cli_task_t *_pool_claim(_cli_pool_t *pool)
+{
+  dt_pthread_mutex_lock(&pool->lock);
+  for(;;)
+  {
+    gboolean pending = FALSE;
+    for(guint i = 0; i < pool->tasks->len; i++)
+    {
+      if(pool->started[i]) continue;
+      _cli_task_t *task = g_ptr_array_index(pool->tasks, i);
+      pending = TRUE;
+      if(g_hash_table_contains(pool->busy, GINT_TO_POINTER(task->imgid))) continue;
+
+      pool->started[i] = TRUE;
+      g_hash_table_add(pool->busy, GINT_TO_POINTER(task->imgid));
+      dt_pthread_mutex_unlock(&pool->lock);
+      return task;
+    }
+    if(!pending) break;
+    dt_pthread_cond_wait(&pool->cond, &pool->lock);
+  }
+  dt_pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void _pool_run_task(_cli_pool_t *pool, _cli_task_t *task)
+{
+  const double start = dt_get_wtime();
+  const int total = pool->tasks->len;
+  gboolean failed = FALSE;
+
+  if(task->xmp && _attach_xmp(task->imgid, task->xmp))
+  {
+    fprintf(stderr, _("error: can't open XMP file %s"), task->xmp);
+    fprintf(stderr, "\n");
+    failed = TRUE;
+  }
+  else if(!task->xmp && _restore_history(task->imgid))
+  {
+    fprintf(stderr, _("error: can't restore the history of %s"), task->input);
+    fprintf(stderr, "\n");
+    failed = TRUE;
+  }
+
+  // every pipe works on its own copy of the format data
+  dt_imageio_module_data_t *fdata = failed ? NULL : task->format->get_params(task->format);
+  if(fdata)
+  {
+    memcpy(fdata, task->fdata, task->format->params_size(task->format));
+    // TODO: have a parameter in command line to get the export presets
+    dt_export_metadata_t metadata;
+    metadata.flags = dt_lib_export_metadata_default_flags();
+    metadata.list = NULL;
+    failed = pool->storage->store(pool->storage, task->sdata, task->imgid, task->format, fdata,
+                                  task->num, total, pool->high_quality, pool->upscale,
+                                  pool->export_masks, pool->icc_type, pool->icc_filename,
+                                  pool->icc_intent, &metadata) != 0;
+    task->format->free_params(task->format, fdata);
+  }
+  else
+    failed = TRUE;
+
+  dt_pthread_mutex_lock(&pool->lock);
+  if(failed) pool->res = 1;
+  // machine readable status line: status, line, seconds, input
+  if(pool->report)
+  {
+    printf("%s\t%d\t%.3f\t%s\n", failed ? "failed" : "ok",
+           task->line, dt_get_wtime() - start, task->input);
+    fflush(stdout);
+  }
+  g_hash_table_remove(pool->busy, GINT_TO_POINTER(task->imgid));
+  pthread_cond_broadcast(&pool->cond);
+  dt_pthread_mutex_unlock(&pool->lock);
+}
+
+static void *_pool_worker(void *ptr)
+{
+  _cli_pool_t *pool = (_cli_pool_t *)ptr;
+#ifdef _OPENMP // need to do this in every thread
+  omp_set_num_threads(pool->omp_threads);
+#endif
+  _cli_task_t *task;
+  while((task = _pool_claim(pool)))
+    _pool_run_task(pool, task);
+  return NULL;
+}
+
+// export all tasks with `jobs' pipes in parallel, the main thread being
+// one of them. returns 0 if all images got exported.
+static int _pool_run(_cli_pool_t *pool, const int jobs)
+{
+  const int nworkers = CLAMP(jobs, 1, MAX(1, (int)pool->tasks->len));
+  pool->started = g_malloc0_n(MAX(1, pool->tasks->len), sizeof(gboolean));
+  pool->busy = g_hash_table_new(NULL, NULL);
+  pool->omp_threads = MAX(1, (int)dt_get_num_threads() / nworkers);
+  dt_pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  pthread_t *threads = g_malloc0_n(nworkers, sizeof(pthread_t));
+  int started = 0;
+  for(int k = 1; k < nworkers; k++)
+    if(!dt_pthread_create(&threads[started], _pool_worker, pool)) started++;
+
+#ifdef _OPENMP
+  if(started) omp_set_num_threads(pool->omp_threads);
+#endif
+  _cli_task_t *task;
+  while((task = _pool_claim(pool)))
+    _pool_run_task(pool, task);
+
+  for(int k = 0; k < started; k++)
+    pthread_join(threads[k], NULL);
+
+  g_free(threads);
+  pthread_cond_destroy(&pool->cond);
+  dt_pthread_mutex_destroy(&pool->lock);
+  g_hash_table_destroy(pool->busy);
+  g_free(pool->started);
+  return pool->res;
+}
+
+// read a --batch manifest: one `input<TAB>xmp<TAB>output' per line, the
+// xmp may be empty or `-'. empty lines and lines starting with # are skipped.
+// the output file extension selects the format. every input gets imported
+// right here, failures are reported and counted in *res.
+static GPtrArray *_read_manifest(const char *filename,
+                                 dt_imageio_module_storage_t *storage,
+                                 const int width,
+                                 const int height,
+                                 const char *style,
+                                 const gboolean style_overwrite,
+                                 const gboolean report,
+                                 int *res)
+{
+  gchar *content = NULL;
+  if(!g_file_get_contents(filename, &content, NULL, NULL))
+  {
+    fprintf(stderr, _("error: can't read batch file %s"), filename);
+    fprintf(stderr, "\n");
+    return NULL;
+  }
+
+  GPtrArray *tasks = g_ptr_array_new_with_free_func(_free_task);
+  gchar **lines = g_strsplit(content, "\n", -1);
+  g_free(content);
+
+  for(int i = 0; lines[i]; i++)
+  {
+    g_strchomp(lines[i]);
+    if(lines[i][0] == '\0' || lines[i][0] == '#') continue;
+
+    const int line = i + 1;
+    gchar **fields = g_strsplit(lines[i], "\t", 3);
+    const char *error = NULL;
+
+    if(g_strv_length(fields) != 3 || fields[0][0] == '\0' || fields[2][0] == '\0')
+      error = "malformed line";
+
+    const dt_imgid_t id = error ? NO_IMGID : _import_file(fields[0]);
+    if(!error && !dt_is_valid_imgid(id))
+      error = "can't open file";
+
+    char *ext = error ? NULL : strrchr(fields[2], '.');
+    if(!error && (!ext || strlen(ext) <= 1 || strlen(ext) > DT_MAX_OUTPUT_EXT_LENGTH + 1))
+      error = "invalid output file extension";
+
+    dt_imageio_module_format_t *format = NULL;
+    if(!error)
+    {
+      gchar *format_name = _format_name_from_ext(ext + 1);
+      format = dt_imageio_get_format_by_name(format_name);
+      g_free(format_name);
+      if(!format) error = "unknown output file extension";
+    }
+
+    dt_imageio_module_data_t *sdata = error ? NULL : storage->get_params(storage);
+    dt_imageio_module_data_t *fdata = sdata ? format->get_params(format) : NULL;
+    if(!error && (!sdata || !fdata))
+      error = "failed to get export parameters";
+
+    if(error)
+    {
+      if(sdata) storage->free_params(storage, sdata);
+      // the status line keeps the documented fields, the reason goes to stderr
+      if(report)
+        printf("failed\t%d\t0.000\t%s\n", line, fields[0] ? fields[0] : "");
+      fprintf(stderr, "error: %s in %s line %d\n", error, filename, line);
+      *res = 1;
+      g_strfreev(fields);
+      continue;
+    }
+
+    // same hack as for the single output: the storage takes the filename
+    // without extension as first member of its params
+    *ext = '\0';
+    g_strlcpy((char *)sdata, fields[2], DT_MAX_PATH_FOR_PARAMS);
+    _setup_fdata(storage, sdata, format, fdata, width, height, style, style_overwrite);
+
+    _cli_task_t *task = g_new0(_cli_task_t, 1);
+    task->line = line;
+    task->num = tasks->len + 1;
+    task->imgid = id;
+    task->input = g_strdup(fields[0]);
+    if(fields[1][0] != '\0' && strcmp(fields[1], "-"))
+      task->xmp = g_strdup(fields[1]);
+    task->format = format;
+    task->fdata = fdata;
+    task->sdata = sdata;
+    g_ptr_array_add(tasks, task);
+    g_strfreev(fields);
+  }
+  g_strfreev(lines);
+  return tasks;
+}
+
 int main(int argc, char *arg[])
 {
 #ifdef __APPLE__
@@ -217,7 +570,10 @@ int main(int argc, char *arg[])
   gchar *output_filename = NULL;
   gchar *output_ext = NULL;
   char *style = NULL;
+  char *batch_filename = NULL;
   int file_counter = 0;
+  int jobs = 1;
+  gboolean report = FALSE;
   int width = 0, height = 0, bpp = 0;
   gboolean verbose = FALSE, high_quality = TRUE, upscale = FALSE,
            style_overwrite = FALSE, custom_presets = TRUE, export_masks = FALSE,
@@ -404,6 +760,18 @@ int main(int argc, char *arg[])
           exit(1);
         }
       }
+      else if(!strcmp(arg[k], "--jobs") && argc > k + 1)
+      {
+        k++;
+        jobs = MAX(atoi(arg[k]), 1);
+        report = TRUE;
+      }
+      else if(!strcmp(arg[k], "--batch") && argc > k + 1)
+      {
+        k++;
+        batch_filename = arg[k];
+        report = TRUE;
+      }
       else if(!strcmp(arg[k], "-v") || !strcmp(arg[k], "--verbose"))
       {
         verbose = TRUE;
@@ -443,6 +811,73 @@ int main(int argc, char *arg[])
   for(; k < argc; k++) m_arg[m_argc++] = arg[k];
   m_arg[m_argc] = NULL;
 
+  if(batch_filename)
+  {
+    if(inputs || file_counter > 0)
+    {
+      fprintf(stderr, _("error: --batch can't be combined with other inputs or outputs\n"));
+      usage(arg[0]);
+      free(m_arg);
+      g_free(output_filename);
+      g_free(output_ext);
+      g_list_free_full(inputs, g_free);
+      exit(1);
+    }
+
+    // init dt once for the whole manifest
+    if(dt_init(m_argc, m_arg, FALSE, custom_presets, NULL))
+    {
+      free(m_arg);
+      g_free(output_ext);
+      exit(1);
+    }
+
+    dt_imageio_module_storage_t *storage = dt_imageio_get_storage_by_name("disk");
+    if(storage == NULL)
+    {
+      fprintf(
+          stderr, "%s\n",
+          _("cannot find disk storage module. please check your installation, something seems to be broken."));
+      free(m_arg);
+      g_free(output_ext);
+      exit(1);
+    }
+
+    int res = 0;
+    GPtrArray *tasks = _read_manifest(batch_filename, storage, width, height,
+                                      style, style_overwrite, report, &res);
+    if(!tasks)
+      res = 1;
+    else
+    {
+      _cli_pool_t pool = { 0 };
+      pool.tasks = tasks;
+      pool.storage = storage;
+      pool.high_quality = high_quality;
+      pool.upscale = upscale;
+      pool.export_masks = export_masks;
+      pool.icc_type = icc_type;
+      pool.icc_filename = icc_filename;
+      pool.icc_intent = icc_intent;
+      pool.report = report;
+      if(_pool_run(&pool, jobs)) res = 1;
+
+      for(guint i = 0; i < tasks->len; i++)
+      {
+        _cli_task_t *task = g_ptr_array_index(tasks, i);
+        storage->free_params(storage, task->sdata);
+        task->format->free_params(task->format, task->fdata);
+      }
+      g_ptr_array_free(tasks, TRUE);
+    }
+
+    g_free(icc_filename);
+    g_free(output_ext);
+    dt_cleanup();
+    free(m_arg);
+    exit(res);
+  }
+
   if( (inputs && file_counter < 1) || (!inputs && file_counter < 2) || file_counter > 3)
   {
     usage(arg[0]);
@@ -560,13 +995,7 @@ int main(int argc, char *arg[])
     }
     else
     {
-      dt_film_t film;
-      dt_filmid_t filmid = NO_FILMID;
-
-      gchar *directory = g_path_get_dirname(input);
-      filmid = dt_film_new(&film, directory);
-      const dt_imgid_t id = dt_image_import(filmid, input, TRUE, TRUE);
-      g_free(directory);
+      const dt_imgid_t id = _import_file(input);
       if(!dt_is_valid_imgid(id))
       {
         fprintf(stderr, _("error: can't open file %s"), input);
@@ -599,9 +1028,8 @@ int main(int argc, char *arg[])
   {
     for(GList *iter = id_list; iter; iter = g_list_next(iter))
     {
-      int id = GPOINTER_TO_INT(iter->data);
-      dt_image_t *image = dt_image_cache_get(darktable.image_cache, id, 'w');
-      if(dt_exif_xmp_read(image, xmp_filename, 1))
+      const dt_imgid_t id = GPOINTER_TO_INT(iter->data);
+      if(_attach_xmp(id, xmp_filename))
       {
         fprintf(stderr, _("error: can't open XMP file %s"), xmp_filename);
         fprintf(stderr, "\n");
@@ -611,8 +1039,6 @@ int main(int argc, char *arg[])
           g_free(output_ext);
         exit(1);
       }
-      // don't write new xmp:
-      dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_RELAXED);
     }
   }
 
@@ -661,23 +1087,9 @@ int main(int argc, char *arg[])
     }
   }
 
-  if(!strcmp(output_ext, "jpg"))
-  {
-    g_free(output_ext);
-    output_ext = g_strdup("jpeg");
-  }
-
-  if(!strcmp(output_ext, "tif"))
-  {
-    g_free(output_ext);
-    output_ext = g_strdup("tiff");
-  }
-
-  if(!strcmp(output_ext, "jxl"))
-  {
-    g_free(output_ext);
-    output_ext = g_strdup("jpegxl");
-  }
+  gchar *format_name = _format_name_from_ext(output_ext);
+  g_free(output_ext);
+  output_ext = format_name;
 
   // init the export data structures
   dt_imageio_module_format_t *format;
@@ -731,35 +1143,7 @@ int main(int argc, char *arg[])
     exit(1);
   }
 
-  uint32_t w, h, fw, fh, sw, sh;
-  fw = fh = sw = sh = 0;
-  storage->dimension(storage, sdata, &sw, &sh);
-  format->dimension(format, fdata, &fw, &fh);
-
-  if(sw == 0 || fw == 0)
-    w = sw > fw ? sw : fw;
-  else
-    w = sw < fw ? sw : fw;
-
-  if(sh == 0 || fh == 0)
-    h = sh > fh ? sh : fh;
-  else
-    h = sh < fh ? sh : fh;
-
-  fdata->max_width = width;
-  fdata->max_height = height;
-  fdata->max_width = (w != 0 && fdata->max_width > w) ? w : fdata->max_width;
-  fdata->max_height = (h != 0 && fdata->max_height > h) ? h : fdata->max_height;
-  fdata->style[0] = '\0';
-  fdata->style_append = 1; // make append the default and override with --style-overwrite
-
-  if(style)
-  {
-    g_strlcpy((char *)fdata->style, style, DT_MAX_STYLE_NAME_LENGTH);
-    fdata->style[127] = '\0';
-    if(style_overwrite)
-      fdata->style_append = 0;
-  }
+  _setup_fdata(storage, sdata, format, fdata, width, height, style, style_overwrite);
 
   if(storage->initialize_store)
   {
@@ -771,19 +1155,37 @@ int main(int argc, char *arg[])
 
   // TODO: add a callback to set the bpp without going through the config
 
-  int num = 1, res = 0;
+  GPtrArray *tasks = g_ptr_array_new_with_free_func(_free_task);
+  int num = 1;
   for(GList *iter = id_list; iter; iter = g_list_next(iter), num++)
   {
-    const int id = GPOINTER_TO_INT(iter->data);
-    // TODO: have a parameter in command line to get the export presets
-    dt_export_metadata_t metadata;
-    metadata.flags = dt_lib_export_metadata_default_flags();
-    metadata.list = NULL;
-    if(storage->store(storage, sdata, id, format, fdata, num, total, high_quality, upscale, export_masks,
-                      icc_type, icc_filename, icc_intent, &metadata) != 0)
-      res = 1;
+    _cli_task_t *task = g_new0(_cli_task_t, 1);
+    task->line = num;
+    task->num = num;
+    task->imgid = GPOINTER_TO_INT(iter->data);
+    char input[PATH_MAX] = { 0 };
+    gboolean from_cache = FALSE;
+    dt_image_full_path(task->imgid, input, sizeof(input), &from_cache);
+    task->input = g_strdup(input);
+    task->format = format;
+    task->fdata = fdata;
+    task->sdata = sdata;
+    g_ptr_array_add(tasks, task);
   }
 
+  _cli_pool_t pool = { 0 };
+  pool.tasks = tasks;
+  pool.storage = storage;
+  pool.high_quality = high_quality;
+  pool.upscale = upscale;
+  pool.export_masks = export_masks;
+  pool.icc_type = icc_type;
+  pool.icc_filename = icc_filename;
+  pool.icc_intent = icc_intent;
+  pool.report = report;
+  const int res = _pool_run(&pool, jobs);
+  g_ptr_array_free(tasks, TRUE);
+
   // cleanup time
   if(storage->finalize_store) storage->finalize_store(storage, sdata);
   storage->free_params(storage, sdata);
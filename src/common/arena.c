@@ -0,0 +1,403 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/arena.h"
+#include "common/numa.h"
+#include "control/conf.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// size of a huge page on x86_64 and the usual arm64 configurations.
+// buffers at least this large are rounded up to a multiple of it, which
+// also makes slightly different sizes share the same free buffers.
+#define DT_ARENA_HUGE_PAGE ((size_t)2 * 1024 * 1024)
+
+typedef enum _block_kind_t
+{
+  _BLOCK_ALIGNED = 0,   // dt_alloc_aligned()
+  _BLOCK_MEMALIGN = 1,  // posix_memalign() on huge page boundaries
+  _BLOCK_MMAP = 2,      // mmap(MAP_HUGETLB)
+} _block_kind_t;
+
+typedef struct _block_t
+{
+  void *ptr;
+  size_t size;
+  _block_kind_t kind;
+} _block_t;
+
+struct dt_arena_t
+{
+  dt_pthread_mutex_t lock;
+  dt_arena_mode_t mode;
+  size_t retain;
+  size_t retained;       // bytes in the free list
+  GHashTable *in_use;    // ptr -> _block_t
+  GQueue free;           // most recently freed first
+};
+
+// statistics of all arenas, only updated atomically
+static size_t _stats_used = 0;      // bytes handed out
+static size_t _stats_peak = 0;
+static size_t _stats_retained = 0;  // bytes kept for reuse
+static size_t _stats_huge = 0;      // bytes backed by huge pages, used or retained
+static uint64_t _stats_allocs = 0;
+static uint64_t _stats_reuses = 0;
+
+static inline int _to_mb(const size_t m)
+{
+  return (int)((m + 0x80000lu) / 0x400lu / 0x400lu);
+}
+
+dt_arena_mode_t dt_arena_get_mode(void)
+{
+  const char *mode = dt_conf_get_string_const("pixelpipe_arena");
+  if(!strcmp(mode, "on"))
+    return DT_ARENA_ON;
+  else if(!strcmp(mode, "transparent huge pages"))
+    return DT_ARENA_THP;
+  else if(!strcmp(mode, "huge pages"))
+    return DT_ARENA_HUGETLB;
+  return DT_ARENA_OFF;
+}
+
+static inline size_t _round(const size_t size)
+{
+  return size >= DT_ARENA_HUGE_PAGE
+    ? dt_round_size(size, DT_ARENA_HUGE_PAGE)
+    : dt_round_size(size, DT_CACHELINE_BYTES);
+}
+
+static void _update_peak(void)
+{
+  size_t peak = _stats_peak;
+  const size_t used = __sync_fetch_and_add(&_stats_used, 0);
+  while(used > peak)
+  {
+    const size_t old = __sync_val_compare_and_swap(&_stats_peak, peak, used);
+    if(old == peak) break;
+    peak = old;
+  }
+}
+
+static gboolean _block_alloc(_block_t *block,
+                             const dt_arena_mode_t mode)
+{
+  block->ptr = NULL;
+  block->kind = _BLOCK_ALIGNED;
+#if defined(__linux__)
+  if(block->size >= DT_ARENA_HUGE_PAGE)
+  {
+    if(mode == DT_ARENA_HUGETLB)
+    {
+      void *ptr = mmap(NULL, block->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if(ptr != MAP_FAILED)
+      {
+        block->ptr = ptr;
+        block->kind = _BLOCK_MMAP;
+        return TRUE;
+      }
+    }
+    if(mode == DT_ARENA_THP || mode == DT_ARENA_HUGETLB)
+    {
+      if(!posix_memalign(&block->ptr, DT_ARENA_HUGE_PAGE, block->size))
+      {
+        madvise(block->ptr, block->size, MADV_HUGEPAGE);
+        block->kind = _BLOCK_MEMALIGN;
+        return TRUE;
+      }
+      block->ptr = NULL;
+    }
+  }
+#endif
+  block->ptr = dt_alloc_aligned(block->size);
+  return block->ptr != NULL;
+}
+
+static void _block_release(_block_t *block)
+{
+  switch(block->kind)
+  {
+    case _BLOCK_MEMALIGN:
+      __sync_fetch_and_sub(&_stats_huge, block->size);
+      free(block->ptr);
+      break;
+#if defined(__linux__)
+    case _BLOCK_MMAP:
+      __sync_fetch_and_sub(&_stats_huge, block->size);
+      munmap(block->ptr, block->size);
+      break;
+#endif
+    default:
+      dt_free_align(block->ptr);
+      break;
+  }
+  g_free(block);
+}
+
+dt_arena_t *dt_arena_new(const size_t retain)
+{
+  const dt_arena_mode_t mode = dt_arena_get_mode();
+  if(mode == DT_ARENA_OFF) return NULL;
+
+  dt_arena_t *arena = g_malloc0(sizeof(dt_arena_t));
+  dt_pthread_mutex_init(&arena->lock, NULL);
+  arena->mode = mode;
+  arena->retain = retain;
+  arena->in_use = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_queue_init(&arena->free);
+  return arena;
+}
+
+void dt_arena_trim(dt_arena_t *arena)
+{
+  if(!arena) return;
+
+  dt_pthread_mutex_lock(&arena->lock);
+  GList *blocks = arena->free.head;
+  g_queue_init(&arena->free);
+  __sync_fetch_and_sub(&_stats_retained, arena->retained);
+  arena->retained = 0;
+  dt_pthread_mutex_unlock(&arena->lock);
+
+  for(GList *l = blocks; l; l = g_list_next(l))
+    _block_release((_block_t *)l->data);
+  g_list_free(blocks);
+}
+
+void dt_arena_set_retain(dt_arena_t *arena,
+                         const size_t retain)
+{
+  if(!arena) return;
+
+  GList *release = NULL;
+
+  dt_pthread_mutex_lock(&arena->lock);
+  // buffers are rounded up, so must be the limit to keep one of this size
+  arena->retain = retain ? _round(retain) : 0;
+  while(arena->retained > arena->retain)
+  {
+    _block_t *old = g_queue_pop_tail(&arena->free);
+    arena->retained -= old->size;
+    __sync_fetch_and_sub(&_stats_retained, old->size);
+    release = g_list_prepend(release, old);
+  }
+  dt_pthread_mutex_unlock(&arena->lock);
+
+  for(GList *l = release; l; l = g_list_next(l))
+    _block_release((_block_t *)l->data);
+  g_list_free(release);
+}
+
+size_t dt_arena_get_retain(dt_arena_t *arena)
+{
+  if(!arena) return 0;
+
+  dt_pthread_mutex_lock(&arena->lock);
+  const size_t retain = arena->retain;
+  dt_pthread_mutex_unlock(&arena->lock);
+  return retain;
+}
+
+size_t dt_arena_retained(dt_arena_t *arena)
+{
+  if(!arena) return 0;
+
+  dt_pthread_mutex_lock(&arena->lock);
+  const size_t retained = arena->retained;
+  dt_pthread_mutex_unlock(&arena->lock);
+  return retained;
+}
+
+void dt_arena_destroy(dt_arena_t *arena)
+{
+  if(!arena) return;
+
+  dt_arena_trim(arena);
+
+  // buffers still handed out are a bug of the owner, don't leak them
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, arena->in_use);
+  while(g_hash_table_iter_next(&iter, NULL, &value))
+  {
+    _block_t *block = (_block_t *)value;
+    __sync_fetch_and_sub(&_stats_used, block->size);
+    _block_release(block);
+  }
+  g_hash_table_destroy(arena->in_use);
+  dt_pthread_mutex_destroy(&arena->lock);
+  g_free(arena);
+}
+
+void *dt_arena_alloc(dt_arena_t *arena,
+                     const size_t size)
+{
+  if(!arena)
+  {
+    void *ptr = dt_alloc_aligned(size);
+    dt_numa_place(ptr, size);
+    return ptr;
+  }
+
+  const size_t rounded = _round(size);
+  _block_t *block = NULL;
+
+  dt_pthread_mutex_lock(&arena->lock);
+  for(GList *l = arena->free.head; l; l = g_list_next(l))
+  {
+    _block_t *b = (_block_t *)l->data;
+    if(b->size == rounded)
+    {
+      block = b;
+      g_queue_delete_link(&arena->free, l);
+      arena->retained -= rounded;
+      __sync_fetch_and_sub(&_stats_retained, rounded);
+      g_hash_table_insert(arena->in_use, block->ptr, block);
+      break;
+    }
+  }
+  dt_pthread_mutex_unlock(&arena->lock);
+
+  if(block)
+  {
+    __sync_fetch_and_add(&_stats_reuses, 1);
+    __sync_fetch_and_add(&_stats_used, rounded);
+    _update_peak();
+    return block->ptr;
+  }
+
+  block = g_malloc0(sizeof(_block_t));
+  block->size = rounded;
+  if(!_block_alloc(block, arena->mode))
+  {
+    // make room by dropping what we kept for reuse and try again
+    dt_arena_trim(arena);
+    if(!_block_alloc(block, arena->mode))
+    {
+      g_free(block);
+      return NULL;
+    }
+  }
+  dt_numa_place(block->ptr, block->size);
+
+  if(block->kind != _BLOCK_ALIGNED)
+    __sync_fetch_and_add(&_stats_huge, rounded);
+  __sync_fetch_and_add(&_stats_allocs, 1);
+  __sync_fetch_and_add(&_stats_used, rounded);
+  _update_peak();
+
+  dt_pthread_mutex_lock(&arena->lock);
+  g_hash_table_insert(arena->in_use, block->ptr, block);
+  dt_pthread_mutex_unlock(&arena->lock);
+  return block->ptr;
+}
+
+void dt_arena_free(dt_arena_t *arena,
+                   void *ptr)
+{
+  if(!ptr) return;
+  if(!arena)
+  {
+    dt_free_align(ptr);
+    return;
+  }
+
+  GList *release = NULL;
+
+  dt_pthread_mutex_lock(&arena->lock);
+  _block_t *block = g_hash_table_lookup(arena->in_use, ptr);
+  if(block)
+  {
+    g_hash_table_remove(arena->in_use, ptr);
+    __sync_fetch_and_sub(&_stats_used, block->size);
+    if(block->size <= arena->retain)
+    {
+      g_queue_push_head(&arena->free, block);
+      arena->retained += block->size;
+      __sync_fetch_and_add(&_stats_retained, block->size);
+      // release the least recently freed buffers beyond the limit
+      while(arena->retained > arena->retain)
+      {
+        _block_t *old = g_queue_pop_tail(&arena->free);
+        arena->retained -= old->size;
+        __sync_fetch_and_sub(&_stats_retained, old->size);
+        release = g_list_prepend(release, old);
+      }
+    }
+    else
+      release = g_list_prepend(release, block);
+  }
+  dt_pthread_mutex_unlock(&arena->lock);
+
+  if(!block)
+  {
+    dt_print(DT_DEBUG_ALWAYS, "[dt_arena_free] %p was not allocated by this arena\n", ptr);
+    return;
+  }
+
+  for(GList *l = release; l; l = g_list_next(l))
+    _block_release((_block_t *)l->data);
+  g_list_free(release);
+}
+
+void dt_arena_advise_hugepages(void *ptr,
+                               const size_t size)
+{
+#if defined(__linux__)
+  if(!ptr || size < 2 * DT_ARENA_HUGE_PAGE) return;
+
+  const dt_arena_mode_t mode = dt_arena_get_mode();
+  if(mode != DT_ARENA_THP && mode != DT_ARENA_HUGETLB) return;
+
+  // the kernel can only use huge pages for the aligned part of the buffer
+  const uintptr_t start = ((uintptr_t)ptr + DT_ARENA_HUGE_PAGE - 1) & ~(DT_ARENA_HUGE_PAGE - 1);
+  const uintptr_t end = ((uintptr_t)ptr + size) & ~(DT_ARENA_HUGE_PAGE - 1);
+  if(end > start)
+    madvise((void *)start, end - start, MADV_HUGEPAGE);
+#endif
+}
+
+void dt_arena_print_stats(void)
+{
+  const uint64_t allocs = __sync_fetch_and_add(&_stats_allocs, 0);
+  const uint64_t reuses = __sync_fetch_and_add(&_stats_reuses, 0);
+  if(!allocs && !reuses) return;
+
+  dt_print(DT_DEBUG_ALWAYS,
+           "[memory] pipe arenas: used %iMB, peak %iMB, kept for reuse %iMB, huge pages %iMB,"
+           " %" PRIu64 " of %" PRIu64 " buffers reused\n",
+           _to_mb(__sync_fetch_and_add(&_stats_used, 0)),
+           _to_mb(__sync_fetch_and_add(&_stats_peak, 0)),
+           _to_mb(__sync_fetch_and_add(&_stats_retained, 0)),
+           _to_mb(__sync_fetch_and_add(&_stats_huge, 0)),
+           reuses, allocs + reuses);
+}
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -0,0 +1,84 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common/darktable.h"
+
+/**
+ * an arena keeping freed image buffers around for reuse, one per pixelpipe.
+ *
+ * a pipe processes the same roi for all modules and runs over and over, so
+ * its cache lines are mostly freed and allocated again with the same size.
+ * buffers given back to the arena are handed out again for an allocation of
+ * the same (rounded) size instead of going through mmap/munmap and faulting
+ * in fresh pages. at most `retain` bytes are kept, the least recently freed
+ * buffers are released first.
+ *
+ * depending on pixelpipe_arena, large buffers can be backed by transparent
+ * huge pages or by explicit huge pages (MAP_HUGETLB), both linux only. the
+ * latter need pages reserved by the administrator, if none are left we fall
+ * back to transparent huge pages.
+ */
+
+typedef enum dt_arena_mode_t
+{
+  DT_ARENA_OFF = 0,
+  DT_ARENA_ON = 1,
+  DT_ARENA_THP = 2,       // madvise(MADV_HUGEPAGE)
+  DT_ARENA_HUGETLB = 3,   // mmap(MAP_HUGETLB)
+} dt_arena_mode_t;
+
+typedef struct dt_arena_t dt_arena_t;
+
+/** the mode configured in pixelpipe_arena */
+dt_arena_mode_t dt_arena_get_mode(void);
+
+/** a new arena keeping up to retain bytes of free buffers, NULL if disabled */
+dt_arena_t *dt_arena_new(const size_t retain);
+void dt_arena_destroy(dt_arena_t *arena);
+
+/** an aligned buffer of at least size bytes. with a NULL arena this is
+ * dt_alloc_aligned() followed by dt_numa_place() */
+void *dt_arena_alloc(dt_arena_t *arena, const size_t size);
+
+/** give back a buffer from dt_arena_alloc(), with a NULL arena this is dt_free_align() */
+void dt_arena_free(dt_arena_t *arena, void *ptr);
+
+/** release all free buffers kept by the arena */
+void dt_arena_trim(dt_arena_t *arena);
+
+/** change the number of bytes kept for reuse, releasing free buffers beyond it */
+void dt_arena_set_retain(dt_arena_t *arena, const size_t retain);
+size_t dt_arena_get_retain(dt_arena_t *arena);
+
+/** bytes of free buffers currently kept for reuse */
+size_t dt_arena_retained(dt_arena_t *arena);
+
+/** ask for transparent huge pages for a large buffer not owned by an arena,
+ * if the configured mode uses huge pages */
+void dt_arena_advise_hugepages(void *ptr, const size_t size);
+
+/** print the statistics of all arenas, used by dt_print_mem_usage() */
+void dt_arena_print_stats(void);
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
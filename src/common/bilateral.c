@@ -37,6 +37,10 @@
 // mode (only 1mpix there).
 #define DT_COMMON_BILATERAL_MAX_RES_S 3000
 #define DT_COMMON_BILATERAL_MAX_RES_R 50
+// floats of an xz plane of the grid filtered together in the y pass
+#define DT_COMMON_BILATERAL_BLOCK 256
+// largest grid (in floats) which is splatted and blurred in one go
+#define DT_COMMON_BILATERAL_FUSED_MAX (1 << 18)
 
 void dt_bilateral_grid_size(dt_bilateral_t *b,
                             const int width,
@@ -135,41 +139,6 @@ size_t dt_bilateral_singlebuffer_size2(const int width,
 }
 #endif /* !HAVE_OPENCL */
 
-static size_t image_to_grid(const dt_bilateral_t *const b,
-                            const int i,
-                            const int j,
-                            const float L,
-                            float *xf,
-                            float *yf,
-                            float *zf)
-{
-  float x = CLAMPS(i * b->sigma_s_inv, 0, b->size_x - 1);
-  float y = CLAMPS(j * b->sigma_s_inv, 0, b->size_y - 1);
-  float z = CLAMPS(L * b->sigma_r_inv, 0, b->size_z - 1);
-  const int xi = MIN((int)x, b->size_x - 2);
-  const int yi = MIN((int)y, b->size_y - 2);
-  const int zi = MIN((int)z, b->size_z - 2);
-  *xf = x - xi;
-  *yf = y - yi;
-  *zf = z - zi;
-  return ((xi + yi * b->size_x) * b->size_z) + zi;
-}
-
-static size_t image_to_relgrid(const dt_bilateral_t *const b,
-                               const int i,
-                               const float L,
-                               float *xf,
-                               float *zf)
-{
-  float x = CLAMPS(i * b->sigma_s_inv, 0, b->size_x - 1);
-  float z = CLAMPS(L * b->sigma_r_inv, 0, b->size_z - 1);
-  const int xi = MIN((int)x, b->size_x - 2);
-  const int zi = MIN((int)z, b->size_z - 2);
-  *xf = x - xi;
-  *zf = z - zi;
-  return (xi * b->size_z) + zi;
-}
-
 dt_bilateral_t *dt_bilateral_init(const int width,     // width of input image
                                   const int height,    // height of input image
                                   const float sigma_s, // spatial sigma (blur pixel coords)
@@ -184,11 +153,15 @@ dt_bilateral_t *dt_bilateral_init(const int width,     // width of input image
   b->sliceheight = (height + b->numslices - 1) / b->numslices;
   b->slicerows = (b->size_y + b->numslices - 1) / b->numslices + 2;
   b->buf = dt_calloc_align_float(b->size_x * b->size_z * b->numslices * b->slicerows);
-  if(!b->buf)
+  // the blur scratch is part of the memory counted by dt_bilateral_memory_use()
+  b->scratch = dt_alloc_perthread_float((b->size_x + 4) * b->size_z, &b->scratch_padded);
+  if(!b->buf || !b->scratch)
   {
     dt_print(DT_DEBUG_ALWAYS,
              "[bilateral] unable to allocate buffer for %zux%zux%zu grid\n",
              b->size_x,b->size_y,b->size_z);
+    dt_free_align(b->buf);
+    dt_free_align(b->scratch);
     free(b);
     return NULL;
   }
@@ -198,31 +171,272 @@ dt_bilateral_t *dt_bilateral_init(const int width,     // width of input image
   return b;
 }
 
-DT_OMP_DECLARE_SIMD(aligned(in:64))
-void dt_bilateral_splat(const dt_bilateral_t *b, const float *const in)
+// 1-4-6-4-1 gaussian and the -2 derivative of the gaussian along z, up to 3 sigma
+#define DT_BILATERAL_W0 (6.f / 16.f)
+#define DT_BILATERAL_W1 (4.f / 16.f)
+#define DT_BILATERAL_W2 (1.f / 16.f)
+#define DT_BILATERAL_DW1 (4.f / 16.f)
+#define DT_BILATERAL_DW2 (2.f / 16.f)
+
+// blur one xz plane of the grid, i.e. size_x runs of size_z contiguous
+// floats, along z and x.  the z derivative goes into scratch with two zero
+// runs of padding on either side, so the gaussian along x can be computed
+// back into the row as one flat loop over all runs at once.
+// scratch holds (size_x + 4) * size_z floats.
+static void _blur_row_xz(float *const restrict row,
+                         float *const restrict scratch,
+                         const int size_x,
+                         const int size_z)
 {
-  const int ox = b->size_z;
-  const int oy = b->size_x * b->size_z;
+  const size_t oz = size_z;
+  const size_t n = size_x * oz;
+  float *const restrict s = scratch + 2 * oz;
+  memset(scratch, 0, sizeof(float) * 2 * oz);
+  memset(s + n, 0, sizeof(float) * 2 * oz);
+
+  // derivative along z for the whole row, the first and last two
+  // entries of each run see the neighbouring runs and are redone below
+  DT_OMP_SIMD()
+  for(size_t k = 2; k < n - 2; k++)
+    s[k] = DT_BILATERAL_DW1 * (row[k + 1] - row[k - 1])
+         + DT_BILATERAL_DW2 * (row[k + 2] - row[k - 2]);
+  for(size_t k = 0; k < n; k += oz)
+  {
+    const float *const r = row + k;
+    float *const t = s + k;
+    const int e = size_z - 1;
+    t[0] = DT_BILATERAL_DW1 * r[1] + DT_BILATERAL_DW2 * r[2];
+    t[1] = DT_BILATERAL_DW1 * (r[2] - r[0]) + DT_BILATERAL_DW2 * r[3];
+    t[e - 1] = DT_BILATERAL_DW1 * (r[e] - r[e - 2]) - DT_BILATERAL_DW2 * r[e - 3];
+    t[e] = -DT_BILATERAL_DW1 * r[e - 1] - DT_BILATERAL_DW2 * r[e - 2];
+  }
+
+  // gaussian along x, the padding takes care of the borders
+  DT_OMP_SIMD()
+  for(size_t k = 0; k < n; k++)
+    row[k] = DT_BILATERAL_W0 * s[k]
+           + DT_BILATERAL_W1 * (s[k - oz] + s[k + oz])
+           + DT_BILATERAL_W2 * (s[k - 2 * oz] + s[k + 2 * oz]);
+}
+
+// gaussian along y, in place.  the xz planes are cut into blocks which are
+// filtered side by side while walking down y, keeping the two previous
+// input rows of the block around.
+static void _blur_y(float *const buf,
+                    const size_t oy,
+                    const int size_y)
+{
+  static const float zero[DT_COMMON_BILATERAL_BLOCK] = { 0.0f };
+  DT_OMP_FOR()
+  for(size_t block = 0; block < oy; block += DT_COMMON_BILATERAL_BLOCK)
+  {
+    const int len = MIN(DT_COMMON_BILATERAL_BLOCK, oy - block);
+    float DT_ALIGNED_ARRAY prev1[DT_COMMON_BILATERAL_BLOCK] = { 0.0f };
+    float DT_ALIGNED_ARRAY prev2[DT_COMMON_BILATERAL_BLOCK] = { 0.0f };
+    for(int j = 0; j < size_y; j++)
+    {
+      float *const cur = buf + j * oy + block;
+      const float *const next1 = j + 1 < size_y ? cur + oy : zero;
+      const float *const next2 = j + 2 < size_y ? cur + 2 * oy : zero;
+      DT_OMP_SIMD()
+      for(int k = 0; k < len; k++)
+      {
+        const float v = cur[k];
+        cur[k] = DT_BILATERAL_W0 * v
+               + DT_BILATERAL_W1 * (next1[k] + prev1[k])
+               + DT_BILATERAL_W2 * (next2[k] + prev2[k]);
+        prev2[k] = prev1[k];
+        prev1[k] = v;
+      }
+    }
+  }
+}
+
+// pixels of a row are splatted and sliced in blocks: the grid coordinates
+// and interpolation weights of a block are computed in plain loops, which
+// the compiler vectorizes at the width of the codepath they are compiled
+// for, gathering the grid values when slicing.  the splatting itself stays
+// serial as neighbouring pixels add to the same cells.  avx512 machines run
+// the avx2 variants, the wider gathers and blocks measured slower.
+#define DT_COMMON_BILATERAL_ROW_BLOCK 64
+
+static inline __attribute__((always_inline)) void _splat_row(const dt_bilateral_t *const b,
+                                                             const float *const restrict in,
+                                                             const int j,
+                                                             const int slice_offset)
+{
+  const int size_x = b->size_x;
+  const int size_y = b->size_y;
+  const int size_z = b->size_z;
+  const int ox = size_z;
+  const int oy = size_x * size_z;
   const int oz = 1;
-  const float sigma_s = b->sigma_s * b->sigma_s;
+  const float sigma_s_inv = b->sigma_s_inv;
+  const float sigma_r_inv = b->sigma_r_inv;
+  const float norm = 100.0f / (b->sigma_s * b->sigma_s);
+  float *const buf = b->buf;
+
+  const float y = CLAMPS(j * sigma_s_inv, 0, size_y - 1);
+  const int yi = MIN((int)y, size_y - 2);
+  const float yf = y - yi;
+  float *const base = buf + (size_t)(yi + slice_offset) * oy;
+
+  for(int start = 0; start < b->width; start += DT_COMMON_BILATERAL_ROW_BLOCK)
+  {
+    const int n = MIN(DT_COMMON_BILATERAL_ROW_BLOCK, b->width - start);
+    int DT_ALIGNED_ARRAY gi[DT_COMMON_BILATERAL_ROW_BLOCK];
+    float DT_ALIGNED_ARRAY xf[DT_COMMON_BILATERAL_ROW_BLOCK];
+    float DT_ALIGNED_ARRAY zf[DT_COMMON_BILATERAL_ROW_BLOCK];
+
+    for(int i = 0; i < n; i++)
+    {
+      const float x = CLAMPS((start + i) * sigma_s_inv, 0, size_x - 1);
+      const float z = CLAMPS(in[4 * (start + i)] * sigma_r_inv, 0, size_z - 1);
+      const int xi = MIN((int)x, size_x - 2);
+      const int zi = MIN((int)z, size_z - 2);
+      xf[i] = x - xi;
+      zf[i] = z - zi;
+      gi[i] = xi * ox + zi;
+    }
+
+    for(int i = 0; i < n; i++)
+    {
+      // nearest neighbour splatting, with the contributions along the
+      // first two dimensions precomputed
+      float *const cell = base + gi[i];
+      const float c00 = (1.0f - xf[i]) * (1.0f - yf) * norm;
+      const float c10 = xf[i] * (1.0f - yf) * norm;
+      const float c01 = (1.0f - xf[i]) * yf * norm;
+      const float c11 = xf[i] * yf * norm;
+      cell[0] += c00 * (1.0f - zf[i]);
+      cell[ox] += c10 * (1.0f - zf[i]);
+      cell[oy] += c01 * (1.0f - zf[i]);
+      cell[ox + oy] += c11 * (1.0f - zf[i]);
+      cell[oz] += c00 * zf[i];
+      cell[oz + ox] += c10 * zf[i];
+      cell[oz + oy] += c01 * zf[i];
+      cell[oz + oy + ox] += c11 * zf[i];
+    }
+  }
+}
+
+static inline __attribute__((always_inline)) void _slice_row(const dt_bilateral_t *const b,
+                                                             const float *const in,
+                                                             float *const out,
+                                                             const int j,
+                                                             const float detail_norm,
+                                                             const gboolean to_output)
+{
+  const int size_x = b->size_x;
+  const int size_y = b->size_y;
+  const int size_z = b->size_z;
+  const int ox = size_z;
+  const int oy = size_x * size_z;
+  const int oz = 1;
+  const float sigma_s_inv = b->sigma_s_inv;
+  const float sigma_r_inv = b->sigma_r_inv;
+  const float *const restrict buf = b->buf;
+
+  const float y = CLAMPS(j * sigma_s_inv, 0, size_y - 1);
+  const int yi = MIN((int)y, size_y - 2);
+  const float yf = y - yi;
+  const int base = yi * oy;
+
+  for(int start = 0; start < b->width; start += DT_COMMON_BILATERAL_ROW_BLOCK)
+  {
+    const int n = MIN(DT_COMMON_BILATERAL_ROW_BLOCK, b->width - start);
+    float DT_ALIGNED_ARRAY Lout[DT_COMMON_BILATERAL_ROW_BLOCK];
+
+    // trilinear lookup
+    for(int i = 0; i < n; i++)
+    {
+      const float x = CLAMPS((start + i) * sigma_s_inv, 0, size_x - 1);
+      const float z = CLAMPS(in[4 * (start + i)] * sigma_r_inv, 0, size_z - 1);
+      const int xi = MIN((int)x, size_x - 2);
+      const int zi = MIN((int)z, size_z - 2);
+      const float xf = x - xi;
+      const float zf = z - zi;
+      const int gi = base + xi * ox + zi;
+      Lout[i] = detail_norm * (buf[gi] * (1.0f - xf) * (1.0f - yf) * (1.0f - zf)
+                               + buf[gi + ox] * (xf) * (1.0f - yf) * (1.0f - zf)
+                               + buf[gi + oy] * (1.0f - xf) * (yf) * (1.0f - zf)
+                               + buf[gi + ox + oy] * (xf) * (yf) * (1.0f - zf)
+                               + buf[gi + oz] * (1.0f - xf) * (1.0f - yf) * (zf)
+                               + buf[gi + ox + oz] * (xf) * (1.0f - yf) * (zf)
+                               + buf[gi + oy + oz] * (1.0f - xf) * (yf) * (zf)
+                               + buf[gi + ox + oy + oz] * (xf) * (yf) * (zf));
+    }
+
+    if(to_output)
+    {
+      for(int i = 0; i < n; i++)
+        out[4 * (start + i)] = MAX(0.0f, out[4 * (start + i)] + Lout[i]);
+    }
+    else
+    {
+      // copy color and mask, then update L
+      for(int i = 0; i < n; i++)
+      {
+        // copy_pixel() would not be inlined into the avx2/avx512 variants
+        // under the optimize pragma of this file
+        const size_t index = 4 * (start + i);
+        for_each_channel(c)
+          out[index + c] = in[index + c];
+        out[index] = MAX(0.0f, in[index] + Lout[i]);
+      }
+    }
+  }
+}
+
+typedef void((*_splat_row_t)(const dt_bilateral_t *const b, const float *const restrict in,
+                             const int j, const int slice_offset));
+typedef void((*_slice_row_t)(const dt_bilateral_t *const b, const float *const in,
+                             float *const out, const int j, const float detail_norm,
+                             const gboolean to_output));
+
+static void _splat_row_generic(const dt_bilateral_t *const b, const float *const restrict in,
+                               const int j, const int slice_offset)
+{
+  _splat_row(b, in, j, slice_offset);
+}
+
+static void _slice_row_generic(const dt_bilateral_t *const b, const float *const in,
+                               float *const out, const int j, const float detail_norm,
+                               const gboolean to_output)
+{
+  _slice_row(b, in, out, j, detail_norm, to_output);
+}
+
+#ifdef DT_CODEPATH_VARIANTS
+__DT_TARGET_AVX2__
+static void _splat_row_avx2(const dt_bilateral_t *const b, const float *const restrict in,
+                            const int j, const int slice_offset)
+{
+  _splat_row(b, in, j, slice_offset);
+}
+
+__DT_TARGET_AVX2__
+static void _slice_row_avx2(const dt_bilateral_t *const b, const float *const in,
+                            float *const out, const int j, const float detail_norm,
+                            const gboolean to_output)
+{
+  _slice_row(b, in, out, j, detail_norm, to_output);
+}
+#endif
+
+static void _bilateral_splat(const dt_bilateral_t *b,
+                             const float *const in,
+                             float *const scratch)
+{
+  const int oy = b->size_x * b->size_z;
   float *const buf = b->buf;
 
   if(!buf) return;
   // splat into downsampled grid
   const int nthreads = dt_get_num_threads();
-  const size_t offsets[8] =
-  {
-    0,
-    ox,
-    oy,
-    ox + oy,
-    oz,
-    oz + ox,
-    oz + oy,
-    oz + oy + ox
-  };
-
-  DT_OMP_FOR()  
+  const _splat_row_t splat_row = dt_codepath_select(_splat_row_generic, _splat_row_avx2, _splat_row_avx2);
+
+  DT_OMP_FOR()
   for(int slice = 0; slice < b->numslices; slice++)
   {
     const int firstrow = slice * b->sliceheight;
@@ -233,42 +447,21 @@ void dt_bilateral_splat(const dt_bilateral_t *b, const float *const in)
     const int slice_offset = slice * b->slicerows - (int)(firstrow * b->sigma_s_inv);
     // now iterate over the rows of the current horizontal slice
     for(int j = firstrow; j < lastrow; j++)
-    {
-      float y = CLAMPS(j * b->sigma_s_inv, 0, b->size_y - 1);
-      const int yi = MIN((int)y, b->size_y - 2);
-      const float yf = y - yi;
-      const size_t base = (size_t)(yi + slice_offset) * oy;
-      for(int i = 0; i < b->width; i++)
-      {
-        size_t index = 4 * (j * b->width + i);
-        float xf, zf;
-        const float L = in[index];
-        // nearest neighbour splatting:
-        const size_t grid_index = base + image_to_relgrid(b, i, L, &xf, &zf);
-        // sum up payload here
-        const dt_aligned_pixel_t contrib =
-        {
-          // precompute the contributions along the first two dimensions:
-          (1.0f - xf) * (1.0f - yf) * 100.0f / sigma_s,
-          xf * (1.0f - yf) * 100.0f / sigma_s,
-          (1.0f - xf) * yf * 100.0f / sigma_s,
-          xf * yf * 100.0f / sigma_s
-        };
-        DT_OMP_SIMD(aligned(buf:64))
-        for(int k = 0; k < 4; k++)
-        {
-          buf[grid_index + offsets[k]] += (contrib[k] * (1.0f - zf));
-          buf[grid_index + offsets[k+4]] += (contrib[k] * zf);
-        }
-      }
-    }
+      splat_row(b, in + (size_t)4 * j * b->width, j, slice_offset);
   }
 
-  // merge the per-thread results into the final result
+  // merge the per-thread results into the final result.  when fusing with
+  // the blur, the rows above the first one of a slice are final once the
+  // slices before it are merged, and get blurred along z and x while they
+  // are still in cache.
+  int done = 0;
   for(int slice = 1 ; slice < nthreads; slice++)
   {
     // compute the first row of the final grid which this slice splats
     const int destrow = (int)(slice * b->sliceheight * b->sigma_s_inv);
+    if(scratch)
+      for(; done < destrow; done++)
+        _blur_row_xz(buf + (size_t)done * oy, scratch, b->size_x, b->size_z);
     float *dest = buf + destrow * oy;
     // now iterate over the grid rows splatted for this slice
     for(int j = slice * b->slicerows; j < (slice+1)*b->slicerows; j++)
@@ -286,204 +479,104 @@ void dt_bilateral_splat(const dt_bilateral_t *b, const float *const in)
         memset(buf + j*oy, '\0', sizeof(float) * oy);
     }
   }
+  if(scratch)
+    for(; done < b->size_y; done++)
+      _blur_row_xz(buf + (size_t)done * oy, scratch, b->size_x, b->size_z);
 }
 
-DT_OMP_DECLARE_SIMD(aligned(buf:64))
-static void blur_line_z(float *buf,
-                        const int offset1,
-                        const int offset2,
-                        const int offset3,
-                        const int size1,
-                        const int size2,
-                        const int size3)
+void dt_bilateral_splat(const dt_bilateral_t *b, const float *const in)
 {
-  const float w1 = 4.f / 16.f;
-  const float w2 = 2.f / 16.f;
-  DT_OMP_FOR()
-  for(int k = 0; k < size1; k++)
-  {
-    size_t index = (size_t)k * offset1;
-    for(int j = 0; j < size2; j++)
-    {
-      float tmp1 = buf[index];
-      buf[index] = w1 * buf[index + offset3] + w2 * buf[index + 2 * offset3];
-      index += offset3;
-      float tmp2 = buf[index];
-      buf[index] = w1 * (buf[index + offset3] - tmp1) + w2 * buf[index + 2 * offset3];
-      index += offset3;
-      for(int i = 2; i < size3 - 2; i++)
-      {
-        const float tmp3 = buf[index];
-        buf[index] = +w1 * (buf[index + offset3] - tmp2)
-          + w2 * (buf[index + 2 * offset3] - tmp1);
-        index += offset3;
-        tmp1 = tmp2;
-        tmp2 = tmp3;
-      }
-      const float tmp3 = buf[index];
-      buf[index] = w1 * (buf[index + offset3] - tmp2) - w2 * tmp1;
-      index += offset3;
-      buf[index] = -w1 * tmp3 - w2 * tmp2;
-      index += offset3;
-      index += offset2 - offset3 * size3;
-    }
-  }
+  _bilateral_splat(b, in, NULL);
 }
 
-DT_OMP_DECLARE_SIMD(aligned(buf:64))
-static void blur_line(float *buf,
-                      const int offset1,
-                      const int offset2,
-                      const int offset3,
-                      const int size1,
-                      const int size2,
-                      const int size3)
+void dt_bilateral_blur(const dt_bilateral_t *b)
 {
-  const float w0 = 6.f / 16.f;
-  const float w1 = 4.f / 16.f;
-  const float w2 = 1.f / 16.f;
+  if(!b || !b->buf)
+    return;
+
+  const size_t oy = b->size_x * b->size_z;
+  float *const scratch = b->scratch;
+  const size_t padded_size = b->scratch_padded;
+  // the passes commute, so z and x are done together on each xz plane
   DT_OMP_FOR()
-  for(int k = 0; k < size1; k++)
-  {
-    size_t index = (size_t)k * offset1;
-    for(int j = 0; j < size2; j++)
-    {
-      float tmp1 = buf[index];
-      buf[index] = buf[index] * w0 + w1 * buf[index + offset3]
-        + w2 * buf[index + 2 * offset3];
-      index += offset3;
-      float tmp2 = buf[index];
-      buf[index] = buf[index] * w0 + w1 * (buf[index + offset3] + tmp1)
-        + w2 * buf[index + 2 * offset3];
-      index += offset3;
-      for(int i = 2; i < size3 - 2; i++)
-      {
-        const float tmp3 = buf[index];
-        buf[index]
-            = buf[index] * w0 + w1 * (buf[index + offset3] + tmp2)
-          + w2 * (buf[index + 2 * offset3] + tmp1);
-        index += offset3;
-        tmp1 = tmp2;
-        tmp2 = tmp3;
-      }
-      const float tmp3 = buf[index];
-      buf[index] = buf[index] * w0 + w1 * (buf[index + offset3] + tmp2) + w2 * tmp1;
-      index += offset3;
-      buf[index] = buf[index] * w0 + w1 * tmp3 + w2 * tmp2;
-      index += offset3;
-      index += offset2 - offset3 * size3;
-    }
-  }
+  for(int j = 0; j < b->size_y; j++)
+    _blur_row_xz(b->buf + j * oy, dt_get_perthread(scratch, padded_size), b->size_x, b->size_z);
+  _blur_y(b->buf, oy, b->size_y);
 }
 
-
-void dt_bilateral_blur(const dt_bilateral_t *b)
+void dt_bilateral_splat_blur(const dt_bilateral_t *b, const float *const in)
 {
   if(!b || !b->buf)
     return;
 
-  const int ox = b->size_z;
-  const int oy = b->size_x * b->size_z;
-  const int oz = 1;
-  // gaussian up to 3 sigma
-  blur_line(b->buf, oz, oy, ox, b->size_z, b->size_y, b->size_x);
-  // gaussian up to 3 sigma
-  blur_line(b->buf, oz, ox, oy, b->size_z, b->size_x, b->size_y);
-  // -2 derivative of the gaussian up to 3 sigma: x*exp(-x*x)
-  blur_line_z(b->buf, ox, oy, oz, b->size_x, b->size_y, b->size_z);
+  // large grids are better off with the parallel blur passes
+  if(b->size_x * b->size_y * b->size_z > DT_COMMON_BILATERAL_FUSED_MAX)
+  {
+    dt_bilateral_splat(b, in);
+    dt_bilateral_blur(b);
+    return;
+  }
+  // the fused blur runs in the serial merge, on the first thread's scratch
+  _bilateral_splat(b, in, b->scratch);
+  _blur_y(b->buf, b->size_x * b->size_z, b->size_y);
 }
 
-
-DT_OMP_DECLARE_SIMD(aligned(out, in :64))
-void dt_bilateral_slice(const dt_bilateral_t *const b,
-                        const float *const in,
-                        float *out,
-                        const float detail)
+#undef DT_BILATERAL_W0
+#undef DT_BILATERAL_W1
+#undef DT_BILATERAL_W2
+#undef DT_BILATERAL_DW1
+#undef DT_BILATERAL_DW2
+
+static void _bilateral_slice(const dt_bilateral_t *const b,
+                             const float *const in,
+                             float *out,
+                             const float detail,
+                             const gboolean to_output)
 {
+  if(!b->buf) return;
+
   // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
   const float norm = -detail * b->sigma_r * 0.04f;
-  const int ox = b->size_z;
-  const int oy = b->size_x * b->size_z;
-  const int oz = 1;
-  float *const buf = b->buf;
   const int width = b->width;
-  const int height = b->height;
+  const _slice_row_t slice_row = dt_codepath_select(_slice_row_generic, _slice_row_avx2, _slice_row_avx2);
 
-  if(!buf) return;
-  DT_OMP_FOR(collapse(2))
-  for(int j = 0; j < height; j++)
+  DT_OMP_FOR()
+  for(int j = 0; j < b->height; j++)
   {
-    for(int i = 0; i < width; i++)
-    {
-      size_t index = 4 * (j * width + i);
-      float xf, yf, zf;
-      const float L = in[index];
-      // trilinear lookup:
-      const size_t gi = image_to_grid(b, i, j, L, &xf, &yf, &zf);
-      const float Lout = fmaxf( 0.0f, L
-                         + norm * (buf[gi] * (1.0f - xf) * (1.0f - yf) * (1.0f - zf)
-                                   + buf[gi + ox] * (xf) * (1.0f - yf) * (1.0f - zf)
-                                   + buf[gi + oy] * (1.0f - xf) * (yf) * (1.0f - zf)
-                                   + buf[gi + ox + oy] * (xf) * (yf) * (1.0f - zf)
-                                   + buf[gi + oz] * (1.0f - xf) * (1.0f - yf) * (zf)
-                                   + buf[gi + ox + oz] * (xf) * (1.0f - yf) * (zf)
-                                   + buf[gi + oy + oz] * (1.0f - xf) * (yf) * (zf)
-                                   + buf[gi + ox + oy + oz] * (xf) * (yf) * (zf)));
-      // copy color and mask, then update L
-      copy_pixel(out + index, in + index);
-      out[index] = Lout;
-    }
+    const size_t row = (size_t)4 * j * width;
+    slice_row(b, in + row, out + row, j, norm, to_output);
   }
 }
 
-DT_OMP_DECLARE_SIMD(aligned(out, in :64))
+void dt_bilateral_slice(const dt_bilateral_t *const b,
+                        const float *const in,
+                        float *out,
+                        const float detail)
+{
+  _bilateral_slice(b, in, out, detail, FALSE);
+}
+
 void dt_bilateral_slice_to_output(const dt_bilateral_t *const b,
                                   const float *const in,
                                   float *out,
                                   const float detail)
 {
-  // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
-  const float norm = -detail * b->sigma_r * 0.04f;
-  const int ox = b->size_z;
-  const int oy = b->size_x * b->size_z;
-  const int oz = 1;
-  float *const buf = b->buf;
-  const int width = b->width;
-  const int height = b->height;
-
-  if(!buf) return;
-  DT_OMP_FOR(collapse(2))
-  for(int j = 0; j < height; j++)
-  {
-    for(int i = 0; i < width; i++)
-    {
-      size_t index = 4 * (j * width + i);
-      float xf, yf, zf;
-      const float L = in[index];
-      // trilinear lookup:
-      const size_t gi = image_to_grid(b, i, j, L, &xf, &yf, &zf);
-      const float Lout = norm * (buf[gi] * (1.0f - xf) * (1.0f - yf) * (1.0f - zf)
-                                 + buf[gi + ox] * (xf) * (1.0f - yf) * (1.0f - zf)
-                                 + buf[gi + oy] * (1.0f - xf) * (yf) * (1.0f - zf)
-                                 + buf[gi + ox + oy] * (xf) * (yf) * (1.0f - zf)
-                                 + buf[gi + oz] * (1.0f - xf) * (1.0f - yf) * (zf)
-                                 + buf[gi + ox + oz] * (xf) * (1.0f - yf) * (zf)
-                                 + buf[gi + oy + oz] * (1.0f - xf) * (yf) * (zf)
-                                 + buf[gi + ox + oy + oz] * (xf) * (yf) * (zf));
-      out[index] = MAX(0.0f, out[index] + Lout);
-    }
-  }
+  _bilateral_slice(b, in, out, detail, TRUE);
 }
 
 void dt_bilateral_free(dt_bilateral_t *b)
 {
   if(!b) return;
   dt_free_align(b->buf);
+  dt_free_align(b->scratch);
   free(b);
 }
 
 #undef DT_COMMON_BILATERAL_MAX_RES_S
 #undef DT_COMMON_BILATERAL_MAX_RES_R
+#undef DT_COMMON_BILATERAL_BLOCK
+#undef DT_COMMON_BILATERAL_FUSED_MAX
+#undef DT_COMMON_BILATERAL_ROW_BLOCK
 
 // clang-format off
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
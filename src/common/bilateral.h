@@ -28,6 +28,8 @@ typedef struct dt_bilateral_t
   float sigma_s, sigma_r;
   float sigma_s_inv, sigma_r_inv;  // reciprocals of sigma_s and sigma_r to avoid divisions
   float *buf __attribute__((aligned(64)));
+  float *scratch;        // per-thread rows for the blur along z and x
+  size_t scratch_padded; // floats per thread in scratch
 } __attribute__((packed)) dt_bilateral_t;
 
 size_t dt_bilateral_memory_use(const int width,      // width of input image
@@ -62,6 +64,10 @@ void dt_bilateral_splat(const dt_bilateral_t *b, const float *const in);
 
 void dt_bilateral_blur(const dt_bilateral_t *b);
 
+// same as dt_bilateral_splat() followed by dt_bilateral_blur(), but small grids
+// are blurred row by row while the splatted slices are merged
+void dt_bilateral_splat_blur(const dt_bilateral_t *b, const float *const in);
+
 void dt_bilateral_slice(const dt_bilateral_t *const b, const float *const in, float *out, const float detail);
 
 void dt_bilateral_slice_to_output(const dt_bilateral_t *const b, const float *const in, float *out,
@@ -29,52 +29,136 @@
 
 // this implements a concurrent LRU cache
 
-void dt_cache_init(dt_cache_t *cache,
-                   const size_t entry_size,
-                   const size_t cost_quota)
+static inline dt_cache_shard_t *_get_shard(const dt_cache_t *cache,
+                                           const uint32_t key)
+{
+  // fibonacci hashing, so that consecutive keys (image ids) end up in
+  // different shards
+  const uint32_t hash = key * 2654435769u;
+  return cache->shards + ((hash >> 16) & (cache->num_shards - 1));
+}
+
+// the lru list is threaded through the entries themselves, so touching and
+// evicting entries never allocates. all of these need the shard lock.
+static inline void _lru_unlink(dt_cache_shard_t *shard,
+                               dt_cache_entry_t *entry)
+{
+  if(entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else shard->lru_head = entry->lru_next;
+  if(entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else shard->lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static inline void _lru_append(dt_cache_shard_t *shard,
+                               dt_cache_entry_t *entry)
+{
+  entry->lru_prev = shard->lru_tail;
+  entry->lru_next = NULL;
+  if(shard->lru_tail) shard->lru_tail->lru_next = entry;
+  else shard->lru_head = entry;
+  shard->lru_tail = entry;
+}
+
+static inline void _lru_touch(const dt_cache_t *cache,
+                              dt_cache_shard_t *shard,
+                              dt_cache_entry_t *entry)
+{
+  if(cache->policy == DT_CACHE_POLICY_CLOCK)
+    entry->referenced = TRUE;
+  else if(entry != shard->lru_tail)
+  {
+    _lru_unlink(shard, entry);
+    _lru_append(shard, entry);
+  }
+}
+
+static inline void _shard_lock(dt_cache_shard_t *shard)
 {
+  if(dt_pthread_mutex_trylock(&shard->lock))
+  {
+    dt_pthread_mutex_lock(&shard->lock);
+    shard->contended++;
+  }
+}
+
+static inline void _shard_unlock(dt_cache_shard_t *shard)
+{
+  dt_pthread_mutex_unlock(&shard->lock);
+}
+
+void dt_cache_init_sharded(dt_cache_t *cache,
+                           const size_t entry_size,
+                           const size_t cost_quota,
+                           const uint32_t num_shards)
+{
+  uint32_t shards = 1;
+  while(shards < num_shards && shards < DT_CACHE_MAX_SHARDS) shards <<= 1;
+
   cache->cost = 0;
-  cache->lru = 0;
   cache->entry_size = entry_size;
   cache->cost_quota = cost_quota;
-  dt_pthread_mutex_init(&cache->lock, 0);
+  cache->num_shards = shards;
+  cache->shards = dt_calloc_align_type(dt_cache_shard_t, shards);
+  cache->policy = DT_CACHE_POLICY_LRU;
+  for(uint32_t k = 0; k < shards; k++)
+  {
+    dt_cache_shard_t *shard = cache->shards + k;
+    dt_pthread_mutex_init(&shard->lock, 0);
+    shard->hashtable = g_hash_table_new(0, 0);
+  }
   cache->allocate = 0;
   cache->allocate_data = 0;
   cache->cleanup = 0;
   cache->cleanup_data = 0;
-  cache->hashtable = g_hash_table_new(0, 0);
+}
+
+void dt_cache_init(dt_cache_t *cache,
+                   const size_t entry_size,
+                   const size_t cost_quota)
+{
+  dt_cache_init_sharded(cache, entry_size, cost_quota, 1);
 }
 
 void dt_cache_cleanup(dt_cache_t *cache)
 {
-  g_hash_table_destroy(cache->hashtable);
-  for(GList *l = cache->lru; l; l = g_list_next(l))
+  for(uint32_t k = 0; k < cache->num_shards; k++)
   {
-    dt_cache_entry_t *entry = (dt_cache_entry_t *)l->data;
-
-    if(cache->cleanup)
+    dt_cache_shard_t *shard = cache->shards + k;
+    g_hash_table_destroy(shard->hashtable);
+    dt_cache_entry_t *next = NULL;
+    for(dt_cache_entry_t *entry = shard->lru_head; entry; entry = next)
     {
-      assert(entry->data_size);
-      ASAN_UNPOISON_MEMORY_REGION(entry->data, entry->data_size);
+      next = entry->lru_next;
 
-      cache->cleanup(cache->cleanup_data, entry);
-    }
-    else
-      dt_free_align(entry->data);
+      if(cache->cleanup)
+      {
+        assert(entry->data_size);
+        ASAN_UNPOISON_MEMORY_REGION(entry->data, entry->data_size);
 
-    dt_pthread_rwlock_destroy(&entry->lock);
-    g_slice_free1(sizeof(*entry), entry);
+        cache->cleanup(cache->cleanup_data, entry);
+      }
+      else
+        dt_free_align(entry->data);
+
+      dt_pthread_rwlock_destroy(&entry->lock);
+      g_slice_free1(sizeof(*entry), entry);
+    }
+    shard->lru_head = shard->lru_tail = NULL;
+    dt_pthread_mutex_destroy(&shard->lock);
   }
-  g_list_free(cache->lru);
-  dt_pthread_mutex_destroy(&cache->lock);
+  dt_free_align(cache->shards);
+  cache->shards = NULL;
+  cache->num_shards = 0;
 }
 
 int32_t dt_cache_contains(dt_cache_t *cache,
                           const uint32_t key)
 {
-  dt_pthread_mutex_lock(&cache->lock);
-  int32_t result = g_hash_table_contains(cache->hashtable, GINT_TO_POINTER(key));
-  dt_pthread_mutex_unlock(&cache->lock);
+  dt_cache_shard_t *shard = _get_shard(cache, key);
+  _shard_lock(shard);
+  int32_t result = g_hash_table_contains(shard->hashtable, GINT_TO_POINTER(key));
+  _shard_unlock(shard);
   return result;
 }
 
@@ -83,25 +167,161 @@ int dt_cache_for_all
    int (*process)(const uint32_t key, const void *data, void *user_data),
    void *user_data)
 {
-  dt_pthread_mutex_lock(&cache->lock);
-  GHashTableIter iter;
-  gpointer key, value;
-
-  g_hash_table_iter_init (&iter, cache->hashtable);
-  while(g_hash_table_iter_next (&iter, &key, &value))
+  for(uint32_t k = 0; k < cache->num_shards; k++)
   {
-    dt_cache_entry_t *entry = (dt_cache_entry_t *)value;
-    const int err = process(GPOINTER_TO_INT(key), entry->data, user_data);
-    if(err)
+    dt_cache_shard_t *shard = cache->shards + k;
+    _shard_lock(shard);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, shard->hashtable);
+    while(g_hash_table_iter_next (&iter, &key, &value))
     {
-      dt_pthread_mutex_unlock(&cache->lock);
-      return err;
+      dt_cache_entry_t *entry = (dt_cache_entry_t *)value;
+      const int err = process(GPOINTER_TO_INT(key), entry->data, user_data);
+      if(err)
+      {
+        _shard_unlock(shard);
+        return err;
+      }
     }
+    _shard_unlock(shard);
   }
-  dt_pthread_mutex_unlock(&cache->lock);
   return 0;
 }
 
+void dt_cache_print_stats(dt_cache_t *cache,
+                          const char *name)
+{
+  uint64_t hits = 0, misses = 0, contended = 0, busy = 0;
+  size_t min_cost = SIZE_MAX, max_cost = 0;
+  for(uint32_t k = 0; k < cache->num_shards; k++)
+  {
+    dt_cache_shard_t *shard = cache->shards + k;
+    _shard_lock(shard);
+    hits += shard->hits;
+    misses += shard->misses;
+    contended += shard->contended;
+    busy += shard->busy;
+    min_cost = MIN(min_cost, shard->cost);
+    max_cost = MAX(max_cost, shard->cost);
+    _shard_unlock(shard);
+  }
+  const uint64_t requests = MAX(1, hits + misses);
+  dt_print(DT_DEBUG_ALWAYS,
+           "[%s] %" PRIu32 " shards (fill %zu..%zu) | requests %" PRIu64
+           " | hits %.2f%% | lock contended %.2f%% | entry busy %.2f%%\n",
+           name, cache->num_shards, min_cost, max_cost, hits + misses,
+           100.0 * hits / requests, 100.0 * contended / requests, 100.0 * busy / requests);
+}
+
+// drop up to max_evict of the least recently used entries of the shard
+// while the cost of the whole cache is above the fill ratio. never blocks,
+// skips entries locked by anyone. returns the number of dropped entries.
+static guint _shard_gc(dt_cache_t *cache,
+                       dt_cache_shard_t *shard,
+                       const float fill_ratio,
+                       guint max_evict)
+{
+  guint evicted = 0;
+  // with the clock policy an entry may be looked at twice: once to take
+  // away its second chance and once more to evict it.
+  guint budget = 2 * g_hash_table_size(shard->hashtable);
+  dt_cache_entry_t *entry = shard->lru_head;
+  while(entry && budget-- && evicted < max_evict)
+  {
+    if(cache->cost < cache->cost_quota * fill_ratio)
+      break;
+
+    dt_cache_entry_t *next = entry->lru_next;
+    if(entry->referenced)
+    {
+      // used since the hand passed last time, move it behind all others:
+      entry->referenced = FALSE;
+      if(next)
+      {
+        _lru_unlink(shard, entry);
+        _lru_append(shard, entry);
+        entry = next;
+      }
+      continue;
+    }
+
+    // if still locked by anyone else give up:
+    if(dt_pthread_rwlock_trywrlock(&entry->lock))
+    {
+      entry = next;
+      continue;
+    }
+
+    if(entry->_lock_demoting)
+    {
+      // oops, we are currently demoting (rw -> r) lock to this entry
+      // in some thread. do not touch!
+      dt_pthread_rwlock_unlock(&entry->lock);
+      entry = next;
+      continue;
+    }
+
+    // delete!
+    g_hash_table_remove(shard->hashtable, GINT_TO_POINTER(entry->key));
+    _lru_unlink(shard, entry);
+    shard->cost -= entry->cost;
+    __sync_fetch_and_sub(&cache->cost, entry->cost);
+
+    if(cache->cleanup)
+    {
+      assert(entry->data_size);
+      ASAN_UNPOISON_MEMORY_REGION(entry->data, entry->data_size);
+
+      cache->cleanup(cache->cleanup_data, entry);
+    }
+    else
+      dt_free_align(entry->data);
+
+    dt_pthread_rwlock_unlock(&entry->lock);
+    dt_pthread_rwlock_destroy(&entry->lock);
+    g_slice_free1(sizeof(*entry), entry);
+    entry = next;
+    evicted++;
+  }
+  return evicted;
+}
+
+// the quota is shared by all shards. evict the oldest entry of each shard
+// in turn, so the shards age evenly and approximate one global lru list.
+// own is the shard locked by the caller, or NULL. the other shards are only
+// tried if they can be locked without waiting, unless the caller holds none.
+static void _cache_gc(dt_cache_t *cache,
+                      dt_cache_shard_t *own,
+                      const float fill_ratio)
+{
+  // a single shard is its own global lru list, no need to take turns
+  const guint step = cache->num_shards == 1 ? G_MAXUINT : 1;
+  guint evicted = 1;
+  while(evicted && cache->cost >= cache->cost_quota * fill_ratio)
+  {
+    evicted = 0;
+    for(uint32_t k = 0; k < cache->num_shards; k++)
+    {
+      dt_cache_shard_t *shard = cache->shards + k;
+      if(shard == own)
+        evicted += _shard_gc(cache, shard, fill_ratio, step);
+      else if(!own)
+      {
+        _shard_lock(shard);
+        evicted += _shard_gc(cache, shard, fill_ratio, step);
+        _shard_unlock(shard);
+      }
+      else if(!dt_pthread_mutex_trylock(&shard->lock))
+      {
+        evicted += _shard_gc(cache, shard, fill_ratio, step);
+        _shard_unlock(shard);
+      }
+    }
+  }
+}
+
 // return read locked bucket, or NULL if it's not already there.
 // never attempt to allocate a new slot.
 dt_cache_entry_t *dt_cache_testget(dt_cache_t *cache,
@@ -110,8 +330,9 @@ dt_cache_entry_t *dt_cache_testget(dt_cache_t *cache,
 {
   gpointer orig_key, value;
   const double start = dt_get_debug_wtime();
-  dt_pthread_mutex_lock(&cache->lock);
-  const gboolean res = g_hash_table_lookup_extended(cache->hashtable,
+  dt_cache_shard_t *shard = _get_shard(cache, key);
+  _shard_lock(shard);
+  const gboolean res = g_hash_table_lookup_extended(shard->hashtable,
                                                     GINT_TO_POINTER(key),
                                                     &orig_key,
                                                     &value);
@@ -125,13 +346,14 @@ dt_cache_entry_t *dt_cache_testget(dt_cache_t *cache,
     if(result)
     { // need to give up mutex so other threads have a chance to get in between and
       // free the lock we're trying to acquire:
-      dt_pthread_mutex_unlock(&cache->lock);
+      shard->busy++;
+      _shard_unlock(shard);
       return 0;
     }
     // bubble up in lru list:
-    cache->lru = g_list_remove_link(cache->lru, entry->link);
-    cache->lru = g_list_concat(cache->lru, entry->link);
-    dt_pthread_mutex_unlock(&cache->lock);
+    _lru_touch(cache, shard, entry);
+    shard->hits++;
+    _shard_unlock(shard);
     const double end = dt_get_debug_wtime();
     if(end - start > 0.1)
       dt_print(DT_DEBUG_ALWAYS, "try+ wait time %.06fs mode %c \n", end - start, mode);
@@ -146,7 +368,7 @@ dt_cache_entry_t *dt_cache_testget(dt_cache_t *cache,
 
     return entry;
   }
-  dt_pthread_mutex_unlock(&cache->lock);
+  _shard_unlock(shard);
   const double end = dt_get_debug_wtime();
   if(end - start > 0.1)
     dt_print(DT_DEBUG_ALWAYS, "try- wait time %.06fs\n", end - start);
@@ -164,9 +386,10 @@ dt_cache_entry_t *dt_cache_get_with_caller(dt_cache_t *cache,
 {
   gpointer orig_key, value;
   const double start = dt_get_debug_wtime();
+  dt_cache_shard_t *shard = _get_shard(cache, key);
 restart:
-  dt_pthread_mutex_lock(&cache->lock);
-  const gboolean res = g_hash_table_lookup_extended(cache->hashtable,
+  _shard_lock(shard);
+  const gboolean res = g_hash_table_lookup_extended(shard->hashtable,
                                                     GINT_TO_POINTER(key),
                                                     &orig_key,
                                                     &value);
@@ -181,14 +404,15 @@ restart:
     if(result)
     { // need to give up mutex so other threads have a chance to get in between and
       // free the lock we're trying to acquire:
-      dt_pthread_mutex_unlock(&cache->lock);
+      shard->busy++;
+      _shard_unlock(shard);
       g_usleep(5);
       goto restart;
     }
     // bubble up in lru list:
-    cache->lru = g_list_remove_link(cache->lru, entry->link);
-    cache->lru = g_list_concat(cache->lru, entry->link);
-    dt_pthread_mutex_unlock(&cache->lock);
+    _lru_touch(cache, shard, entry);
+    shard->hits++;
+    _shard_unlock(shard);
 
 #ifdef _DEBUG
     const pthread_t writer = dt_pthread_rwlock_get_writer(&entry->lock);
@@ -214,13 +438,14 @@ restart:
   }
 
   // else, not found, need to allocate.
+  shard->misses++;
 
   // first try to clean up.
   // also wait if we can't free more than the requested fill ratio.
   if(cache->cost > 0.8f * cache->cost_quota)
   {
     // need to roll back all the way to get a consistent lock state:
-    dt_cache_gc(cache, 0.8f);
+    _cache_gc(cache, shard, 0.8f);
   }
 
   // here dies your 32-bit system:
@@ -231,11 +456,12 @@ restart:
   entry->data = 0;
   entry->data_size = cache->entry_size;
   entry->cost = 1;
-  entry->link = g_list_append(0, entry);
+  entry->lru_prev = entry->lru_next = NULL;
+  entry->referenced = FALSE;
   entry->key = key;
   entry->_lock_demoting = FALSE;
 
-  g_hash_table_insert(cache->hashtable, GINT_TO_POINTER(key), entry);
+  g_hash_table_insert(shard->hashtable, GINT_TO_POINTER(key), entry);
 
   assert(cache->allocate || entry->data_size);
 
@@ -256,12 +482,13 @@ restart:
   else
     dt_pthread_rwlock_rdlock_with_caller(&entry->lock, file, line);
 
-  cache->cost += entry->cost;
+  shard->cost += entry->cost;
+  __sync_fetch_and_add(&cache->cost, entry->cost);
 
   // put at end of lru list (most recently used):
-  cache->lru = g_list_concat(cache->lru, entry->link);
+  _lru_append(shard, entry);
 
-  dt_pthread_mutex_unlock(&cache->lock);
+  _shard_unlock(shard);
   const double end = dt_get_debug_wtime();
   if(end - start > 0.1)
     dt_print(DT_DEBUG_ALWAYS, "wait time %.06fs\n", end - start);
@@ -271,29 +498,31 @@ restart:
   return entry;
 }
 
-int dt_cache_remove(dt_cache_t *cache,
+int32_t dt_cache_remove(dt_cache_t *cache,
                     const uint32_t key)
 {
   dt_cache_entry_t *entry;
   gpointer orig_key, value;
+  dt_cache_shard_t *shard = _get_shard(cache, key);
 restart:
-  dt_pthread_mutex_lock(&cache->lock);
+  _shard_lock(shard);
 
-  const gboolean res = g_hash_table_lookup_extended(cache->hashtable,
+  const gboolean res = g_hash_table_lookup_extended(shard->hashtable,
                                                     GINT_TO_POINTER(key),
                                                     &orig_key,
                                                     &value);
   entry = (dt_cache_entry_t *)value;
   if(!res)
   { // not found in cache, not deleting.
-    dt_pthread_mutex_unlock(&cache->lock);
+    _shard_unlock(shard);
     return 1;
   }
   // need write lock to be able to delete:
   const int result = dt_pthread_rwlock_trywrlock(&entry->lock);
   if(result)
   {
-    dt_pthread_mutex_unlock(&cache->lock);
+    shard->busy++;
+    _shard_unlock(shard);
     g_usleep(5);
     goto restart;
   }
@@ -303,15 +532,15 @@ restart:
     // oops, we are currently demoting (rw -> r) lock to this entry in
     // some thread. do not touch!
     dt_pthread_rwlock_unlock(&entry->lock);
-    dt_pthread_mutex_unlock(&cache->lock);
+    _shard_unlock(shard);
     g_usleep(5);
     goto restart;
   }
 
-  gboolean removed = g_hash_table_remove(cache->hashtable, GINT_TO_POINTER(key));
+  gboolean removed = g_hash_table_remove(shard->hashtable, GINT_TO_POINTER(key));
   (void)removed; // make non-assert compile happy
   assert(removed);
-  cache->lru = g_list_delete_link(cache->lru, entry->link);
+  _lru_unlink(shard, entry);
 
   if(cache->cleanup)
   {
@@ -325,10 +554,11 @@ restart:
 
   dt_pthread_rwlock_unlock(&entry->lock);
   dt_pthread_rwlock_destroy(&entry->lock);
-  cache->cost -= entry->cost;
+  shard->cost -= entry->cost;
+  __sync_fetch_and_sub(&cache->cost, entry->cost);
   g_slice_free1(sizeof(*entry), entry);
 
-  dt_pthread_mutex_unlock(&cache->lock);
+  _shard_unlock(shard);
   return 0;
 }
 
@@ -337,48 +567,7 @@ restart:
 void dt_cache_gc(dt_cache_t *cache,
                  const float fill_ratio)
 {
-  GList *l = cache->lru;
-  while(l)
-  {
-    dt_cache_entry_t *entry = (dt_cache_entry_t *)l->data;
-    assert(entry->link->data == entry);
-    l = g_list_next(l); // we might remove this element, so walk to
-                        // the next one while we still have the
-                        // pointer..
-    if(cache->cost < cache->cost_quota * fill_ratio)
-      break;
-
-    // if still locked by anyone else give up:
-    if(dt_pthread_rwlock_trywrlock(&entry->lock))
-      continue;
-
-    if(entry->_lock_demoting)
-    {
-      // oops, we are currently demoting (rw -> r) lock to this entry
-      // in some thread. do not touch!
-      dt_pthread_rwlock_unlock(&entry->lock);
-      continue;
-    }
-
-    // delete!
-    g_hash_table_remove(cache->hashtable, GINT_TO_POINTER(entry->key));
-    cache->lru = g_list_delete_link(cache->lru, entry->link);
-    cache->cost -= entry->cost;
-
-    if(cache->cleanup)
-    {
-      assert(entry->data_size);
-      ASAN_UNPOISON_MEMORY_REGION(entry->data, entry->data_size);
-
-      cache->cleanup(cache->cleanup_data, entry);
-    }
-    else
-      dt_free_align(entry->data);
-
-    dt_pthread_rwlock_unlock(&entry->lock);
-    dt_pthread_rwlock_destroy(&entry->lock);
-    g_slice_free1(sizeof(*entry), entry);
-  }
+  _cache_gc(cache, NULL, fill_ratio);
 }
 
 void dt_cache_release_with_caller(dt_cache_t *cache,
@@ -1,6 +1,6 @@
 /*
     This file is part of darktable,
-    Copyright (C) 2011-2020 darktable developers.
+    Copyright (C) 2011-2024 darktable developers.
 
     darktable is free software: you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
@@ -28,7 +28,9 @@ typedef struct dt_cache_entry_t
   void *data;
   size_t data_size;
   size_t cost;
-  GList *link;
+  struct dt_cache_entry_t *lru_prev; // intrusive lru list of the shard
+  struct dt_cache_entry_t *lru_next;
+  gboolean referenced;               // second chance bit, DT_CACHE_POLICY_CLOCK only
   dt_pthread_rwlock_t lock;
   gboolean _lock_demoting;
   uint32_t key;
@@ -38,16 +40,47 @@ dt_cache_entry_t;
 typedef void((*dt_cache_allocate_t)(void *userdata, dt_cache_entry_t *entry));
 typedef void((*dt_cache_cleanup_t)(void *userdata, dt_cache_entry_t *entry));
 
-typedef struct dt_cache_t
+// how entries are picked for eviction
+typedef enum dt_cache_policy_t
+{
+  DT_CACHE_POLICY_LRU = 0, // every access moves the entry to the end of the list
+  DT_CACHE_POLICY_CLOCK,   // accesses only set a flag, gc gives flagged entries a second chance
+} dt_cache_policy_t;
+
+// upper bound for the number of shards of one cache, must be a power of two
+#define DT_CACHE_MAX_SHARDS 64
+
+// the entries are distributed over a number of shards by a hash of their key.
+// every shard has its own lock, hashtable and lru list, so threads working on
+// different keys rarely have to wait for each other. the cost quota is shared.
+typedef struct dt_cache_shard_t
 {
-  dt_pthread_mutex_t lock; // big fat lock. we're only expecting a couple hand full of cpu threads to use this concurrently.
+  dt_pthread_mutex_t lock; // protects everything in this shard
+
+  size_t cost;           // sum of the cost of the entries in this shard
+
+  GHashTable *hashtable; // stores (key, entry) pairs
+  dt_cache_entry_t *lru_head; // about to be kicked from cache
+  dt_cache_entry_t *lru_tail; // most recently used (or inserted, for clock)
+
+  // statistics, updated under the shard lock
+  uint64_t hits;         // entry found
+  uint64_t misses;       // entry had to be allocated
+  uint64_t contended;    // shard lock was held by another thread
+  uint64_t busy;         // entry was locked by another thread, had to retry
+}
+__attribute__((aligned(64))) dt_cache_shard_t;
 
+typedef struct dt_cache_t
+{
   size_t entry_size; // cache line allocation
-  size_t cost;       // user supplied cost per cache line (bytes?)
+  size_t cost;       // user supplied cost per cache line (bytes?), summed up over all shards
   size_t cost_quota; // quota to try and meet. but don't use as hard limit.
 
-  GHashTable *hashtable; // stores (key, entry) pairs
-  GList *lru;            // last element is most recently used, first is about to be kicked from cache.
+  uint32_t num_shards;      // power of two
+  dt_cache_shard_t *shards;
+
+  dt_cache_policy_t policy;
 
   // callback functions for cache misses/garbage collection
   dt_cache_allocate_t allocate;
@@ -61,6 +94,13 @@ dt_cache_t;
 void dt_cache_init(dt_cache_t *cache,
                    const size_t entry_size,
                    const size_t cost_quota);
+// same, but spread the entries over num_shards independently locked shards.
+// all shards count against the one quota, eviction takes the oldest entry
+// of each shard in turn.
+void dt_cache_init_sharded(dt_cache_t *cache,
+                           const size_t entry_size,
+                           const size_t cost_quota,
+                           const uint32_t num_shards);
 void dt_cache_cleanup(dt_cache_t *cache);
 
 static inline void dt_cache_set_allocate_callback(dt_cache_t *cache,
@@ -78,6 +118,13 @@ static inline void dt_cache_set_cleanup_callback(dt_cache_t *cache,
   cache->cleanup_data = cleanup_data;
 }
 
+// select the eviction policy, must be called before the cache is used
+static inline void dt_cache_set_policy(dt_cache_t *cache,
+                                       const dt_cache_policy_t policy)
+{
+  cache->policy = policy;
+}
+
 // returns a slot in the cache for this key (newly allocated if need
 // be), locked according to mode (r, w)
 #define dt_cache_get(A, B, C)  dt_cache_get_with_caller(A, B, C, __FILE__, __LINE__)
@@ -103,11 +150,15 @@ int32_t dt_cache_remove(dt_cache_t *cache,
                         const uint32_t key);
 // removes from the tip of the lru list, until the fill ratio of the hashtable
 // goes below the given parameter, in terms of the user defined cost measure.
-// will never lock and never fail, but sometimes not free memory (in case all
+// will never block on entry locks and never fail, but sometimes not free memory (in case all
 // is locked)
 void dt_cache_gc(dt_cache_t *cache,
                  const float fill_ratio);
 
+// print hit/miss and lock contention statistics, summed over all shards
+void dt_cache_print_stats(dt_cache_t *cache,
+                          const char *name);
+
 // iterate over all currently contained data blocks.
 // not thread safe! only use this for init/cleanup!
 // returns non zero the first time process() returns non zero.
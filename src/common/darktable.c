@@ -29,6 +29,7 @@
 #include <sys/malloc.h>
 #endif
 
+#include "common/arena.h"
 #include "common/collection.h"
 #include "common/colorspaces.h"
 #include "common/darktable.h"
@@ -47,10 +48,12 @@
 #include "common/grealpath.h"
 #include "common/image.h"
 #include "common/image_cache.h"
+#include "common/imagebuf.h"
 #include "common/iop_order.h"
 #include "common/l10n.h"
 #include "common/mipmap_cache.h"
 #include "common/noiseprofiles.h"
+#include "common/numa.h"
 #include "common/opencl.h"
 #include "common/points.h"
 #include "common/resource_limits.h"
@@ -64,6 +67,9 @@
 #include "control/signal.h"
 #include "develop/blend.h"
 #include "develop/imageop.h"
+#include "develop/pixelpipe_cache.h"
+#include "develop/tiling_model.h"
+#include "common/trace.h"
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
 #include "gui/guides.h"
@@ -246,6 +252,11 @@ static int usage(const char *argv0)
          "\n"
          "--dumpdir DIR\n"
          "\n"
+         "--trace FILE\n"
+         "    Record the pixelpipe processing steps, cache hits, tiling\n"
+         "    and OpenCL fallbacks and write them to FILE as chrome trace\n"
+         "    event json after each export job and at exit.\n"
+         "\n"
          "-d SIGNAL\n"
          "    Enable debug output to the terminal. Valid signals are:\n\n"
          "    act_on, cache, camctl, camsupport, control, dev, expose,\n"
@@ -436,14 +447,29 @@ dt_imgid_t dt_load_from_string(const gchar *input,
 
 static void dt_codepaths_init()
 {
-  // we no longer do explicit runtime selection of code paths, so initialize to "none"
-  // (there are still functions where the compiler creates runtime selection due to "target_clones"
-  // directives, but those are not affected by this code)
+  // functions with "target_clones" directives select their code path
+  // themselves. here we pick the variant of the kernels which have explicit
+  // avx2/avx512 versions, see dt_codepath_select()
 
   memset(&(darktable.codepath), 0, sizeof(darktable.codepath));
 
   // do we have any intrinsics sets enabled? (nope)
   darktable.codepath._no_intrinsics = 1;
+
+#ifdef DT_CODEPATH_VARIANTS
+  __builtin_cpu_init();
+  darktable.codepath.AVX2 = __builtin_cpu_supports("avx2")
+    && __builtin_cpu_supports("fma")
+    && dt_conf_get_bool("codepaths/avx2");
+  darktable.codepath.AVX512 = darktable.codepath.AVX2
+    && __builtin_cpu_supports("avx512f")
+    && __builtin_cpu_supports("avx512vl")
+    && dt_conf_get_bool("codepaths/avx512");
+#endif
+
+  dt_print(DT_DEBUG_PERF, "[dt_codepaths_init] using %s kernels\n",
+           darktable.codepath.AVX512 ? "avx512"
+           : darktable.codepath.AVX2 ? "avx2" : "generic");
 }
 
 static inline size_t _get_total_memory()
@@ -830,7 +856,9 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
   char *tmpdir_from_command = NULL;
   char *configdir_from_command = NULL;
   char *cachedir_from_command = NULL;
+  char *trace_from_command = NULL;
 
+  darktable.trace = NULL;
   darktable.dump_pfm_module = NULL;
   darktable.dump_pfm_pipe = NULL;
   darktable.tmp_directory = NULL;
@@ -879,6 +907,12 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
         argv[k-1] = NULL;
         argv[k] = NULL;
       }
+      else if(!strcmp(argv[k], "--trace") && argc > k + 1)
+      {
+        trace_from_command = argv[++k];
+        argv[k-1] = NULL;
+        argv[k] = NULL;
+      }
       else if(!strcmp(argv[k], "--bench-module") && argc > k + 1)
       {
         darktable.bench_module = argv[++k];
@@ -1358,6 +1392,15 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
   // detect cpu features and decide which codepaths to enable
   dt_codepaths_init();
 
+  // buffer and thread placement on multi-socket machines
+  dt_numa_init();
+
+  // parallel image copies, calibrated to the memory bandwidth if needed
+  dt_iop_image_copy_configure();
+
+  // measured memory and time of the modules for planning tiling
+  dt_tiling_model_init();
+
   // get the list of color profiles
   darktable.color_profiles = dt_colorspaces_init();
 
@@ -1545,9 +1588,17 @@ int dt_init(int argc, char *argv[], const gboolean init_gui, const gboolean load
   darktable.image_cache = (dt_image_cache_t *)calloc(1, sizeof(dt_image_cache_t));
   dt_image_cache_init(darktable.image_cache);
 
+  dt_trace_init(trace_from_command);
+
   darktable.mipmap_cache = (dt_mipmap_cache_t *)calloc(1, sizeof(dt_mipmap_cache_t));
   dt_mipmap_cache_init(darktable.mipmap_cache);
 
+  // one pool of cachelines for all darkroom pipes, limited like the full pipe cache
+  darktable.shared_pipe_cache =
+    init_gui && darktable.pipe_cache && dt_conf_get_bool("plugins/darkroom/shared_pipecache")
+    ? dt_dev_pixelpipe_shared_cache_new(MAX(64*1024*1024, darktable.dtresources.mipmap_memory / 4))
+    : NULL;
+
   // The GUI must be initialized before the views, because the init()
   // functions of the views depend on darktable.control->accels_* to
   // register their keyboard accelerators
@@ -1826,6 +1877,8 @@ void dt_cleanup()
   free(darktable.image_cache);
   dt_mipmap_cache_cleanup(darktable.mipmap_cache);
   free(darktable.mipmap_cache);
+  dt_dev_pixelpipe_shared_cache_free(darktable.shared_pipe_cache);
+  darktable.shared_pipe_cache = NULL;
   if(init_gui)
   {
     dt_control_cleanup(darktable.control);
@@ -1905,6 +1958,12 @@ void dt_cleanup()
 
   dt_capabilities_cleanup();
 
+  dt_trace_cleanup();
+
+  dt_tiling_model_cleanup();
+
+  dt_numa_cleanup();
+
   if(darktable.tmp_directory)
     g_free(darktable.tmp_directory);
 
@@ -2334,6 +2393,8 @@ void dt_print_mem_usage()
 #else
   dt_print(DT_DEBUG_ALWAYS, "dt_print_mem_usage() currently unsupported on this platform\n");
 #endif
+
+  dt_arena_print_stats();
 }
 
 // clang-format off
@@ -163,6 +163,23 @@ extern "C" {
 #define __DT_CLONE_TARGETS__
 #endif
 
+/* Kernels with explicit avx2 and avx512 variants, picked once at startup by
+   dt_codepaths_init() and selected with dt_codepath_select(). the variants
+   must not contain OpenMP regions themselves, as the outlined region would
+   be compiled for the default target: parallelize in a generic caller and
+   dispatch per row or block. not on windows, where gcc can't align the
+   stack for spilled avx registers. */
+#if __has_attribute(target) && !defined(_WIN32) \
+  && (defined(__amd64__) || defined(__amd64) || defined(__x86_64__) || defined(__x86_64))
+#define DT_CODEPATH_VARIANTS 1
+#define __DT_TARGET_AVX2__ __attribute__((target("avx2,fma")))
+#define __DT_TARGET_AVX512__ __attribute__((target("avx512f,avx512vl,avx2,fma")))
+#define dt_codepath_select(generic, avx2, avx512)                                     \
+  (darktable.codepath.AVX512 ? (avx512) : darktable.codepath.AVX2 ? (avx2) : (generic))
+#else
+#define dt_codepath_select(generic, avx2, avx512) (generic)
+#endif
+
 typedef int32_t dt_imgid_t;
 typedef int32_t dt_filmid_t;
 #define NO_IMGID (0)
@@ -324,6 +341,8 @@ typedef enum dt_debug_thread_t
 typedef struct dt_codepath_t
 {
   unsigned int _no_intrinsics : 1;
+  unsigned int AVX2 : 1;   // cpu has avx2 and fma, and it is not disabled
+  unsigned int AVX512 : 1; // same for avx512f and avx512vl, implies AVX2
 } dt_codepath_t;
 
 typedef struct dt_sys_resources_t
@@ -414,6 +433,8 @@ typedef struct darktable_t
   int32_t unmuted_signal_dbg_acts;
   gboolean unmuted_signal_dbg[DT_SIGNAL_COUNT];
   gboolean pipe_cache;
+  struct dt_dev_pixelpipe_shared_cache_t *shared_pipe_cache;
+  struct dt_trace_t *trace;
   GTimeZone *utc_tz;
   GDateTime *origin_gdt;
   struct dt_sys_resources_t dtresources;
@@ -274,102 +274,252 @@ static inline _aligned_pixel add_float4(_aligned_pixel acc, _aligned_pixel newva
     sum[c] /= wgt[c];                                                   				     \
     pcoarse[c] = sum[c];                                                                                     \
     det[c] = (px[c] - sum[c]);									             \
-    sum_sq.v[c] += (det[c]*det[c]);					                                     \
+    sum_sq->v[c] += (det[c]*det[c]);					                                     \
   }                                                                       				     \
   copy_pixel_nontemporal(pdetail, det);                                                                      \
   px += 4;                                                                                                   \
   pdetail += 4;                                                                                              \
   pcoarse += 4;
 
-void eaw_dn_decompose(float *const restrict out, const float *const restrict in, float *const restrict detail,
-                      dt_aligned_pixel_t sum_squared, const int scale, const float inv_sigma2,
-                      const int32_t width, const int32_t height)
+static const float dn_filter[25] =
+  {
+    1.0f / 256.0f,  4.0f / 256.0f,  6.0f / 256.0f,  4.0f / 256.0f, 1.0f / 256.0f,
+    4.0f / 256.0f, 16.0f / 256.0f, 24.0f / 256.0f, 16.0f / 256.0f, 4.0f / 256.0f,
+    6.0f / 256.0f, 24.0f / 256.0f, 36.0f / 256.0f, 24.0f / 256.0f, 6.0f / 256.0f,
+    4.0f / 256.0f, 16.0f / 256.0f, 24.0f / 256.0f, 16.0f / 256.0f, 4.0f / 256.0f,
+    1.0f / 256.0f,  4.0f / 256.0f,  6.0f / 256.0f,  4.0f / 256.0f, 1.0f / 256.0f
+  };
+
+// neighbouring pixels of the bulk of a row in one vector: two for avx2
+// and four for avx512, so the shuffles stay within 128 bit lanes. this is
+// the same computation as SUM_PIXEL_* for each of them, including the
+// weights, with fast_mexp2f() on integer vectors.
+typedef float dn_v8sf __attribute__((vector_size(32)));
+typedef int dn_v8si __attribute__((vector_size(32)));
+typedef float dn_v16sf __attribute__((vector_size(64)));
+typedef int dn_v16si __attribute__((vector_size(64)));
+
+// broadcast channel C of each pixel to all of its channels
+#ifdef __clang__
+#define DN_BROADCAST8(V, C)                                                   \
+  __builtin_shufflevector(V, V, C, C, C, C, 4+C, 4+C, 4+C, 4+C)
+#define DN_BROADCAST16(V, C)                                                  \
+  __builtin_shufflevector(V, V, C, C, C, C, 4+C, 4+C, 4+C, 4+C,               \
+                          8+C, 8+C, 8+C, 8+C, 12+C, 12+C, 12+C, 12+C)
+#else
+#define DN_BROADCAST8(V, C)                                                   \
+  __builtin_shuffle(V, ((dn_v8si){ C, C, C, C, 4+C, 4+C, 4+C, 4+C }))
+#define DN_BROADCAST16(V, C)                                                  \
+  __builtin_shuffle(V, ((dn_v16si){ C, C, C, C, 4+C, 4+C, 4+C, 4+C,           \
+                                    8+C, 8+C, 8+C, 8+C, 12+C, 12+C, 12+C, 12+C }))
+#endif
+
+#define DN_DECOMPOSE_BLOCK(VSF, VSI, BROADCAST)                                                              \
+  /* the rows are only aligned to a pixel */                                                                 \
+  VSF centre;                                                                                                \
+  memcpy(&centre, px, sizeof(centre));                                                                       \
+  VSF sum = { 0.0f };                                                                                        \
+  VSF wgt = { 0.0f };                                                                                        \
+  size_t filter_idx = 0;                                                                                     \
+  for(int jj = 0; jj < 5; jj++)                                                                              \
+  {                                                                                                          \
+    for(int ii = 0; ii < 5; ii++)                                                                            \
+    {                                                                                                        \
+      VSF p2;                                                                                                \
+      memcpy(&p2, px2, sizeof(p2));                                                                          \
+      const VSF diff = centre - p2;                                                                          \
+      const VSF sqr = diff * diff;                                                                           \
+      const VSF dot = (BROADCAST(sqr, 0) + BROADCAST(sqr, 1) + BROADCAST(sqr, 2)) * inv_sigma2;              \
+      VSF x = dot * 0.02f - 9.0f;                                                                            \
+      x = (VSF)((VSI)x & (x > 0.0f));                                                                        \
+      const VSF k0 = (float)0x3f800000u + x * ((float)0x3f000000u - (float)0x3f800000u);                     \
+      const VSI ki = __builtin_convertvector(k0, VSI) & (k0 >= (float)0x800000u);                            \
+      const VSF w = dn_filter[filter_idx++] * (VSF)ki;                                                       \
+      wgt += w;                                                                                              \
+      sum += w * p2;                                                                                         \
+      px2 += (size_t)4 * mult;                                                                               \
+    }                                                                                                        \
+    px2 += (size_t)4 * (width - 5) * mult;                                                                   \
+  }                                                                                                          \
+  sum /= wgt;                                                                                                \
+  const VSF det = centre - sum;                                                                              \
+  memcpy(pcoarse, &sum, sizeof(sum));                                                                        \
+  memcpy(pdetail, &det, sizeof(det));                                                                        \
+  const VSF det2 = det * det;                                                                                \
+  for(size_t k = 0; k < sizeof(VSF) / sizeof(float); k += 4)                                                 \
+    for_four_channels(c)                                                                                     \
+      sum_sq->v[c] += det2[k+c];
+
+static inline __attribute__((always_inline)) void dn_decompose_block2(const float *const px,
+                                                                      const float *px2,
+                                                                      float *const pcoarse,
+                                                                      float *const pdetail,
+                                                                      _aligned_pixel *const sum_sq,
+                                                                      const int mult,
+                                                                      const int32_t width,
+                                                                      const float inv_sigma2)
 {
-  const int mult = 1u << scale;
-  static const float filter[25] =
-    {
-      1.0f / 256.0f,  4.0f / 256.0f,  6.0f / 256.0f,  4.0f / 256.0f, 1.0f / 256.0f,
-      4.0f / 256.0f, 16.0f / 256.0f, 24.0f / 256.0f, 16.0f / 256.0f, 4.0f / 256.0f,
-      6.0f / 256.0f, 24.0f / 256.0f, 36.0f / 256.0f, 24.0f / 256.0f, 6.0f / 256.0f,
-      4.0f / 256.0f, 16.0f / 256.0f, 24.0f / 256.0f, 16.0f / 256.0f, 4.0f / 256.0f,
-      1.0f / 256.0f,  4.0f / 256.0f,  6.0f / 256.0f,  4.0f / 256.0f, 1.0f / 256.0f
-    };
-  const int boundary = 2 * mult;
+  DN_DECOMPOSE_BLOCK(dn_v8sf, dn_v8si, DN_BROADCAST8)
+}
 
-  _aligned_pixel sum_sq = { .v = { 0.0f } };
+static inline __attribute__((always_inline)) void dn_decompose_block4(const float *const px,
+                                                                      const float *px2,
+                                                                      float *const pcoarse,
+                                                                      float *const pdetail,
+                                                                      _aligned_pixel *const sum_sq,
+                                                                      const int mult,
+                                                                      const int32_t width,
+                                                                      const float inv_sigma2)
+{
+  DN_DECOMPOSE_BLOCK(dn_v16sf, dn_v16si, DN_BROADCAST16)
+}
 
-#if !(defined(__apple_build_version__) && __apple_build_version__ < 11030000) //makes Xcode 11.3.1 compiler crash
-DT_OMP_FOR(reduction(vsum: sum_sq))
-#endif
-  for(int rowid = 0; rowid < height; rowid++)
+#undef DN_DECOMPOSE_BLOCK
+#undef DN_BROADCAST8
+#undef DN_BROADCAST16
+
+static inline __attribute__((always_inline)) void dn_decompose_row(float *const restrict out,
+                                                                   const float *const restrict in,
+                                                                   float *const restrict detail,
+                                                                   _aligned_pixel *const sum_sq,
+                                                                   const size_t j,
+                                                                   const int mult,
+                                                                   const float inv_sigma2,
+                                                                   const int32_t width,
+                                                                   const int32_t height,
+                                                                   const int block)
+{
+  const float *const filter = dn_filter;
+  const int boundary = 2 * mult;
+  const float *px = ((float *)in) + (size_t)4 * j * width;
+  const float *px2;
+  float *pdetail = detail + (size_t)4 * j * width;
+  float *pcoarse = out + (size_t)4 * j * width;
+
+  // for the first and last 'boundary' rows, we have to perform boundary tests for the entire row;
+  //   for the central bulk, we only need to use those slower versions on the leftmost and rightmost pixels
+  const int lbound = (j < boundary || j >= height - boundary) ? width-boundary : boundary;
+
+  /* The first "2*mult" pixels need a boundary check because we might try to access past the left edge,
+   * which requires nearest pixel interpolation */
+  int i;
+  for(i = 0; i < lbound; i++)
   {
-    const size_t j = dwt_interleave_rows(rowid, height, mult);
-    const float *px = ((float *)in) + (size_t)4 * j * width;
-    const float *px2;
-    float *pdetail = detail + (size_t)4 * j * width;
-    float *pcoarse = out + (size_t)4 * j * width;
-
-    // for the first and last 'boundary' rows, we have to perform boundary tests for the entire row;
-    //   for the central bulk, we only need to use those slower versions on the leftmost and rightmost pixels
-    const int lbound = (j < boundary || j >= height - boundary) ? width-boundary : boundary;
-
-    /* The first "2*mult" pixels need a boundary check because we might try to access past the left edge,
-     * which requires nearest pixel interpolation */
-    int i;
-    for(i = 0; i < lbound; i++)
+    SUM_PIXEL_PROLOGUE;
+    for(int jj = 0; jj < 5; jj++)
     {
-      SUM_PIXEL_PROLOGUE;
-      for(int jj = 0; jj < 5; jj++)
+      const int y = j + mult * (jj-2);
+      const int clamp_y = CLAMP(y,0,height-1);
+      for(int ii = 0; ii < 5; ii++)
       {
-        const int y = j + mult * (jj-2);
-        const int clamp_y = CLAMP(y,0,height-1);
-        for(int ii = 0; ii < 5; ii++)
-        {
-          int x = i + mult * ((ii)-2);
-          if(x < 0) x = 0;			// we might be looking past the left edge
-          px2 = ((float *)in) + 4 * x + (size_t)4 * clamp_y * width;
-          SUM_PIXEL_CONTRIBUTION;
-        }
+        int x = i + mult * ((ii)-2);
+        if(x < 0) x = 0;			// we might be looking past the left edge
+        px2 = ((float *)in) + 4 * x + (size_t)4 * clamp_y * width;
+        SUM_PIXEL_CONTRIBUTION;
       }
-      SUM_PIXEL_EPILOGUE;
     }
+    SUM_PIXEL_EPILOGUE;
+  }
 
-    /* For pixels [2*mult, width-2*mult], we don't need to do any boundary checks */
-    for( ; i < width - boundary; i++)
+  /* For pixels [2*mult, width-2*mult], we don't need to do any boundary checks */
+  for( ; block > 1 && i + block <= width - boundary; i += block)
+  {
+    px2 = ((float *)in) + (size_t)4 * (i - 2 * mult + (size_t)(j - 2 * mult) * width);
+    if(block == 4)
+      dn_decompose_block4(px, px2, pcoarse, pdetail, sum_sq, mult, width, inv_sigma2);
+    else
+      dn_decompose_block2(px, px2, pcoarse, pdetail, sum_sq, mult, width, inv_sigma2);
+    px += 4 * block;
+    pdetail += 4 * block;
+    pcoarse += 4 * block;
+  }
+  for( ; i < width - boundary; i++)
+  {
+    SUM_PIXEL_PROLOGUE;
+    px2 = ((float *)in) + (size_t)4 * (i - 2 * mult + (size_t)(j - 2 * mult) * width);
+    for(int jj = 0; jj < 5; jj++)
     {
-      SUM_PIXEL_PROLOGUE;
-      px2 = ((float *)in) + (size_t)4 * (i - 2 * mult + (size_t)(j - 2 * mult) * width);
-      for(int jj = 0; jj < 5; jj++)
+      for(int ii = 0; ii < 5; ii++)
       {
-        for(int ii = 0; ii < 5; ii++)
-        {
-          SUM_PIXEL_CONTRIBUTION;
-          px2 += (size_t)4 * mult;
-        }
-        px2 += (size_t)4 * (width - 5) * mult;
+        SUM_PIXEL_CONTRIBUTION;
+        px2 += (size_t)4 * mult;
       }
-      SUM_PIXEL_EPILOGUE;
+      px2 += (size_t)4 * (width - 5) * mult;
     }
+    SUM_PIXEL_EPILOGUE;
+  }
 
-    /* Last 2*mult pixels in the row require the boundary check again */
-    for( ; i < width; i++)
+  /* Last 2*mult pixels in the row require the boundary check again */
+  for( ; i < width; i++)
+  {
+    SUM_PIXEL_PROLOGUE;
+    for(int jj = 0; jj < 5; jj++)
     {
-      SUM_PIXEL_PROLOGUE;
-      for(int jj = 0; jj < 5; jj++)
+      const int y = j + mult * (jj-2);
+      const int clamp_y = CLAMP(y,0,height-1);
+      for(int ii = 0; ii < 5; ii++)
       {
-        const int y = j + mult * (jj-2);
-        const int clamp_y = CLAMP(y,0,height-1);
-        for(int ii = 0; ii < 5; ii++)
-        {
-          const int x = i + mult * ((ii)-2);
-          // ensure that we don't look past either edge (left edge is possible at higher scales on small images)
-          const int clamp_x = CLAMP(x, 0, width-1);
-          px2 = ((float *)in) + 4 * clamp_x + (size_t)4 * clamp_y * width;
-          SUM_PIXEL_CONTRIBUTION;
-        }
+        const int x = i + mult * ((ii)-2);
+        // ensure that we don't look past either edge (left edge is possible at higher scales on small images)
+        const int clamp_x = CLAMP(x, 0, width-1);
+        px2 = ((float *)in) + 4 * clamp_x + (size_t)4 * clamp_y * width;
+        SUM_PIXEL_CONTRIBUTION;
       }
-      SUM_PIXEL_EPILOGUE;
     }
+    SUM_PIXEL_EPILOGUE;
+  }
+}
+
+typedef void((*dn_decompose_row_t)(float *const restrict out, const float *const restrict in,
+                                   float *const restrict detail, _aligned_pixel *const sum_sq,
+                                   const size_t j, const int mult, const float inv_sigma2,
+                                   const int32_t width, const int32_t height));
+
+static void dn_decompose_row_generic(float *const restrict out, const float *const restrict in,
+                                     float *const restrict detail, _aligned_pixel *const sum_sq,
+                                     const size_t j, const int mult, const float inv_sigma2,
+                                     const int32_t width, const int32_t height)
+{
+  dn_decompose_row(out, in, detail, sum_sq, j, mult, inv_sigma2, width, height, 1);
+}
+
+#ifdef DT_CODEPATH_VARIANTS
+__DT_TARGET_AVX2__
+static void dn_decompose_row_avx2(float *const restrict out, const float *const restrict in,
+                                  float *const restrict detail, _aligned_pixel *const sum_sq,
+                                  const size_t j, const int mult, const float inv_sigma2,
+                                  const int32_t width, const int32_t height)
+{
+  dn_decompose_row(out, in, detail, sum_sq, j, mult, inv_sigma2, width, height, 2);
+}
+
+__DT_TARGET_AVX512__
+static void dn_decompose_row_avx512(float *const restrict out, const float *const restrict in,
+                                    float *const restrict detail, _aligned_pixel *const sum_sq,
+                                    const size_t j, const int mult, const float inv_sigma2,
+                                    const int32_t width, const int32_t height)
+{
+  dn_decompose_row(out, in, detail, sum_sq, j, mult, inv_sigma2, width, height, 4);
+}
+#endif
+
+void eaw_dn_decompose(float *const restrict out, const float *const restrict in, float *const restrict detail,
+                      dt_aligned_pixel_t sum_squared, const int scale, const float inv_sigma2,
+                      const int32_t width, const int32_t height)
+{
+  const int mult = 1u << scale;
+  const dn_decompose_row_t decompose_row =
+    dt_codepath_select(dn_decompose_row_generic, dn_decompose_row_avx2, dn_decompose_row_avx512);
+
+  _aligned_pixel sum_sq = { .v = { 0.0f } };
+
+#if !(defined(__apple_build_version__) && __apple_build_version__ < 11030000) //makes Xcode 11.3.1 compiler crash
+DT_OMP_FOR(reduction(vsum: sum_sq))
+#endif
+  for(int rowid = 0; rowid < height; rowid++)
+  {
+    const size_t j = dwt_interleave_rows(rowid, height, mult);
+    decompose_row(out, in, detail, &sum_sq, j, mult, inv_sigma2, width, height);
   }
   for_each_channel(c)
     sum_squared[c] = sum_sq.v[c];
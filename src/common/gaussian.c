@@ -455,6 +455,132 @@ void dt_gaussian_blur_4c(dt_gaussian_t *g, const float *const in, float *const o
   }
 }
 
+// vertical recursive filter of the columns i0..i1 of a plane. all columns
+// of the block advance together row by row, so the loads and stores are
+// contiguous and the loop over the block vectorizes.
+static inline void _blur_plane_columns(const float *const restrict in,
+                                       float *const restrict out,
+                                       const size_t width,
+                                       const size_t height,
+                                       const size_t i0,
+                                       const size_t n,
+                                       const float min,
+                                       const float max,
+                                       const float a0, const float a1,
+                                       const float a2, const float a3,
+                                       const float b1, const float b2,
+                                       const float coefp, const float coefn)
+{
+  float DT_ALIGNED_ARRAY xp[BLOCKSIZE], yb[BLOCKSIZE], yp[BLOCKSIZE];
+
+  // forward filter
+  for(size_t k = 0; k < n; k++)
+  {
+    xp[k] = CLAMPF(in[i0 + k], min, max);
+    yb[k] = xp[k] * coefp;
+    yp[k] = yb[k];
+  }
+
+  for(size_t j = 0; j < height; j++)
+  {
+    const float *const restrict row = in + j * width + i0;
+    float *const restrict orow = out + j * width + i0;
+    DT_OMP_SIMD()
+    for(size_t k = 0; k < n; k++)
+    {
+      const float xc = CLAMPF(row[k], min, max);
+      const float yc = (a0 * xc) + (a1 * xp[k]) - (b1 * yp[k]) - (b2 * yb[k]);
+      orow[k] = yc;
+      xp[k] = xc;
+      yb[k] = yp[k];
+      yp[k] = yc;
+    }
+  }
+
+  // backward filter, reusing the state arrays as xn, xa, yn and ya
+  float DT_ALIGNED_ARRAY xa[BLOCKSIZE];
+  const float *const restrict last = in + (height - 1) * width + i0;
+  for(size_t k = 0; k < n; k++)
+  {
+    xp[k] = CLAMPF(last[k], min, max);
+    xa[k] = xp[k];
+    yp[k] = xp[k] * coefn;
+    yb[k] = yp[k];
+  }
+
+  for(size_t j = height; j > 0; j--)
+  {
+    const float *const restrict row = in + (j - 1) * width + i0;
+    float *const restrict orow = out + (j - 1) * width + i0;
+    DT_OMP_SIMD()
+    for(size_t k = 0; k < n; k++)
+    {
+      const float xc = CLAMPF(row[k], min, max);
+      const float yc = (a2 * xp[k]) + (a3 * xa[k]) - (b1 * yp[k]) - (b2 * yb[k]);
+      xa[k] = xp[k];
+      xp[k] = xc;
+      yb[k] = yp[k];
+      yp[k] = yc;
+      orow[k] += yc;
+    }
+  }
+}
+
+// out (width x height) = transposed in (height x width), in square tiles
+static void _transpose_plane(const float *const restrict in,
+                             float *const restrict out,
+                             const size_t width,
+                             const size_t height)
+{
+  DT_OMP_FOR(collapse(2))
+  for(size_t jj = 0; jj < height; jj += BLOCKSIZE)
+    for(size_t ii = 0; ii < width; ii += BLOCKSIZE)
+    {
+      const size_t jend = MIN(jj + BLOCKSIZE, height);
+      const size_t iend = MIN(ii + BLOCKSIZE, width);
+      for(size_t i = ii; i < iend; i++)
+        for(size_t j = jj; j < jend; j++)
+          out[i * height + j] = in[j * width + i];
+    }
+}
+
+void dt_gaussian_blur_planar(dt_gaussian_t *g, const float *const in, float *const out)
+{
+  const size_t width = g->width;
+  const size_t height = g->height;
+  const size_t plane = width * height;
+
+  float a0, a1, a2, a3, b1, b2, coefp, coefn;
+
+  compute_gauss_params(g->sigma, g->order, &a0, &a1, &a2, &a3, &b1, &b2, &coefp, &coefn);
+
+  for(int c = 0; c < g->channels; c++)
+  {
+    const float *const in_c = in + c * plane;
+    float *const out_c = out + c * plane;
+    float *const temp = g->buf + c * plane;
+    const float min = g->min[c];
+    const float max = g->max[c];
+
+    // vertical blur, then the same on the transposed plane for the
+    // horizontal one. out_c serves as the transposed buffer, so in and out
+    // may be the same.
+    DT_OMP_FOR()
+    for(size_t i = 0; i < width; i += BLOCKSIZE)
+      _blur_plane_columns(in_c, temp, width, height, i, MIN(BLOCKSIZE, width - i),
+                          min, max, a0, a1, a2, a3, b1, b2, coefp, coefn);
+
+    _transpose_plane(temp, out_c, width, height);
+
+    DT_OMP_FOR()
+    for(size_t j = 0; j < height; j += BLOCKSIZE)
+      _blur_plane_columns(out_c, temp, height, width, j, MIN(BLOCKSIZE, height - j),
+                          min, max, a0, a1, a2, a3, b1, b2, coefp, coefn);
+
+    _transpose_plane(temp, out_c, height, width);
+  }
+}
+
 void dt_gaussian_free(dt_gaussian_t *g)
 {
   if(!g) return;
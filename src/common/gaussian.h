@@ -54,6 +54,10 @@ void dt_gaussian_blur(dt_gaussian_t *g, const float *const in, float *const out)
 
 void dt_gaussian_blur_4c(dt_gaussian_t *g, const float *const in, float *const out);
 
+/** blur the first channels planes of width * height floats each, e.g. of a
+ * planar pixelpipe buffer. in and out may be the same buffer */
+void dt_gaussian_blur_planar(dt_gaussian_t *g, const float *const in, float *const out);
+
 void dt_gaussian_free(dt_gaussian_t *g);
 
 
@@ -0,0 +1,106 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/halffloat.h"
+#include "common/darktable.h"
+
+#ifdef DT_CODEPATH_VARIANTS
+#include <immintrin.h>
+#endif
+
+// elements converted by one thread at a time
+#define DT_HALF_CHUNK (64 * 1024)
+
+typedef void (*_to_half_t)(dt_half_t *const out, const float *const in, const size_t n);
+typedef void (*_to_float_t)(float *const out, const dt_half_t *const in, const size_t n);
+
+static void _to_half_generic(dt_half_t *const restrict out,
+                             const float *const restrict in,
+                             const size_t n)
+{
+  for(size_t k = 0; k < n; k++)
+    out[k] = dt_float_to_half(in[k]);
+}
+
+static void _to_float_generic(float *const restrict out,
+                              const dt_half_t *const restrict in,
+                              const size_t n)
+{
+  for(size_t k = 0; k < n; k++)
+    out[k] = dt_half_to_float(in[k]);
+}
+
+#ifdef DT_CODEPATH_VARIANTS
+// every cpu with avx2 also has f16c, so these share its codepath
+__attribute__((target("avx,f16c")))
+static void _to_half_f16c(dt_half_t *const restrict out,
+                          const float *const restrict in,
+                          const size_t n)
+{
+  // saturate like dt_float_to_half(), NaN is passed as the second operand
+  const __m256 lo = _mm256_set1_ps(-DT_HALF_MAX);
+  const __m256 hi = _mm256_set1_ps(DT_HALF_MAX);
+  size_t k = 0;
+  for(; k + 8 <= n; k += 8)
+  {
+    const __m256 v = _mm256_min_ps(hi, _mm256_max_ps(lo, _mm256_loadu_ps(in + k)));
+    _mm_storeu_si128((__m128i *)(out + k), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+  }
+  for(; k < n; k++)
+    out[k] = dt_float_to_half(in[k]);
+}
+
+__attribute__((target("avx,f16c")))
+static void _to_float_f16c(float *const restrict out,
+                           const dt_half_t *const restrict in,
+                           const size_t n)
+{
+  size_t k = 0;
+  for(; k + 8 <= n; k += 8)
+    _mm256_storeu_ps(out + k, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + k))));
+  for(; k < n; k++)
+    out[k] = dt_half_to_float(in[k]);
+}
+#else
+#define _to_half_f16c _to_half_generic
+#define _to_float_f16c _to_float_generic
+#endif
+
+void dt_float_to_half_buf(dt_half_t *const out, const float *const in, const size_t n)
+{
+  const _to_half_t convert = dt_codepath_select(_to_half_generic, _to_half_f16c, _to_half_f16c);
+  DT_OMP_FOR()
+  for(size_t k = 0; k < n; k += DT_HALF_CHUNK)
+    convert(out + k, in + k, MIN(DT_HALF_CHUNK, n - k));
+}
+
+void dt_half_to_float_buf(float *const out, const dt_half_t *const in, const size_t n)
+{
+  const _to_float_t convert = dt_codepath_select(_to_float_generic, _to_float_f16c, _to_float_f16c);
+  DT_OMP_FOR()
+  for(size_t k = 0; k < n; k += DT_HALF_CHUNK)
+    convert(out + k, in + k, MIN(DT_HALF_CHUNK, n - k));
+}
+
+#undef DT_HALF_CHUNK
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -0,0 +1,97 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * IEEE 754 half precision floats, used to store float buffers in half the
+ * memory. all computation stays in float, the buffers are converted when
+ * they are stored and loaded.
+ *
+ * the conversion rounds to nearest even. the relative error of normal
+ * numbers (2^-14 .. 65504) is below 2^-11, smaller numbers keep an absolute
+ * precision of 2^-24. finite values and infinities beyond the range
+ * saturate to +-65504, NaN stays NaN.
+ */
+
+typedef uint16_t dt_half_t;
+
+#define DT_HALF_MAX 65504.0f
+
+typedef union dt_half_bits_t
+{
+  float f;
+  uint32_t u;
+} dt_half_bits_t;
+
+static inline dt_half_t dt_float_to_half(const float f)
+{
+  dt_half_bits_t v = { .f = f };
+  const uint32_t sign = v.u & 0x80000000u;
+  v.u ^= sign;
+
+  uint32_t h;
+  if(v.u > 0x477fe000u) // beyond 65504, inf or nan
+    h = (v.u > 0x7f800000u) ? 0x7e00u : 0x7bffu;
+  else if(v.u < 0x38800000u) // below 2^-14, denormal or zero
+  {
+    // let the float adder do the rounding of the shifted mantissa
+    const dt_half_bits_t magic = { .u = 126u << 23 };
+    v.f += magic.f;
+    h = v.u - magic.u;
+  }
+  else
+  {
+    // rebias the exponent and round the mantissa to nearest even
+    const uint32_t odd = (v.u >> 13) & 1u;
+    v.u += 0xc8000fffu + odd;
+    h = v.u >> 13;
+  }
+  return (dt_half_t)(h | (sign >> 16));
+}
+
+static inline float dt_half_to_float(const dt_half_t h)
+{
+  dt_half_bits_t v = { .u = (uint32_t)(h & 0x7fffu) << 13 };
+  const uint32_t exp = v.u & 0x0f800000u;
+  v.u += (127u - 15u) << 23;
+  if(exp == 0x0f800000u) // inf or nan
+    v.u += (128u - 16u) << 23;
+  else if(exp == 0) // denormal or zero, renormalize
+  {
+    const dt_half_bits_t magic = { .u = 113u << 23 };
+    v.u += 1u << 23;
+    v.f -= magic.f;
+  }
+  v.u |= (uint32_t)(h & 0x8000u) << 16;
+  return v.f;
+}
+
+/** convert n floats to half floats and back, in parallel and with the F16C
+ * instructions where available */
+void dt_float_to_half_buf(dt_half_t *const out, const float *const in, const size_t n);
+void dt_half_to_float_buf(float *const out, const dt_half_t *const in, const size_t n);
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
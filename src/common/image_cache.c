@@ -217,7 +217,10 @@ void dt_image_cache_init(dt_image_cache_t *cache)
   //       can we get away with a fixed size?
   const uint32_t max_mem = 50 * 1024 * 1024;
   const uint32_t num = (uint32_t)(1.5f * max_mem / sizeof(dt_image_t));
-  dt_cache_init(&cache->cache, sizeof(dt_image_t), max_mem);
+  // lots of small entries accessed from every thread, spread them out
+  dt_cache_init_sharded(&cache->cache, sizeof(dt_image_t), max_mem, 16);
+  // hits are far more common than evictions here, keep them cheap
+  dt_cache_set_policy(&cache->cache, DT_CACHE_POLICY_CLOCK);
   dt_cache_set_allocate_callback(&cache->cache, &_image_cache_allocate, cache);
   dt_cache_set_cleanup_callback(&cache->cache, &_image_cache_deallocate, cache);
 
@@ -236,6 +239,7 @@ void dt_image_cache_print(dt_image_cache_t *cache)
            cache->cache.cost / (1024.0 * 1024.0),
            cache->cache.cost_quota / (1024.0 * 1024.0),
            (float)cache->cache.cost / (float)cache->cache.cost_quota);
+  dt_cache_print_stats(&cache->cache, "image cache");
 }
 
 dt_image_t *dt_image_cache_get(dt_image_cache_t *cache,
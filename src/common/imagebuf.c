@@ -16,12 +16,19 @@
     along with darktable.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <float.h>
 #include <stdarg.h>
 #include "common/imagebuf.h"
+#include "common/arena.h"
+#include "control/conf.h"
 
+// defaults until dt_iop_image_copy_configure() has been called
 static size_t parallel_imgop_minimum = 500000;
 static size_t parallel_imgop_maxthreads = 4;
 
+// bump this to have the timings redone after changes to the copy code
+#define CALIBRATION_VERSION 1
+
 // Allocate one or more buffers as detailed in the given parameters.
 // If any allocation fails, free all of them, set the module's trouble
 // flag, and return FALSE.
@@ -95,6 +102,7 @@ gboolean dt_iop_alloc_image_buffers(struct dt_iop_module_t *const module,
     else
     {
       *bufptr = dt_alloc_align_float(nfloats);
+      dt_arena_advise_hugepages(*bufptr, nfloats * sizeof(float));
       if((size & DT_IMGSZ_CLEARBUF) && *bufptr)
         memset(*bufptr, 0, nfloats * sizeof(float));
     }
@@ -145,6 +153,30 @@ gboolean dt_iop_alloc_image_buffers(struct dt_iop_module_t *const module,
 // because it helps document the purpose of the code and because it
 // gives us a single point where we can optimize performance on
 // different architectures.
+#ifdef _OPENMP
+static void _image_copy_parallel(float *const __restrict__ out,
+                                 const float *const __restrict__ in,
+                                 const size_t nfloats,
+                                 const size_t nthreads)
+{
+  float *const outv __attribute__((aligned(16))) = out;
+  const float *const inv __attribute__((aligned(16))) = in;
+  // determine the number of 4-float vectors to be processed by each thread
+  const size_t chunksize = (((nfloats + nthreads - 1) / nthreads) + 3) / 4;
+  DT_OMP_FOR(num_threads(nthreads))
+  for(size_t chunk = 0; chunk < nthreads; chunk++)
+  {
+    const size_t limit = MIN(4*(chunk+1)*chunksize, nfloats);
+    const size_t limit4 = limit & ~3;
+    for(size_t k = 4 * chunk * chunksize; k < limit4; k += 4)
+      copy_pixel_nontemporal(outv + k, inv + k);
+    // handle any leftover pixels in the final slice
+    for(size_t k = 0; k < (limit & 3); k++)
+      outv[k + limit4] = inv[k + limit4];
+  }
+}
+#endif // _OPENMP
+
 void dt_iop_image_copy(float *const __restrict__ out,
                        const float *const __restrict__ in,
                        const size_t nfloats)
@@ -152,27 +184,13 @@ void dt_iop_image_copy(float *const __restrict__ out,
 #ifdef _OPENMP
   if(nfloats > parallel_imgop_minimum)	// is the copy big enough to outweigh threading overhead?
   {
-    float *const outv __attribute__((aligned(16))) = out;
-    const float *const inv __attribute__((aligned(16))) = in;
     // we can gain a little by using a small number of threads in
     // parallel, but not much since the memory bus quickly saturates
     // (basically, each core can saturate a memory channel, so a
     // system with quad-channel memory won't be able to take advantage
     // of more than four cores).
     const int nthreads = MIN(dt_get_num_threads(), parallel_imgop_maxthreads);
-    // determine the number of 4-float vectors to be processed by each thread
-    const size_t chunksize = (((nfloats + nthreads - 1) / nthreads) + 3) / 4;
-    DT_OMP_FOR(num_threads(nthreads))
-    for(size_t chunk = 0; chunk < nthreads; chunk++)
-    {
-      const size_t limit = MIN(4*(chunk+1)*chunksize, nfloats);
-      const size_t limit4 = limit & ~3;
-      for(size_t k = 4 * chunk * chunksize; k < limit4; k += 4)
-        copy_pixel_nontemporal(outv + k, inv + k);
-      // handle any leftover pixels in the final slice
-      for(size_t k = 0; k < (limit & 3); k++)
-        outv[k + limit4] = inv[k + limit4];
-    }
+    _image_copy_parallel(out, in, nfloats, nthreads);
     return;
   }
 #endif // _OPENMP
@@ -207,7 +225,9 @@ void dt_iop_copy_image_roi(float *const __restrict__ out,
       && (roi_in->height - dy >= roi_out->height))
   {
     const size_t lwidth = sizeof(float) * roi_out->width * ch;
-    DT_OMP_FOR()
+    const size_t nfloats = (size_t)roi_out->width * roi_out->height * ch;
+    const int nthreads = MIN(dt_get_num_threads(), parallel_imgop_maxthreads);
+    DT_OMP_FOR(if(nfloats > parallel_imgop_minimum) num_threads(nthreads))
     for(size_t row = 0; row < roi_out->height; row++)
     {
       float *o = out + (size_t)(ch * row * roi_out->width);
@@ -276,7 +296,7 @@ void dt_iop_image_fill(float *const buf,
 #ifdef _OPENMP
   if(nfloats > parallel_imgop_minimum)	// is the copy big enough to outweigh threading overhead?
   {
-    const size_t nthreads = MIN(16, dt_get_num_threads());
+    const size_t nthreads = MIN(dt_get_num_threads(), parallel_imgop_maxthreads);
     // determine the number of 4-float vectors to be processed by each thread
     const size_t chunksize = (((nfloats + nthreads - 1) / nthreads) + 3) / 4;
     DT_OMP_FOR(num_threads(nthreads))
@@ -463,7 +483,7 @@ void dt_iop_image_div_const(float *const buf,
     // (basically, each core can saturate a memory channel, so a
     // system with quad-channel memory won't be able to take advantage
     // of more than four cores).
-    const int nthreads = MIN(darktable.num_openmp_threads,parallel_imgop_maxthreads);
+    const int nthreads = MIN(dt_get_num_threads(), parallel_imgop_maxthreads);
     DT_OMP_FOR_SIMD(num_threads(nthreads) aligned(buf:16))
     for(size_t k = 0; k < nfloats; k++)
       buf[k] /= div_value;
@@ -507,22 +527,175 @@ void dt_iop_image_linear_blend(float *const restrict buf,
     buf[k] = lambda*buf[k] + lambda_1*other[k];
 }
 
+// Split a buffer of 4-channel pixels into four planes, the plane of
+// channel c starting at planes + c * width * height.
+void dt_iop_image_to_planar(float *const restrict planes,
+                            const float *const restrict in,
+                            const size_t width,
+                            const size_t height)
+{
+  const size_t npixels = width * height;
+  DT_OMP_FOR()
+  for(size_t k = 0; k < npixels; k++)
+    for_four_channels(c)
+      planes[c * npixels + k] = in[4 * k + c];
+}
+
+// Interleave four planes back into 4-channel pixels.
+void dt_iop_image_from_planar(float *const restrict out,
+                              const float *const restrict planes,
+                              const size_t width,
+                              const size_t height)
+{
+  const size_t npixels = width * height;
+  DT_OMP_FOR()
+  for(size_t k = 0; k < npixels; k++)
+    for_four_channels(c)
+      out[4 * k + c] = planes[c * npixels + k];
+}
+
+#ifdef _OPENMP
+// best of a few runs of copying nfloats with the given number of
+// threads, in seconds per copy. small copies are repeated so that a
+// single timing is well above the timer resolution.
+static double _time_copy(float *const out,
+                         const float *const in,
+                         const size_t nfloats,
+                         const size_t nthreads)
+{
+  const size_t reps = MAX(1, (1 << 22) / nfloats);
+  double best = DBL_MAX;
+  for(int run = 0; run < 3; run++)
+  {
+    const double start = dt_get_wtime();
+    for(size_t r = 0; r < reps; r++)
+    {
+      if(nthreads > 1)
+        _image_copy_parallel(out, in, nfloats, nthreads);
+      else
+        memcpy(out, in, nfloats * sizeof(float));
+    }
+    best = MIN(best, (dt_get_wtime() - start) / reps);
+  }
+  return best;
+}
+#endif // _OPENMP
+
 // perform timings to determine the optimal threshold for switching to
 // parallel operations, as well as the maximal number of threads
 // before saturating the memory bus
 void dt_iop_image_copy_benchmark()
 {
-  ///TODO
+#ifdef _OPENMP
+  const size_t max_threads = dt_get_num_threads();
+  if(max_threads < 2) return;
+
+  // 32MB per buffer is well beyond the last level cache of desktop
+  // cpus, so this measures the memory bandwidth
+  const size_t max_floats = (size_t)1 << 23;
+  float *in = dt_alloc_align_float(max_floats);
+  float *out = dt_alloc_align_float(max_floats);
+  if(!in || !out)
+  {
+    dt_free_align(in);
+    dt_free_align(out);
+    return;
+  }
+  // fault in all pages before timing anything
+  memset(in, 0, max_floats * sizeof(float));
+  memset(out, 0, max_floats * sizeof(float));
+
+  const double start = dt_get_wtime();
+
+  // first find the number of threads saturating the memory bus: the
+  // smallest count reaching 95% of the best bandwidth seen. step
+  // through the counts sparsely on machines with many cores.
+  double times[64] = { 0.0 };
+  size_t counts[64] = { 0 };
+  int ncounts = 0;
+  double best = DBL_MAX;
+  for(size_t t = 1; t <= max_threads && ncounts < 64; t += MAX(1, t / 4))
+  {
+    counts[ncounts] = t;
+    times[ncounts] = _time_copy(out, in, max_floats, t);
+    best = MIN(best, times[ncounts]);
+    ncounts++;
+  }
+  size_t maxthreads = counts[ncounts - 1];
+  for(int k = 0; k < ncounts; k++)
+  {
+    if(times[k] <= best / 0.95)
+    {
+      maxthreads = counts[k];
+      break;
+    }
+  }
+
+  // then the smallest size from which on the parallel copy with that
+  // many threads is faster than a plain memcpy. the threshold is the
+  // largest size where the serial copy still won.
+  size_t minimum = max_floats;
+  if(maxthreads > 1)
+  {
+    for(size_t nfloats = max_floats; nfloats >= ((size_t)1 << 14); nfloats /= 2)
+    {
+      const double serial = _time_copy(out, in, nfloats, 1);
+      const double parallel = _time_copy(out, in, nfloats, maxthreads);
+      if(parallel >= serial) break;
+      minimum = nfloats / 2;
+    }
+  }
+
+  dt_free_align(in);
+  dt_free_align(out);
+
+  const double bandwidth = 2.0 * max_floats * sizeof(float) / best / 1.0e9;
+  dt_print(DT_DEBUG_PERF,
+           "[dt_iop_image_copy_benchmark] %.1f GB/s, parallel copies from %zu floats"
+           " with at most %zu threads, calibration took %.3fs\n",
+           bandwidth, minimum, maxthreads, dt_get_wtime() - start);
+
+  dt_conf_set_int("memcpy_parallel_calibrated_threshold", minimum);
+  dt_conf_set_int("memcpy_parallel_calibrated_maxthreads", maxthreads);
+  dt_conf_set_int("memcpy_parallel_calibrated_threads", max_threads);
+  dt_conf_set_int("memcpy_parallel_calibration_version", CALIBRATION_VERSION);
+#endif // _OPENMP
 }
 
 void dt_iop_image_copy_configure()
 {
+  // the calibration depends on the number of threads we may use, redo
+  // it if that changed or if it has been reset
+  if(dt_conf_get_bool("memcpy_parallel_calibrate")
+     && (dt_conf_get_int("memcpy_parallel_calibration_version") != CALIBRATION_VERSION
+         || dt_conf_get_int("memcpy_parallel_calibrated_threads") != (int)dt_get_num_threads()
+         || dt_conf_get_int("memcpy_parallel_calibrated_threshold") <= 0
+         || dt_conf_get_int("memcpy_parallel_calibrated_maxthreads") <= 0))
+    dt_iop_image_copy_benchmark();
+
+  if(dt_conf_get_bool("memcpy_parallel_calibrate")
+     && dt_conf_get_int("memcpy_parallel_calibrated_threads") == (int)dt_get_num_threads())
+  {
+    const int thresh = dt_conf_get_int("memcpy_parallel_calibrated_threshold");
+    if(thresh > 0)
+      parallel_imgop_minimum = thresh;
+    const int threads = dt_conf_get_int("memcpy_parallel_calibrated_maxthreads");
+    if(threads > 0)
+      parallel_imgop_maxthreads = threads;
+  }
+
+  // explicit settings take precedence over the calibration
   int thresh = dt_conf_get_int("memcpy_parallel_threshold");
   if(thresh > 0)
     parallel_imgop_minimum = thresh;
   int threads = dt_conf_get_int("memcpy_parallel_maxthreads");
   if(threads > 0)
     parallel_imgop_maxthreads = threads;
+
+  dt_print(DT_DEBUG_PERF,
+           "[dt_iop_image_copy_configure] parallel image operations from %zu floats"
+           " with at most %zu threads\n",
+           parallel_imgop_minimum, parallel_imgop_maxthreads);
 }
 
 // clang-format off
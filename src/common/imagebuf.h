@@ -176,6 +176,18 @@ void dt_iop_image_linear_blend(float *const __restrict__ buf,
                                const size_t height,
                                const size_t ch);
 
+// Split 4-channel pixels into one plane per channel and back again,
+// the plane of channel c starts at planes + c * width * height
+void dt_iop_image_to_planar(float *const __restrict__ planes,
+                            const float *const __restrict__ in,
+                            const size_t width,
+                            const size_t height);
+
+void dt_iop_image_from_planar(float *const __restrict__ out,
+                              const float *const __restrict__ planes,
+                              const size_t width,
+                              const size_t height);
+
 // perform timings to determine the optimal threshold for switching to
 // parallel operations, as well as the maximal number of threads
 // before saturating the memory bus
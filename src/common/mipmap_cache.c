@@ -18,17 +18,21 @@
 
 #include "common/mipmap_cache.h"
 #include "common/darktable.h"
+#include "common/database.h"
 #include "common/debug.h"
 #include "common/exif.h"
 #include "common/file_location.h"
 #include "common/grealpath.h"
 #include "common/image_cache.h"
+#include "common/mipmap_pack.h"
+#include "common/utility.h"
 #include "control/conf.h"
 #include "control/jobs.h"
 #include "develop/imageop_math.h"
 #include "imageio/imageio_common.h"
 #include "imageio/imageio_jpeg.h"
 #include "imageio/imageio_module.h"
+#include "imageio/qoi.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -301,6 +305,257 @@ void *dt_mipmap_cache_alloc(dt_mipmap_buffer_t *buf, const dt_image_t *img)
   return dsc + 1;
 }
 
+// refuse to fill up the disk with thumbnails
+static gboolean _enough_disk_space(const char *filename)
+{
+  struct statvfs vfsbuf;
+  if(!statvfs(filename, &vfsbuf))
+  {
+    const int64_t free_mb = ((vfsbuf.f_frsize * vfsbuf.f_bavail) >> 20);
+    if(free_mb < 100)
+    {
+      dt_print(DT_DEBUG_ALWAYS,
+               "[mipmap_cache] aborting image write as only %" PRId64 " MB free to write %s\n",
+               free_mb, filename);
+      return FALSE;
+    }
+  }
+  else
+  {
+    dt_print(DT_DEBUG_ALWAYS,
+             "[mipmap_cache] aborting image write since couldn't determine free space available to write %s\n",
+             filename);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// the packed backend keys thumbnails by the history they were generated from
+static dt_hash_t _history_hash(const dt_imgid_t imgid)
+{
+  dt_hash_t hash = DT_INITHASH;
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT current_hash FROM main.history_hash WHERE imgid = ?1",
+                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  if(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const void *blob = sqlite3_column_blob(stmt, 0);
+    const int len = sqlite3_column_bytes(stmt, 0);
+    if(blob && len > 0) hash = dt_hash(hash, blob, len);
+  }
+  sqlite3_finalize(stmt);
+  return hash;
+}
+
+static inline dt_mipmap_pack_codec_t _disk_codec(void)
+{
+  return !g_strcmp0(dt_conf_get_string_const("cache_disk_codec"), "QOI")
+    ? DT_MIPMAP_PACK_CODEC_QOI
+    : DT_MIPMAP_PACK_CODEC_JPEG;
+}
+
+static inline dt_mipmap_pack_codec_t _other_codec(const dt_mipmap_pack_codec_t codec)
+{
+  return codec == DT_MIPMAP_PACK_CODEC_QOI ? DT_MIPMAP_PACK_CODEC_JPEG : DT_MIPMAP_PACK_CODEC_QOI;
+}
+
+// single thumbnail files are named by codec. qoi files start with a small
+// header holding the colour space, jpeg files have it in their exif data.
+static const char *_file_ext[] = { "jpg", "qoi" };
+static const char _qoi_file_magic[4] = { 'd', 't', 'q', '1' };
+#define DT_MIPMAP_QOI_FILE_HEADER 8
+
+// decode a compressed thumbnail into the buffer of a cache entry. the colour
+// space of jpeg thumbnails is returned if color_space isn't NULL.
+static gboolean _decode(dt_mipmap_cache_t *cache,
+                        dt_cache_entry_t *entry,
+                        const dt_mipmap_size_t mip,
+                        const dt_mipmap_pack_codec_t codec,
+                        const uint8_t *blob,
+                        const size_t len,
+                        dt_colorspaces_color_profile_type_t *color_space)
+{
+  struct dt_mipmap_buffer_dsc *dsc = entry->data;
+  uint8_t *out = (uint8_t *)entry->data + sizeof(*dsc);
+  const size_t room = entry->data_size - sizeof(*dsc);
+
+  if(codec == DT_MIPMAP_PACK_CODEC_QOI)
+  {
+    // decodes into a buffer of its own, still a lot faster than libjpeg
+    qoi_desc desc;
+    uint8_t *pixels = len <= INT_MAX ? qoi_decode(blob, (int)len, &desc, 4) : NULL;
+    const gboolean ok = pixels
+      && desc.width <= cache->max_width[mip] && desc.height <= cache->max_height[mip]
+      && (size_t)4 * desc.width * desc.height <= room;
+    if(ok)
+    {
+      memcpy(out, pixels, (size_t)4 * desc.width * desc.height);
+      dsc->width = desc.width;
+      dsc->height = desc.height;
+      dsc->iscale = 1.0f;
+    }
+    free(pixels);
+    return ok;
+  }
+
+  dt_imageio_jpeg_t jpg;
+  if(dt_imageio_jpeg_decompress_header(blob, len, &jpg)
+     || jpg.width > cache->max_width[mip] || jpg.height > cache->max_height[mip]
+     || (size_t)4 * jpg.width * jpg.height > room)
+    return FALSE;
+  if(color_space)
+    *color_space = dt_imageio_jpeg_read_color_space(&jpg);
+  if(dt_imageio_jpeg_decompress(&jpg, out))
+    return FALSE;
+  dsc->width = jpg.width;
+  dsc->height = jpg.height;
+  dsc->iscale = 1.0f;
+  return TRUE;
+}
+
+// thumbnails don't use alpha, make it constant so qoi compresses it away.
+// returns a buffer to be freed with free()
+static uint8_t *_qoi_encode(uint8_t *buf,
+                            const int width,
+                            const int height,
+                            int *len)
+{
+  for(size_t k = 3; k < (size_t)4 * width * height; k += 4)
+    buf[k] = 255;
+  const qoi_desc desc = { .width = width, .height = height,
+                          .channels = 4, .colorspace = QOI_SRGB };
+  return qoi_encode(buf, &desc, len);
+}
+
+static gboolean _file_load(dt_mipmap_cache_t *cache,
+                           dt_cache_entry_t *entry,
+                           const dt_mipmap_size_t mip,
+                           const dt_mipmap_pack_codec_t codec)
+{
+  struct dt_mipmap_buffer_dsc *dsc = entry->data;
+  const dt_imgid_t imgid = get_imgid(entry->key);
+  char filename[PATH_MAX] = {0};
+  snprintf(filename, sizeof(filename), "%s.d/%d/%d.%s", cache->cachedir, (int)mip, imgid,
+           _file_ext[codec]);
+
+  gchar *blob = NULL;
+  gsize len = 0;
+  if(!g_file_get_contents(filename, &blob, &len, NULL))
+    return FALSE;
+
+  dt_colorspaces_color_profile_type_t color_space = DT_COLORSPACE_DISPLAY;
+  gboolean ok = FALSE;
+  if(codec == DT_MIPMAP_PACK_CODEC_QOI)
+  {
+    if(len > DT_MIPMAP_QOI_FILE_HEADER && !memcmp(blob, _qoi_file_magic, sizeof(_qoi_file_magic)))
+    {
+      int32_t cs;
+      memcpy(&cs, blob + sizeof(_qoi_file_magic), sizeof(cs));
+      color_space = cs;
+      ok = _decode(cache, entry, mip, codec, (uint8_t *)blob + DT_MIPMAP_QOI_FILE_HEADER,
+                   len - DT_MIPMAP_QOI_FILE_HEADER, NULL);
+    }
+  }
+  else
+    ok = _decode(cache, entry, mip, codec, (uint8_t *)blob, len, &color_space);
+  g_free(blob);
+
+  if(!ok)
+  {
+    dt_print(DT_DEBUG_ALWAYS,
+             "[mipmap_cache] failed to decompress thumbnail for image %d from `%s'!\n",
+             imgid, filename);
+    g_unlink(filename);
+    return FALSE;
+  }
+
+  dt_print(DT_DEBUG_CACHE,
+           "[mipmap_cache] grab mip %d for image %d from disk cache\n", mip, imgid);
+  dsc->color_space = color_space;
+  return TRUE;
+}
+
+static gboolean _file_exists(const dt_mipmap_cache_t *cache,
+                             const dt_mipmap_size_t mip,
+                             const uint32_t id)
+{
+  for(size_t k = 0; k < G_N_ELEMENTS(_file_ext); k++)
+  {
+    char filename[PATH_MAX] = {0};
+    snprintf(filename, sizeof(filename), "%s.d/%d/%"PRIu32".%s", cache->cachedir, (int)mip, id,
+             _file_ext[k]);
+    if(g_file_test(filename, G_FILE_TEST_EXISTS)) return TRUE;
+  }
+  return FALSE;
+}
+
+static gboolean _pack_load(dt_mipmap_cache_t *cache,
+                           dt_cache_entry_t *entry,
+                           const dt_mipmap_size_t mip)
+{
+  struct dt_mipmap_buffer_dsc *dsc = entry->data;
+  const dt_imgid_t imgid = get_imgid(entry->key);
+  dt_mipmap_pack_blob_t blob;
+  if(!dt_mipmap_pack_get(cache->pack, imgid, mip, _history_hash(imgid), &blob))
+    return FALSE;
+
+  const gboolean ok = _decode(cache, entry, mip, blob.codec, blob.data, blob.length, NULL);
+  const dt_colorspaces_color_profile_type_t color_space = blob.color_space;
+  dt_mipmap_pack_release(&blob);
+
+  if(!ok)
+  {
+    dt_print(DT_DEBUG_ALWAYS,
+             "[mipmap_cache] failed to decompress packed thumbnail for image %d\n", imgid);
+    dt_mipmap_pack_remove(cache->pack, imgid, mip);
+    return FALSE;
+  }
+
+  dt_print(DT_DEBUG_CACHE,
+           "[mipmap_cache] grab mip %d for image %d from packed disk cache\n", mip, imgid);
+  dsc->color_space = color_space;
+  return TRUE;
+}
+
+static void _pack_store(dt_mipmap_cache_t *cache,
+                        dt_cache_entry_t *entry,
+                        const dt_mipmap_size_t mip)
+{
+  struct dt_mipmap_buffer_dsc *dsc = entry->data;
+  const dt_imgid_t imgid = get_imgid(entry->key);
+  const dt_hash_t hash = _history_hash(imgid);
+  const dt_mipmap_pack_codec_t codec = _disk_codec();
+
+  // don't write existing thumbnails as both performance and quality (lossy jpg) suffer,
+  // unless they are still in the other format
+  if(dt_mipmap_pack_is_current(cache->pack, imgid, mip, hash, codec)) return;
+  if(!_enough_disk_space(cache->cachedir)) return;
+
+  uint8_t *in = (uint8_t *)entry->data + sizeof(*dsc);
+  if(codec == DT_MIPMAP_PACK_CODEC_QOI)
+  {
+    int len = 0;
+    uint8_t *blob = _qoi_encode(in, dsc->width, dsc->height, &len);
+    if(blob)
+      dt_mipmap_pack_put(cache->pack, imgid, mip, hash, codec,
+                         dsc->width, dsc->height, dsc->color_space, blob, len);
+    free(blob);
+    return;
+  }
+
+  const int cache_quality = dt_conf_get_int("database_cache_quality");
+  uint8_t *blob = dt_alloc_aligned((size_t)4 * dsc->width * dsc->height);
+  if(!blob) return;
+  const int len = dt_imageio_jpeg_compress(in, blob, dsc->width, dsc->height,
+                                           MIN(100, MAX(10, cache_quality)));
+  if(len > 0)
+    dt_mipmap_pack_put(cache->pack, imgid, mip, hash, codec,
+                       dsc->width, dsc->height, dsc->color_space, blob, len);
+  dt_free_align(blob);
+}
+
 // callback for the cache backend to initialize payload pointers
 void dt_mipmap_cache_allocate_dynamic(void *data, dt_cache_entry_t *entry)
 {
@@ -363,53 +618,18 @@ void dt_mipmap_cache_allocate_dynamic(void *data, dt_cache_entry_t *entry)
   int loaded_from_disk = 0;
   if(mip < DT_MIPMAP_F)
   {
-    if(cache->cachedir[0] && ((dt_conf_get_bool("cache_disk_backend") && mip < DT_MIPMAP_8)
-                              || (dt_conf_get_bool("cache_disk_backend_full") && mip == DT_MIPMAP_8)))
+    if(cache->pack && ((dt_conf_get_bool("cache_disk_backend") && mip < DT_MIPMAP_8)
+                       || (dt_conf_get_bool("cache_disk_backend_full") && mip == DT_MIPMAP_8)))
     {
-      // try and load from disk, if successful set flag
-      char filename[PATH_MAX] = {0};
-      snprintf(filename, sizeof(filename), "%s.d/%d/%" PRIu32 ".jpg", cache->cachedir, (int)mip,
-               get_imgid(entry->key));
-      FILE *f = g_fopen(filename, "rb");
-      if(f)
-      {
-        uint8_t *blob = 0;
-        fseek(f, 0, SEEK_END);
-        const long len = ftell(f);
-        if(len <= 0) goto read_error; // coverity madness
-        blob = (uint8_t *)dt_alloc_aligned(len);
-        if(!blob) goto read_error;
-        fseek(f, 0, SEEK_SET);
-        const int rd = fread(blob, sizeof(uint8_t), len, f);
-        if(rd != len) goto read_error;
-        dt_colorspaces_color_profile_type_t color_space;
-        dt_imageio_jpeg_t jpg;
-        if(dt_imageio_jpeg_decompress_header(blob, len, &jpg)
-           || (jpg.width > cache->max_width[mip] || jpg.height > cache->max_height[mip])
-           || ((color_space = dt_imageio_jpeg_read_color_space(&jpg)) == DT_COLORSPACE_NONE) // pointless test to keep it in the if clause
-           || dt_imageio_jpeg_decompress(&jpg, (uint8_t *)entry->data + sizeof(*dsc)))
-        {
-          dt_print(DT_DEBUG_ALWAYS,
-                   "[mipmap_cache] failed to decompress thumbnail for image %" PRIu32 " from `%s'!\n",
-                   get_imgid(entry->key), filename);
-          goto read_error;
-        }
-        dt_print(DT_DEBUG_CACHE,
-                 "[mipmap_cache] grab mip %d for image %" PRIu32 " from disk cache\n", mip,
-                 get_imgid(entry->key));
-        dsc->width = jpg.width;
-        dsc->height = jpg.height;
-        dsc->iscale = 1.0f;
-        dsc->color_space = color_space;
-        loaded_from_disk = 1;
-        if(0)
-        {
-read_error:
-          g_unlink(filename);
-        }
-        dt_free_align(blob);
-        fclose(f);
-      }
+      loaded_from_disk = _pack_load(cache, entry, mip);
+    }
+    else if(cache->cachedir[0] && ((dt_conf_get_bool("cache_disk_backend") && mip < DT_MIPMAP_8)
+                                   || (dt_conf_get_bool("cache_disk_backend_full") && mip == DT_MIPMAP_8)))
+    {
+      // try the configured codec first, so an existing cache migrates on eviction
+      const dt_mipmap_pack_codec_t codec = _disk_codec();
+      loaded_from_disk = _file_load(cache, entry, mip, codec)
+                         || _file_load(cache, entry, mip, _other_codec(codec));
     }
   }
 
@@ -436,11 +656,17 @@ static void dt_mipmap_cache_unlink_ondisk_thumbnail(void *data,
   // also remove jpg backing (always try to do that, in case user just temporarily switched it off,
   // to avoid inconsistencies.
   // if(dt_conf_get_bool("cache_disk_backend"))
+  if(cache->pack)
+    dt_mipmap_pack_remove(cache->pack, imgid, mip);
   if(cache->cachedir[0])
   {
-    char filename[PATH_MAX] = { 0 };
-    snprintf(filename, sizeof(filename), "%s.d/%d/%"PRIu32".jpg", cache->cachedir, (int)mip, imgid);
-    g_unlink(filename);
+    for(size_t k = 0; k < G_N_ELEMENTS(_file_ext); k++)
+    {
+      char filename[PATH_MAX] = { 0 };
+      snprintf(filename, sizeof(filename), "%s.d/%d/%"PRIu32".%s", cache->cachedir, (int)mip, imgid,
+               _file_ext[k]);
+      g_unlink(filename);
+    }
   }
 }
 
@@ -458,6 +684,11 @@ void dt_mipmap_cache_deallocate_dynamic(void *data, dt_cache_entry_t *entry)
       {
         dt_mipmap_cache_unlink_ondisk_thumbnail(data, get_imgid(entry->key), mip);
       }
+      else if(cache->pack && ((dt_conf_get_bool("cache_disk_backend") && mip < DT_MIPMAP_8)
+                              || (dt_conf_get_bool("cache_disk_backend_full") && mip == DT_MIPMAP_8)))
+      {
+        _pack_store(cache, entry, mip);
+      }
       else if(cache->cachedir[0] && ((dt_conf_get_bool("cache_disk_backend") && mip < DT_MIPMAP_8)
                                      || (dt_conf_get_bool("cache_disk_backend_full") && mip == DT_MIPMAP_8)))
       {
@@ -467,53 +698,55 @@ void dt_mipmap_cache_deallocate_dynamic(void *data, dt_cache_entry_t *entry)
         const int mkd = g_mkdir_with_parents(filename, 0750);
         if(!mkd)
         {
-          snprintf(filename, sizeof(filename), "%s.d/%d/%" PRIu32 ".jpg", cache->cachedir, (int)mip,
-                   get_imgid(entry->key));
+          const dt_mipmap_pack_codec_t codec = _disk_codec();
+          snprintf(filename, sizeof(filename), "%s.d/%d/%" PRIu32 ".%s", cache->cachedir, (int)mip,
+                   get_imgid(entry->key), _file_ext[codec]);
           // Don't write existing files as both performance and quality (lossy jpg) suffer
           FILE *f = NULL;
           if(!g_file_test(filename, G_FILE_TEST_EXISTS) && (f = g_fopen(filename, "wb")))
           {
             // first check the disk isn't full
-            struct statvfs vfsbuf;
-            if(!statvfs(filename, &vfsbuf))
+            gboolean failed = !_enough_disk_space(filename);
+            if(!failed && codec == DT_MIPMAP_PACK_CODEC_QOI)
             {
-              const int64_t free_mb = ((vfsbuf.f_frsize * vfsbuf.f_bavail) >> 20);
-              if(free_mb < 100)
-              {
-                dt_print(DT_DEBUG_ALWAYS,
-                         "[mipmap_cache] aborting image write as only %" PRId64 " MB free to write %s\n",
-                         free_mb, filename);
-                goto write_error;
-              }
+              const int32_t color_space = dsc->color_space;
+              int len = 0;
+              uint8_t *blob = _qoi_encode((uint8_t *)entry->data + sizeof(*dsc),
+                                          dsc->width, dsc->height, &len);
+              failed = !blob
+                || fwrite(_qoi_file_magic, sizeof(_qoi_file_magic), 1, f) != 1
+                || fwrite(&color_space, sizeof(color_space), 1, f) != 1
+                || fwrite(blob, 1, len, f) != (size_t)len;
+              free(blob);
             }
-            else
+            else if(!failed)
             {
-              dt_print(DT_DEBUG_ALWAYS,
-                       "[mipmap_cache] aborting image write since couldn't determine free space available to write %s\n",
-                       filename);
-              goto write_error;
+              const int cache_quality = dt_conf_get_int("database_cache_quality");
+              const uint8_t *exif = NULL;
+              int exif_len = 0;
+              if(dsc->color_space == DT_COLORSPACE_SRGB)
+              {
+                exif = dt_mipmap_cache_exif_data_srgb;
+                exif_len = dt_mipmap_cache_exif_data_srgb_length;
+              }
+              else if(dsc->color_space == DT_COLORSPACE_ADOBERGB)
+              {
+                exif = dt_mipmap_cache_exif_data_adobergb;
+                exif_len = dt_mipmap_cache_exif_data_adobergb_length;
+              }
+              failed = dt_imageio_jpeg_write(filename, (uint8_t *)entry->data + sizeof(*dsc), dsc->width, dsc->height, MIN(100, MAX(10, cache_quality)), exif, exif_len) != 0;
             }
+            if(fclose(f)) failed = TRUE;
+            if(failed) g_unlink(filename);
+          }
 
-            const int cache_quality = dt_conf_get_int("database_cache_quality");
-            const uint8_t *exif = NULL;
-            int exif_len = 0;
-            if(dsc->color_space == DT_COLORSPACE_SRGB)
-            {
-              exif = dt_mipmap_cache_exif_data_srgb;
-              exif_len = dt_mipmap_cache_exif_data_srgb_length;
-            }
-            else if(dsc->color_space == DT_COLORSPACE_ADOBERGB)
-            {
-              exif = dt_mipmap_cache_exif_data_adobergb;
-              exif_len = dt_mipmap_cache_exif_data_adobergb_length;
-            }
-            if(dt_imageio_jpeg_write(filename, (uint8_t *)entry->data + sizeof(*dsc), dsc->width, dsc->height, MIN(100, MAX(10, cache_quality)), exif, exif_len))
-            {
-write_error:
-              g_unlink(filename);
-            }
+          // the thumbnail is in the configured format now, drop a copy in the other one
+          if(g_file_test(filename, G_FILE_TEST_EXISTS))
+          {
+            snprintf(filename, sizeof(filename), "%s.d/%d/%" PRIu32 ".%s", cache->cachedir, (int)mip,
+                     get_imgid(entry->key), _file_ext[_other_codec(codec)]);
+            g_unlink(filename);
           }
-          if(f) fclose(f);
         }
       }
     }
@@ -586,7 +819,10 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   cache->mip_full.stats_fetches = 0;
   cache->mip_full.stats_standin = 0;
 
-  dt_cache_init(&cache->mip_thumbs.cache, 0, max_mem);
+  // the thumbnail cache holds many entries and is hammered by the lighttable
+  // and the background jobs at the same time, so it gets its own lock per shard.
+  // the float and full buffers only have a handful of slots and stay unsharded.
+  dt_cache_init_sharded(&cache->mip_thumbs.cache, 0, max_mem, 16);
   dt_cache_set_allocate_callback(&cache->mip_thumbs.cache, dt_mipmap_cache_allocate_dynamic, cache);
   dt_cache_set_cleanup_callback(&cache->mip_thumbs.cache, dt_mipmap_cache_deallocate_dynamic, cache);
 
@@ -608,13 +844,26 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   cache->buffer_size[DT_MIPMAP_F] = sizeof(struct dt_mipmap_buffer_dsc)
                                         + 4 * sizeof(float) * cache->max_width[DT_MIPMAP_F]
                                           * cache->max_height[DT_MIPMAP_F];
+
+  // optionally keep the thumbnails on disk in a few large files instead of
+  // one file per image and size
+  cache->pack = NULL;
+  if(cache->cachedir[0] && dt_conf_get_bool("cache_disk_backend_packed"))
+  {
+    gchar *dirname = g_strdup_printf("%s.d/packed", cache->cachedir);
+    cache->pack = dt_mipmap_pack_open(dirname);
+    g_free(dirname);
+  }
 }
 
 void dt_mipmap_cache_cleanup(dt_mipmap_cache_t *cache)
 {
+  // flushes the thumbnails to disk
   dt_cache_cleanup(&cache->mip_thumbs.cache);
   dt_cache_cleanup(&cache->mip_full.cache);
   dt_cache_cleanup(&cache->mip_f.cache);
+  dt_mipmap_pack_close(cache->pack);
+  cache->pack = NULL;
 }
 
 void dt_mipmap_cache_print(dt_mipmap_cache_t *cache)
@@ -629,6 +878,10 @@ void dt_mipmap_cache_print(dt_mipmap_cache_t *cache)
   dt_print(DT_DEBUG_ALWAYS,"[mipmap_cache] full  fill %"PRIu32"/%"PRIu32" slots (%.2f%%)\n",
            (uint32_t)cache->mip_full.cache.cost, (uint32_t)cache->mip_full.cache.cost_quota,
            100.0f * (float)cache->mip_full.cache.cost / (float)cache->mip_full.cache.cost_quota);
+  dt_cache_print_stats(&cache->mip_thumbs.cache, "mipmap_cache thumbs");
+  dt_cache_print_stats(&cache->mip_f.cache, "mipmap_cache float");
+  dt_cache_print_stats(&cache->mip_full.cache, "mipmap_cache full");
+  dt_mipmap_pack_print(cache->pack);
 
   uint64_t sum = 0;
   uint64_t sum_fetches = 0;
@@ -683,6 +936,43 @@ static dt_mipmap_cache_one_t *_get_cache(dt_mipmap_cache_t *cache,
   }
 }
 
+// decode the full image into the buffer allocated through dt_mipmap_cache_alloc()
+static dt_imageio_retval_t _load_full(dt_mipmap_buffer_t *buf,
+                                      const dt_imgid_t imgid)
+{
+  // load the image:
+  // make sure we access the r/w lock as shortly as possible!
+  dt_image_t DT_ALIGNED_ARRAY buffered_image;
+  const dt_image_t *cimg = dt_image_cache_get(darktable.image_cache, imgid, 'r');
+  buffered_image = *cimg;
+  // dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
+  // dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+  dt_image_cache_read_release(darktable.image_cache, cimg);
+
+  char filename[PATH_MAX] = { 0 };
+  gboolean from_cache = TRUE;
+  dt_image_full_path(buffered_image.id, filename, sizeof(filename), &from_cache);
+
+  buf->imgid = imgid;
+  buf->size = DT_MIPMAP_FULL;
+  buf->buf = 0;
+  buf->width = buf->height = 0;
+  buf->iscale = 0.0f;
+  buf->color_space = DT_COLORSPACE_NONE; // TODO: does the full buffer need to know this?
+  const dt_imageio_retval_t ret = dt_imageio_open(&buffered_image, filename, buf); // TODO: color_space?
+  if(ret == DT_IMAGEIO_OK)
+  {
+    // swap back new image data:
+    dt_image_t *img = dt_image_cache_get(darktable.image_cache, imgid, 'w');
+    *img = buffered_image;
+    // dt_print(DT_DEBUG_ALWAYS, "[mipmap read get] initializing full buffer img %u with %u %u -> %d %d (%p)\n",
+    // imgid, data[0], data[1], img->width, img->height, data);
+    // don't write xmp for this (we only changed db stuff):
+    dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+  }
+  return ret;
+}
+
 void dt_mipmap_cache_get_with_caller(
     dt_mipmap_cache_t *cache,
     dt_mipmap_buffer_t *buf,
@@ -739,10 +1029,13 @@ void dt_mipmap_cache_get_with_caller(
     if(!cache->cachedir[0]) return;
     if(mip > DT_MIPMAP_FULL || (int)mip < DT_MIPMAP_0)
       return; // remove the (int) once we no longer have to support gcc < 4.8 :/
-    char filename[PATH_MAX] = {0};
-    snprintf(filename, sizeof(filename), "%s.d/%d/%"PRIu32".jpg", cache->cachedir, (int)mip, key);
     // don't attempt to load if disk cache doesn't exist
-    if(!g_file_test(filename, G_FILE_TEST_EXISTS)) return;
+    if(cache->pack)
+    {
+      if(!dt_mipmap_pack_contains(cache->pack, imgid, mip)) return;
+    }
+    else if(!_file_exists(cache, mip, key))
+      return;
     dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_FG, dt_image_load_job_create(imgid, mip));
   }
   else if(flags == DT_MIPMAP_BLOCKING)
@@ -766,26 +1059,7 @@ void dt_mipmap_cache_get_with_caller(
       // now fill it with data:
       if(mip == DT_MIPMAP_FULL)
       {
-        // load the image:
-        // make sure we access the r/w lock as shortly as possible!
-        dt_image_t DT_ALIGNED_ARRAY buffered_image;
-        const dt_image_t *cimg = dt_image_cache_get(darktable.image_cache, imgid, 'r');
-        buffered_image = *cimg;
-        // dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
-        // dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
-        dt_image_cache_read_release(darktable.image_cache, cimg);
-
-        char filename[PATH_MAX] = { 0 };
-        gboolean from_cache = TRUE;
-        dt_image_full_path(buffered_image.id, filename, sizeof(filename), &from_cache);
-
-        buf->imgid = imgid;
-        buf->size = mip;
-        buf->buf = 0;
-        buf->width = buf->height = 0;
-        buf->iscale = 0.0f;
-        buf->color_space = DT_COLORSPACE_NONE; // TODO: does the full buffer need to know this?
-        dt_imageio_retval_t ret = dt_imageio_open(&buffered_image, filename, buf); // TODO: color_space?
+        const dt_imageio_retval_t ret = _load_full(buf, imgid);
         // might have been reallocated:
         ASAN_UNPOISON_MEMORY_REGION(entry->data, dt_mipmap_buffer_dsc_size);
         dsc = (struct dt_mipmap_buffer_dsc *)buf->cache_entry->data;
@@ -803,16 +1077,6 @@ void dt_mipmap_cache_get_with_caller(
             dsc->color_space = DT_COLORSPACE_NONE;
           }
         }
-        else
-        {
-          // swap back new image data:
-          dt_image_t *img = dt_image_cache_get(darktable.image_cache, imgid, 'w');
-          *img = buffered_image;
-          // dt_print(DT_DEBUG_ALWAYS, "[mipmap read get] initializing full buffer img %u with %u %u -> %d %d (%p)\n",
-          // imgid, data[0], data[1], img->width, img->height, data);
-          // don't write xmp for this (we only changed db stuff):
-          dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
-        }
       }
       else if(mip == DT_MIPMAP_F)
       {
@@ -922,11 +1186,14 @@ void dt_mipmap_cache_get_with_caller(
     __sync_fetch_and_add(&(_get_cache(cache, mip)->stats_misses), 1);
     // in case we don't even have a disk cache for our requested thumbnail,
     // prefetch at least mip0, in case we have that in the disk caches:
-    if(cache->cachedir[0])
+    if(cache->pack)
     {
-      char filename[PATH_MAX] = {0};
-      snprintf(filename, sizeof(filename), "%s.d/%d/%"PRIu32".jpg", cache->cachedir, (int)mip, key);
-      if(g_file_test(filename, G_FILE_TEST_EXISTS))
+      if(dt_mipmap_pack_contains(cache->pack, imgid, mip))
+        dt_mipmap_cache_get(cache, 0, imgid, DT_MIPMAP_0, DT_MIPMAP_PREFETCH_DISK, 0);
+    }
+    else if(cache->cachedir[0])
+    {
+      if(_file_exists(cache, mip, key))
         dt_mipmap_cache_get(cache, 0, imgid, DT_MIPMAP_0, DT_MIPMAP_PREFETCH_DISK, 0);
     }
     // nothing found :(
@@ -955,6 +1222,52 @@ void dt_mipmap_cache_release_with_caller(dt_mipmap_cache_t *cache,
 }
 
 
+gboolean dt_mipmap_cache_get_private_full(dt_mipmap_buffer_t *buf,
+                                          const dt_imgid_t imgid)
+{
+  // dt_mipmap_cache_alloc() only needs the entry to hold the allocation
+  dt_cache_entry_t *entry = g_malloc0(sizeof(dt_cache_entry_t));
+  buf->cache_entry = entry;
+
+  const dt_imageio_retval_t ret = _load_full(buf, imgid);
+  struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)entry->data;
+  if(ret != DT_IMAGEIO_OK
+     || !dsc
+     || (void *)dsc == (void *)dt_mipmap_cache_static_dead_image
+     || !dsc->width || !dsc->height)
+  {
+    dt_print(DT_DEBUG_ALWAYS,
+             "[mipmap_cache] can't load full image %i into a private buffer\n", imgid);
+    dt_mipmap_cache_release_private_full(buf);
+    return FALSE;
+  }
+
+  dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
+  buf->width = dsc->width;
+  buf->height = dsc->height;
+  buf->iscale = dsc->iscale;
+  buf->color_space = dsc->color_space;
+  buf->imgid = imgid;
+  buf->size = DT_MIPMAP_FULL;
+  buf->buf = (uint8_t *)(dsc + 1);
+  ASAN_UNPOISON_MEMORY_REGION(buf->buf, dsc->size - sizeof(struct dt_mipmap_buffer_dsc));
+  return TRUE;
+}
+
+void dt_mipmap_cache_release_private_full(dt_mipmap_buffer_t *buf)
+{
+  dt_cache_entry_t *entry = buf->cache_entry;
+  if(entry)
+  {
+    if(entry->data && entry->data != (void *)dt_mipmap_cache_static_dead_image)
+      dt_free_align(entry->data);
+    g_free(entry);
+  }
+  buf->cache_entry = NULL;
+  buf->size = DT_MIPMAP_NONE;
+  buf->buf = NULL;
+}
+
 // return index dt_mipmap_size_t having at least width and height requested instead of minimum combined diff
 // please note that the requested size is in pixels not dots.
 dt_mipmap_size_t dt_mipmap_cache_get_matching_size(const dt_mipmap_cache_t *cache,
@@ -1349,25 +1662,47 @@ dt_colorspaces_color_profile_type_t dt_mipmap_cache_get_colorspace()
   return DT_COLORSPACE_DISPLAY;
 }
 
+gboolean dt_mipmap_cache_on_disk(const dt_mipmap_cache_t *cache,
+                                 const dt_imgid_t imgid,
+                                 const dt_mipmap_size_t mip)
+{
+  if(cache->pack)
+    return dt_mipmap_pack_contains(cache->pack, imgid, mip);
+
+  for(size_t k = 0; k < G_N_ELEMENTS(_file_ext); k++)
+  {
+    char filename[PATH_MAX] = { 0 };
+    snprintf(filename, sizeof(filename), "%s.d/%d/%d.%s", cache->cachedir, (int)mip, imgid,
+             _file_ext[k]);
+    if(dt_util_test_image_file(filename)) return TRUE;
+  }
+  return FALSE;
+}
+
 void dt_mipmap_cache_copy_thumbnails(const dt_mipmap_cache_t *cache, const uint32_t dst_imgid, const uint32_t src_imgid)
 {
-  if(cache->cachedir[0] && dt_conf_get_bool("cache_disk_backend"))
+  if(cache->pack && dt_conf_get_bool("cache_disk_backend"))
+    dt_mipmap_pack_copy(cache->pack, dst_imgid, src_imgid);
+  else if(cache->cachedir[0] && dt_conf_get_bool("cache_disk_backend"))
   {
     for(dt_mipmap_size_t mip = DT_MIPMAP_0; mip < DT_MIPMAP_F; mip++)
     {
-      // try and load from disk, if successful set flag
-      char srcpath[PATH_MAX] = {0};
-      char dstpath[PATH_MAX] = {0};
-      snprintf(srcpath, sizeof(srcpath), "%s.d/%d/%"PRIu32".jpg", cache->cachedir, (int)mip, src_imgid);
-      snprintf(dstpath, sizeof(dstpath), "%s.d/%d/%"PRIu32".jpg", cache->cachedir, (int)mip, dst_imgid);
-      GFile *src = g_file_new_for_path(srcpath);
-      GFile *dst = g_file_new_for_path(dstpath);
-      GError *gerror = NULL;
-      g_file_copy(src, dst, G_FILE_COPY_NONE, NULL, NULL, NULL, &gerror);
-      // ignore errors, we tried what we could.
-      g_object_unref(dst);
-      g_object_unref(src);
-      g_clear_error(&gerror);
+      // whichever codec the thumbnail was written with
+      for(size_t k = 0; k < G_N_ELEMENTS(_file_ext); k++)
+      {
+        char srcpath[PATH_MAX] = {0};
+        char dstpath[PATH_MAX] = {0};
+        snprintf(srcpath, sizeof(srcpath), "%s.d/%d/%"PRIu32".%s", cache->cachedir, (int)mip, src_imgid, _file_ext[k]);
+        snprintf(dstpath, sizeof(dstpath), "%s.d/%d/%"PRIu32".%s", cache->cachedir, (int)mip, dst_imgid, _file_ext[k]);
+        GFile *src = g_file_new_for_path(srcpath);
+        GFile *dst = g_file_new_for_path(dstpath);
+        GError *gerror = NULL;
+        g_file_copy(src, dst, G_FILE_COPY_NONE, NULL, NULL, NULL, &gerror);
+        // ignore errors, we tried what we could.
+        g_object_unref(dst);
+        g_object_unref(src);
+        g_clear_error(&gerror);
+      }
     }
   }
 }
@@ -101,6 +101,7 @@ typedef struct dt_mipmap_cache_t
   dt_mipmap_cache_one_t mip_f;
   dt_mipmap_cache_one_t mip_full;
   char cachedir[PATH_MAX]; // cached sha1sum filename for faster access
+  struct dt_mipmap_pack_t *pack; // packed disk backend, NULL for one file per thumbnail
 } dt_mipmap_cache_t;
 
 // dynamic memory allocation interface for imageio backend: a write locked
@@ -127,6 +128,11 @@ void dt_mipmap_cache_get_with_caller(
     int line);
 
 // drop a lock
+/** decode the full image into a buffer of its own, not entered into the
+ * cache. for exports, which use the image only once */
+gboolean dt_mipmap_cache_get_private_full(dt_mipmap_buffer_t *buf, const dt_imgid_t imgid);
+void dt_mipmap_cache_release_private_full(dt_mipmap_buffer_t *buf);
+
 #define dt_mipmap_cache_release(A, B) dt_mipmap_cache_release_with_caller(A, B, __FILE__, __LINE__)
 void dt_mipmap_cache_release_with_caller(dt_mipmap_cache_t *cache, dt_mipmap_buffer_t *buf, const char *file,
                                          int line);
@@ -153,6 +159,11 @@ dt_mipmap_size_t dt_mipmap_cache_get_matching_size(
 // returns the colorspace to use for created thumbnails, takes config into account
 dt_colorspaces_color_profile_type_t dt_mipmap_cache_get_colorspace();
 
+// is there a thumbnail of the image in the disk cache
+gboolean dt_mipmap_cache_on_disk(const dt_mipmap_cache_t *cache,
+                                 const dt_imgid_t imgid,
+                                 const dt_mipmap_size_t mip);
+
 // copy over thumbnails. used by file operation that copies raw files, to speed up thumbnail generation.
 // only copies over the jpg backend on disk, doesn't directly affect the in-memory cache.
 void dt_mipmap_cache_copy_thumbnails(const dt_mipmap_cache_t *cache, const uint32_t dst_imgid, const uint32_t src_imgid);
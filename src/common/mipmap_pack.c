@@ -0,0 +1,650 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/mipmap_pack.h"
+#include "common/dtpthread.h"
+
+#include <glib/gstdio.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+// a new pack file is started once the current one reaches this size
+#define DT_MIPMAP_PACK_FILE_SIZE ((size_t)512 << 20)
+// don't bother compacting less than this
+#define DT_MIPMAP_PACK_COMPACT_MIN ((size_t)64 << 20)
+// mip levels fit in the upper 4 bits of the key
+#define DT_MIPMAP_PACK_MIPS 16
+
+static const char _record_magic[4] = { 'd', 't', 'm', 'p' };
+static const char _index_magic[8] = { 'd', 't', 'm', 'p', 'i', 'd', 'x', '1' };
+
+// stored in front of every thumbnail in the pack files, so a stale index
+// can never hand out the wrong image
+typedef struct _record_t
+{
+  char magic[4];
+  uint32_t imgid;
+  uint32_t mip;
+  uint32_t codec;
+  uint64_t hash;
+  int32_t width;
+  int32_t height;
+  int32_t color_space;
+  uint32_t length;
+} _record_t;
+
+// one entry of the index journal, later entries override earlier ones
+typedef struct _entry_t
+{
+  uint32_t imgid;
+  uint16_t mip;
+  uint16_t file;
+  uint64_t hash;
+  uint64_t offset; // of the record
+  uint32_t length; // of the thumbnail data, 0 if removed
+  uint32_t codec;
+} _entry_t;
+
+typedef struct _file_t
+{
+  GMappedFile *map; // mapped on demand, remapped when it grew
+  size_t size;      // bytes written
+} _file_t;
+
+struct dt_mipmap_pack_t
+{
+  gchar *dirname;
+  dt_pthread_mutex_t lock;
+  GHashTable *index;  // key -> _entry_t
+  GPtrArray *files;   // _file_t, the last one is appended to
+  FILE *active;
+  FILE *journal;
+  size_t live;        // record bytes referenced by the index
+  uint64_t hits, misses, stale, writes;
+};
+
+static inline gpointer _key(const dt_imgid_t imgid,
+                            const int mip)
+{
+  return GUINT_TO_POINTER(((uint32_t)imgid & 0x0fffffff) | ((uint32_t)mip << 28));
+}
+
+static inline size_t _record_size(const size_t length)
+{
+  // keep the records 16 byte aligned in the mapping
+  return (sizeof(_record_t) + length + 15) & ~(size_t)15;
+}
+
+static gchar *_file_name(const dt_mipmap_pack_t *pack,
+                         const guint file,
+                         const char *suffix)
+{
+  return g_strdup_printf("%s/%04u.pack%s", pack->dirname, file, suffix);
+}
+
+static void _file_free(gpointer data)
+{
+  _file_t *file = (_file_t *)data;
+  if(file->map) g_mapped_file_unref(file->map);
+  g_free(file);
+}
+
+static void _index_set(dt_mipmap_pack_t *pack,
+                       const _entry_t *entry)
+{
+  gpointer key = _key(entry->imgid, entry->mip);
+  _entry_t *old = g_hash_table_lookup(pack->index, key);
+  if(old) pack->live -= _record_size(old->length);
+
+  if(entry->length)
+  {
+    pack->live += _record_size(entry->length);
+    _entry_t *copy = g_malloc(sizeof(_entry_t));
+    *copy = *entry;
+    g_hash_table_insert(pack->index, key, copy);
+  }
+  else
+    g_hash_table_remove(pack->index, key);
+}
+
+static gboolean _journal_append(dt_mipmap_pack_t *pack,
+                                const _entry_t *entry)
+{
+  if(!pack->journal) return FALSE;
+  return fwrite(entry, sizeof(_entry_t), 1, pack->journal) == 1
+      && fflush(pack->journal) == 0;
+}
+
+// make sure the mapping of a file covers [0, end), caller holds the lock
+static GMappedFile *_map(dt_mipmap_pack_t *pack,
+                         const guint f,
+                         const size_t end)
+{
+  _file_t *file = g_ptr_array_index(pack->files, f);
+  if(file->map && g_mapped_file_get_length(file->map) >= end)
+    return file->map;
+
+  // readers still holding the old mapping keep their reference
+  if(file->map) g_mapped_file_unref(file->map);
+  gchar *filename = _file_name(pack, f, "");
+  file->map = g_mapped_file_new(filename, FALSE, NULL);
+  g_free(filename);
+
+  if(file->map && g_mapped_file_get_length(file->map) >= end)
+    return file->map;
+  return NULL;
+}
+
+// look up an entry and map its record, caller holds the lock
+static gboolean _lookup(dt_mipmap_pack_t *pack,
+                        const dt_imgid_t imgid,
+                        const int mip,
+                        dt_mipmap_pack_blob_t *blob)
+{
+  const _entry_t *entry = g_hash_table_lookup(pack->index, _key(imgid, mip));
+  if(!entry) return FALSE;
+
+  const size_t end = entry->offset + sizeof(_record_t) + entry->length;
+  GMappedFile *map = _map(pack, entry->file, end);
+  if(!map) return FALSE;
+
+  const char *base = g_mapped_file_get_contents(map) + entry->offset;
+  _record_t rec;
+  memcpy(&rec, base, sizeof(rec));
+  if(memcmp(rec.magic, _record_magic, sizeof(rec.magic))
+     || rec.imgid != (uint32_t)imgid
+     || rec.mip != (uint32_t)mip
+     || rec.hash != entry->hash
+     || rec.length != entry->length)
+  {
+    dt_print(DT_DEBUG_CACHE,
+             "[mipmap_pack] broken record for image %d mip %d, dropping it\n", imgid, mip);
+    const _entry_t removed = { .imgid = imgid, .mip = mip };
+    _index_set(pack, &removed);
+    _journal_append(pack, &removed);
+    return FALSE;
+  }
+
+  blob->map = g_mapped_file_ref(map);
+  blob->data = (const uint8_t *)base + sizeof(_record_t);
+  blob->length = rec.length;
+  blob->codec = rec.codec;
+  blob->width = rec.width;
+  blob->height = rec.height;
+  blob->color_space = rec.color_space;
+  blob->hash = rec.hash;
+  return TRUE;
+}
+
+// append a record to the active pack file, caller holds the lock
+static gboolean _append(dt_mipmap_pack_t *pack,
+                        const _record_t *rec,
+                        const uint8_t *data,
+                        _entry_t *entry)
+{
+  const size_t size = _record_size(rec->length);
+  _file_t *file = pack->files->len
+    ? g_ptr_array_index(pack->files, pack->files->len - 1)
+    : NULL;
+
+  if(!file || !pack->active || file->size + size > DT_MIPMAP_PACK_FILE_SIZE)
+  {
+    if(pack->files->len >= G_MAXUINT16) return FALSE;
+    if(pack->active) fclose(pack->active);
+    gchar *filename = _file_name(pack, pack->files->len, "");
+    pack->active = g_fopen(filename, "wb");
+    g_free(filename);
+    if(!pack->active) return FALSE;
+    file = g_malloc0(sizeof(_file_t));
+    g_ptr_array_add(pack->files, file);
+  }
+
+  static const uint8_t zeros[16] = { 0 };
+  const size_t padding = size - sizeof(_record_t) - rec->length;
+  if(fwrite(rec, sizeof(_record_t), 1, pack->active) != 1
+     || fwrite(data, 1, rec->length, pack->active) != rec->length
+     || fwrite(zeros, 1, padding, pack->active) != padding
+     || fflush(pack->active))
+  {
+    // don't know how much made it to the disk, start over with a new file
+    dt_print(DT_DEBUG_ALWAYS, "[mipmap_pack] can't write to `%s'\n", pack->dirname);
+    fclose(pack->active);
+    pack->active = NULL;
+    file->size = DT_MIPMAP_PACK_FILE_SIZE;
+    return FALSE;
+  }
+
+  entry->imgid = rec->imgid;
+  entry->mip = rec->mip;
+  entry->file = pack->files->len - 1;
+  entry->hash = rec->hash;
+  entry->offset = file->size;
+  entry->length = rec->length;
+  entry->codec = rec->codec;
+  file->size += size;
+  return TRUE;
+}
+
+static FILE *_journal_create(const char *filename)
+{
+  FILE *f = g_fopen(filename, "wb");
+  if(f && fwrite(_index_magic, sizeof(_index_magic), 1, f) != 1)
+  {
+    fclose(f);
+    f = NULL;
+  }
+  return f;
+}
+
+static gint _sort_by_location(gconstpointer a,
+                              gconstpointer b)
+{
+  const _entry_t *ea = *(const _entry_t **)a;
+  const _entry_t *eb = *(const _entry_t **)b;
+  if(ea->file != eb->file) return ea->file < eb->file ? -1 : 1;
+  return ea->offset < eb->offset ? -1 : (ea->offset > eb->offset);
+}
+
+static void _remove_files(dt_mipmap_pack_t *pack,
+                          const guint first,
+                          const char *suffix)
+{
+  for(guint f = first;; f++)
+  {
+    gchar *filename = _file_name(pack, f, suffix);
+    const gboolean gone = g_unlink(filename) != 0;
+    g_free(filename);
+    if(gone) break;
+  }
+}
+
+// copy the live records into new pack files, in the order of the old ones
+static void _compact(dt_mipmap_pack_t *pack)
+{
+  const double start = dt_get_wtime();
+  size_t total = 0;
+  for(guint f = 0; f < pack->files->len; f++)
+    total += ((_file_t *)g_ptr_array_index(pack->files, f))->size;
+
+  GPtrArray *entries = g_ptr_array_sized_new(g_hash_table_size(pack->index));
+  GHashTableIter it;
+  gpointer value;
+  g_hash_table_iter_init(&it, pack->index);
+  while(g_hash_table_iter_next(&it, NULL, &value))
+    g_ptr_array_add(entries, value);
+  g_ptr_array_sort(entries, _sort_by_location);
+
+  gchar *journalname = g_build_filename(pack->dirname, "index.new", NULL);
+  FILE *journal = _journal_create(journalname);
+
+  GPtrArray *files = g_ptr_array_new_with_free_func(_file_free);
+  GHashTable *index = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  FILE *active = NULL;
+  size_t live = 0;
+  gboolean ok = journal != NULL;
+
+  for(guint k = 0; ok && k < entries->len; k++)
+  {
+    const _entry_t *old = g_ptr_array_index(entries, k);
+    const size_t size = _record_size(old->length);
+    GMappedFile *map = _map(pack, old->file, old->offset + sizeof(_record_t) + old->length);
+    if(!map) continue;
+
+    _file_t *file = files->len ? g_ptr_array_index(files, files->len - 1) : NULL;
+    if(!file || file->size + size > DT_MIPMAP_PACK_FILE_SIZE)
+    {
+      if(active) fclose(active);
+      gchar *filename = _file_name(pack, files->len, ".new");
+      active = g_fopen(filename, "wb");
+      g_free(filename);
+      if(!active)
+      {
+        ok = FALSE;
+        break;
+      }
+      file = g_malloc0(sizeof(_file_t));
+      g_ptr_array_add(files, file);
+    }
+
+    _entry_t entry = *old;
+    entry.file = files->len - 1;
+    entry.offset = file->size;
+    const char *data = g_mapped_file_get_contents(map) + old->offset;
+    ok = fwrite(data, 1, size, active) == size
+      && fwrite(&entry, sizeof(entry), 1, journal) == 1;
+    file->size += size;
+    live += size;
+    _entry_t *copy = g_malloc(sizeof(_entry_t));
+    *copy = entry;
+    g_hash_table_insert(index, _key(entry.imgid, entry.mip), copy);
+  }
+  if(active && fclose(active)) ok = FALSE;
+  if(journal && fclose(journal)) ok = FALSE;
+  g_ptr_array_free(entries, TRUE);
+
+  if(!ok)
+  {
+    dt_print(DT_DEBUG_ALWAYS, "[mipmap_pack] compacting `%s' failed\n", pack->dirname);
+    _remove_files(pack, 0, ".new");
+    g_unlink(journalname);
+    g_free(journalname);
+    g_ptr_array_free(files, TRUE);
+    g_hash_table_destroy(index);
+    return;
+  }
+
+  // the records check imgid, mip and hash, so being interrupted here at
+  // worst loses some thumbnails
+  const guint old_files = pack->files->len;
+  g_ptr_array_free(pack->files, TRUE);
+  for(guint f = 0; f < files->len; f++)
+  {
+    gchar *from = _file_name(pack, f, ".new");
+    gchar *to = _file_name(pack, f, "");
+    g_unlink(to);
+    g_rename(from, to);
+    g_free(from);
+    g_free(to);
+  }
+  for(guint f = files->len; f < old_files; f++)
+  {
+    gchar *filename = _file_name(pack, f, "");
+    g_unlink(filename);
+    g_free(filename);
+  }
+  gchar *indexname = g_build_filename(pack->dirname, "index", NULL);
+  g_unlink(indexname);
+  g_rename(journalname, indexname);
+  g_free(indexname);
+  g_free(journalname);
+
+  g_hash_table_destroy(pack->index);
+  pack->index = index;
+  pack->files = files;
+  pack->live = live;
+
+  dt_print(DT_DEBUG_CACHE,
+           "[mipmap_pack] compacted %.1f MB to %.1f MB in %.3fs\n",
+           total / (1024.0 * 1024.0), live / (1024.0 * 1024.0), dt_get_wtime() - start);
+}
+
+dt_mipmap_pack_t *dt_mipmap_pack_open(const char *dirname)
+{
+  if(g_mkdir_with_parents(dirname, 0750))
+  {
+    dt_print(DT_DEBUG_ALWAYS, "[mipmap_pack] can't create `%s'\n", dirname);
+    return NULL;
+  }
+
+  dt_mipmap_pack_t *pack = g_malloc0(sizeof(dt_mipmap_pack_t));
+  pack->dirname = g_strdup(dirname);
+  dt_pthread_mutex_init(&pack->lock, NULL);
+  pack->index = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  pack->files = g_ptr_array_new_with_free_func(_file_free);
+
+  // leftovers of an interrupted compaction
+  _remove_files(pack, 0, ".new");
+
+  for(guint f = 0; f < G_MAXUINT16; f++)
+  {
+    gchar *filename = _file_name(pack, f, "");
+    GStatBuf st;
+    const gboolean exists = !g_stat(filename, &st);
+    g_free(filename);
+    if(!exists) break;
+    _file_t *file = g_malloc0(sizeof(_file_t));
+    file->size = st.st_size;
+    g_ptr_array_add(pack->files, file);
+  }
+
+  gchar *indexname = g_build_filename(dirname, "index", NULL);
+  gchar *contents = NULL;
+  gsize length = 0;
+  size_t count = 0;
+  if(g_file_get_contents(indexname, &contents, &length, NULL)
+     && length >= sizeof(_index_magic)
+     && !memcmp(contents, _index_magic, sizeof(_index_magic)))
+  {
+    // a trailing partial entry is ignored and overwritten below
+    const size_t entries = (length - sizeof(_index_magic)) / sizeof(_entry_t);
+    for(size_t k = 0; k < entries; k++)
+    {
+      _entry_t entry;
+      memcpy(&entry, contents + sizeof(_index_magic) + k * sizeof(_entry_t), sizeof(entry));
+      if(entry.mip >= DT_MIPMAP_PACK_MIPS) continue;
+      if(entry.length
+         && (entry.file >= pack->files->len
+             || entry.offset + _record_size(entry.length)
+                > ((_file_t *)g_ptr_array_index(pack->files, entry.file))->size))
+        continue;
+      _index_set(pack, &entry);
+      count++;
+    }
+    length = sizeof(_index_magic) + entries * sizeof(_entry_t);
+  }
+  else if(pack->files->len)
+  {
+    // no usable index, the packs are of no use
+    dt_print(DT_DEBUG_ALWAYS, "[mipmap_pack] index of `%s' is missing, starting over\n", dirname);
+    _remove_files(pack, 0, "");
+    g_ptr_array_set_size(pack->files, 0);
+    length = 0;
+  }
+  else
+    length = 0;
+  g_free(contents);
+
+  size_t total = 0;
+  for(guint f = 0; f < pack->files->len; f++)
+    total += ((_file_t *)g_ptr_array_index(pack->files, f))->size;
+
+  dt_print(DT_DEBUG_CACHE,
+           "[mipmap_pack] %u thumbnails in %u files, %.1f of %.1f MB in use, %zu index entries\n",
+           g_hash_table_size(pack->index), pack->files->len,
+           pack->live / (1024.0 * 1024.0), total / (1024.0 * 1024.0), count);
+
+  if(total > DT_MIPMAP_PACK_COMPACT_MIN && pack->live < total / 2)
+  {
+    _compact(pack);
+    GStatBuf st;
+    length = g_stat(indexname, &st) ? 0 : st.st_size;
+  }
+
+  if(length)
+  {
+    // continue right after the last complete entry, overwriting a torn one
+    pack->journal = g_fopen(indexname, "r+b");
+    if(pack->journal && fseek(pack->journal, length, SEEK_SET))
+    {
+      fclose(pack->journal);
+      pack->journal = NULL;
+    }
+  }
+  else
+    pack->journal = _journal_create(indexname);
+  g_free(indexname);
+
+  if(!pack->journal)
+  {
+    dt_print(DT_DEBUG_ALWAYS, "[mipmap_pack] can't write index of `%s'\n", dirname);
+    dt_mipmap_pack_close(pack);
+    return NULL;
+  }
+
+  // appending continues in the last file
+  if(pack->files->len)
+  {
+    gchar *filename = _file_name(pack, pack->files->len - 1, "");
+    pack->active = g_fopen(filename, "ab");
+    g_free(filename);
+  }
+
+  return pack;
+}
+
+void dt_mipmap_pack_close(dt_mipmap_pack_t *pack)
+{
+  if(!pack) return;
+  if(pack->active) fclose(pack->active);
+  if(pack->journal) fclose(pack->journal);
+  g_ptr_array_free(pack->files, TRUE);
+  g_hash_table_destroy(pack->index);
+  dt_pthread_mutex_destroy(&pack->lock);
+  g_free(pack->dirname);
+  g_free(pack);
+}
+
+gboolean dt_mipmap_pack_get(dt_mipmap_pack_t *pack,
+                            const dt_imgid_t imgid,
+                            const int mip,
+                            const dt_hash_t hash,
+                            dt_mipmap_pack_blob_t *blob)
+{
+  memset(blob, 0, sizeof(*blob));
+  dt_pthread_mutex_lock(&pack->lock);
+  const _entry_t *entry = g_hash_table_lookup(pack->index, _key(imgid, mip));
+  gboolean found = FALSE;
+  if(!entry)
+    pack->misses++;
+  else if(entry->hash != hash)
+    pack->stale++;
+  else if((found = _lookup(pack, imgid, mip, blob)))
+    pack->hits++;
+  dt_pthread_mutex_unlock(&pack->lock);
+  return found;
+}
+
+void dt_mipmap_pack_release(dt_mipmap_pack_blob_t *blob)
+{
+  if(blob->map) g_mapped_file_unref(blob->map);
+  memset(blob, 0, sizeof(*blob));
+}
+
+gboolean dt_mipmap_pack_contains(dt_mipmap_pack_t *pack,
+                                 const dt_imgid_t imgid,
+                                 const int mip)
+{
+  dt_pthread_mutex_lock(&pack->lock);
+  const gboolean found = g_hash_table_contains(pack->index, _key(imgid, mip));
+  dt_pthread_mutex_unlock(&pack->lock);
+  return found;
+}
+
+gboolean dt_mipmap_pack_is_current(dt_mipmap_pack_t *pack,
+                                   const dt_imgid_t imgid,
+                                   const int mip,
+                                   const dt_hash_t hash,
+                                   const dt_mipmap_pack_codec_t codec)
+{
+  dt_pthread_mutex_lock(&pack->lock);
+  const _entry_t *entry = g_hash_table_lookup(pack->index, _key(imgid, mip));
+  const gboolean current = entry && entry->hash == hash && entry->codec == codec;
+  dt_pthread_mutex_unlock(&pack->lock);
+  return current;
+}
+
+gboolean dt_mipmap_pack_put(dt_mipmap_pack_t *pack,
+                            const dt_imgid_t imgid,
+                            const int mip,
+                            const dt_hash_t hash,
+                            const dt_mipmap_pack_codec_t codec,
+                            const int32_t width,
+                            const int32_t height,
+                            const int32_t color_space,
+                            const uint8_t *data,
+                            const size_t length)
+{
+  if(!length || length > G_MAXUINT32 || mip < 0 || mip >= DT_MIPMAP_PACK_MIPS) return FALSE;
+
+  _record_t rec;
+  memcpy(rec.magic, _record_magic, sizeof(rec.magic));
+  rec.imgid = imgid;
+  rec.mip = mip;
+  rec.codec = codec;
+  rec.hash = hash;
+  rec.width = width;
+  rec.height = height;
+  rec.color_space = color_space;
+  rec.length = length;
+
+  _entry_t entry;
+  dt_pthread_mutex_lock(&pack->lock);
+  const gboolean ok = _append(pack, &rec, data, &entry) && _journal_append(pack, &entry);
+  if(ok)
+  {
+    _index_set(pack, &entry);
+    pack->writes++;
+  }
+  dt_pthread_mutex_unlock(&pack->lock);
+  return ok;
+}
+
+void dt_mipmap_pack_remove(dt_mipmap_pack_t *pack,
+                           const dt_imgid_t imgid,
+                           const int mip)
+{
+  dt_pthread_mutex_lock(&pack->lock);
+  if(g_hash_table_contains(pack->index, _key(imgid, mip)))
+  {
+    const _entry_t removed = { .imgid = imgid, .mip = mip };
+    _index_set(pack, &removed);
+    _journal_append(pack, &removed);
+  }
+  dt_pthread_mutex_unlock(&pack->lock);
+}
+
+void dt_mipmap_pack_copy(dt_mipmap_pack_t *pack,
+                         const dt_imgid_t dst_imgid,
+                         const dt_imgid_t src_imgid)
+{
+  for(int mip = 0; mip < DT_MIPMAP_PACK_MIPS; mip++)
+  {
+    dt_mipmap_pack_blob_t blob = { 0 };
+    dt_pthread_mutex_lock(&pack->lock);
+    const gboolean found = _lookup(pack, src_imgid, mip, &blob);
+    dt_pthread_mutex_unlock(&pack->lock);
+    if(!found) continue;
+
+    // a record carries its imgid, so the data is copied rather than shared
+    dt_mipmap_pack_put(pack, dst_imgid, mip, blob.hash, blob.codec,
+                       blob.width, blob.height, blob.color_space, blob.data, blob.length);
+    dt_mipmap_pack_release(&blob);
+  }
+}
+
+void dt_mipmap_pack_print(dt_mipmap_pack_t *pack)
+{
+  if(!pack) return;
+  dt_pthread_mutex_lock(&pack->lock);
+  size_t total = 0;
+  for(guint f = 0; f < pack->files->len; f++)
+    total += ((_file_t *)g_ptr_array_index(pack->files, f))->size;
+  dt_print(DT_DEBUG_ALWAYS,
+           "[mipmap_pack] %u thumbnails, %.1f of %.1f MB in use, "
+           "%" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " stale, %" PRIu64 " writes\n",
+           g_hash_table_size(pack->index), pack->live / (1024.0 * 1024.0),
+           total / (1024.0 * 1024.0), pack->hits, pack->misses, pack->stale, pack->writes);
+  dt_pthread_mutex_unlock(&pack->lock);
+}
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -0,0 +1,107 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common/darktable.h"
+
+/**
+ * packed disk backend for the thumbnail cache.
+ *
+ * instead of one file per image and mip level, compressed thumbnails are
+ * appended to a few large pack files and read back through memory mapping.
+ * an index journal, appended to on every write or removal, maps
+ * (imgid, mip) to the location of the thumbnail and the history hash it was
+ * generated from. it is read in one go on startup.
+ *
+ * replaced and removed thumbnails leave dead space behind, the packs are
+ * compacted on startup once more than half of them is dead.
+ */
+
+typedef enum dt_mipmap_pack_codec_t
+{
+  DT_MIPMAP_PACK_CODEC_JPEG = 0,
+  DT_MIPMAP_PACK_CODEC_QOI = 1,
+} dt_mipmap_pack_codec_t;
+
+typedef struct dt_mipmap_pack_blob_t
+{
+  GMappedFile *map;              // keeps the data mapped until released
+  const uint8_t *data;
+  size_t length;
+  dt_mipmap_pack_codec_t codec;
+  int32_t width, height;
+  int32_t color_space;           // dt_colorspaces_color_profile_type_t
+  dt_hash_t hash;
+} dt_mipmap_pack_blob_t;
+
+typedef struct dt_mipmap_pack_t dt_mipmap_pack_t;
+
+/** open or create the packs in dirname, returns NULL on failure */
+dt_mipmap_pack_t *dt_mipmap_pack_open(const char *dirname);
+void dt_mipmap_pack_close(dt_mipmap_pack_t *pack);
+
+/** look up the thumbnail of an image generated with the given history hash.
+ * on success blob points into the mapped pack until dt_mipmap_pack_release() */
+gboolean dt_mipmap_pack_get(dt_mipmap_pack_t *pack,
+                            const dt_imgid_t imgid,
+                            const int mip,
+                            const dt_hash_t hash,
+                            dt_mipmap_pack_blob_t *blob);
+void dt_mipmap_pack_release(dt_mipmap_pack_blob_t *blob);
+
+/** is there any thumbnail for the image, whatever history it was generated from */
+gboolean dt_mipmap_pack_contains(dt_mipmap_pack_t *pack,
+                                 const dt_imgid_t imgid,
+                                 const int mip);
+
+/** is the thumbnail of the image generated with the given history hash and stored with codec */
+gboolean dt_mipmap_pack_is_current(dt_mipmap_pack_t *pack,
+                                   const dt_imgid_t imgid,
+                                   const int mip,
+                                   const dt_hash_t hash,
+                                   const dt_mipmap_pack_codec_t codec);
+
+/** store a thumbnail, replacing an existing one */
+gboolean dt_mipmap_pack_put(dt_mipmap_pack_t *pack,
+                            const dt_imgid_t imgid,
+                            const int mip,
+                            const dt_hash_t hash,
+                            const dt_mipmap_pack_codec_t codec,
+                            const int32_t width,
+                            const int32_t height,
+                            const int32_t color_space,
+                            const uint8_t *data,
+                            const size_t length);
+
+void dt_mipmap_pack_remove(dt_mipmap_pack_t *pack,
+                           const dt_imgid_t imgid,
+                           const int mip);
+
+/** copy all thumbnails of src_imgid to dst_imgid */
+void dt_mipmap_pack_copy(dt_mipmap_pack_t *pack,
+                         const dt_imgid_t dst_imgid,
+                         const dt_imgid_t src_imgid);
+
+void dt_mipmap_pack_print(dt_mipmap_pack_t *pack);
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -0,0 +1,241 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "common/numa.h"
+#include "control/conf.h"
+
+#include <string.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// buffers smaller than this are not worth the trouble
+#define DT_NUMA_MIN_SIZE (4 * 1024 * 1024)
+
+#define DT_NUMA_MAX_NODES 64
+
+#if defined(__linux__)
+// from linux/mempolicy.h, which isn't available everywhere
+#define DT_MPOL_INTERLEAVE 3
+
+typedef struct dt_numa_t
+{
+  dt_numa_mode_t mode;
+  int num_nodes;
+  int node_id[DT_NUMA_MAX_NODES];      // as used by the kernel, may have gaps
+  cpu_set_t cpus[DT_NUMA_MAX_NODES];
+  size_t page_size;
+} dt_numa_t;
+
+static dt_numa_t _numa = { DT_NUMA_OFF };
+
+// the number of openmp threads last pinned from this thread, they are
+// reused for all parallel regions the thread starts
+static __thread size_t _bound_threads = 0;
+
+static gboolean _parse_cpulist(const char *list,
+                               cpu_set_t *cpus)
+{
+  CPU_ZERO(cpus);
+  gchar **ranges = g_strsplit(list, ",", -1);
+  for(gchar **r = ranges; *r; r++)
+  {
+    int first, last;
+    const int n = sscanf(*r, "%d-%d", &first, &last);
+    if(n < 1) continue;
+    if(n == 1) last = first;
+    for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, cpus);
+  }
+  g_strfreev(ranges);
+  return CPU_COUNT(cpus) > 0;
+}
+
+static void _detect_nodes(void)
+{
+  const char *sysdir = "/sys/devices/system/node";
+  GDir *dir = g_dir_open(sysdir, 0, NULL);
+  if(!dir) return;
+
+  const gchar *name;
+  while((name = g_dir_read_name(dir)) && _numa.num_nodes < DT_NUMA_MAX_NODES)
+  {
+    int id;
+    char tail;
+    if(sscanf(name, "node%d%c", &id, &tail) != 1) continue;
+
+    gchar *filename = g_build_filename(sysdir, name, "cpulist", NULL);
+    gchar *list = NULL;
+    // nodes without cpus only provide memory, we don't use them
+    if(g_file_get_contents(filename, &list, NULL, NULL)
+       && _parse_cpulist(g_strstrip(list), &_numa.cpus[_numa.num_nodes]))
+      _numa.node_id[_numa.num_nodes++] = id;
+    g_free(list);
+    g_free(filename);
+  }
+  g_dir_close(dir);
+}
+
+void dt_numa_init(void)
+{
+  const char *mode = dt_conf_get_string_const("numa_mode");
+  if(!strcmp(mode, "first touch"))
+    _numa.mode = DT_NUMA_FIRST_TOUCH;
+  else if(!strcmp(mode, "interleave"))
+    _numa.mode = DT_NUMA_INTERLEAVE;
+  else
+    return;
+
+  _detect_nodes();
+  if(_numa.num_nodes < 2)
+  {
+    dt_print(DT_DEBUG_ALWAYS, "[numa] %d node(s) found, numa placement disabled\n",
+             _numa.num_nodes);
+    _numa.mode = DT_NUMA_OFF;
+    return;
+  }
+  _numa.page_size = sysconf(_SC_PAGESIZE);
+
+  dt_print(DT_DEBUG_ALWAYS, "[numa] %s placement on %d nodes\n", mode, _numa.num_nodes);
+  for(int k = 0; k < _numa.num_nodes; k++)
+    dt_print(DT_DEBUG_PERF, "[numa] node %d: %d cpus\n",
+             _numa.node_id[k], CPU_COUNT(&_numa.cpus[k]));
+}
+
+void dt_numa_cleanup(void)
+{
+  _numa.mode = DT_NUMA_OFF;
+  _numa.num_nodes = 0;
+}
+
+dt_numa_mode_t dt_numa_mode(void)
+{
+  return _numa.mode;
+}
+
+void dt_numa_bind_threads(void)
+{
+#ifdef _OPENMP
+  if(_numa.mode == DT_NUMA_OFF) return;
+
+  const size_t nthreads = dt_get_num_threads();
+  if(_bound_threads == nthreads) return;
+
+  // the same split as schedule(static) uses for the rows of an image,
+  // so each node gets a contiguous part of it
+  const int nodes = _numa.num_nodes;
+  DT_OMP_PRAGMA(parallel num_threads(nthreads))
+  {
+    const size_t k = omp_get_thread_num();
+    const int node = k * nodes / omp_get_num_threads();
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &_numa.cpus[node]);
+  }
+  _bound_threads = nthreads;
+#endif
+}
+
+static void _interleave(void *buf,
+                        const size_t size)
+{
+  // mbind() works on whole pages
+  const uintptr_t page = _numa.page_size;
+  const uintptr_t start = ((uintptr_t)buf + page - 1) & ~(page - 1);
+  const uintptr_t end = ((uintptr_t)buf + size) & ~(page - 1);
+  if(end <= start) return;
+
+  const int bits = 8 * sizeof(unsigned long);
+  unsigned long mask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+  int maxnode = 0;
+  for(int k = 0; k < _numa.num_nodes; k++)
+  {
+    const int id = _numa.node_id[k];
+    if(id >= 1024) continue;
+    mask[id / bits] |= 1UL << (id % bits);
+    maxnode = MAX(maxnode, id + 1);
+  }
+
+  if(syscall(SYS_mbind, start, end - start, DT_MPOL_INTERLEAVE, mask, maxnode + 1, 0))
+    dt_print(DT_DEBUG_PERF, "[numa] can't interleave %zu bytes\n", size);
+}
+
+static void _first_touch(void *buf,
+                         const size_t size)
+{
+  const size_t nthreads = dt_get_num_threads();
+  const size_t chunk = dt_round_size((size + nthreads - 1) / nthreads, _numa.page_size);
+  char *const data = (char *)buf;
+  DT_OMP_FOR(num_threads(nthreads))
+  for(size_t k = 0; k < nthreads; k++)
+  {
+    const size_t offset = k * chunk;
+    if(offset < size)
+      memset(data + offset, 0, MIN(chunk, size - offset));
+  }
+}
+
+void dt_numa_place(void *buf,
+                   const size_t size)
+{
+  if(_numa.mode == DT_NUMA_OFF || !buf || size < DT_NUMA_MIN_SIZE) return;
+
+  dt_numa_bind_threads();
+  if(_numa.mode == DT_NUMA_INTERLEAVE)
+    _interleave(buf, size);
+  else
+    _first_touch(buf, size);
+}
+
+#else // __linux__
+
+void dt_numa_init(void)
+{
+  if(!dt_conf_is_equal("numa_mode", "off"))
+    dt_print(DT_DEBUG_ALWAYS, "[numa] numa placement is only supported on linux\n");
+}
+
+void dt_numa_cleanup(void)
+{
+}
+
+dt_numa_mode_t dt_numa_mode(void)
+{
+  return DT_NUMA_OFF;
+}
+
+void dt_numa_bind_threads(void)
+{
+}
+
+void dt_numa_place(void *buf,
+                   const size_t size)
+{
+}
+
+#endif // __linux__
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
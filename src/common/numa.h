@@ -0,0 +1,64 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common/darktable.h"
+
+/**
+ * opt-in placement of pixelpipe buffers and openmp threads on machines with
+ * several NUMA nodes (usually one per socket), linux only.
+ *
+ * without it a buffer's pages end up on the node of the thread first writing
+ * them, and the threads of the other sockets access them remotely. with
+ * numa_mode set to
+ *  - "first touch": new buffers are zeroed in parallel, every thread touching
+ *    the contiguous block of the buffer a static openmp schedule assigns to it
+ *    when processing rows, so the pages end up close to the threads using them.
+ *  - "interleave": the pages of new buffers are spread round robin over all
+ *    nodes, giving every thread the same average bandwidth.
+ * in both modes the openmp threads are pinned to the cpus of one node, the
+ * first threads of a team to the first node and so on.
+ */
+
+typedef enum dt_numa_mode_t
+{
+  DT_NUMA_OFF = 0,
+  DT_NUMA_FIRST_TOUCH = 1,
+  DT_NUMA_INTERLEAVE = 2,
+} dt_numa_mode_t;
+
+void dt_numa_init(void);
+void dt_numa_cleanup(void);
+
+/** the active mode, DT_NUMA_OFF unless enabled and there is more than one node */
+dt_numa_mode_t dt_numa_mode(void);
+
+/** pin the openmp threads of the calling thread's team to their nodes.
+ * cheap after the first call from a thread with the same number of threads */
+void dt_numa_bind_threads(void);
+
+/** place the pages of a freshly allocated buffer according to the mode.
+ * the contents of the buffer are undefined afterwards */
+void dt_numa_place(void *buf, const size_t size);
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -0,0 +1,274 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/trace.h"
+#include "common/dtpthread.h"
+
+#include <glib/gstdio.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// events kept per thread, about 1MB
+#define DT_TRACE_EVENTS 8192
+
+typedef struct dt_trace_event_t
+{
+  double ts;      // dt_get_wtime() seconds
+  double value;   // duration for complete events, value for counters
+  int32_t tid;
+  char ph;        // 'X' complete, 'i' instant, 'C' counter
+  char cat[11];
+  char name[32];
+  char args[96];
+} dt_trace_event_t;
+
+typedef struct dt_trace_buffer_t
+{
+  int32_t tid;
+  gboolean retired; // owning thread has exited, may be taken over by a new one
+  gint head;        // number of events ever written, only advanced by the owner
+  dt_trace_event_t events[DT_TRACE_EVENTS];
+} dt_trace_buffer_t;
+
+typedef struct dt_trace_t
+{
+  gchar *filename;
+  dt_pthread_mutex_t lock; // protects the buffer list, never taken while recording
+  GList *buffers;
+  pthread_key_t key;
+  gint next_tid;
+} dt_trace_t;
+
+static __thread dt_trace_buffer_t *_thread_buffer = NULL;
+
+static void _thread_exit(void *data)
+{
+  dt_trace_buffer_t *buf = (dt_trace_buffer_t *)data;
+  g_atomic_int_set(&buf->retired, TRUE);
+}
+
+static dt_trace_buffer_t *_get_buffer(void)
+{
+  if(_thread_buffer) return _thread_buffer;
+
+  dt_trace_t *trace = darktable.trace;
+  dt_trace_buffer_t *buf = NULL;
+
+  dt_pthread_mutex_lock(&trace->lock);
+  for(GList *l = trace->buffers; l; l = g_list_next(l))
+  {
+    dt_trace_buffer_t *b = (dt_trace_buffer_t *)l->data;
+    if(g_atomic_int_get(&b->retired))
+    {
+      buf = b;
+      break;
+    }
+  }
+  if(!buf)
+  {
+    buf = g_malloc0(sizeof(dt_trace_buffer_t));
+    trace->buffers = g_list_prepend(trace->buffers, buf);
+  }
+  // events already recorded keep the id of the thread that wrote them
+  buf->tid = g_atomic_int_add(&trace->next_tid, 1);
+  g_atomic_int_set(&buf->retired, FALSE);
+  dt_pthread_mutex_unlock(&trace->lock);
+
+  pthread_setspecific(trace->key, buf);
+  _thread_buffer = buf;
+  return buf;
+}
+
+static dt_trace_event_t *_new_event(const char ph,
+                                    const char *cat,
+                                    const char *name)
+{
+  dt_trace_buffer_t *buf = _get_buffer();
+  dt_trace_event_t *ev = buf->events + (buf->head % DT_TRACE_EVENTS);
+  ev->ph = ph;
+  ev->tid = buf->tid;
+  g_strlcpy(ev->cat, cat, sizeof(ev->cat));
+  g_strlcpy(ev->name, name, sizeof(ev->name));
+  ev->args[0] = '\0';
+  return ev;
+}
+
+static inline void _commit_event(void)
+{
+  // publish the event to dt_trace_dump()
+  g_atomic_int_inc(&_thread_buffer->head);
+}
+
+void dt_trace_init(const char *filename)
+{
+  if(!filename || !filename[0]) return;
+
+  dt_trace_t *trace = g_malloc0(sizeof(dt_trace_t));
+  trace->filename = g_strdup(filename);
+  dt_pthread_mutex_init(&trace->lock, NULL);
+  pthread_key_create(&trace->key, _thread_exit);
+  darktable.trace = trace;
+  dt_print(DT_DEBUG_ALWAYS, "[trace] recording to `%s'\n", filename);
+}
+
+void dt_trace_cleanup(void)
+{
+  dt_trace_t *trace = darktable.trace;
+  if(!trace) return;
+
+  dt_trace_dump();
+  darktable.trace = NULL;
+  g_list_free_full(trace->buffers, g_free);
+  pthread_key_delete(trace->key);
+  dt_pthread_mutex_destroy(&trace->lock);
+  g_free(trace->filename);
+  g_free(trace);
+}
+
+void dt_trace_complete(const char *cat,
+                       const char *name,
+                       const double start,
+                       const double end,
+                       const char *args, ...)
+{
+  if(!dt_trace_enabled()) return;
+
+  dt_trace_event_t *ev = _new_event('X', cat, name);
+  ev->ts = start;
+  ev->value = end - start;
+  if(args)
+  {
+    va_list ap;
+    va_start(ap, args);
+    vsnprintf(ev->args, sizeof(ev->args), args, ap);
+    va_end(ap);
+  }
+  _commit_event();
+}
+
+void dt_trace_instant(const char *cat,
+                      const char *name,
+                      const char *args, ...)
+{
+  if(!dt_trace_enabled()) return;
+
+  dt_trace_event_t *ev = _new_event('i', cat, name);
+  ev->ts = dt_get_wtime();
+  ev->value = 0.0;
+  if(args)
+  {
+    va_list ap;
+    va_start(ap, args);
+    vsnprintf(ev->args, sizeof(ev->args), args, ap);
+    va_end(ap);
+  }
+  _commit_event();
+}
+
+void dt_trace_counter(const char *name,
+                      const double value)
+{
+  if(!dt_trace_enabled()) return;
+
+  dt_trace_event_t *ev = _new_event('C', "counter", name);
+  ev->ts = dt_get_wtime();
+  ev->value = value;
+  _commit_event();
+}
+
+static void _write_string(FILE *f,
+                          const char *s)
+{
+  fputc('"', f);
+  for(; *s; s++)
+  {
+    if(*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+    else if((unsigned char)*s < 0x20) fputc(' ', f);
+    else fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+void dt_trace_dump(void)
+{
+  dt_trace_t *trace = darktable.trace;
+  if(!trace) return;
+
+  gchar *tmpname = g_strdup_printf("%s.tmp", trace->filename);
+  FILE *f = g_fopen(tmpname, "wb");
+  if(!f)
+  {
+    dt_print(DT_DEBUG_ALWAYS, "[trace] can't write `%s'\n", tmpname);
+    g_free(tmpname);
+    return;
+  }
+
+  // other threads keep recording meanwhile. we only read published events,
+  // but the oldest ones might get overwritten while we write them out.
+  const double origin = darktable.start_wtime;
+  size_t count = 0;
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  dt_pthread_mutex_lock(&trace->lock);
+  for(GList *l = trace->buffers; l; l = g_list_next(l))
+  {
+    dt_trace_buffer_t *buf = (dt_trace_buffer_t *)l->data;
+    const gint head = g_atomic_int_get(&buf->head);
+    for(gint k = MAX(0, head - DT_TRACE_EVENTS); k < head; k++)
+    {
+      const dt_trace_event_t *ev = buf->events + (k % DT_TRACE_EVENTS);
+      fprintf(f, "%s{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"cat\":",
+              count++ ? ",\n" : "", ev->ph, ev->tid, 1e6 * (ev->ts - origin));
+      _write_string(f, ev->cat);
+      fprintf(f, ",\"name\":");
+      _write_string(f, ev->name);
+      if(ev->ph == 'X')
+        fprintf(f, ",\"dur\":%.1f", 1e6 * ev->value);
+      else if(ev->ph == 'i')
+        fprintf(f, ",\"s\":\"t\"");
+
+      if(ev->ph == 'C')
+        fprintf(f, ",\"args\":{\"value\":%g}}", ev->value);
+      else if(ev->args[0])
+      {
+        fprintf(f, ",\"args\":{\"info\":");
+        _write_string(f, ev->args);
+        fprintf(f, "}}");
+      }
+      else
+        fputc('}', f);
+    }
+  }
+  dt_pthread_mutex_unlock(&trace->lock);
+  fprintf(f, "\n]}\n");
+
+  if(fclose(f) || g_rename(tmpname, trace->filename))
+  {
+    dt_print(DT_DEBUG_ALWAYS, "[trace] can't write `%s'\n", trace->filename);
+    g_unlink(tmpname);
+  }
+  else
+    dt_print(DT_DEBUG_ALWAYS, "[trace] wrote %zu events to `%s'\n", count, trace->filename);
+  g_free(tmpname);
+}
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
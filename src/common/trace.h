@@ -0,0 +1,65 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "common/darktable.h"
+
+/**
+ * a small profiler recording pipeline events in the chrome trace event format,
+ * to be viewed in chrome://tracing or https://ui.perfetto.dev
+ *
+ * enabled with --trace FILE. every thread records into its own ring buffer
+ * so recording never takes a lock, the oldest events of a thread are dropped
+ * once its buffer is full. the buffers are written to FILE after each export
+ * job and at exit.
+ *
+ * timestamps are in seconds as returned by dt_get_wtime().
+ */
+
+#define dt_trace_enabled() (darktable.trace != NULL)
+
+void dt_trace_init(const char *filename);
+void dt_trace_cleanup(void);
+
+/** write all recorded events to the trace file */
+void dt_trace_dump(void);
+
+/** an event spanning from start to end, args is an optional printf style description */
+void dt_trace_complete(const char *cat,
+                       const char *name,
+                       const double start,
+                       const double end,
+                       const char *args, ...)
+  __attribute__((format(printf, 5, 6)));
+
+/** an event at the current time */
+void dt_trace_instant(const char *cat,
+                      const char *name,
+                      const char *args, ...)
+  __attribute__((format(printf, 3, 4)));
+
+/** the current value of a counter, shown as a graph */
+void dt_trace_counter(const char *name,
+                      const double value);
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -0,0 +1,63 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2026 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+/* Let GCC vectorize loops calling these float functions of libm, by
+ * declaring the vector variants glibc ships in libmvec on x86_64. glibc
+ * only declares them itself under -ffast-math, which we don't use as a
+ * whole since we need -fno-finite-math-only. The vector variants are
+ * accurate to 4 ulp instead of 1, so include this header only in the
+ * source files whose kernels are fine with that, and write those kernels
+ * as plain loops over blocks of values: the compiler then picks the
+ * variant matching the codepath (sse, avx2 or avx512) of the function
+ * the loop is compiled in.
+ **/
+
+#include <math.h>
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__GLIBC__) \
+  && defined(__x86_64__) && !defined(__FAST_MATH__)
+
+#define DT_VECTOR_MATH 1
+#define DT_VECTOR_MATH_DECL __attribute__((__simd__("notinbranch"))) extern
+
+DT_VECTOR_MATH_DECL float expf(float x);
+DT_VECTOR_MATH_DECL float logf(float x);
+DT_VECTOR_MATH_DECL float powf(float x, float y);
+DT_VECTOR_MATH_DECL float sinf(float x);
+DT_VECTOR_MATH_DECL float cosf(float x);
+
+#if __GLIBC_PREREQ(2, 35)
+DT_VECTOR_MATH_DECL float exp2f(float x);
+DT_VECTOR_MATH_DECL float log2f(float x);
+DT_VECTOR_MATH_DECL float log10f(float x);
+DT_VECTOR_MATH_DECL float cbrtf(float x);
+DT_VECTOR_MATH_DECL float atan2f(float y, float x);
+DT_VECTOR_MATH_DECL float hypotf(float x, float y);
+#endif
+
+#undef DT_VECTOR_MATH_DECL
+
+#endif
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -28,6 +28,7 @@
 #include "common/image_cache.h"
 #include "common/mipmap_cache.h"
 #include "common/tags.h"
+#include "common/trace.h"
 #include "common/undo.h"
 #include "common/grouping.h"
 #include "common/import_session.h"
@@ -1489,6 +1490,227 @@ static int32_t dt_control_refresh_exif_run(dt_job_t *job)
 }
 
 
+// per-pixel memory estimate of one export pixelpipe: the full input buffer plus
+// the input/output float buffers of the module being processed and the
+// output buffer handed to the format module.
+#define DT_EXPORT_BYTES_PER_PIXEL (4 * 4 * sizeof(float))
+
+typedef struct _export_shared_t
+{
+  dt_job_t *job;
+  dt_control_export_t *settings;
+  dt_imageio_module_format_t *mformat;
+  dt_imageio_module_storage_t *mstorage;
+  dt_imageio_module_data_t *sdata;
+  dt_export_metadata_t *metadata;
+
+  dt_pthread_mutex_t lock;
+  pthread_cond_t cond;
+  GList *next;           // next image to be claimed
+  guint total;
+  guint claimed;         // images handed to a worker, defines `num'
+  guint done;            // images fully processed, drives the progress bar
+  size_t mem_budget;
+  size_t mem_inflight;   // including the prefetch reservation
+  dt_imgid_t prefetch;   // image decoded ahead, its memory is reserved
+  size_t prefetch_mem;
+  int running;           // number of images currently in a pipe
+  int omp_threads;       // openmp threads per worker
+
+  guint tagid, etagid;
+  gboolean tag_change;
+} _export_shared_t;
+
+typedef struct _export_worker_t
+{
+  _export_shared_t *shared;
+  dt_imageio_module_data_t *fdata;
+  pthread_t thread;
+} _export_worker_t;
+
+static size_t _export_estimate_mem(const dt_imgid_t imgid)
+{
+  const dt_image_t *image = dt_image_cache_get(darktable.image_cache, imgid, 'r');
+  if(!image) return 0;
+  const size_t pixels = (size_t)MAX(1, image->width) * MAX(1, image->height);
+  dt_image_cache_read_release(darktable.image_cache, image);
+  return pixels * DT_EXPORT_BYTES_PER_PIXEL;
+}
+
+static int _export_concurrency(const guint total)
+{
+  const int max_parallel = dt_conf_get_int("plugins/lighttable/export/max_parallel");
+  return CLAMP(MIN(max_parallel, (int)total), 1, (int)dt_get_num_procs());
+}
+
+// claim the next image of the list; blocks while the images already being
+// processed use up the memory budget. returns FALSE if there is nothing left.
+static gboolean _export_claim(_export_shared_t *s,
+                              dt_imgid_t *imgid,
+                              guint *num,
+                              size_t *mem)
+{
+  dt_pthread_mutex_lock(&s->lock);
+  while(s->next && dt_control_job_get_state(s->job) != DT_JOB_STATE_CANCELLED)
+  {
+    const dt_imgid_t id = GPOINTER_TO_INT(s->next->data);
+    // a prefetched image has its memory reserved already
+    const gboolean reserved = id == s->prefetch;
+    const size_t need = reserved ? s->prefetch_mem : _export_estimate_mem(id);
+
+    // always let one image through, even if it exceeds the budget on its own
+    if(reserved || s->running == 0 || s->mem_inflight + need <= s->mem_budget)
+    {
+      s->next = g_list_next(s->next);
+      s->claimed++;
+      s->running++;
+      if(reserved)
+      {
+        // the reservation becomes ours
+        s->prefetch = NO_IMGID;
+        s->prefetch_mem = 0;
+      }
+      else
+        s->mem_inflight += need;
+      *imgid = id;
+      *num = s->claimed;
+      *mem = need;
+
+      // decode the image after this one while we process, as long as it
+      // fits into the budget next to the ones in flight. its memory is
+      // reserved until it is claimed or the prefetch is dropped.
+      dt_imgid_t prefetch = NO_IMGID;
+      if(s->next && !dt_is_valid_imgid(s->prefetch))
+      {
+        const dt_imgid_t next = GPOINTER_TO_INT(s->next->data);
+        const size_t next_need = _export_estimate_mem(next);
+        if(s->mem_inflight + next_need <= s->mem_budget)
+        {
+          prefetch = next;
+          s->prefetch = next;
+          s->prefetch_mem = next_need;
+          s->mem_inflight += next_need;
+        }
+      }
+      dt_pthread_mutex_unlock(&s->lock);
+
+      if(dt_is_valid_imgid(prefetch) && !dt_imageio_export_prefetch(prefetch))
+      {
+        // not decoded ahead, give back the reservation unless the
+        // image has been claimed meanwhile
+        dt_pthread_mutex_lock(&s->lock);
+        if(s->prefetch == prefetch)
+        {
+          s->mem_inflight -= s->prefetch_mem;
+          s->prefetch = NO_IMGID;
+          s->prefetch_mem = 0;
+          pthread_cond_broadcast(&s->cond);
+        }
+        dt_pthread_mutex_unlock(&s->lock);
+      }
+      return TRUE;
+    }
+    dt_pthread_cond_wait(&s->cond, &s->lock);
+  }
+  dt_pthread_mutex_unlock(&s->lock);
+  return FALSE;
+}
+
+static void _export_release(_export_shared_t *s,
+                            const size_t mem)
+{
+  dt_pthread_mutex_lock(&s->lock);
+  s->running--;
+  s->mem_inflight -= mem;
+  s->done++;
+
+  // progress message
+  char message[512] = { 0 };
+  snprintf(message, sizeof(message), _("exporting %d / %d to %s"),
+           s->done, s->total, s->mstorage->name(s->mstorage));
+  // update the message. initialize_store() might have changed the number of images
+  dt_control_job_set_progress_message(s->job, message);
+  dt_control_job_set_progress(s->job, MIN(1.0, (double)s->done / s->total));
+
+  pthread_cond_broadcast(&s->cond);
+  dt_pthread_mutex_unlock(&s->lock);
+}
+
+static void _export_image(_export_shared_t *s,
+                          dt_imageio_module_data_t *fdata,
+                          const dt_imgid_t imgid,
+                          const guint num)
+{
+  dt_control_export_t *settings = s->settings;
+
+  // check if image still exists:
+  const dt_image_t *image =
+    dt_image_cache_get(darktable.image_cache, (int32_t)imgid, 'r');
+  if(!image) return;
+
+  char imgfilename[PATH_MAX] = { 0 };
+  gboolean from_cache = TRUE;
+  dt_image_full_path(image->id, imgfilename, sizeof(imgfilename), &from_cache);
+  if(!g_file_test(imgfilename, G_FILE_TEST_IS_REGULAR))
+  {
+    dt_control_log(_("image `%s' is currently unavailable"), image->filename);
+    dt_print(DT_DEBUG_ALWAYS, "image `%s' is currently unavailable\n", imgfilename);
+    // dt_image_remove(imgid);
+    dt_image_cache_read_release(darktable.image_cache, image);
+    return;
+  }
+  dt_image_cache_read_release(darktable.image_cache, image);
+
+  const double start = dt_get_wtime();
+  const int failed = s->mstorage->store(s->mstorage, s->sdata, imgid, s->mformat, fdata,
+                                        num, s->total, settings->high_quality, settings->upscale,
+                                        settings->export_masks, settings->icc_type,
+                                        settings->icc_filename, settings->icc_intent,
+                                        s->metadata);
+  dt_trace_complete("export", s->mformat->plugin_name, start, dt_get_wtime(),
+                    "imgid=%d %s", imgid, imgfilename);
+  if(failed)
+  {
+    dt_control_job_cancel(s->job);
+    return;
+  }
+
+  dt_pthread_mutex_lock(&s->lock);
+  // remove 'changed' tag from image
+  if(dt_tag_detach(s->tagid, imgid, FALSE, FALSE)) s->tag_change = TRUE;
+
+  // make sure the 'exported' tag is set on the image
+  if(dt_tag_attach(s->etagid, imgid, FALSE, FALSE)) s->tag_change = TRUE;
+  dt_pthread_mutex_unlock(&s->lock);
+
+  /* register export timestamp in cache */
+  dt_image_cache_set_export_timestamp(darktable.image_cache, imgid);
+}
+
+static void _export_loop(_export_shared_t *s,
+                         dt_imageio_module_data_t *fdata)
+{
+  dt_imgid_t imgid = NO_IMGID;
+  guint num = 0;
+  size_t mem = 0;
+  while(_export_claim(s, &imgid, &num, &mem))
+  {
+    _export_image(s, fdata, imgid, num);
+    _export_release(s, mem);
+  }
+}
+
+static void *_export_worker(void *ptr)
+{
+  _export_worker_t *w = (_export_worker_t *)ptr;
+  dt_pthread_setname("export");
+#ifdef _OPENMP // need to do this in every thread
+  omp_set_num_threads(w->shared->omp_threads);
+#endif
+  _export_loop(w->shared, w->fdata);
+  return NULL;
+}
+
 static int32_t dt_control_export_job_run(dt_job_t *job)
 {
   dt_control_image_enumerator_t *params =
@@ -1542,8 +1764,6 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
   else
     dt_control_log(_("no image to export"));
 
-  double fraction = 0;
-
   fdata->max_width =
     (settings->max_width != 0 && w != 0)
     ? MIN(w, settings->max_width)
@@ -1580,65 +1800,82 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
     metadata.list = g_list_remove(metadata.list, metadata.list->data);
   }
 
-  while(t && dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED)
-  {
-    const dt_imgid_t imgid = GPOINTER_TO_INT(t->data);
-    t = g_list_next(t);
-    const guint num = total - g_list_length(t);
-
-    // progress message
-    char message[512] = { 0 };
-    snprintf(message, sizeof(message), _("exporting %d / %d to %s"),
-             num, total, mstorage->name(mstorage));
-    // update the message. initialize_store() might have changed the number of images
-    dt_control_job_set_progress_message(job, message);
-
-    // check if image still exists:
-    const dt_image_t *image =
-      dt_image_cache_get(darktable.image_cache, (int32_t)imgid, 'r');
-    if(image)
+  _export_shared_t shared = { 0 };
+  shared.job = job;
+  shared.settings = settings;
+  shared.mformat = mformat;
+  shared.mstorage = mstorage;
+  shared.sdata = sdata;
+  shared.metadata = &metadata;
+  shared.next = t;
+  shared.total = total;
+  shared.mem_budget = dt_get_available_mem();
+  shared.prefetch = NO_IMGID;
+  shared.tagid = tagid;
+  shared.etagid = etagid;
+  dt_pthread_mutex_init(&shared.lock, NULL);
+  pthread_cond_init(&shared.cond, NULL);
+
+  // run several export pipes side by side, the calling thread being
+  // one of them. the openmp threads are split among the pipes so the
+  // parallel stages don't oversubscribe the cpu.
+  const int nworkers = _export_concurrency(total);
+  shared.omp_threads = MAX(1, (int)dt_get_num_threads() / nworkers);
+
+  _export_worker_t *workers = nworkers > 1
+    ? g_malloc0_n(nworkers - 1, sizeof(_export_worker_t))
+    : NULL;
+  int started = 0;
+  for(int k = 0; k < nworkers - 1; k++)
+  {
+    // every pipe gets its own format data, as the format modules keep
+    // per-image state (jpeg structs, dimensions ...) in there
+    _export_worker_t *w = &workers[started];
+    w->shared = &shared;
+    w->fdata = mformat->get_params(mformat);
+    if(!w->fdata) break;
+    memcpy(w->fdata, fdata, mformat->params_size(mformat));
+    if(dt_pthread_create(&w->thread, _export_worker, w))
     {
-      char imgfilename[PATH_MAX] = { 0 };
-      gboolean from_cache = TRUE;
-      dt_image_full_path(image->id, imgfilename, sizeof(imgfilename), &from_cache);
-      if(!g_file_test(imgfilename, G_FILE_TEST_IS_REGULAR))
-      {
-        dt_control_log(_("image `%s' is currently unavailable"), image->filename);
-        dt_print(DT_DEBUG_ALWAYS, "image `%s' is currently unavailable\n", imgfilename);
-        // dt_image_remove(imgid);
-        dt_image_cache_read_release(darktable.image_cache, image);
-      }
-      else
-      {
-        dt_image_cache_read_release(darktable.image_cache, image);
-        if(mstorage->store(mstorage, sdata, imgid, mformat, fdata,
-                           num, total, settings->high_quality, settings->upscale,
-                           settings->export_masks, settings->icc_type,
-                           settings->icc_filename, settings->icc_intent,
-                           &metadata) != 0)
-          dt_control_job_cancel(job);
-        else
-        {
-          // remove 'changed' tag from image
-          if(dt_tag_detach(tagid, imgid, FALSE, FALSE)) tag_change = TRUE;
+      mformat->free_params(mformat, w->fdata);
+      break;
+    }
+    started++;
+  }
 
-          // make sure the 'exported' tag is set on the image
-          if(dt_tag_attach(etagid, imgid, FALSE, FALSE)) tag_change = TRUE;
+  dt_print(DT_DEBUG_PERF,
+           "[export_job] %d parallel pipes, %d threads each, memory budget %zuMB\n",
+           started + 1, started ? shared.omp_threads : (int)dt_get_num_threads(),
+           shared.mem_budget / (1024lu * 1024lu));
 
-          /* register export timestamp in cache */
-          dt_image_cache_set_export_timestamp(darktable.image_cache, imgid);
-        }
-      }
-    }
+#ifdef _OPENMP
+  const int omp_threads = omp_get_max_threads();
+  if(started) omp_set_num_threads(shared.omp_threads);
+#endif
+  _export_loop(&shared, fdata);
+#ifdef _OPENMP
+  omp_set_num_threads(omp_threads);
+#endif
 
-    fraction += 1.0 / total;
-    if(fraction > 1.0) fraction = 1.0;
-    dt_control_job_set_progress(job, fraction);
+  for(int k = 0; k < started; k++)
+  {
+    pthread_join(workers[k].thread, NULL);
+    mformat->free_params(mformat, workers[k].fdata);
   }
+  g_free(workers);
+  // drop what was decoded ahead of a cancelled export
+  dt_imageio_export_prefetch_cleanup();
+
+  tag_change = shared.tag_change;
+  pthread_cond_destroy(&shared.cond);
+  dt_pthread_mutex_destroy(&shared.lock);
+
   g_list_free_full(metadata.list, g_free);
 
   if(mstorage->finalize_store) mstorage->finalize_store(mstorage, sdata);
 
+  dt_trace_dump();
+
 end:
   // all threads free their fdata
   mformat->free_params(mformat, fdata);
@@ -503,16 +503,20 @@ static inline void _dt_dev_load_pipeline_defaults(dt_develop_t *dev)
 
 // load the raw and get the new image struct, blocking in gui thread
 static inline void _dt_dev_load_raw(dt_develop_t *dev,
-                                    const dt_imgid_t imgid)
+                                    const dt_imgid_t imgid,
+                                    const gboolean load_raw)
 {
   // first load the raw, to make sure dt_image_t will contain all and correct data.
-  dt_mipmap_buffer_t buf;
-  dt_times_t start;
-  dt_get_perf_times(&start);
-  dt_mipmap_cache_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL,
-                      DT_MIPMAP_BLOCKING, 'r');
-  dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
-  dt_show_times(&start, "[dt_dev_load_raw] loading the image.");
+  if(load_raw)
+  {
+    dt_mipmap_buffer_t buf;
+    dt_times_t start;
+    dt_get_perf_times(&start);
+    dt_mipmap_cache_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL,
+                        DT_MIPMAP_BLOCKING, 'r');
+    dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
+    dt_show_times(&start, "[dt_dev_load_raw] loading the image.");
+  }
 
   const dt_image_t *image = dt_image_cache_get(darktable.image_cache, imgid, 'r');
   dev->image_storage = *image;
@@ -524,7 +528,7 @@ static inline void _dt_dev_load_raw(dt_develop_t *dev,
 void dt_dev_reload_image(dt_develop_t *dev,
                          const dt_imgid_t imgid)
 {
-  _dt_dev_load_raw(dev, imgid);
+  _dt_dev_load_raw(dev, imgid, TRUE);
   dev->image_force_reload = TRUE;
   dev->full.pipe->loading = dev->preview_pipe->loading = dev->preview2.pipe->loading = TRUE;
   dev->full.pipe->changed |= DT_DEV_PIPE_SYNCH;
@@ -589,10 +593,17 @@ float dt_dev_get_zoomed_in(void)
 
 void dt_dev_load_image(dt_develop_t *dev,
                        const dt_imgid_t imgid)
+{
+  dt_dev_load_image_ext(dev, imgid, TRUE);
+}
+
+void dt_dev_load_image_ext(dt_develop_t *dev,
+                           const dt_imgid_t imgid,
+                           const gboolean load_raw)
 {
   dt_lock_image(imgid);
 
-  _dt_dev_load_raw(dev, imgid);
+  _dt_dev_load_raw(dev, imgid, load_raw);
 
   if(dev->full.pipe)
   {
@@ -369,6 +369,11 @@ void dt_dev_process_preview2(dt_develop_t *dev);
 
 void dt_dev_load_image(dt_develop_t *dev,
                        const dt_imgid_t imgid);
+/** as dt_dev_load_image(), with load_raw FALSE the caller has decoded the
+ * full image already, outside the mipmap cache */
+void dt_dev_load_image_ext(dt_develop_t *dev,
+                           const dt_imgid_t imgid,
+                           const gboolean load_raw);
 void dt_dev_reload_image(dt_develop_t *dev,
                          const dt_imgid_t imgid);
 /** checks if provided imgid is the image currently in develop */
@@ -61,6 +61,10 @@ typedef struct dt_iop_buffer_dsc_t
   /** colorspace of the image */
   int cst;
 
+  /** 4 channel float data stored as one plane per channel instead of
+   * interleaved pixels, see process_planar() */
+  gboolean planar;
+
 } dt_iop_buffer_dsc_t;
 
 size_t dt_iop_buffer_dsc_to_bpp(const struct dt_iop_buffer_dsc_t *dsc);
@@ -2043,6 +2043,14 @@ void dt_iop_commit_params(dt_iop_module_t *module,
   if(module->flags() & IOP_FLAGS_ALLOW_TILING)
     piece->process_tiling_ready = TRUE;
 
+  // point-wise modules can be run in strips together with their neighbours,
+  // commit_params can overwrite this.
+  piece->process_strips_ready = (module->flags() & IOP_FLAGS_POINTWISE) != 0;
+
+  // modules with a planar variant of process use it where possible,
+  // commit_params can overwrite this.
+  piece->process_planar_ready = module->process_planar != NULL;
+
   if(darktable.unmuted & DT_DEBUG_PARAMS && module->so->get_introspection())
     _iop_validate_params(module->so->get_introspection()->field, params,
                          TRUE, module->so->op);
@@ -119,7 +119,9 @@ typedef enum dt_iop_flags_t
   IOP_FLAGS_UNSAFE_COPY = 1 << 13,       // Unsafe to copy as part of history
   IOP_FLAGS_GUIDES_SPECIAL_DRAW = 1 << 14, // handle the grid drawing directly
   IOP_FLAGS_GUIDES_WIDGET = 1 << 15,      // require the guides widget
-  IOP_FLAGS_CROP_EXPOSER = 1 << 16        // offers crop exposing
+  IOP_FLAGS_CROP_EXPOSER = 1 << 16,       // offers crop exposing
+  IOP_FLAGS_POINTWISE = 1 << 17,          // Output pixels only depend on the same input pixel, no roi changes
+  IOP_FLAGS_PIPE_SHAREABLE = 1 << 18      // process() ignores the pipe type and has no gui side effects, output shared among pipes
 } dt_iop_flags_t;
 
 /** status of a module*/
@@ -17,10 +17,15 @@
 */
 
 #include "develop/pixelpipe_cache.h"
+#include "common/arena.h"
+#include "common/file_location.h"
+#include "common/halffloat.h"
+#include "develop/blend.h"
 #include "develop/format.h"
 #include "develop/pixelpipe_hb.h"
 #include "libs/lib.h"
 #include "libs/colorpicker.h"
+#include <glib/gstdio.h>
 #include <stdlib.h>
 
 #define INVALID_CACHEHASH 0
@@ -30,6 +35,64 @@ static inline int _to_mb(size_t m)
   return (int)((m + 0x80000lu) / 0x400lu / 0x400lu);
 }
 
+// the caches can keep float lines as half floats, the pipe itself always
+// gets floats back
+static inline gboolean _store_half(const gboolean enabled,
+                                   const dt_iop_buffer_dsc_t *dsc,
+                                   const size_t size)
+{
+  return enabled && dsc->datatype == TYPE_FLOAT && !(size % sizeof(float));
+}
+
+/*
+ * the shared pool holds copies of cachelines of the image being developed,
+ * so pipes computing the same line (for example the full pipe and the second
+ * window up to the first module depending on the pipe type) are served without
+ * processing again. lines are keyed by dt_dev_pixelpipe_cache_shared_hash(). all access is under the
+ * pool lock, lines are copied in and out so the pipes keep owning their buffers.
+ * with pixelpipe_cache_half the copies of float lines are half floats.
+ */
+typedef struct dt_dev_pixelpipe_shared_line_t
+{
+  dt_hash_t hash;  // key in the hashtable
+  void *data;
+  size_t size;     // size of the cacheline
+  size_t stored;   // size of data, half of size for half floats
+  dt_iop_buffer_dsc_t dsc;
+  float cost;      // seconds it took to compute
+  uint64_t used;   // pool stamp of last access
+} dt_dev_pixelpipe_shared_line_t;
+
+typedef struct dt_dev_pixelpipe_shared_cache_t
+{
+  dt_pthread_mutex_t lock;
+  GHashTable *lines;
+  dt_imgid_t imgid;
+  size_t allmem;
+  size_t memlimit;
+  gboolean half;   // store float lines as half floats
+  uint64_t stamp;
+  uint64_t hits;
+  uint64_t puts;
+} dt_dev_pixelpipe_shared_cache_t;
+
+// bytes held by cacheline k
+static inline size_t _line_bytes(const dt_dev_pixelpipe_cache_t *cache,
+                                 const int k)
+{
+  return cache->packed[k] ? cache->size[k] / 2 : cache->size[k];
+}
+
+// pipes without a memory limit have no budget to derive the retained bytes
+// from, let their arena keep one freed line as large as the largest they use.
+// for export this is the full image line allocated up front.
+static inline void _arena_fit(dt_dev_pixelpipe_cache_t *cache,
+                              const size_t size)
+{
+  if(!cache->memlimit && size > dt_arena_get_retain(cache->arena))
+    dt_arena_set_retain(cache->arena, size);
+}
+
 gboolean dt_dev_pixelpipe_cache_init(
            struct dt_dev_pixelpipe_t *pipe,
            const int entries,
@@ -39,16 +102,31 @@ gboolean dt_dev_pixelpipe_cache_init(
   dt_dev_pixelpipe_cache_t *cache = &(pipe->cache);
 
   cache->entries = entries;
-  cache->allmem = cache->hits = cache->calls = cache->tests = 0;
+  cache->allmem = cache->hits = cache->misses = cache->calls = cache->tests = 0;
+  cache->saved = cache->evicted = 0.0;
   cache->memlimit = limit;
+  cache->disklimit = cache->disksize = 0;
+  cache->diskmodules = NULL;
+  cache->diskhalf = FALSE;
+  cache->diskhits = cache->diskwrites = 0;
+  cache->shared = NULL;
+  // only pipes keeping lines between runs gain from packing them
+  cache->half = entries > DT_PIPECACHE_MIN && dt_conf_get_bool("pixelpipe_cache_half");
+  // keep up to a quarter of the cache limit of freed lines for reuse, the
+  // retained bytes count against the limit in dt_dev_pixelpipe_cache_checkmem().
+  // pipes without a limit (export, thumbnails, previews) keep one line of their
+  // largest size, see _arena_fit().
+  cache->arena = dt_arena_new(limit / 4);
 
-  const size_t csize = sizeof(void *) + sizeof(size_t) + sizeof(dt_iop_buffer_dsc_t) + 2*sizeof(int32_t) + sizeof(uint64_t);
+  const size_t csize = sizeof(void *) + sizeof(size_t) + sizeof(dt_iop_buffer_dsc_t) + 2*sizeof(int32_t) + sizeof(uint64_t) + sizeof(float) + sizeof(gboolean);
   cache->data = (void **) calloc(entries, csize);
   cache->size = (size_t *)((void *)cache->data + entries * sizeof(void *));
   cache->dsc = (dt_iop_buffer_dsc_t *)((void *)cache->size + entries * sizeof(size_t));
   cache->hash = (dt_hash_t *)((void *)cache->dsc + entries * sizeof(dt_iop_buffer_dsc_t));
   cache->used = (int32_t *)((void *)cache->hash + entries * sizeof(dt_hash_t));
   cache->ioporder = (int32_t *)((void *)cache->used + entries * sizeof(int32_t));
+  cache->cost = (float *)((void *)cache->ioporder + entries * sizeof(int32_t));
+  cache->packed = (gboolean *)((void *)cache->cost + entries * sizeof(float));
 
   for(int k = 0; k < entries; k++)
   {
@@ -58,10 +136,11 @@ gboolean dt_dev_pixelpipe_cache_init(
   if(!size) return TRUE;
 
   // some pixelpipes use preallocated cachelines, following code is special for those
+  _arena_fit(cache, size);
   for(int k = 0; k < entries; k++)
   {
     cache->size[k] = size;
-    cache->data[k] = (void *)dt_alloc_aligned(size);
+    cache->data[k] = dt_arena_alloc(cache->arena, size);
     if(!cache->data[k])
       goto alloc_memory_fail;
 
@@ -75,10 +154,11 @@ gboolean dt_dev_pixelpipe_cache_init(
   // but will only fail to generate thumbnails for example.
   for(int k = 0; k < cache->entries; k++)
   {
-    dt_free_align(cache->data[k]);
+    dt_arena_free(cache->arena, cache->data[k]);
     cache->size[k] = 0;
     cache->data[k] = NULL;
   }
+  dt_arena_trim(cache->arena);
   cache->allmem = 0;
   return FALSE;
 }
@@ -96,17 +176,27 @@ void dt_dev_pixelpipe_cache_cleanup(struct dt_dev_pixelpipe_t *pipe)
 
   for(int k = 0; k < cache->entries; k++)
   {
-    dt_free_align(cache->data[k]);
+    dt_arena_free(cache->arena, cache->data[k]);
     cache->data[k] = NULL;
   }
   free(cache->data);
   cache->data = NULL;
+  dt_arena_destroy(cache->arena);
+  cache->arena = NULL;
+
+  if(cache->disklimit)
+    dt_print(DT_DEBUG_PIPE, "[pixelpipe_cache] disk cache: %u hits, %u writes\n",
+             cache->diskhits, cache->diskwrites);
+  g_strfreev(cache->diskmodules);
+  cache->diskmodules = NULL;
+  cache->disklimit = 0;
 }
 
 static dt_hash_t _dev_pixelpipe_cache_basichash(
            const dt_imgid_t imgid,
            struct dt_dev_pixelpipe_t *pipe,
-           const int position)
+           const int position,
+           const gboolean shared)
 {
   /* What do we use for the basic hash
        1) imgid as all structures using the hash might possibly contain data from other images
@@ -117,10 +207,24 @@ static dt_hash_t _dev_pixelpipe_cache_basichash(
           Do we have to keep the roi of details mask? No as that is always defined by roi_in
           of the mask writing module (rawprepare or demosaic)
   */
+  /* The key of the shared pool leaves out which pipe this is, as long as all modules
+     up to position are flagged IOP_FLAGS_PIPE_SHAREABLE, but keeps flags like fast
+     mode and the mask display. Instead the input buffer is included, the preview pipe
+     starts from a downscaled one.
+  */
   const uint32_t hashing_pipemode[3] = {(uint32_t)imgid,
-                                        (uint32_t)pipe->type,
+                                        (uint32_t)(shared
+                                                   ? pipe->type & ~DT_DEV_PIXELPIPE_ANY
+                                                   : pipe->type),
                                         (uint32_t)pipe->want_detail_mask };
   dt_hash_t hash = dt_hash(DT_INITHASH, &hashing_pipemode, sizeof(hashing_pipemode));
+  if(shared)
+  {
+    const int input[2] = { pipe->iwidth, pipe->iheight };
+    hash = dt_hash(hash, input, sizeof(input));
+    hash = dt_hash(hash, &pipe->iscale, sizeof(pipe->iscale));
+    hash = dt_hash(hash, &pipe->mask_display, sizeof(pipe->mask_display));
+  }
 
   // go through all modules up to position and compute a hash using the operation and params.
   GList *pieces = pipe->nodes;
@@ -136,6 +240,10 @@ static dt_hash_t _dev_pixelpipe_cache_basichash(
     if(!skipped)
     {
       hash = dt_hash(hash, &piece->hash, sizeof(piece->hash));
+      if(shared
+         && piece->enabled
+         && !(piece->module->flags() & IOP_FLAGS_PIPE_SHAREABLE))
+        hash = dt_hash(hash, &pipe->type, sizeof(pipe->type));
       if(piece->module->request_color_pick != DT_REQUEST_COLORPICK_OFF)
       {
         if(darktable.lib->proxy.colorpicker.primary_sample->size == DT_LIB_COLORPICKER_SIZE_BOX)
@@ -159,13 +267,92 @@ dt_hash_t dt_dev_pixelpipe_cache_hash(
            struct dt_dev_pixelpipe_t *pipe,
            const int position)
 {
-  dt_hash_t hash = _dev_pixelpipe_cache_basichash(imgid, pipe, position);
+  dt_hash_t hash = _dev_pixelpipe_cache_basichash(imgid, pipe, position, FALSE);
   // also include roi data
   // FIXME include full roi data in cachelines
   hash = dt_hash(hash, roi, sizeof(dt_iop_roi_t));
   return dt_hash(hash, &pipe->scharr.hash, sizeof(pipe->scharr.hash));
 }
 
+dt_hash_t dt_dev_pixelpipe_cache_shared_hash(
+           const dt_imgid_t imgid,
+           const dt_iop_roi_t *roi,
+           struct dt_dev_pixelpipe_t *pipe,
+           const int position)
+{
+  if(!pipe->cache.shared) return INVALID_CACHEHASH;
+
+  dt_hash_t hash = _dev_pixelpipe_cache_basichash(imgid, pipe, position, TRUE);
+  hash = dt_hash(hash, roi, sizeof(dt_iop_roi_t));
+  return dt_hash(hash, &pipe->scharr.hash, sizeof(pipe->scharr.hash));
+}
+
+static void _mark_invalid_cacheline(const dt_dev_pixelpipe_cache_t *cache, const int k)
+{
+  cache->hash[k] = INVALID_CACHEHASH;
+  cache->ioporder[k] = 0;
+  cache->cost[k] = 0.0f;
+}
+
+// convert a line packed by dt_dev_pixelpipe_cache_pack() back to floats. if
+// there is no memory for that the line is dropped and FALSE returned
+static gboolean _unpack_cacheline(dt_dev_pixelpipe_cache_t *cache,
+                                  const int k)
+{
+  if(!cache->packed[k]) return TRUE;
+
+  const size_t size = cache->size[k];
+  float *buf = dt_arena_alloc(cache->arena, size);
+  if(buf)
+    dt_half_to_float_buf(buf, cache->data[k], size / sizeof(float));
+  else
+    _mark_invalid_cacheline(cache, k);
+
+  dt_arena_free(cache->arena, cache->data[k]);
+  cache->allmem -= size / 2;
+  cache->data[k] = buf;
+  cache->packed[k] = FALSE;
+  if(buf)
+    cache->allmem += size;
+  else
+    cache->size[k] = 0;
+  return buf != NULL;
+}
+
+void dt_dev_pixelpipe_cache_pack(struct dt_dev_pixelpipe_t *pipe)
+{
+  dt_dev_pixelpipe_cache_t *cache = &(pipe->cache);
+  if(!cache->half || pipe->nocache || pipe->mask_display) return;
+
+  size_t packed = 0;
+  for(int k = DT_PIPECACHE_MIN; k < cache->entries; k++)
+  {
+    // important lines are the input of the focused module, taken on every run
+    if(cache->packed[k]
+       || !cache->data[k]
+       || cache->hash[k] == INVALID_CACHEHASH
+       || cache->used[k] < 0
+       || !_store_half(TRUE, &cache->dsc[k], cache->size[k]))
+      continue;
+
+    const size_t size = cache->size[k];
+    dt_half_t *buf = dt_arena_alloc(cache->arena, size / 2);
+    if(!buf) break;
+
+    dt_float_to_half_buf(buf, cache->data[k], size / sizeof(float));
+    dt_arena_free(cache->arena, cache->data[k]);
+    cache->data[k] = buf;
+    cache->packed[k] = TRUE;
+    cache->allmem -= size / 2;
+    packed += size / 2;
+  }
+
+  if(packed)
+    dt_print_pipe(DT_DEBUG_PIPE | DT_DEBUG_VERBOSE, "pipe cache pack",
+      pipe, NULL, DT_DEVICE_NONE, NULL, NULL,
+      "saved %iMB, using %iMB\n", _to_mb(packed), _to_mb(cache->allmem));
+}
+
 gboolean dt_dev_pixelpipe_cache_available(
            dt_dev_pixelpipe_t *pipe,
            const dt_hash_t hash,
@@ -183,6 +370,9 @@ gboolean dt_dev_pixelpipe_cache_available(
   {
     if((cache->size[k] == size) && (cache->hash[k] == hash))
     {
+      // the caller takes the line right away, it has to be floats by then
+      if(!_unpack_cacheline(cache, k))
+        return FALSE;
       cache->hits++;
       return TRUE;
     }
@@ -216,6 +406,37 @@ static int _get_oldest_cacheline(dt_dev_pixelpipe_cache_t *cache,
   return id;
 }
 
+// Among the valid lines that are not important choose the one that is cheapest to recompute
+// per byte of memory it holds, lines not used for a long time become cheaper over time.
+// Ties are broken by age.
+static int _get_cheapest_cacheline(dt_dev_pixelpipe_cache_t *cache)
+{
+  int id = 0;
+  float weight = FLT_MAX;
+  for(int k = DT_PIPECACHE_MIN; k < cache->entries; k++)
+  {
+    if((cache->used[k] <= 1) || (k == cache->lastline) || !cache->data[k])
+      continue;
+
+    // a millisecond base cost so that lines without timing are ordered by size and age
+    const float w = (cache->cost[k] + 1e-3f)
+                    / (float)MAX(1, _to_mb(_line_bytes(cache, k)))
+                    / (float)cache->used[k];
+    if((w < weight) || ((w == weight) && (cache->used[k] > cache->used[id])))
+    {
+      weight = w;
+      id = k;
+    }
+  }
+  return id;
+}
+
+static void _evict_stats(dt_dev_pixelpipe_cache_t *cache, const int k)
+{
+  if(k && (cache->hash[k] != INVALID_CACHEHASH))
+    cache->evicted += cache->cost[k];
+}
+
 static int __get_cacheline(struct dt_dev_pixelpipe_cache_t *cache)
 {
   int oldest = _get_oldest_cacheline(cache, DT_CACHETEST_INVALID);
@@ -224,7 +445,9 @@ static int __get_cacheline(struct dt_dev_pixelpipe_cache_t *cache)
   oldest = _get_oldest_cacheline(cache, DT_CACHETEST_FREE);
   if(oldest > 0) return oldest;
 
-  oldest = _get_oldest_cacheline(cache, DT_CACHETEST_PLAIN);
+  oldest = _get_cheapest_cacheline(cache);
+  if(oldest == 0) oldest = _get_oldest_cacheline(cache, DT_CACHETEST_PLAIN);
+  _evict_stats(cache, oldest);
   return (oldest == 0) ? cache->calls & 1 : oldest;
 }
 
@@ -271,13 +494,14 @@ static gboolean _get_by_hash(
         // this should not happen but we make sure
         cache->hash[k] = INVALID_CACHEHASH;
       }
-      else
+      else if(_unpack_cacheline(cache, k))
       {
         // we have a proper hit
         *data = cache->data[k];
         *dsc = &cache->dsc[k];
         // in case of a hit it's always good to further keep the cacheline as important
         cache->used[k] = -cache->entries;
+        cache->saved += cache->cost[k];
         return TRUE;
       }
     }
@@ -309,9 +533,17 @@ gboolean dt_dev_pixelpipe_cache_get(
           pipe, module, DT_DEVICE_NONE, NULL, NULL,
           "%s, hash=%" PRIx64 "\n",
           dt_iop_colorspace_to_name(cdsc->cst), hash);
+    dt_trace_instant("cache", "hit", "%s %s",
+                     dt_dev_pixelpipe_type_to_str(pipe->type), module ? module->op : "input");
     return FALSE;
   }
   // We need a fresh buffer as there was no hit.
+  if(cache->entries > DT_PIPECACHE_MIN && (hash != INVALID_CACHEHASH))
+  {
+    cache->misses++;
+    dt_trace_instant("cache", "miss", "%s %s",
+                     dt_dev_pixelpipe_type_to_str(pipe->type), module ? module->op : "input");
+  }
   //
   // Pipes with two cache lines have pre-allocated memory, but we must
   // grow storage if a later iop requires a larger buffer.
@@ -321,11 +553,14 @@ gboolean dt_dev_pixelpipe_cache_get(
   const int cline = _get_cacheline(pipe);
 
   if(((cache->entries == DT_PIPECACHE_MIN) && (cache->size[cline] < size))
-     || ((cache->entries > DT_PIPECACHE_MIN) && (cache->size[cline] != size)))
+     || ((cache->entries > DT_PIPECACHE_MIN) && (cache->size[cline] != size))
+     || cache->packed[cline])
   {
-    dt_free_align(cache->data[cline]);
-    cache->allmem -= cache->size[cline];
-    cache->data[cline] = (void *)dt_alloc_aligned(size);
+    _arena_fit(cache, size);
+    dt_arena_free(cache->arena, cache->data[cline]);
+    cache->allmem -= _line_bytes(cache, cline);
+    cache->packed[cline] = FALSE;
+    cache->data[cline] = dt_arena_alloc(cache->arena, size);
     if(cache->data[cline])
     {
       cache->size[cline] = size;
@@ -335,6 +570,12 @@ gboolean dt_dev_pixelpipe_cache_get(
     {
       cache->size[cline] = 0;
     }
+    if(dt_trace_enabled())
+    {
+      char counter[32];
+      snprintf(counter, sizeof(counter), "%s cache MB", dt_dev_pixelpipe_type_to_str(pipe->type));
+      dt_trace_counter(counter, _to_mb(cache->allmem));
+    }
   }
 
   *data = cache->data[cline];
@@ -357,16 +598,11 @@ gboolean dt_dev_pixelpipe_cache_get(
 
   cache->used[cline]      = !masking && important ? -cache->entries : 0;
   cache->ioporder[cline]  = module ? module->iop_order : 0;
+  cache->cost[cline]      = 0.0f;
 
   return TRUE;
 }
 
-static void _mark_invalid_cacheline(const dt_dev_pixelpipe_cache_t *cache, const int k)
-{
-  cache->hash[k] = INVALID_CACHEHASH;
-  cache->ioporder[k] = 0;
-}
-
 void dt_dev_pixelpipe_cache_invalidate_later(
         const struct dt_dev_pixelpipe_t *pipe,
         const int32_t order)
@@ -385,6 +621,19 @@ void dt_dev_pixelpipe_cache_flush(const struct dt_dev_pixelpipe_t *pipe)
   dt_dev_pixelpipe_cache_invalidate_later(pipe, 0);
 }
 
+void dt_dev_pixelpipe_cache_set_cost(
+       const struct dt_dev_pixelpipe_t *pipe,
+       const void *data,
+       const float seconds)
+{
+  const dt_dev_pixelpipe_cache_t *cache = &(pipe->cache);
+  for(int k = 0; k < cache->entries; k++)
+  {
+    if(cache->data[k] == data)
+      cache->cost[k] = seconds;
+  }
+}
+
 void dt_dev_pixelpipe_important_cacheline(
        const struct dt_dev_pixelpipe_t *pipe,
        const void *data,
@@ -412,10 +661,11 @@ void dt_dev_pixelpipe_invalidate_cacheline(const struct dt_dev_pixelpipe_t *pipe
 
 static size_t _free_cacheline(dt_dev_pixelpipe_cache_t *cache, const int k)
 {
-  const size_t removed = cache->size[k];
+  const size_t removed = _line_bytes(cache, k);
 
-  dt_free_align(cache->data[k]);
+  dt_arena_free(cache->arena, cache->data[k]);
   cache->allmem -= removed;
+  cache->packed[k] = FALSE;
   cache->size[k] = 0;
   cache->data[k] = NULL;
   _mark_invalid_cacheline(cache, k);
@@ -450,19 +700,30 @@ void dt_dev_pixelpipe_cache_checkmem(struct dt_dev_pixelpipe_t *pipe)
       freed += _free_cacheline(cache, k);
   }
 
+  // lines kept for reuse by the arena are part of our memory, give them
+  // back before evicting valid lines
+  if(cache->memlimit && (cache->memlimit < cache->allmem + dt_arena_retained(cache->arena)))
+    dt_arena_trim(cache->arena);
+
+  gboolean evicted = FALSE;
   while(cache->memlimit && (cache->memlimit < cache->allmem))
   {
-    const int k = _get_oldest_cacheline(cache, DT_CACHETEST_USED);
+    const int k = _get_cheapest_cacheline(cache);
     if(k == 0) break;
 
+    _evict_stats(cache, k);
     freed += _free_cacheline(cache, k);
+    evicted = TRUE;
   }
+  // we are short of memory, don't keep the evicted lines for reuse
+  if(evicted) dt_arena_trim(cache->arena);
 
   _cline_stats(cache);
   dt_print_pipe(DT_DEBUG_PIPE, "pipe cache check", pipe, NULL, DT_DEVICE_NONE, NULL, NULL,
-    "%i lines (important=%i, used=%i). Freed %iMB. Using using %iMB, limit=%iMB\n",
+    "%i lines (important=%i, used=%i). Freed %iMB. Using using %iMB, kept %iMB, limit=%iMB\n",
     cache->entries, cache->limportant, cache->lused,
-    _to_mb(freed), _to_mb(cache->allmem), _to_mb(cache->memlimit));
+    _to_mb(freed), _to_mb(cache->allmem), _to_mb(dt_arena_retained(cache->arena)),
+    _to_mb(cache->memlimit));
 }
 
 void dt_dev_pixelpipe_cache_report(struct dt_dev_pixelpipe_t *pipe)
@@ -471,13 +732,486 @@ void dt_dev_pixelpipe_cache_report(struct dt_dev_pixelpipe_t *pipe)
 
   _cline_stats(cache);
   dt_print_pipe(DT_DEBUG_PIPE, "cache report", pipe, NULL, DT_DEVICE_NONE, NULL, NULL,
-    "%i lines (important=%i, used=%i, invalid=%i). Using %iMB, limit=%iMB. Hits/run=%.2f. Hits/test=%.3f\n",
+    "%i lines (important=%i, used=%i, invalid=%i). Using %iMB, limit=%iMB. Hits/run=%.2f. Hits/test=%.3f."
+    " Hits=%" PRIu64 ", misses=%" PRIu64 ". Saved %.3fs, evicted %.3fs\n",
     cache->entries, cache->limportant, cache->lused, cache->linvalid,
     _to_mb(cache->allmem), _to_mb(cache->memlimit),
     (double)(cache->hits) / fmax(1.0, pipe->runs),
-    (double)(cache->hits) / fmax(1.0, cache->tests));
+    (double)(cache->hits) / fmax(1.0, cache->tests),
+    cache->hits, cache->misses, cache->saved, cache->evicted);
+
+  dt_dev_pixelpipe_shared_cache_t *shared = cache->shared;
+  if(shared)
+  {
+    dt_pthread_mutex_lock(&shared->lock);
+    dt_print_pipe(DT_DEBUG_PIPE, "shared cache report", pipe, NULL, DT_DEVICE_NONE, NULL, NULL,
+      "%u lines%s. Using %iMB, limit=%iMB. Hits=%" PRIu64 ", stored=%" PRIu64 "\n",
+      g_hash_table_size(shared->lines), shared->half ? " (half floats)" : "",
+      _to_mb(shared->allmem), _to_mb(shared->memlimit),
+      shared->hits, shared->puts);
+    dt_pthread_mutex_unlock(&shared->lock);
+  }
+}
+
+/*
+ * persistent second level cache
+ *
+ * export pipes may spill the output of selected modules (typically demosaic)
+ * into the user cache directory, so re-exporting an image with unchanged
+ * history at another size or format can start right after the spilled module.
+ * every file holds one cacheline, named by the pipe hash combined with the
+ * source file identity and the darktable version. the directory is kept below
+ * the configured size by dropping the least recently used files.
+ */
+
+#define DT_PIPECACHE_DISK_MAGIC "dtppc03"
+
+typedef struct dt_pipecache_disk_header_t
+{
+  char magic[8];
+  dt_hash_t key;
+  uint64_t size;    // size of the cacheline
+  uint64_t stored;  // bytes of data following, half of size for half floats
+  dt_iop_buffer_dsc_t dsc;
+} dt_pipecache_disk_header_t;
+
+static void _disk_dir(char *dir, const size_t size)
+{
+  char cachedir[PATH_MAX] = { 0 };
+  dt_loc_get_user_cache_dir(cachedir, sizeof(cachedir));
+  snprintf(dir, size, "%s/pixelpipe", cachedir);
+}
+
+typedef struct _disk_file_t
+{
+  gchar *path;
+  size_t size;
+  time_t mtime;
+} _disk_file_t;
+
+static gint _disk_file_older(gconstpointer a, gconstpointer b)
+{
+  const _disk_file_t *fa = (_disk_file_t *)a;
+  const _disk_file_t *fb = (_disk_file_t *)b;
+  return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+// if the directory is above the limit drop least recently used files until it
+// is below 90% of it. returns the size of the directory left.
+static size_t _disk_gc(const size_t limit)
+{
+  char dir[PATH_MAX] = { 0 };
+  _disk_dir(dir, sizeof(dir));
+  GDir *gdir = g_dir_open(dir, 0, NULL);
+  if(!gdir) return 0;
+
+  GArray *files = g_array_new(FALSE, FALSE, sizeof(_disk_file_t));
+  size_t total = 0;
+  const gchar *name;
+  while((name = g_dir_read_name(gdir)))
+  {
+    if(!g_str_has_suffix(name, ".ppc")) continue;
+    _disk_file_t f = { g_build_filename(dir, name, NULL), 0, 0 };
+    GStatBuf st;
+    if(g_stat(f.path, &st))
+    {
+      g_free(f.path);
+      continue;
+    }
+    f.size = st.st_size;
+    f.mtime = st.st_mtime;
+    total += f.size;
+    g_array_append_val(files, f);
+  }
+  g_dir_close(gdir);
+
+  if(total > limit)
+  {
+    g_array_sort(files, _disk_file_older);
+    for(guint k = 0; k < files->len && total > limit / 10 * 9; k++)
+    {
+      const _disk_file_t *f = &g_array_index(files, _disk_file_t, k);
+      if(!g_unlink(f->path)) total -= f->size;
+    }
+  }
+
+  for(guint k = 0; k < files->len; k++)
+    g_free(g_array_index(files, _disk_file_t, k).path);
+  g_array_free(files, TRUE);
+  return total;
+}
+
+void dt_dev_pixelpipe_cache_disk_init(struct dt_dev_pixelpipe_t *pipe)
+{
+  dt_dev_pixelpipe_cache_t *cache = &(pipe->cache);
+  const size_t limit = (size_t)MAX(0, dt_conf_get_int("plugins/lighttable/export/pipecache_size"));
+  if(!limit || !darktable.pipe_cache) return;
+
+  const char *modules = dt_conf_get_string_const("plugins/lighttable/export/pipecache_modules");
+  if(!modules || !modules[0]) return;
+
+  char dir[PATH_MAX] = { 0 };
+  _disk_dir(dir, sizeof(dir));
+  if(g_mkdir_with_parents(dir, 0750))
+  {
+    dt_print(DT_DEBUG_ALWAYS, "[pixelpipe_cache] can't create disk cache directory `%s'\n", dir);
+    return;
+  }
+
+  cache->diskmodules = g_strsplit(modules, ",", -1);
+  for(gchar **m = cache->diskmodules; *m; m++) g_strstrip(*m);
+  cache->disklimit = limit * 1024lu * 1024lu;
+  cache->diskhalf = dt_conf_get_bool("pixelpipe_cache_half");
+  cache->disksize = _disk_gc(cache->disklimit);
+}
+
+// the modules up to and including module are not processed on a hit in the
+// disk cache or the shared pool, so none of them may provide a raster mask to
+// later ones. module NULL is the pipe input.
+static gboolean _masks_up_to(const dt_dev_pixelpipe_t *pipe,
+                             const dt_iop_module_t *module)
+{
+  if(!module) return FALSE;
+  for(const GList *nodes = pipe->nodes; nodes; nodes = g_list_next(nodes))
+  {
+    const dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)nodes->data;
+    if(piece->enabled
+       && piece->blendop_data
+       && ((dt_develop_blend_params_t *)piece->blendop_data)->mask_mode != DEVELOP_MASK_DISABLED)
+      return TRUE;
+    if(piece->module == module) break;
+  }
+  return FALSE;
+}
+
+gboolean dt_dev_pixelpipe_cache_disk_wanted(const struct dt_dev_pixelpipe_t *pipe,
+                                            const struct dt_iop_module_t *module,
+                                            const dt_hash_t hash)
+{
+  const dt_dev_pixelpipe_cache_t *cache = &(pipe->cache);
+  if(!cache->disklimit
+     || !module
+     || hash == INVALID_CACHEHASH
+     || pipe->nocache
+     || pipe->want_detail_mask
+     || pipe->store_all_raster_masks
+     || pipe->mask_display != DT_DEV_PIXELPIPE_DISPLAY_NONE
+     || !g_strv_contains((const gchar *const *)cache->diskmodules, module->op))
+    return FALSE;
+
+  return !_masks_up_to(pipe, module);
+}
+
+// the pipe hash only covers the processing parameters, also tie the
+// cacheline to the exact source file, darktable build and storage mode
+static dt_hash_t _disk_key(const dt_dev_pixelpipe_t *pipe,
+                           const dt_hash_t hash,
+                           char *filename,
+                           const size_t size)
+{
+  char path[PATH_MAX] = { 0 };
+  gboolean from_cache = FALSE;
+  dt_image_full_path(pipe->image.id, path, sizeof(path), &from_cache);
+
+  GStatBuf st;
+  if(!path[0] || g_stat(path, &st)) return INVALID_CACHEHASH;
+
+  const int64_t stamp[2] = { (int64_t)st.st_size, (int64_t)st.st_mtime };
+  dt_hash_t key = dt_hash(hash, path, strlen(path));
+  key = dt_hash(key, stamp, sizeof(stamp));
+  key = dt_hash(key, darktable_package_string, strlen(darktable_package_string));
+  key = dt_hash(key, &pipe->cache.diskhalf, sizeof(pipe->cache.diskhalf));
+
+  char dir[PATH_MAX] = { 0 };
+  _disk_dir(dir, sizeof(dir));
+  snprintf(filename, size, "%s/%016" PRIx64 ".ppc", dir, key);
+  return key;
+}
+
+gboolean dt_dev_pixelpipe_cache_disk_get(struct dt_dev_pixelpipe_t *pipe,
+                                         const dt_hash_t hash,
+                                         const size_t size,
+                                         void **data,
+                                         dt_iop_buffer_dsc_t **dsc,
+                                         struct dt_iop_module_t *module)
+{
+  if(!dt_dev_pixelpipe_cache_disk_wanted(pipe, module, hash)) return FALSE;
+
+  char filename[PATH_MAX] = { 0 };
+  const dt_hash_t key = _disk_key(pipe, hash, filename, sizeof(filename));
+  if(key == INVALID_CACHEHASH) return FALSE;
+
+  FILE *f = g_fopen(filename, "rb");
+  if(!f) return FALSE;
+
+  dt_pipecache_disk_header_t header;
+  gboolean ok = fread(&header, sizeof(header), 1, f) == 1
+    && !memcmp(header.magic, DT_PIPECACHE_DISK_MAGIC, sizeof(header.magic))
+    && header.key == key
+    && header.size == size
+    && header.stored == (_store_half(pipe->cache.diskhalf, &header.dsc, size) ? size / 2 : size);
+
+  if(ok)
+  {
+    **dsc = header.dsc;
+    dt_dev_pixelpipe_cache_get(pipe, hash, size, data, dsc, module, FALSE);
+    if(header.stored == size)
+      ok = *data && fread(*data, 1, size, f) == size;
+    else
+    {
+      // written with pixelpipe_cache_half
+      dt_half_t *half = *data ? dt_alloc_aligned(header.stored) : NULL;
+      ok = half && fread(half, 1, header.stored, f) == header.stored;
+      if(ok) dt_half_to_float_buf(*data, half, size / sizeof(float));
+      dt_free_align(half);
+    }
+    if(!ok && *data)
+      dt_dev_pixelpipe_invalidate_cacheline(pipe, *data);
+  }
+  fclose(f);
+
+  if(ok)
+  {
+    // keep recently used files in the cache
+    g_utime(filename, NULL);
+    pipe->cache.diskhits++;
+  }
+  dt_print_pipe(DT_DEBUG_PIPE, ok ? "disk cache HIT" : "disk cache invalid",
+                pipe, module, DT_DEVICE_NONE, NULL, NULL, "hash=%" PRIx64 "\n", hash);
+  dt_trace_instant("cache", ok ? "disk hit" : "disk invalid", "%s %s",
+                   dt_dev_pixelpipe_type_to_str(pipe->type), module->op);
+  if(!ok) g_unlink(filename);
+  return ok;
+}
+
+void dt_dev_pixelpipe_cache_disk_put(struct dt_dev_pixelpipe_t *pipe,
+                                     const dt_hash_t hash,
+                                     const size_t size,
+                                     const void *data,
+                                     const dt_iop_buffer_dsc_t *dsc,
+                                     struct dt_iop_module_t *module)
+{
+  if(!data) return;
+  dt_dev_pixelpipe_cache_t *cache = &(pipe->cache);
+  const gboolean half = _store_half(cache->diskhalf, dsc, size);
+  const size_t stored = half ? size / 2 : size;
+  // a single cacheline must not flush the whole directory
+  if(stored > cache->disklimit / 4) return;
+
+  char filename[PATH_MAX] = { 0 };
+  const dt_hash_t key = _disk_key(pipe, hash, filename, sizeof(filename));
+  if(key == INVALID_CACHEHASH || g_file_test(filename, G_FILE_TEST_EXISTS)) return;
+
+  dt_half_t *buf = NULL;
+  if(half)
+  {
+    buf = dt_alloc_aligned(stored);
+    if(!buf) return;
+    dt_float_to_half_buf(buf, data, size / sizeof(float));
+  }
+
+  // write to a temporary file first, parallel exports may produce the same line
+  gchar *tmpname = g_strdup_printf("%s.XXXXXX", filename);
+  const int fd = g_mkstemp(tmpname);
+  FILE *f = fd == -1 ? NULL : fdopen(fd, "wb");
+  if(!f)
+  {
+    if(fd != -1) close(fd);
+    g_unlink(tmpname);
+    g_free(tmpname);
+    dt_free_align(buf);
+    return;
+  }
+
+  dt_pipecache_disk_header_t header = { { 0 }, key, size, stored, *dsc };
+  memcpy(header.magic, DT_PIPECACHE_DISK_MAGIC, sizeof(header.magic));
+  const gboolean ok = fwrite(&header, sizeof(header), 1, f) == 1
+    && fwrite(half ? (const void *)buf : data, 1, stored, f) == stored;
+  const gboolean closed = fclose(f) == 0;
+  dt_free_align(buf);
+
+  if(ok && closed && !g_rename(tmpname, filename))
+  {
+    cache->diskwrites++;
+    dt_print_pipe(DT_DEBUG_PIPE, "disk cache write",
+                  pipe, module, DT_DEVICE_NONE, NULL, NULL, "hash=%" PRIx64 "\n", hash);
+    // only scan the directory once our estimate of its size is above the
+    // limit, other pipes may have written to it since the last scan
+    cache->disksize += sizeof(header) + stored;
+    if(cache->disksize > cache->disklimit)
+      cache->disksize = _disk_gc(cache->disklimit);
+  }
+  else
+    g_unlink(tmpname);
+  g_free(tmpname);
+}
+
+static void _shared_line_free(gpointer data)
+{
+  dt_dev_pixelpipe_shared_line_t *line = (dt_dev_pixelpipe_shared_line_t *)data;
+  dt_free_align(line->data);
+  g_free(line);
+}
+
+struct dt_dev_pixelpipe_shared_cache_t *dt_dev_pixelpipe_shared_cache_new(const size_t memlimit)
+{
+  dt_dev_pixelpipe_shared_cache_t *shared = g_malloc0(sizeof(dt_dev_pixelpipe_shared_cache_t));
+  dt_pthread_mutex_init(&shared->lock, NULL);
+  shared->lines = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, _shared_line_free);
+  shared->imgid = NO_IMGID;
+  shared->memlimit = memlimit;
+  shared->half = dt_conf_get_bool("pixelpipe_cache_half");
+  return shared;
+}
+
+void dt_dev_pixelpipe_shared_cache_free(struct dt_dev_pixelpipe_shared_cache_t *shared)
+{
+  if(!shared) return;
+  g_hash_table_destroy(shared->lines);
+  dt_pthread_mutex_destroy(&shared->lock);
+  g_free(shared);
+}
+
+static gboolean _shared_usable(const dt_dev_pixelpipe_t *pipe,
+                               const dt_hash_t key,
+                               const dt_iop_module_t *module)
+{
+  // side products like the detail mask and raster masks are not part of the
+  // line and would be missing if another pipe served it
+  return pipe->cache.shared
+    && key != INVALID_CACHEHASH
+    && !pipe->nocache
+    && !pipe->bypass_blendif
+    && !pipe->want_detail_mask
+    && !pipe->store_all_raster_masks
+    && pipe->mask_display == DT_DEV_PIXELPIPE_DISPLAY_NONE
+    && !_masks_up_to(pipe, module);
+}
+
+// same weighting as _get_cheapest_cacheline(), needs the pool lock
+static gboolean _shared_evict(dt_dev_pixelpipe_shared_cache_t *shared)
+{
+  dt_dev_pixelpipe_shared_line_t *victim = NULL;
+  float weight = FLT_MAX;
+
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init(&iter, shared->lines);
+  while(g_hash_table_iter_next(&iter, &key, &value))
+  {
+    dt_dev_pixelpipe_shared_line_t *line = (dt_dev_pixelpipe_shared_line_t *)value;
+    const float w = (line->cost + 1e-3f)
+                    / (float)MAX(1, _to_mb(line->stored))
+                    / (float)(shared->stamp - line->used + 1);
+    if(w < weight)
+    {
+      weight = w;
+      victim = line;
+    }
+  }
+  if(!victim) return FALSE;
+
+  shared->allmem -= victim->stored;
+  g_hash_table_remove(shared->lines, &victim->hash);
+  return TRUE;
+}
+
+gboolean dt_dev_pixelpipe_cache_shared_get(struct dt_dev_pixelpipe_t *pipe,
+                                           const dt_hash_t hash,
+                                           const dt_hash_t key,
+                                           const size_t size,
+                                           void **data,
+                                           dt_iop_buffer_dsc_t **dsc,
+                                           struct dt_iop_module_t *module)
+{
+  if(!_shared_usable(pipe, key, module)) return FALSE;
+
+  dt_dev_pixelpipe_shared_cache_t *shared = pipe->cache.shared;
+  dt_pthread_mutex_lock(&shared->lock);
+  dt_dev_pixelpipe_shared_line_t *line = g_hash_table_lookup(shared->lines, &key);
+  gboolean hit = line && (line->size == size);
+  if(hit)
+  {
+    **dsc = line->dsc;
+    dt_dev_pixelpipe_cache_get(pipe, hash, size, data, dsc, module, FALSE);
+    hit = *data != NULL;
+    if(hit)
+    {
+      if(line->stored == size)
+        memcpy(*data, line->data, size);
+      else
+        dt_half_to_float_buf(*data, line->data, size / sizeof(float));
+      dt_dev_pixelpipe_cache_set_cost(pipe, *data, line->cost);
+      line->used = ++shared->stamp;
+      shared->hits++;
+    }
+  }
+  dt_pthread_mutex_unlock(&shared->lock);
+
+  if(hit)
+  {
+    dt_print_pipe(DT_DEBUG_PIPE, "shared cache HIT",
+                  pipe, module, DT_DEVICE_NONE, NULL, NULL, "key=%" PRIx64 "\n", key);
+    dt_trace_instant("cache", "shared hit", "%s %s",
+                     dt_dev_pixelpipe_type_to_str(pipe->type), module ? module->op : "input");
+  }
+  return hit;
+}
+
+void dt_dev_pixelpipe_cache_shared_put(struct dt_dev_pixelpipe_t *pipe,
+                                       const dt_hash_t key,
+                                       const size_t size,
+                                       const void *data,
+                                       const dt_iop_buffer_dsc_t *dsc,
+                                       const struct dt_iop_module_t *module,
+                                       const float cost)
+{
+  // lines computed faster than they are copied are not worth keeping
+  if(!data || (cost < 0.005f) || !_shared_usable(pipe, key, module)) return;
+
+  dt_dev_pixelpipe_shared_cache_t *shared = pipe->cache.shared;
+  const gboolean half = _store_half(shared->half, dsc, size);
+  const size_t stored = half ? size / 2 : size;
+  if(stored > shared->memlimit / 4) return;
+
+  dt_pthread_mutex_lock(&shared->lock);
+  // the pool only serves the image currently developed
+  if(shared->imgid != pipe->image.id)
+  {
+    g_hash_table_remove_all(shared->lines);
+    shared->allmem = 0;
+    shared->imgid = pipe->image.id;
+  }
+
+  if(!g_hash_table_contains(shared->lines, &key))
+  {
+    while((shared->allmem + stored > shared->memlimit) && _shared_evict(shared))
+      ;
+
+    void *copy = dt_alloc_aligned(stored);
+    if(copy)
+    {
+      dt_dev_pixelpipe_shared_line_t *line = g_malloc0(sizeof(dt_dev_pixelpipe_shared_line_t));
+      line->hash = key;
+      line->data = copy;
+      line->size = size;
+      line->stored = stored;
+      line->dsc = *dsc;
+      line->cost = cost;
+      line->used = ++shared->stamp;
+      if(half)
+        dt_float_to_half_buf(copy, data, size / sizeof(float));
+      else
+        memcpy(copy, data, size);
+      g_hash_table_insert(shared->lines, &line->hash, line);
+      shared->allmem += stored;
+      shared->puts++;
+    }
+  }
+  dt_pthread_mutex_unlock(&shared->lock);
 }
 
+#undef DT_PIPECACHE_DISK_MAGIC
 #undef INVALID_CACHEHASH
 // clang-format off
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
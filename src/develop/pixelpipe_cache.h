@@ -1,6 +1,6 @@
 /*
     This file is part of darktable,
-    Copyright (C) 2009-2022 darktable developers.
+    Copyright (C) 2009-2024 darktable developers.
 
     darktable is free software: you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
@@ -23,6 +23,8 @@
 struct dt_dev_pixelpipe_t;
 struct dt_iop_buffer_dsc_t;
 struct dt_iop_roi_t;
+struct dt_iop_module_t;
+struct dt_dev_pixelpipe_shared_cache_t;
 
 /**
  * implements a simple pixel cache suitable for caching float images
@@ -41,14 +43,31 @@ typedef struct dt_dev_pixelpipe_cache_t
   dt_hash_t *hash;
   int32_t *used;
   int32_t *ioporder;
+  float *cost;          // seconds it took to compute the cacheline
+  gboolean *packed;     // the line is stored as half floats, size stays the float size
+  gboolean half;        // pack float lines as half floats between runs
   uint64_t calls;
   int32_t lastline;
   // profiling & stats:
   uint64_t tests;
   uint64_t hits;
+  uint64_t misses;
+  double saved;         // seconds of processing saved by cache hits
+  double evicted;       // seconds of processing thrown away by evicting valid lines
   uint32_t lused;
   uint32_t linvalid;
   uint32_t limportant;
+  // persistent second level cache on disk, export pipes only:
+  size_t disklimit;     // size of the cache directory in bytes, 0 if disabled
+  size_t disksize;      // size of the directory when last scanned plus our writes since
+  gchar **diskmodules;  // operations whose output is written to disk
+  gboolean diskhalf;    // write float lines as half floats
+  uint32_t diskhits;
+  uint32_t diskwrites;
+  // pool shared by the darkroom pipes, NULL if not used by this pipe
+  struct dt_dev_pixelpipe_shared_cache_t *shared;
+  // freed cache lines kept for reuse, NULL if disabled
+  struct dt_arena_t *arena;
 } dt_dev_pixelpipe_cache_t;
 
 typedef enum dt_dev_pixelpipe_cache_test_t
@@ -68,6 +87,10 @@ void dt_dev_pixelpipe_cache_cleanup(struct dt_dev_pixelpipe_t *pipe);
 /** creates a hopefully unique hash from the complete module stack up to the module-th, including current viewport. */
 dt_hash_t dt_dev_pixelpipe_cache_hash(const dt_imgid_t imgid, const struct dt_iop_roi_t *roi,
                                      struct dt_dev_pixelpipe_t *pipe, const int position);
+/** same, but only depends on the pipe type after the first module up to position that is not
+  flagged IOP_FLAGS_PIPE_SHAREABLE. key of the shared pool, invalid if the pipe does not use it. */
+dt_hash_t dt_dev_pixelpipe_cache_shared_hash(const dt_imgid_t imgid, const struct dt_iop_roi_t *roi,
+                                            struct dt_dev_pixelpipe_t *pipe, const int position);
 
 /** returns a float data buffer in 'data' for the given hash from the cache, dsc is updated too.
   If the hash does not match any cache line, use an old buffer or allocate a fresh one.
@@ -86,12 +109,55 @@ void dt_dev_pixelpipe_cache_flush(const struct dt_dev_pixelpipe_t *pipe);
 /** invalidates all cachelines for modules with at least the same iop_order */
 void dt_dev_pixelpipe_cache_invalidate_later(const struct dt_dev_pixelpipe_t *pipe, const int32_t order);
 
+/** records the time it took to compute the cacheline holding data, used to choose eviction victims. */
+void dt_dev_pixelpipe_cache_set_cost(const struct dt_dev_pixelpipe_t *pipe, const void *data, const float seconds);
+
 /** makes this buffer very important after it has been pulled from the cache. */
 void dt_dev_pixelpipe_important_cacheline(const struct dt_dev_pixelpipe_t *pipe, const void *data, const size_t size);
 
 /** mark the given cache line as invalid or to be ignored */
 void dt_dev_pixelpipe_invalidate_cacheline(const struct dt_dev_pixelpipe_t *pipe, const void *data);
 
+/** enables the disk cache for this pipe if configured, see plugins/lighttable/export/pipecache_size */
+void dt_dev_pixelpipe_cache_disk_init(struct dt_dev_pixelpipe_t *pipe);
+
+/** looks up the output of module in the disk cache. On success the data is read into a fresh
+  cacheline returned in 'data' and 'dsc' like dt_dev_pixelpipe_cache_get() does and TRUE is returned.
+*/
+gboolean dt_dev_pixelpipe_cache_disk_get(struct dt_dev_pixelpipe_t *pipe, const dt_hash_t hash,
+                                         const size_t size, void **data, struct dt_iop_buffer_dsc_t **dsc,
+                                         struct dt_iop_module_t *module);
+
+/** TRUE if the output of module is a configured spill point and may be taken from or written to disk. */
+gboolean dt_dev_pixelpipe_cache_disk_wanted(const struct dt_dev_pixelpipe_t *pipe,
+                                            const struct dt_iop_module_t *module, const dt_hash_t hash);
+
+/** writes the output of module to the disk cache, check dt_dev_pixelpipe_cache_disk_wanted() first. */
+void dt_dev_pixelpipe_cache_disk_put(struct dt_dev_pixelpipe_t *pipe, const dt_hash_t hash,
+                                     const size_t size, const void *data,
+                                     const struct dt_iop_buffer_dsc_t *dsc, struct dt_iop_module_t *module);
+
+/** creates the pool of cachelines shared by all darkroom pipes, limited to memlimit bytes in total. */
+struct dt_dev_pixelpipe_shared_cache_t *dt_dev_pixelpipe_shared_cache_new(const size_t memlimit);
+void dt_dev_pixelpipe_shared_cache_free(struct dt_dev_pixelpipe_shared_cache_t *shared);
+
+/** looks up key in the shared pool. On success the data is copied into a fresh cacheline for hash
+  returned in 'data' and 'dsc' like dt_dev_pixelpipe_cache_get() does and TRUE is returned.
+*/
+gboolean dt_dev_pixelpipe_cache_shared_get(struct dt_dev_pixelpipe_t *pipe, const dt_hash_t hash,
+                                           const dt_hash_t key, const size_t size, void **data,
+                                           struct dt_iop_buffer_dsc_t **dsc, struct dt_iop_module_t *module);
+
+/** offers the freshly computed output of module that took 'cost' seconds to the shared pool. */
+void dt_dev_pixelpipe_cache_shared_put(struct dt_dev_pixelpipe_t *pipe, const dt_hash_t key,
+                                       const size_t size, const void *data,
+                                       const struct dt_iop_buffer_dsc_t *dsc,
+                                       const struct dt_iop_module_t *module, const float cost);
+
+/** with pixelpipe_cache_half, stores the valid float lines that are not important as half
+  floats until they are hit again. called after the pipe has finished processing. */
+void dt_dev_pixelpipe_cache_pack(struct dt_dev_pixelpipe_t *pipe);
+
 /** print out cache lines/hashes and do a cache cleanup */
 void dt_dev_pixelpipe_cache_report(struct dt_dev_pixelpipe_t *pipe);
 void dt_dev_pixelpipe_cache_checkmem(struct dt_dev_pixelpipe_t *pipe);
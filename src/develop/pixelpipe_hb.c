@@ -16,19 +16,24 @@
     along with darktable.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "common/arena.h"
 #include "common/color_picker.h"
 #include "common/colorspaces.h"
 #include "common/histogram.h"
 #include "common/opencl.h"
 #include "common/iop_order.h"
+#include "common/numa.h"
+#include "common/trace.h"
 #include "common/imagebuf.h"
 #include "control/control.h"
+#include "control/conf.h"
 #include "control/signal.h"
 #include "develop/blend.h"
 #include "develop/format.h"
 #include "develop/imageop_math.h"
 #include "develop/develop.h"
 #include "develop/tiling.h"
+#include "develop/tiling_model.h"
 #include "develop/masks.h"
 #include "gui/gtk.h"
 #include "imageio/imageio_common.h"
@@ -155,6 +160,7 @@ gboolean dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe,
   pipe->type = DT_DEV_PIXELPIPE_EXPORT;
   pipe->levels = levels;
   pipe->store_all_raster_masks = store_masks;
+  dt_dev_pixelpipe_cache_disk_init(pipe);
   return res;
 }
 
@@ -184,6 +190,7 @@ gboolean dt_dev_pixelpipe_init_preview(dt_dev_pixelpipe_t *pipe)
   const gboolean res =
     dt_dev_pixelpipe_init_cached(pipe, 0, darktable.pipe_cache ? 12 : DT_PIPECACHE_MIN, 0);
   pipe->type = DT_DEV_PIXELPIPE_PREVIEW;
+  pipe->cache.shared = darktable.shared_pipe_cache;
   pipe->average_delay = DT_DEV_PREVIEW_AVERAGE_DELAY_START;
   return res;
 }
@@ -193,6 +200,7 @@ gboolean dt_dev_pixelpipe_init_preview2(dt_dev_pixelpipe_t *pipe)
   const gboolean res =
     dt_dev_pixelpipe_init_cached(pipe, 0, darktable.pipe_cache ? 5 : DT_PIPECACHE_MIN, 0);
   pipe->type = DT_DEV_PIXELPIPE_PREVIEW2;
+  pipe->cache.shared = darktable.shared_pipe_cache;
   pipe->average_delay = DT_DEV_PREVIEW_AVERAGE_DELAY_START;
   return res;
 }
@@ -203,6 +211,7 @@ gboolean dt_dev_pixelpipe_init(dt_dev_pixelpipe_t *pipe)
   const gboolean res =
     dt_dev_pixelpipe_init_cached(pipe, 0, darktable.pipe_cache ? 64 : DT_PIPECACHE_MIN, csize);
   pipe->type = DT_DEV_PIXELPIPE_FULL;
+  pipe->cache.shared = darktable.shared_pipe_cache;
   return res;
 }
 
@@ -425,6 +434,8 @@ void dt_dev_pixelpipe_create_nodes(dt_dev_pixelpipe_t *pipe,
     piece->hash = 0;
     piece->process_cl_ready = FALSE;
     piece->process_tiling_ready = FALSE;
+    piece->process_strips_ready = FALSE;
+    piece->process_planar_ready = FALSE;
     piece->raster_masks = g_hash_table_new_full(g_direct_hash,
                                                 g_direct_equal, NULL, dt_free_align_ptr);
     memset(&piece->processed_roi_in, 0, sizeof(piece->processed_roi_in));
@@ -1065,6 +1076,100 @@ static void _collect_histogram_on_CPU(dt_dev_pixelpipe_t *pipe,
   }
 }
 
+#ifdef HAVE_OPENCL
+static inline gboolean _opencl_pipe_isok(dt_dev_pixelpipe_t *pipe)
+{
+  return darktable.opencl->inited
+         && !darktable.opencl->stopped
+         && pipe->opencl_enabled
+         && (pipe->devid >= 0);
+}
+#endif
+
+// intermediate results are never reused by export pipes, all others
+// keep them in the cache for the next run. only export pipes on the CPU
+// without debugging aids may keep them in a layout of their own choice.
+static gboolean _cpu_export_pipe(dt_dev_pixelpipe_t *pipe)
+{
+  if(!(pipe->type & DT_DEV_PIXELPIPE_EXPORT)
+     || pipe->mask_display != DT_DEV_PIXELPIPE_DISPLAY_NONE
+     || darktable.dump_pfm_pipe
+     || darktable.bench_module
+     || (darktable.unmuted & DT_DEBUG_NAN))
+    return FALSE;
+
+#ifdef HAVE_OPENCL
+  if(_opencl_pipe_isok(pipe))
+    return FALSE;
+#endif
+
+  return TRUE;
+}
+
+static gboolean _piece_allows_planar(dt_dev_pixelpipe_t *pipe,
+                                     dt_develop_t *dev,
+                                     dt_dev_pixelpipe_iop_t *piece,
+                                     const dt_iop_buffer_dsc_t *input_format,
+                                     const dt_iop_buffer_dsc_t *output_format,
+                                     const gboolean fitting)
+{
+  dt_iop_module_t *module = piece->module;
+  if(!module->process_planar
+     || !piece->process_planar_ready
+     || !fitting
+     || input_format->channels != 4 || input_format->datatype != TYPE_FLOAT
+     || output_format->channels != 4 || output_format->datatype != TYPE_FLOAT
+     || (piece->request_histogram & DT_REQUEST_ON)
+     || _request_color_pick(pipe, dev, module))
+    return FALSE;
+
+  // blending works on interleaved pixels
+  if(piece->blendop_data
+     && ((dt_develop_blend_params_t *)piece->blendop_data)->mask_mode
+     != DEVELOP_MASK_DISABLED)
+    return FALSE;
+
+  return _cpu_export_pipe(pipe) && dt_conf_get_bool("pixelpipe_process_planar");
+}
+
+// convert a 4 channel float buffer in place between interleaved pixels and
+// one plane per channel. this only happens where a planar module follows a
+// non-planar one or the other way round. the buffer is converted into
+// scratch and copied back, without a scratch buffer of the image size a
+// buffer of the pipe's arena is used, which keeps it for the next conversion.
+static gboolean _pixelpipe_convert_layout(dt_dev_pixelpipe_t *pipe,
+                                          dt_iop_module_t *module,
+                                          float *buf,
+                                          float *scratch,
+                                          const dt_iop_roi_t *roi,
+                                          dt_iop_buffer_dsc_t *dsc,
+                                          const gboolean planar)
+{
+  const size_t width = roi->width;
+  const size_t height = roi->height;
+  float *tmp = scratch ? scratch : dt_arena_alloc(pipe->cache.arena, sizeof(float) * 4 * width * height);
+  if(!tmp)
+  {
+    dt_print_pipe(DT_DEBUG_ALWAYS,
+                  "convert layout", pipe, module, DT_DEVICE_CPU, roi, NULL,
+                  "can't allocate buffer\n");
+    return FALSE;
+  }
+
+  dt_print_pipe(DT_DEBUG_PIPE,
+                planar ? "to planar" : "from planar", pipe, module, DT_DEVICE_CPU,
+                roi, NULL, "%s\n", scratch ? " via output" : "");
+  if(planar)
+    dt_iop_image_to_planar(tmp, buf, width, height);
+  else
+    dt_iop_image_from_planar(tmp, buf, width, height);
+  dt_iop_image_copy_by_size(buf, tmp, width, height, 4);
+  if(!scratch)
+    dt_arena_free(pipe->cache.arena, tmp);
+  dsc->planar = planar;
+  return TRUE;
+}
+
 static gboolean _pixelpipe_process_on_CPU(
                  dt_dev_pixelpipe_t *pipe,
                  dt_develop_t *dev,
@@ -1100,6 +1205,33 @@ static gboolean _pixelpipe_process_on_CPU(
   const int cst_to = module->input_colorspace(module, pipe, piece);
   const int cst_out = module->output_colorspace(module, pipe, piece);
 
+  const size_t in_bpp = dt_iop_buffer_dsc_to_bpp(input_format);
+  const size_t bpp = dt_iop_buffer_dsc_to_bpp(*out_format);
+
+  // layout conversions of the input go through the output line, not yet
+  // written. if that is smaller they need another image sized buffer,
+  // which has to fit as well.
+  const size_t convert_size = sizeof(float) * 4 * roi_in->width * roi_in->height;
+  float *convert_scratch =
+    (size_t)roi_out->width * roi_out->height * bpp >= convert_size ? *output : NULL;
+  const gboolean may_convert = input_format->planar || module->process_planar;
+
+  const gboolean fitting = dt_tiling_piece_fits_host_memory
+    (MAX(roi_in->width, roi_out->width),
+     MAX(roi_in->height, roi_out->height),
+     MAX(in_bpp, bpp),
+     tiling->factor,
+     tiling->overhead + (may_convert && !convert_scratch ? convert_size : 0));
+
+  // the input stays planar between planar modules, everything else
+  // including the colorspace transforms works on interleaved pixels
+  gboolean planar = _piece_allows_planar(pipe, dev, piece, input_format, *out_format, fitting);
+
+  if(input_format->planar
+     && (!planar || cst_from != cst_to)
+     && !_pixelpipe_convert_layout(pipe, module, input, convert_scratch, roi_in, input_format, FALSE))
+    return TRUE;
+
   if(cst_from != cst_to)
     dt_print_pipe(DT_DEBUG_PIPE,
            "transform colorspace",
@@ -1120,14 +1252,10 @@ static gboolean _pixelpipe_process_on_CPU(
   if(dt_atomic_get_int(&pipe->shutdown))
     return TRUE;
 
-  const size_t in_bpp = dt_iop_buffer_dsc_to_bpp(input_format);
-  const size_t bpp = dt_iop_buffer_dsc_to_bpp(*out_format);
-
-  const gboolean fitting = dt_tiling_piece_fits_host_memory
-    (MAX(roi_in->width, roi_out->width),
-     MAX(roi_in->height, roi_out->height),
-     MAX(in_bpp, bpp),
-     tiling->factor, tiling->overhead);
+  // never touch the layout of the pipe input, that is the image itself
+  if(planar && !input_format->planar)
+    planar = input != pipe->input
+      && _pixelpipe_convert_layout(pipe, module, input, convert_scratch, roi_in, input_format, TRUE);
 
   /* process module on cpu. use tiling if needed and possible. */
 
@@ -1152,7 +1280,7 @@ static gboolean _pixelpipe_process_on_CPU(
   else
   {
     dt_print_pipe(DT_DEBUG_PIPE,
-       "process",
+       planar ? "process planar" : "process",
        piece->pipe, module, DT_DEVICE_CPU, roi_in, roi_out, "%3i %s%s%s%s\n",
        piece->module->iop_order,
        dt_iop_colorspace_to_name(cst_to),
@@ -1190,7 +1318,13 @@ static gboolean _pixelpipe_process_on_CPU(
         darktable.unmuted = old_muted;
       }
     }
-    module->process(module, piece, input, *output, roi_in, roi_out);
+    dt_tiling_model_sample_t sample;
+    dt_tiling_model_begin(piece, &sample);
+    if(planar)
+      module->process_planar(module, piece, input, *output, roi_in, roi_out);
+    else
+      module->process(module, piece, input, *output, roi_in, roi_out);
+    dt_tiling_model_end(module, piece, roi_in, roi_out, in_bpp, bpp, tiling, &sample);
 
     *pixelpipe_flow |= (PIXELPIPE_FLOW_PROCESSED_ON_CPU);
     *pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU
@@ -1206,8 +1340,9 @@ static gboolean _pixelpipe_process_on_CPU(
                         dt_dev_pixelpipe_type_to_str(piece->pipe->type));
   }
 
-  // and save the output colorspace
+  // and save the output colorspace and layout
   pipe->dsc.cst = module->output_colorspace(module, pipe, piece);
+  pipe->dsc.planar = planar;
 
   if(dt_atomic_get_int(&pipe->shutdown))
     return TRUE;
@@ -1262,16 +1397,6 @@ static gboolean _pixelpipe_process_on_CPU(
     return FALSE;
 }
 
-#ifdef HAVE_OPENCL
-static inline gboolean _opencl_pipe_isok(dt_dev_pixelpipe_t *pipe)
-{
-  return darktable.opencl->inited
-         && !darktable.opencl->stopped
-         && pipe->opencl_enabled
-         && (pipe->devid >= 0);
-}
-#endif
-
 static inline gboolean _skip_piece_on_tags(const dt_dev_pixelpipe_iop_t *piece)
 {
   if(!piece->enabled || piece->module->iop_order == INT_MAX)
@@ -1281,6 +1406,288 @@ static inline gboolean _skip_piece_on_tags(const dt_dev_pixelpipe_iop_t *piece)
           && (piece->pipe->type & DT_DEV_PIXELPIPE_BASIC);
 }
 
+// longest run of point-wise modules processed together in strips
+#define DT_PIPE_STRIPS_MAX 16
+// bytes of a strip buffer handled by one thread, so that the input, output
+// and intermediate rows of a thread stay in its L2 cache
+#define DT_PIPE_STRIP_BYTES (256 * 1024)
+
+static gboolean _dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe,
+                                           dt_develop_t *dev,
+                                           void **output,
+                                           void **cl_mem_output,
+                                           dt_iop_buffer_dsc_t **out_format,
+                                           const dt_iop_roi_t *roi_out,
+                                           GList *modules,
+                                           GList *pieces,
+                                           const int pos);
+
+static gboolean _pipe_allows_strips(dt_dev_pixelpipe_t *pipe)
+{
+  return _cpu_export_pipe(pipe) && dt_conf_get_bool("pixelpipe_process_strips");
+}
+
+static gboolean _piece_allows_strips(dt_dev_pixelpipe_t *pipe,
+                                     dt_develop_t *dev,
+                                     dt_dev_pixelpipe_iop_t *piece,
+                                     const dt_iop_roi_t *roi)
+{
+  dt_iop_module_t *module = piece->module;
+  if(!piece->process_strips_ready
+     || !(module->flags() & IOP_FLAGS_POINTWISE)
+     || (piece->request_histogram & DT_REQUEST_ON)
+     || _request_color_pick(pipe, dev, module))
+    return FALSE;
+
+  // blending needs the whole input and might write a raster mask
+  if(piece->blendop_data
+     && ((dt_develop_blend_params_t *)piece->blendop_data)->mask_mode
+     != DEVELOP_MASK_DISABLED)
+    return FALSE;
+
+  dt_iop_roi_t roi_in = *roi;
+  module->modify_roi_in(module, piece, roi, &roi_in);
+  return !memcmp(&roi_in, roi, sizeof(dt_iop_roi_t));
+}
+
+// collect the run of point-wise modules ending with the given one, in
+// pipe order. returns the number of modules, only runs of at least two
+// are worth processing in strips.
+static int _pointwise_run(dt_dev_pixelpipe_t *pipe,
+                          dt_develop_t *dev,
+                          const dt_iop_roi_t *roi,
+                          GList **modules,
+                          GList **pieces,
+                          int *pos,
+                          dt_dev_pixelpipe_iop_t **run)
+{
+  dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)(*pieces)->data;
+  if(!_piece_allows_strips(pipe, dev, piece, roi))
+    return 0;
+
+  dt_dev_pixelpipe_iop_t *reversed[DT_PIPE_STRIPS_MAX] = { piece };
+  int n = 1;
+
+  GList *m = g_list_previous(*modules);
+  GList *p = g_list_previous(*pieces);
+  int k = *pos - 1;
+  while(m && n < DT_PIPE_STRIPS_MAX)
+  {
+    dt_dev_pixelpipe_iop_t *prev = (dt_dev_pixelpipe_iop_t *)p->data;
+    if(!_skip_piece_on_tags(prev))
+    {
+      dt_iop_module_t *next = reversed[n - 1]->module;
+      const dt_hash_t hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, roi, pipe, k);
+      dt_iop_buffer_dsc_t dsc = { 0 };
+      prev->module->output_format(prev->module, pipe, prev, &dsc);
+      const size_t bufsize = dt_iop_buffer_dsc_to_bpp(&dsc) * roi->width * roi->height;
+      // the output of this module is an input of the next one, it must be
+      // usable without conversion and is better taken from the caches
+      if(!_piece_allows_strips(pipe, dev, prev, roi)
+         || prev->module->output_colorspace(prev->module, pipe, prev)
+            != next->input_colorspace(next, pipe, reversed[n - 1])
+         || dt_dev_pixelpipe_cache_available(pipe, hash, bufsize)
+         || dt_dev_pixelpipe_cache_disk_wanted(pipe, prev->module, hash))
+        break;
+
+      reversed[n++] = prev;
+      *modules = m;
+      *pieces = p;
+      *pos = k;
+    }
+    m = g_list_previous(m);
+    p = g_list_previous(p);
+    k--;
+  }
+
+  for(int i = 0; i < n; i++)
+    run[i] = reversed[n - 1 - i];
+  return n;
+}
+
+// process a run of point-wise modules in horizontal strips, passing each
+// strip through all of them while it is in the cache. only the output of
+// the last module is written to a cache line. modules, pieces and pos
+// refer to the first module of the run. sets *fallback if the run has
+// to be processed module by module instead.
+static gboolean _pixelpipe_process_strips(dt_dev_pixelpipe_t *pipe,
+                                          dt_develop_t *dev,
+                                          void **output,
+                                          dt_iop_buffer_dsc_t **out_format,
+                                          const dt_iop_roi_t *roi,
+                                          dt_dev_pixelpipe_iop_t **run,
+                                          const int n,
+                                          GList *modules,
+                                          GList *pieces,
+                                          const int pos,
+                                          const dt_hash_t hash,
+                                          const dt_hash_t shared_key,
+                                          const size_t bufsize,
+                                          gboolean *fallback)
+{
+  for(int k = 0; k < n; k++)
+  {
+    run[k]->processed_roi_in = *roi;
+    run[k]->processed_roi_out = *roi;
+  }
+
+  void *input = NULL;
+  void *cl_mem_input = NULL;
+  dt_iop_buffer_dsc_t _input_format = { 0 };
+  dt_iop_buffer_dsc_t *input_format = &_input_format;
+  if(_dev_pixelpipe_process_rec(pipe, dev, &input, &cl_mem_input, &input_format, roi,
+                                g_list_previous(modules), g_list_previous(pieces), pos - 1))
+    return TRUE;
+
+  dt_iop_module_t *first = run[0]->module;
+  dt_iop_module_t *last = run[n - 1]->module;
+
+  if(input_format->planar
+     && !_pixelpipe_convert_layout(pipe, first, input, NULL, roi, input_format, FALSE))
+    return TRUE;
+
+  const int width = roi->width;
+  const int height = roi->height;
+
+  // the modules only see their final formats one after the other while
+  // processing the first strip, only the sizes are needed now
+  const size_t in_bpp = dt_iop_buffer_dsc_to_bpp(input_format);
+  size_t max_bpp = in_bpp;
+  dt_iop_buffer_dsc_t dsc = *input_format;
+  for(int k = 0; k < n; k++)
+  {
+    run[k]->module->output_format(run[k]->module, pipe, run[k], &dsc);
+    max_bpp = MAX(max_bpp, dt_iop_buffer_dsc_to_bpp(&dsc));
+  }
+  const size_t out_bpp = dt_iop_buffer_dsc_to_bpp(&dsc);
+
+  // strip height is a multiple of the number of threads, each thread
+  // gets the same share of rows in every module. modules skip a roi of
+  // a single row, so no strip may be shorter than two rows: a remainder
+  // of one row is processed with the strip before it.
+  const size_t nthreads = dt_get_num_threads();
+  const size_t row_bytes = (size_t)width * max_bpp;
+  const int rows =
+    MIN(height, MAX(2, (int)dt_round_size(MAX(1, nthreads * DT_PIPE_STRIP_BYTES / row_bytes),
+                                          nthreads)));
+  void *tmp[2] = { NULL, NULL };
+  tmp[0] = dt_alloc_aligned((rows + 1) * row_bytes);
+  if(n > 2) tmp[1] = dt_alloc_aligned((rows + 1) * row_bytes);
+  if(!tmp[0] || (n > 2 && !tmp[1]))
+  {
+    dt_print_pipe(DT_DEBUG_PIPE,
+                  "process strips", pipe, last, DT_DEVICE_CPU, roi, roi,
+                  "can't allocate strip buffers, process modules one by one\n");
+    dt_free_align(tmp[0]);
+    dt_free_align(tmp[1]);
+    // don't try again for parts of this run until the next commit
+    for(int k = 0; k < n; k++)
+      run[k]->process_strips_ready = FALSE;
+    *fallback = TRUE;
+    return FALSE;
+  }
+
+  run[0]->dsc_out = run[0]->dsc_in = *input_format;
+  **out_format = pipe->dsc = dsc;
+
+  if(dt_atomic_get_int(&pipe->shutdown))
+  {
+    dt_free_align(tmp[0]);
+    dt_free_align(tmp[1]);
+    return TRUE;
+  }
+
+  dt_dev_pixelpipe_cache_get(pipe, hash, bufsize, output, out_format, last, FALSE);
+
+  dt_times_t start;
+  dt_get_perf_times(&start);
+  const double wstart = dt_get_wtime();
+
+  // transform to the input colorspace of the run, the modules of the
+  // run agree on the colorspaces in between
+  const dt_iop_order_iccprofile_info_t *const work_profile =
+    (input_format->cst != IOP_CS_RAW)
+      ? dt_ioppr_get_pipe_work_profile_info(pipe)
+      : NULL;
+  dt_ioppr_transform_image_colorspace
+    (first, input, input, width, height, input_format->cst,
+     first->input_colorspace(first, pipe, run[0]), &input_format->cst, work_profile);
+
+  dt_print_pipe(DT_DEBUG_PIPE,
+                "process strips", pipe, last, DT_DEVICE_CPU, roi, roi,
+                "%i modules from `%s%s', %i rows\n",
+                n, first->op, dt_iop_get_instance_id(first), rows);
+
+  // pipe->dsc as seen by process() of each module, modules like exposure
+  // update processed_maximum in there for every call
+  dt_iop_buffer_dsc_t dsc_process[DT_PIPE_STRIPS_MAX];
+
+  for(int y = 0; y < height;)
+  {
+    if(dt_atomic_get_int(&pipe->shutdown))
+    {
+      dt_free_align(tmp[0]);
+      dt_free_align(tmp[1]);
+      return TRUE;
+    }
+
+    dt_iop_roi_t strip = *roi;
+    strip.y += y;
+    strip.height = (height - y == rows + 1) ? rows + 1 : MIN(rows, height - y);
+
+    void *in = (char *)input + (size_t)y * width * in_bpp;
+    for(int k = 0; k < n; k++)
+    {
+      dt_dev_pixelpipe_iop_t *piece = run[k];
+      dt_iop_module_t *module = piece->module;
+      if(y == 0)
+      {
+        if(k > 0) piece->dsc_out = piece->dsc_in = run[k - 1]->dsc_out;
+        module->output_format(module, pipe, piece, &piece->dsc_out);
+        dsc_process[k] = piece->dsc_out;
+      }
+      pipe->dsc = dsc_process[k];
+
+      void *out = (k == n - 1)
+        ? (char *)*output + (size_t)y * width * out_bpp
+        : tmp[k & 1];
+      module->process(module, piece, in, out, &strip, &strip);
+
+      if(y == 0)
+      {
+        pipe->dsc.cst = module->output_colorspace(module, pipe, piece);
+        piece->dsc_out = pipe->dsc;
+      }
+      in = out;
+    }
+    y += strip.height;
+  }
+
+  dt_free_align(tmp[0]);
+  dt_free_align(tmp[1]);
+
+  **out_format = pipe->dsc = run[n - 1]->dsc_out;
+
+  dt_show_times_f
+    (&start,
+     "[dev_pixelpipe]", "[%s] processed %i modules `%s%s' to `%s%s' in strips on CPU",
+     dt_dev_pixelpipe_type_to_str(pipe->type), n,
+     first->op, dt_iop_get_instance_id(first), last->op, dt_iop_get_instance_id(last));
+
+  const float cost = dt_get_wtime() - wstart;
+  dt_trace_complete("pipe", last->op, wstart, wstart + cost,
+                    "%s imgid=%d %dx%d on CPU in strips of %d modules",
+                    dt_dev_pixelpipe_type_to_str(pipe->type), pipe->image.id,
+                    width, height, n);
+  dt_dev_pixelpipe_cache_set_cost(pipe, *output, cost);
+  dt_dev_pixelpipe_cache_shared_put(pipe, shared_key, bufsize, *output, *out_format,
+                                    last, cost);
+  if(dt_dev_pixelpipe_cache_disk_wanted(pipe, last, hash))
+    dt_dev_pixelpipe_cache_disk_put(pipe, hash, bufsize, *output, *out_format, last);
+
+  return dt_atomic_get_int(&pipe->shutdown) ? TRUE : FALSE;
+}
+
 // recursive helper for process, returns TRUE in case of unfinished work or error
 static gboolean _dev_pixelpipe_process_rec(
                  dt_dev_pixelpipe_t *pipe,
@@ -1336,6 +1743,7 @@ static gboolean _dev_pixelpipe_process_rec(
     return TRUE;
 
   dt_hash_t hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, roi_out, pipe, pos);
+  const dt_hash_t shared_key = dt_dev_pixelpipe_cache_shared_hash(pipe->image.id, roi_out, pipe, pos);
 
   // we do not want data from the preview pixelpipe cache
   // for gamma so we can compute the final scope
@@ -1368,6 +1776,16 @@ static gboolean _dev_pixelpipe_process_rec(
     return FALSE;
   }
 
+  // another darkroom pipe might have computed this line already
+  if(!gamma_preview
+     && dt_dev_pixelpipe_cache_shared_get(pipe, hash, shared_key, bufsize,
+                                          output, out_format, module))
+    return dt_atomic_get_int(&pipe->shutdown) ? TRUE : FALSE;
+
+  // export pipes might have the output of this module in the disk cache
+  if(dt_dev_pixelpipe_cache_disk_get(pipe, hash, bufsize, output, out_format, module))
+    return dt_atomic_get_int(&pipe->shutdown) ? TRUE : FALSE;
+
   // 2) if history changed or exit event, abort processing?
   // preview pipe: abort on all but zoom events (same buffer anyways)
   if(dt_iop_breakpoint(dev, pipe)) return TRUE;
@@ -1444,7 +1862,27 @@ static gboolean _dev_pixelpipe_process_rec(
     return dt_atomic_get_int(&pipe->shutdown) ? TRUE : FALSE;
   }
 
-  // 3b) recurse and obtain output array in &input
+  // 3b) a run of point-wise modules ending here is processed in strips
+  if(_pipe_allows_strips(pipe))
+  {
+    dt_dev_pixelpipe_iop_t *run[DT_PIPE_STRIPS_MAX];
+    GList *first_module = modules;
+    GList *first_piece = pieces;
+    int first_pos = pos;
+    const int n = _pointwise_run(pipe, dev, roi_out, &first_module, &first_piece,
+                                 &first_pos, run);
+    if(n > 1)
+    {
+      gboolean fallback = FALSE;
+      const gboolean err =
+        _pixelpipe_process_strips(pipe, dev, output, out_format, roi_out, run, n,
+                                  first_module, first_piece, first_pos,
+                                  hash, shared_key, bufsize, &fallback);
+      if(!fallback) return err;
+    }
+  }
+
+  // 3c) recurse and obtain output array in &input
 
   // get region of interest which is needed in input
   if(dt_atomic_get_int(&pipe->shutdown))
@@ -1475,6 +1913,8 @@ static gboolean _dev_pixelpipe_process_rec(
   piece->dsc_out = piece->dsc_in = *input_format;
 
   module->output_format(module, pipe, piece, &piece->dsc_out);
+  // set by the CPU path if the module is processed planar
+  piece->dsc_out.planar = FALSE;
 
   **out_format = pipe->dsc = piece->dsc_out;
 
@@ -1499,6 +1939,8 @@ static gboolean _dev_pixelpipe_process_rec(
 
   dt_times_t start;
   dt_get_perf_times(&start);
+  // unlike the perf times always needed for the cache
+  const double wstart = dt_get_wtime();
 
   dt_pixelpipe_flow_t pixelpipe_flow =
     (PIXELPIPE_FLOW_NONE | PIXELPIPE_FLOW_HISTOGRAM_NONE);
@@ -1542,6 +1984,8 @@ static gboolean _dev_pixelpipe_process_rec(
   // default to CPU size if callback didn't set GPU
   if(tiling.factor_cl < 0) tiling.factor_cl = tiling.factor;
   if(tiling.maxbuf_cl < 0) tiling.maxbuf_cl = tiling.maxbuf;
+  // measured memory use of earlier runs, if the planner is on
+  dt_tiling_model_apply(module, piece, &roi_in, roi_out, MAX(in_bpp, out_bpp), &tiling);
 
   /* does this module involve blending? */
   if(piece->blendop_data
@@ -1587,6 +2031,12 @@ static gboolean _dev_pixelpipe_process_rec(
   /* do we have opencl at all? did user tell us to use it? did we get a resource? */
   if(_opencl_pipe_isok(pipe))
   {
+    // only CPU export pipes process planar, but the disk cache might
+    // still hold such a line. the kernels expect interleaved pixels.
+    if(input_format->planar
+       && !_pixelpipe_convert_layout(pipe, module, input, NULL, &roi_in, input_format, FALSE))
+      return TRUE;
+
     gboolean success_opencl = TRUE;
     dt_iop_colorspace_type_t input_cst_cl = input_format->cst;
 
@@ -2153,6 +2603,8 @@ static gboolean _dev_pixelpipe_process_rec(
         dt_print_pipe(DT_DEBUG_OPENCL,
            "pipe aborts", pipe, module, pipe->devid, &roi_in, roi_out, "%s\n",
                 "couldn't run module on GPU, falling back to CPU");
+        dt_trace_instant("opencl", module->op, "%s fallback to CPU on device %d",
+                         dt_dev_pixelpipe_type_to_str(pipe->type), pipe->devid);
 
         /* we might need to free unused output buffer */
         dt_opencl_release_mem_object(*cl_mem_output);
@@ -2280,6 +2732,42 @@ static gboolean _dev_pixelpipe_process_rec(
   // in case we get this buffer from the cache in the future, cache some stuff:
   **out_format = piece->dsc_out = pipe->dsc;
 
+  // remember how expensive this line was for the cache eviction
+  const float cost = dt_get_wtime() - wstart;
+  dt_trace_complete("pipe", module->op, wstart, wstart + cost, "%s imgid=%d %dx%d on %s%s",
+                    dt_dev_pixelpipe_type_to_str(pipe->type), pipe->image.id,
+                    roi_out->width, roi_out->height,
+                    pixelpipe_flow & PIXELPIPE_FLOW_PROCESSED_ON_GPU ? "GPU" : "CPU",
+                    pixelpipe_flow & PIXELPIPE_FLOW_PROCESSED_WITH_TILING ? " with tiling" : "");
+  dt_dev_pixelpipe_cache_set_cost(pipe, *output, cost);
+
+  // the second level caches hand the line to other pipes, which expect
+  // interleaved pixels and might well process it with OpenCL
+  const gboolean disk_wanted = dt_dev_pixelpipe_cache_disk_wanted(pipe, module, hash);
+  if((*out_format)->planar && (disk_wanted || pipe->cache.shared))
+  {
+    if(!_pixelpipe_convert_layout(pipe, module, *output, NULL, roi_out, *out_format, FALSE))
+      return TRUE;
+    piece->dsc_out.planar = pipe->dsc.planar = FALSE;
+  }
+
+#ifdef HAVE_OPENCL
+  if(*cl_mem_output == NULL)
+#endif
+    dt_dev_pixelpipe_cache_shared_put(pipe, shared_key, bufsize, *output, *out_format,
+                                      module, cost);
+
+  // spill to the disk cache, that requires the data in host memory
+  if(disk_wanted)
+  {
+#ifdef HAVE_OPENCL
+    if(*cl_mem_output == NULL
+       || dt_opencl_copy_device_to_host(pipe->devid, *output, *cl_mem_output,
+                                        roi_out->width, roi_out->height, bpp) == CL_SUCCESS)
+#endif
+      dt_dev_pixelpipe_cache_disk_put(pipe, hash, bufsize, *output, *out_format, module);
+  }
+
   // special cases for active modules with available gui
   if(module
      && darktable.develop->gui_attached
@@ -2529,6 +3017,9 @@ static gboolean _dev_pixelpipe_process_rec_and_backcopy(
   gboolean ret = _dev_pixelpipe_process_rec(pipe, dev, output,
                                             cl_mem_output, out_format, roi_out,
                                             modules, pieces, pos);
+  // the pipe output is always interleaved
+  if(!ret && (*out_format)->planar)
+    ret = !_pixelpipe_convert_layout(pipe, NULL, *output, NULL, roi_out, *out_format, FALSE);
 #ifdef HAVE_OPENCL
   // copy back final opencl buffer (if any) to CPU
   if(ret)
@@ -2574,10 +3065,14 @@ gboolean dt_dev_pixelpipe_process(
            const int devid)
 {
   pipe->processing = TRUE;
+  dt_tiling_model_worker_enter();
   pipe->nocache = (pipe->type & DT_DEV_PIXELPIPE_IMAGE) != 0;
   pipe->runs++;
   pipe->opencl_enabled = dt_opencl_running();
 
+  // keep the openmp threads of this pipe close to the buffers they work on
+  dt_numa_bind_threads();
+
   // if devid is a valid CL device we don't lock it as the caller has done so already
   const gboolean claimed = devid > DT_DEVICE_CPU;
   pipe->devid = pipe->opencl_enabled ? (claimed ? devid : dt_opencl_lock_device(pipe->type)) : DT_DEVICE_CPU;
@@ -2711,6 +3206,7 @@ restart:
   if(err)
   {
     pipe->processing = FALSE;
+    dt_tiling_model_worker_leave();
     return TRUE;
   }
 
@@ -2744,12 +3240,16 @@ restart:
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
 
   if(!claimed)
+  {
+    dt_dev_pixelpipe_cache_pack(pipe);
     dt_dev_pixelpipe_cache_report(pipe);
+  }
 
   dt_print_pipe(DT_DEBUG_PIPE, "pipe finished", pipe, NULL, old_devid, &roi, &roi, "ID=%i\n\n",
     pipe->image.id);
 
   pipe->processing = FALSE;
+  dt_tiling_model_worker_leave();
   return FALSE;
 }
 
@@ -65,6 +65,8 @@ typedef struct dt_dev_pixelpipe_iop_t
   dt_iop_roi_t processed_roi_in, processed_roi_out; // the actual roi that was used for processing the piece
   gboolean process_cl_ready;       // set this to FALSE in commit_params to temporarily disable the use of process_cl
   gboolean process_tiling_ready;   // set this to FALSE in commit_params to temporarily disable tiling
+  gboolean process_strips_ready;   // set this to FALSE in commit_params to temporarily disable processing in strips
+  gboolean process_planar_ready;   // set this to FALSE in commit_params to temporarily disable process_planar
 
   // the following are used internally for caching:
   dt_iop_buffer_dsc_t dsc_in, dsc_out;
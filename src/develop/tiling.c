@@ -18,9 +18,12 @@
 
 #include "develop/tiling.h"
 #include "common/opencl.h"
+#include "common/trace.h"
+#include "control/conf.h"
 #include "control/control.h"
 #include "develop/blend.h"
 #include "develop/pixelpipe.h"
+#include "develop/tiling_model.h"
 
 #include <assert.h>
 #include <math.h>
@@ -563,6 +566,220 @@ static int _fit_output_to_input_roi(struct dt_iop_module_t *self,
 }
 
 
+/* copying tiles in and out of the full image buffers. with tiling_cpu_prefetch
+   the copies run on a helper thread while the module processes the current
+   tile: the input of the next tile is copied into a second input buffer and
+   the output of the previous tile is copied from a second output buffer. */
+typedef struct _tile_copy_t
+{
+  size_t src_offset;     // into the image for input copies, into the tile buffer for output copies
+  size_t dst_offset;
+  size_t src_pitch;
+  size_t dst_pitch;
+  size_t row_bytes;
+  size_t rows;
+} _tile_copy_t;
+
+typedef struct _tile_t
+{
+  dt_iop_roi_t iroi;     // as passed to process()
+  dt_iop_roi_t oroi;
+  _tile_copy_t in;
+  _tile_copy_t out;
+} _tile_t;
+
+typedef struct _tile_prefetch_t
+{
+  const char *in_src;
+  char *in_dst;
+  const _tile_copy_t *in;
+  const char *out_src;
+  char *out_dst;
+  const _tile_copy_t *out;
+  double busy;           // seconds spent copying
+} _tile_prefetch_t;
+
+static inline gboolean _tiling_prefetch(void)
+{
+  return dt_conf_get_bool("tiling_cpu_prefetch");
+}
+
+/* two more tile buffers are needed for prefetching */
+static inline float _tiling_cpu_factor(const dt_develop_tiling_t *tiling)
+{
+  return fmaxf(tiling->factor + (_tiling_prefetch() ? 2.0f : 0.0f), 1.0f);
+}
+
+static void _tile_copy(char *const dst,
+                       const char *const src,
+                       const _tile_copy_t *const c,
+                       const gboolean parallel)
+{
+  if(parallel)
+  {
+    DT_OMP_FOR()
+    for(size_t j = 0; j < c->rows; j++)
+      memcpy(dst + c->dst_offset + j * c->dst_pitch, src + c->src_offset + j * c->src_pitch, c->row_bytes);
+  }
+  else
+  {
+    for(size_t j = 0; j < c->rows; j++)
+      memcpy(dst + c->dst_offset + j * c->dst_pitch, src + c->src_offset + j * c->src_pitch, c->row_bytes);
+  }
+}
+
+static void *_tile_prefetch_run(void *data)
+{
+  _tile_prefetch_t *p = (_tile_prefetch_t *)data;
+  const double start = dt_get_wtime();
+  if(p->out) _tile_copy(p->out_dst, p->out_src, p->out, FALSE);
+  if(p->in) _tile_copy(p->in_dst, p->in_src, p->in, FALSE);
+  p->busy = dt_get_wtime() - start;
+  return NULL;
+}
+
+/* process all tiles, either strictly one after the other or with copies
+   overlapping process(). returns FALSE if the tile buffers can't be allocated */
+static gboolean _process_tiles(struct dt_iop_module_t *self,
+                               struct dt_dev_pixelpipe_iop_t *piece,
+                               const void *const ivoid,
+                               void *const ovoid,
+                               const _tile_t *const tiles,
+                               const int num_tiles,
+                               const int in_bpp,
+                               const int out_bpp,
+                               const char *caller)
+{
+  size_t in_size = 0, out_size = 0;
+  for(int i = 0; i < num_tiles; i++)
+  {
+    in_size = MAX(in_size, (size_t)tiles[i].iroi.width * tiles[i].iroi.height * in_bpp);
+    out_size = MAX(out_size, (size_t)tiles[i].oroi.width * tiles[i].oroi.height * out_bpp);
+  }
+
+  /* reserve input and output buffers for tiles, only one pair if there is
+     nothing to overlap or not enough memory for two */
+  void *input[2] = { NULL, NULL };
+  void *output[2] = { NULL, NULL };
+  int nbuf = (_tiling_prefetch() && num_tiles > 1) ? 2 : 1;
+  for(int b = 0; b < nbuf; b++)
+  {
+    input[b] = dt_alloc_aligned(in_size);
+    output[b] = dt_alloc_aligned(out_size);
+    if(!input[b] || !output[b])
+    {
+      dt_free_align(input[b]);
+      dt_free_align(output[b]);
+      input[b] = output[b] = NULL;
+      nbuf = b;
+    }
+  }
+  if(nbuf == 0)
+  {
+    dt_print(DT_DEBUG_TILING,
+             "[%s] [%s] could not alloc tile buffers for module '%s%s'\n",
+             caller, dt_dev_pixelpipe_type_to_str(piece->pipe->type), self->op,
+             dt_iop_get_instance_id(self));
+    return FALSE;
+  }
+
+  /* store processed_maximum to be re-used and aggregated */
+  dt_aligned_pixel_t processed_maximum_saved;
+  dt_aligned_pixel_t processed_maximum_new = { 1.0f };
+  for_four_channels(k) processed_maximum_saved[k] = piece->pipe->dsc.processed_maximum[k];
+
+  double t_process = 0.0, t_copy = 0.0, t_wait = 0.0;
+
+  if(nbuf == 2)
+    _tile_copy(input[0], ivoid, &tiles[0].in, TRUE);
+
+  for(int i = 0; i < num_tiles; i++)
+  {
+    const _tile_t *tile = &tiles[i];
+    const int cur = nbuf == 2 ? i & 1 : 0;
+
+    _tile_prefetch_t prefetch = { 0 };
+    pthread_t thread;
+    gboolean helper = FALSE;
+
+    if(nbuf == 2)
+    {
+      if(i > 0)
+      {
+        prefetch.out = &tiles[i - 1].out;
+        prefetch.out_src = output[cur ^ 1];
+        prefetch.out_dst = ovoid;
+      }
+      if(i + 1 < num_tiles)
+      {
+        prefetch.in = &tiles[i + 1].in;
+        prefetch.in_src = ivoid;
+        prefetch.in_dst = input[cur ^ 1];
+      }
+      helper = !dt_pthread_create(&thread, _tile_prefetch_run, &prefetch);
+      // no helper thread, do it right away
+      if(!helper) _tile_prefetch_run(&prefetch);
+    }
+    else
+      _tile_copy(input[0], ivoid, &tile->in, TRUE);
+
+    /* take original processed_maximum as starting point */
+    for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_saved[k];
+
+    /* call process() of module */
+    const double start = dt_get_wtime();
+    self->process(self, piece, input[cur], output[cur], &tile->iroi, &tile->oroi);
+    const double end = dt_get_wtime();
+    t_process += end - start;
+
+    if(helper)
+    {
+      pthread_join(thread, NULL);
+      t_wait += dt_get_wtime() - end;
+    }
+    t_copy += prefetch.busy;
+
+    /* aggregate resulting processed_maximum */
+    /* TODO: check if there really can be differences between tiles and take
+             appropriate action (calculate minimum, maximum, average, ...?) */
+    for(int k = 0; k < 4; k++)
+    {
+      if(i > 0 && fabs(processed_maximum_new[k] - piece->pipe->dsc.processed_maximum[k]) > 1.0e-6f)
+        dt_print(DT_DEBUG_TILING,
+                 "[%s] [%s] processed_maximum[%d] differs between tiles in module '%s%s'\n",
+                 caller, dt_dev_pixelpipe_type_to_str(piece->pipe->type), k,
+                 self->op, dt_iop_get_instance_id(self));
+      processed_maximum_new[k] = piece->pipe->dsc.processed_maximum[k];
+    }
+
+    /* copy "good" part of tile to output buffer, with prefetching that's
+       done while processing the next tile */
+    if(nbuf == 1)
+      _tile_copy(ovoid, output[0], &tile->out, TRUE);
+  }
+
+  if(nbuf == 2)
+    _tile_copy(ovoid, output[(num_tiles - 1) & 1], &tiles[num_tiles - 1].out, TRUE);
+
+  /* copy back final processed_maximum */
+  for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_new[k];
+
+  if(nbuf == 2)
+    dt_print(DT_DEBUG_TILING,
+             "[%s] [%s] module '%s%s' processed %d tiles in %.3fs, %.3fs of tile copies"
+             " overlapped with processing, %.3fs (%.0f%%) hidden\n",
+             caller, dt_dev_pixelpipe_type_to_str(piece->pipe->type), self->op,
+             dt_iop_get_instance_id(self), num_tiles, t_process, t_copy,
+             MAX(t_copy - t_wait, 0.0), t_copy > 0.0 ? 100.0 * MAX(t_copy - t_wait, 0.0) / t_copy : 100.0);
+
+  for(int b = 0; b < nbuf; b++)
+  {
+    dt_free_align(input[b]);
+    dt_free_align(output[b]);
+  }
+  return TRUE;
+}
+
 /* simple tiling algorithm for roi_in == roi_out, i.e. for pixel to pixel modules/operations */
 static void _default_process_tiling_ptp(struct dt_iop_module_t *self,
                                         struct dt_dev_pixelpipe_iop_t *piece,
@@ -572,8 +789,6 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self,
                                         const dt_iop_roi_t *const roi_out,
                                         const int in_bpp)
 {
-  void *input = NULL;
-  void *output = NULL;
   dt_print(DT_DEBUG_TILING,
            "[default_process_tiling_ptp] [%s] **** tiling module '%s%s' for image with size %dx%d --> %dx%d\n",
            dt_dev_pixelpipe_type_to_str(piece->pipe->type), self->op, dt_iop_get_instance_id(self),
@@ -592,6 +807,7 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self,
   self->tiling_callback(self, piece, roi_in, roi_out, &tiling);
   if(tiling.factor_cl < 0) tiling.factor_cl = tiling.factor;
   if(tiling.maxbuf_cl < 0) tiling.maxbuf_cl = tiling.maxbuf;
+  dt_tiling_model_apply(self, piece, roi_in, roi_out, max_bpp, &tiling);
 
   /* tiling really does not make sense in these cases. standard process() is not better or worse than we are
    */
@@ -617,7 +833,7 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self,
      this will mainly allow tiling for modules with high and "unpredictable" memory demand which is
      reflected in high values of tiling.factor (take bilateral noise reduction as an example). */
   float singlebuffer = dt_get_singlebuffer_mem();
-  const float factor = fmaxf(tiling.factor, 1.0f);
+  const float factor = _tiling_cpu_factor(&tiling);
   const float maxbuf = fmaxf(tiling.maxbuf, 1.0f);
   singlebuffer = fmaxf(available / factor, singlebuffer);
 
@@ -697,38 +913,18 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self,
   dt_print(DT_DEBUG_TILING,
            "[default_process_tiling_ptp] [%s] (%dx%d) tiles with max dimensions %dx%d and overlap %d\n",
            dt_dev_pixelpipe_type_to_str(piece->pipe->type), tiles_x, tiles_y, width, height, overlap);
+  dt_trace_instant("tiling", self->op, "%s %dx%d tiles of %dx%d, overlap %d",
+                   dt_dev_pixelpipe_type_to_str(piece->pipe->type), tiles_x, tiles_y,
+                   width, height, overlap);
 
-  /* reserve input and output buffers for tiles */
-  input = dt_alloc_aligned((size_t)width * height * in_bpp);
-  if(input == NULL)
-  {
-    dt_print(DT_DEBUG_TILING,
-             "[default_process_tiling_ptp] [%s] could not alloc input buffer for module '%s%s'\n",
-             dt_dev_pixelpipe_type_to_str(piece->pipe->type), self->op, dt_iop_get_instance_id(self));
-    goto error;
-  }
-  output = dt_alloc_aligned((size_t)width * height * out_bpp);
-  if(output == NULL)
-  {
-    dt_print(DT_DEBUG_TILING,
-             "[default_process_tiling_ptp] [%s]  could not alloc output buffer for module '%s%s'\n",
-             dt_dev_pixelpipe_type_to_str(piece->pipe->type), self->op, dt_iop_get_instance_id(self));
-    goto error;
-  }
-
-  /* store processed_maximum to be re-used and aggregated */
-  dt_aligned_pixel_t processed_maximum_saved;
-  dt_aligned_pixel_t processed_maximum_new = { 1.0f };
-  for_four_channels(k) processed_maximum_saved[k] = piece->pipe->dsc.processed_maximum[k];
-
-  /* iterate over tiles */
+  /* collect the tiles */
+  _tile_t *tiles = g_malloc_n((size_t)tiles_x * tiles_y, sizeof(_tile_t));
+  int num_tiles = 0;
   for(size_t tx = 0; tx < tiles_x; tx++)
   {
     const size_t wd = tx * tile_wd + width > roi_in->width ? roi_in->width - tx * tile_wd : width;
     for(size_t ty = 0; ty < tiles_y; ty++)
     {
-      piece->pipe->tiling = TRUE;
-
       const size_t ht = ty * tile_ht + height > roi_in->height ? roi_in->height - ty * tile_ht : height;
 
       /* no need to process end-tiles that are smaller than the total overlap area */
@@ -750,30 +946,6 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self,
                "[default_process_tiling_ptp] [%s] tile (%zu,%zu) with %zux%zu at origin [%zu,%zu]\n",
                dt_dev_pixelpipe_type_to_str(piece->pipe->type), tx, ty, wd, ht, tx * tile_wd, ty * tile_ht);
 
-/* prepare input tile buffer */
-      DT_OMP_FOR()
-      for(size_t j = 0; j < ht; j++)
-        memcpy((char *)input + j * wd * in_bpp, (char *)ivoid + ioffs + j * ipitch, (size_t)wd * in_bpp);
-
-      /* take original processed_maximum as starting point */
-      for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_saved[k];
-
-      /* call process() of module */
-      self->process(self, piece, input, output, &iroi, &oroi);
-
-      /* aggregate resulting processed_maximum */
-      /* TODO: check if there really can be differences between tiles and take
-               appropriate action (calculate minimum, maximum, average, ...?) */
-      for(int k = 0; k < 4; k++)
-      {
-        if(tx + ty > 0 && fabs(processed_maximum_new[k] - piece->pipe->dsc.processed_maximum[k]) > 1.0e-6f)
-          dt_print(DT_DEBUG_TILING,
-                   "[default_process_tiling_ptp] [%s] processed_maximum[%d] differs between tiles in module '%s%s'\n",
-                   dt_dev_pixelpipe_type_to_str(piece->pipe->type), k,
-                   self->op, dt_iop_get_instance_id(self));
-        processed_maximum_new[k] = piece->pipe->dsc.processed_maximum[k];
-      }
-
       /* correct origin and region of tile for overlap.
          make sure that we only copy back the "good" part. */
       if(tx > 0)
@@ -789,19 +961,25 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self,
         ooffs += (size_t)overlap * opitch;
       }
 
-/* copy "good" part of tile to output buffer */
-      DT_OMP_FOR(shared(origin, region))
-      for(size_t j = 0; j < region[1]; j++)
-        memcpy((char *)ovoid + ooffs + j * opitch,
-               (char *)output + ((j + origin[1]) * wd + origin[0]) * out_bpp, (size_t)region[0] * out_bpp);
+      _tile_t *tile = &tiles[num_tiles++];
+      tile->iroi = iroi;
+      tile->oroi = oroi;
+      tile->in = (_tile_copy_t){ .src_offset = ioffs, .dst_offset = 0,
+                                 .src_pitch = ipitch, .dst_pitch = wd * in_bpp,
+                                 .row_bytes = wd * in_bpp, .rows = ht };
+      tile->out = (_tile_copy_t){ .src_offset = (origin[1] * wd + origin[0]) * out_bpp, .dst_offset = ooffs,
+                                  .src_pitch = wd * out_bpp, .dst_pitch = opitch,
+                                  .row_bytes = region[0] * out_bpp, .rows = region[1] };
     }
   }
 
-  /* copy back final processed_maximum */
-  for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_new[k];
+  piece->pipe->tiling = TRUE;
+  const gboolean done = num_tiles > 0
+    && _process_tiles(self, piece, ivoid, ovoid, tiles, num_tiles, in_bpp, out_bpp,
+                      "default_process_tiling_ptp");
+  g_free(tiles);
+  if(!done) goto error;
 
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
   piece->pipe->tiling = FALSE;
   return;
 
@@ -810,8 +988,6 @@ error:
 // fall through
 
 fallback:
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
   piece->pipe->tiling = FALSE;
   dt_print(DT_DEBUG_TILING,
            "[default_process_tiling_ptp] [%s] fall back to standard processing for module '%s%s'\n",
@@ -832,9 +1008,6 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self,
                                         const dt_iop_roi_t *const roi_out,
                                         const int in_bpp)
 {
-  void *input = NULL;
-  void *output = NULL;
-
   dt_print(DT_DEBUG_TILING,
            "[default_process_tiling_roi] [%s] **** tiling module '%s%s' for "
            "image input size %dx%d --> %dx%d\n",
@@ -867,6 +1040,7 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self,
   self->tiling_callback(self, piece, roi_in, roi_out, &tiling);
   if(tiling.factor_cl < 0) tiling.factor_cl = tiling.factor;
   if(tiling.maxbuf_cl < 0) tiling.maxbuf_cl = tiling.maxbuf;
+  dt_tiling_model_apply(self, piece, roi_in, roi_out, max_bpp, &tiling);
 
   /* tiling really does not make sense in these cases. standard process() is not better or worse than we are
    */
@@ -891,7 +1065,7 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self,
      this will mainly allow tiling for modules with high and "unpredictable" memory demand which is
      reflected in high values of tiling.factor (take bilateral noise reduction as an example). */
   float singlebuffer = dt_get_singlebuffer_mem();
-  const float factor = fmaxf(tiling.factor, 1.0f);
+  const float factor = _tiling_cpu_factor(&tiling);
   const float maxbuf = fmaxf(tiling.maxbuf, 1.0f);
   singlebuffer = fmaxf(available / factor, singlebuffer);
 
@@ -989,18 +1163,16 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self,
            "[default_process_tiling_roi] [%s] (%dx%d) tiles with max dimensions %dx%d, good %dx%d, overlap %d->%d\n",
            dt_dev_pixelpipe_type_to_str(piece->pipe->type), tiles_x, tiles_y,
            width, height, tile_wd, tile_ht, overlap_in, overlap_out);
+  dt_trace_instant("tiling", self->op, "%s %dx%d tiles of %dx%d, overlap %d->%d",
+                   dt_dev_pixelpipe_type_to_str(piece->pipe->type), tiles_x, tiles_y,
+                   width, height, overlap_in, overlap_out);
 
-  /* store processed_maximum to be re-used and aggregated */
-  dt_aligned_pixel_t processed_maximum_saved;
-  dt_aligned_pixel_t processed_maximum_new = { 1.0f };
-  for_four_channels(k) processed_maximum_saved[k] = piece->pipe->dsc.processed_maximum[k];
-
-  /* iterate over tiles */
+  /* collect the tiles */
+  _tile_t *tiles = g_malloc_n((size_t)tiles_x * tiles_y, sizeof(_tile_t));
+  int num_tiles = 0;
   for(size_t tx = 0; tx < tiles_x; tx++)
     for(size_t ty = 0; ty < tiles_y; ty++)
     {
-      piece->pipe->tiling = TRUE;
-
       /* the output dimensions of the good part of this specific tile */
       const size_t wd = (tx + 1) * tile_wd > roi_out->width ? (size_t)roi_out->width - tx * tile_wd : tile_wd;
       const size_t ht = (ty + 1) * tile_ht > roi_out->height ? (size_t)roi_out->height - ty * tile_ht : tile_ht;
@@ -1051,6 +1223,7 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self,
                  "[default_process_tiling_roi] [%s] can not handle requested roi's. "
                  "tiling for module '%s%s' not possible.\n",
                  dt_dev_pixelpipe_type_to_str(piece->pipe->type), self->op, dt_iop_get_instance_id(self));
+        g_free(tiles);
         goto error;
       }
 
@@ -1087,70 +1260,35 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self,
             size_t ooffs = ((size_t)oroi_good.y - roi_out->y) * opitch + ((size_t)oroi_good.x - roi_out->x) * out_bpp;
 
       dt_print(DT_DEBUG_TILING,
-               "[default_process_tiling_roi] [%s] process tile (%zu,%zu) size %dx%d at origin [%d,%d]\n",
+               "[default_process_tiling_roi] [%s] tile (%zu,%zu) size %dx%d at origin [%d,%d]\n",
                dt_dev_pixelpipe_type_to_str(piece->pipe->type), tx, ty,
                iroi_full.width, iroi_full.height, iroi_full.x, iroi_full.y);
 
-      /* prepare input tile buffer */
-      input = dt_alloc_aligned((size_t)iroi_full.width * iroi_full.height * in_bpp);
-      if(input == NULL)
-      {
-        dt_print(DT_DEBUG_TILING,
-                 "[default_process_tiling_roi] [%s] could not alloc input buffer for module '%s%s'\n",
-                 dt_dev_pixelpipe_type_to_str(piece->pipe->type), self->op, dt_iop_get_instance_id(self));
-        goto error;
-      }
-      output = dt_alloc_aligned((size_t)oroi_full.width * oroi_full.height * out_bpp);
-      if(output == NULL)
-      {
-        dt_print(DT_DEBUG_TILING,
-                 "[default_process_tiling_roi] [%s] could not alloc output buffer for module '%s%s'\n",
-                 dt_dev_pixelpipe_type_to_str(piece->pipe->type), self->op, dt_iop_get_instance_id(self));
-        goto error;
-      }
-
-      DT_OMP_FOR(shared(iroi_full))
-      for(size_t j = 0; j < iroi_full.height; j++)
-        memcpy((char *)input + j * iroi_full.width * in_bpp, (char *)ivoid + ioffs + j * ipitch,
-               (size_t)iroi_full.width * in_bpp);
-
-      /* take original processed_maximum as starting point */
-      for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_saved[k];
-
-      /* call process() of module */
-      self->process(self, piece, input, output, &iroi_full, &oroi_full);
-
-      /* aggregate resulting processed_maximum */
-      /* TODO: check if there really can be differences between tiles and take
-               appropriate action (calculate minimum, maximum, average, ...?) */
-      for(int k = 0; k < 4; k++)
-      {
-        if(tx + ty > 0 && fabs(processed_maximum_new[k] - piece->pipe->dsc.processed_maximum[k]) > 1.0e-6f)
-          dt_print(DT_DEBUG_TILING,
-                   "[default_process_tiling_roi] processed_maximum[%d] differs between tiles in module '%s%s'\n",
-                   k, self->op, dt_iop_get_instance_id(self));
-        processed_maximum_new[k] = piece->pipe->dsc.processed_maximum[k];
-      }
-
-      /* copy "good" part of tile to output buffer */
+      /* the "good" part of the tile goes to the output buffer */
       const int origin_x = oroi_good.x - oroi_full.x;
       const int origin_y = oroi_good.y - oroi_full.y;
-      DT_OMP_FOR(shared(oroi_good, oroi_full))
-      for(size_t j = 0; j < oroi_good.height; j++)
-        memcpy((char *)ovoid + ooffs + j * opitch,
-               (char *)output + ((j + origin_y) * oroi_full.width + origin_x) * out_bpp,
-               (size_t)oroi_good.width * out_bpp);
-
-      dt_free_align(input);
-      dt_free_align(output);
-      input = output = NULL;
+
+      _tile_t *tile = &tiles[num_tiles++];
+      tile->iroi = iroi_full;
+      tile->oroi = oroi_full;
+      tile->in = (_tile_copy_t){ .src_offset = ioffs, .dst_offset = 0,
+                                 .src_pitch = ipitch, .dst_pitch = (size_t)iroi_full.width * in_bpp,
+                                 .row_bytes = (size_t)iroi_full.width * in_bpp,
+                                 .rows = iroi_full.height };
+      tile->out = (_tile_copy_t){ .src_offset = ((size_t)origin_y * oroi_full.width + origin_x) * out_bpp,
+                                  .dst_offset = ooffs,
+                                  .src_pitch = (size_t)oroi_full.width * out_bpp, .dst_pitch = opitch,
+                                  .row_bytes = (size_t)oroi_good.width * out_bpp,
+                                  .rows = oroi_good.height };
     }
 
-  /* copy back final processed_maximum */
-  for(int k = 0; k < 4; k++) piece->pipe->dsc.processed_maximum[k] = processed_maximum_new[k];
+  piece->pipe->tiling = TRUE;
+  const gboolean done = num_tiles > 0
+    && _process_tiles(self, piece, ivoid, ovoid, tiles, num_tiles, in_bpp, out_bpp,
+                      "default_process_tiling_roi");
+  g_free(tiles);
+  if(!done) goto error;
 
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
   piece->pipe->tiling = FALSE;
   return;
 
@@ -1159,8 +1297,6 @@ error:
 // fall through
 
 fallback:
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
   piece->pipe->tiling = FALSE;
   dt_print(DT_DEBUG_TILING,
            "[default_process_tiling_roi] [%s] fall back to standard processing for module '%s%s'\n",
@@ -1209,7 +1345,7 @@ float dt_tiling_estimate_cpumem(struct dt_develop_tiling_t *tiling,
                    - ((float)roi_in->width * roi_in->height * max_bpp) - tiling->overhead, 0.0f);
 
   float singlebuffer = dt_get_singlebuffer_mem();
-  const float factor = fmaxf(tiling->factor, 1.0f);
+  const float factor = _tiling_cpu_factor(tiling);
   const float maxbuf = fmaxf(tiling->maxbuf, 1.0f);
   singlebuffer = fmaxf(available / factor, singlebuffer);
 
@@ -0,0 +1,484 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "develop/tiling_model.h"
+#include "common/file_location.h"
+#include "control/conf.h"
+#include "develop/pixelpipe.h"
+
+#include <glib/gstdio.h>
+#include <inttypes.h>
+#include <limits.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DT_TILING_MODEL_VERSION 2
+// samples on different image sizes needed before the model is used
+#define DT_TILING_MODEL_MIN_SAMPLES 3
+// older samples lose weight, a module changing between versions or with
+// its parameters is followed after a few dozen runs
+#define DT_TILING_MODEL_DECAY 0.98
+// added on top of the prediction, as the next run might need a bit more
+#define DT_TILING_MODEL_MARGIN 1.15
+
+#define MB (1024.0 * 1024.0)
+
+typedef enum _planner_t
+{
+  _PLANNER_OFF = 0,
+  _PLANNER_RECORD = 1,
+  _PLANNER_ON = 2,
+} _planner_t;
+
+// running sums of a least squares fit of y = a * x + b
+typedef struct _fit_t
+{
+  double n, sx, sy, sxx, sxy;
+} _fit_t;
+
+typedef struct _model_t
+{
+  _fit_t memory;     // MB used over MB of the image buffer
+  _fit_t time;       // seconds over megapixels of the output
+
+  // errors of this session's predictions, for the report
+  int runs, memory_runs, model_runs, time_runs;
+  double error_static, error_model, error_time;
+} _model_t;
+
+static GHashTable *_models = NULL;   // op and parameters -> _model_t
+static dt_pthread_mutex_t _lock;
+static gboolean _dirty = FALSE;
+
+// the resident size is measured for the whole process, so only one
+// module at a time can be measured
+static dt_pthread_mutex_t _measure_lock;
+
+// threads busy with pipes, exports and decoding, and how often one started.
+// other threads allocating spoil the measurement of the resident size
+static dt_atomic_int _workers;
+static dt_atomic_int _workers_started;
+static __thread int _worker_depth = 0;
+
+static _planner_t _get_planner(void)
+{
+  const char *mode = dt_conf_get_string_const("tiling_planner");
+  if(!strcmp(mode, "on"))
+    return _PLANNER_ON;
+  else if(!strcmp(mode, "record"))
+    return _PLANNER_RECORD;
+  return _PLANNER_OFF;
+}
+
+static void _fit_add(_fit_t *f,
+                     const double x,
+                     const double y)
+{
+  f->n = f->n * DT_TILING_MODEL_DECAY + 1.0;
+  f->sx = f->sx * DT_TILING_MODEL_DECAY + x;
+  f->sy = f->sy * DT_TILING_MODEL_DECAY + y;
+  f->sxx = f->sxx * DT_TILING_MODEL_DECAY + x * x;
+  f->sxy = f->sxy * DT_TILING_MODEL_DECAY + x * y;
+}
+
+// the line through the samples, or through the origin and their mean if
+// they don't differ enough in size. returns FALSE if there are too few
+static gboolean _fit_line(const _fit_t *f,
+                          double *a,
+                          double *b)
+{
+  if(f->n < DT_TILING_MODEL_MIN_SAMPLES || f->sx <= 0.0)
+    return FALSE;
+
+  const double mean = f->sx / f->n;
+  const double var = f->sxx / f->n - mean * mean;
+  if(var > 0.01 * mean * mean)
+  {
+    *a = (f->n * f->sxy - f->sx * f->sy) / (f->n * f->sxx - f->sx * f->sx);
+    *b = (f->sy - *a * f->sx) / f->n;
+    if(*a > 0.0)
+      return TRUE;
+  }
+  *a = f->sy / f->sx;
+  *b = 0.0;
+  return *a > 0.0;
+}
+
+static gboolean _fit_predict(const _fit_t *f,
+                             const double x,
+                             double *y)
+{
+  double a, b;
+  if(!_fit_line(f, &a, &b)) return FALSE;
+  *y = MAX(a * x + b, 0.0);
+  return TRUE;
+}
+
+static _model_t *_get_model(const char *key)
+{
+  _model_t *m = g_hash_table_lookup(_models, key);
+  if(!m)
+  {
+    m = g_malloc0(sizeof(_model_t));
+    g_hash_table_insert(_models, g_strdup(key), m);
+  }
+  return m;
+}
+
+// the memory used depends on the parameters, like the algorithm or a
+// radius, and on the kind of sensor for raw modules
+static void _model_key(const struct dt_iop_module_t *self,
+                       const struct dt_dev_pixelpipe_iop_t *piece,
+                       char *key,
+                       const size_t size)
+{
+  dt_hash_t hash = dt_hash(DT_INITHASH, self->params, self->params_size);
+  hash = dt_hash(hash, &piece->dsc_in.filters, sizeof(piece->dsc_in.filters));
+  snprintf(key, size, "%s-%016" PRIx64, self->op, hash);
+}
+
+static gchar *_filename(void)
+{
+  char cachedir[PATH_MAX] = { 0 };
+  dt_loc_get_user_cache_dir(cachedir, sizeof(cachedir));
+  return g_build_filename(cachedir, "tiling_models", NULL);
+}
+
+static void _load(void)
+{
+  gchar *filename = _filename();
+  gchar *contents = NULL;
+  if(g_file_get_contents(filename, &contents, NULL, NULL))
+  {
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    int version = 0;
+    if(lines[0] && sscanf(lines[0], "# darktable tiling models %d", &version) == 1
+       && version == DT_TILING_MODEL_VERSION)
+    {
+      for(gchar **line = lines + 1; *line; line++)
+      {
+        gchar **fields = g_strsplit(*line, " ", -1);
+        if(g_strv_length(fields) == 11)
+        {
+          _model_t *m = _get_model(fields[0]);
+          double *v[10] = { &m->memory.n, &m->memory.sx, &m->memory.sy,
+                            &m->memory.sxx, &m->memory.sxy,
+                            &m->time.n, &m->time.sx, &m->time.sy,
+                            &m->time.sxx, &m->time.sxy };
+          for(int k = 0; k < 10; k++)
+            *v[k] = g_ascii_strtod(fields[k + 1], NULL);
+        }
+        g_strfreev(fields);
+      }
+    }
+    g_strfreev(lines);
+  }
+  g_free(contents);
+  g_free(filename);
+}
+
+static void _save(void)
+{
+  GString *out = g_string_new(NULL);
+  g_string_append_printf(out, "# darktable tiling models %d\n", DT_TILING_MODEL_VERSION);
+
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init(&iter, _models);
+  while(g_hash_table_iter_next(&iter, &key, &value))
+  {
+    const _model_t *m = (_model_t *)value;
+    const double v[10] = { m->memory.n, m->memory.sx, m->memory.sy,
+                           m->memory.sxx, m->memory.sxy,
+                           m->time.n, m->time.sx, m->time.sy,
+                           m->time.sxx, m->time.sxy };
+    g_string_append(out, (const char *)key);
+    for(int k = 0; k < 10; k++)
+    {
+      char buf[G_ASCII_DTOSTR_BUF_SIZE];
+      g_string_append_c(out, ' ');
+      g_string_append(out, g_ascii_formatd(buf, sizeof(buf), "%.10g", v[k]));
+    }
+    g_string_append_c(out, '\n');
+  }
+
+  gchar *filename = _filename();
+  GError *error = NULL;
+  if(!g_file_set_contents(filename, out->str, out->len, &error))
+  {
+    dt_print(DT_DEBUG_ALWAYS, "[tiling model] can't write `%s': %s\n", filename, error->message);
+    g_error_free(error);
+  }
+  g_free(filename);
+  g_string_free(out, TRUE);
+}
+
+void dt_tiling_model_worker_enter(void)
+{
+  if(_worker_depth++ == 0)
+  {
+    dt_atomic_add_int(&_workers, 1);
+    dt_atomic_add_int(&_workers_started, 1);
+  }
+}
+
+void dt_tiling_model_worker_leave(void)
+{
+  if(--_worker_depth == 0)
+    dt_atomic_sub_int(&_workers, 1);
+}
+
+void dt_tiling_model_init(void)
+{
+  dt_pthread_mutex_init(&_lock, NULL);
+  dt_pthread_mutex_init(&_measure_lock, NULL);
+  _models = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  if(_get_planner() != _PLANNER_OFF)
+    _load();
+}
+
+void dt_tiling_model_cleanup(void)
+{
+  if(!_models) return;
+
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init(&iter, _models);
+  while(g_hash_table_iter_next(&iter, &key, &value))
+  {
+    const _model_t *m = (_model_t *)value;
+    if(!m->runs) continue;
+    dt_print(DT_DEBUG_TILING,
+             "[tiling model] `%s' %i runs, mean memory error: static %.0f%% (%i), model %.0f%% (%i);"
+             " mean time error: %.0f%% (%i)\n",
+             (const char *)key, m->runs,
+             m->memory_runs ? 100.0 * m->error_static / m->memory_runs : 0.0, m->memory_runs,
+             m->model_runs ? 100.0 * m->error_model / m->model_runs : 0.0, m->model_runs,
+             m->time_runs ? 100.0 * m->error_time / m->time_runs : 0.0, m->time_runs);
+  }
+
+  if(_dirty)
+    _save();
+
+  g_hash_table_destroy(_models);
+  _models = NULL;
+  dt_pthread_mutex_destroy(&_measure_lock);
+  dt_pthread_mutex_destroy(&_lock);
+}
+
+gboolean dt_tiling_model_apply(struct dt_iop_module_t *self,
+                               struct dt_dev_pixelpipe_iop_t *piece,
+                               const dt_iop_roi_t *roi_in,
+                               const dt_iop_roi_t *roi_out,
+                               const int max_bpp,
+                               dt_develop_tiling_t *tiling)
+{
+  if(!_models || _get_planner() != _PLANNER_ON)
+    return FALSE;
+
+  char key[64];
+  _model_key(self, piece, key, sizeof(key));
+
+  double a = 0.0, b = 0.0;
+  dt_pthread_mutex_lock(&_lock);
+  const _model_t *m = g_hash_table_lookup(_models, key);
+  const gboolean valid = m && _fit_line(&m->memory, &a, &b);
+  dt_pthread_mutex_unlock(&_lock);
+  if(!valid) return FALSE;
+
+  // the model works in MB of the image buffer, factor is unit-less. the
+  // measurement might have missed memory, so it never goes below what the
+  // module reports
+  const double buffer = (double)MAX(roi_in->width, roi_out->width)
+    * MAX(roi_in->height, roi_out->height) * max_bpp / MB;
+  const float factor = fmaxf(DT_TILING_MODEL_MARGIN * a, tiling->factor);
+  const size_t overhead = MAX(DT_TILING_MODEL_MARGIN * MAX(b, 0.0) * MB, tiling->overhead);
+
+  dt_print(DT_DEBUG_TILING | DT_DEBUG_VERBOSE,
+           "[tiling model] `%s%s' %.0fMB buffer: factor %.2f -> %.2f, overhead %zuMB -> %zuMB\n",
+           self->op, dt_iop_get_instance_id(self), buffer,
+           tiling->factor, factor,
+           (size_t)(tiling->overhead / MB), (size_t)(overhead / MB));
+
+  tiling->factor = factor;
+  tiling->overhead = overhead;
+  return TRUE;
+}
+
+static inline gboolean _recording(const struct dt_dev_pixelpipe_iop_t *piece)
+{
+  // other pipes run concurrently in the darkroom and spoil the measurement
+  return _models
+    && (piece->pipe->type & DT_DEV_PIXELPIPE_EXPORT)
+    && _get_planner() != _PLANNER_OFF;
+}
+
+#if defined(__linux__)
+static size_t _resident(void)
+{
+  FILE *f = g_fopen("/proc/self/statm", "r");
+  if(!f) return 0;
+  unsigned long size = 0, resident = 0;
+  const int n = fscanf(f, "%lu %lu", &size, &resident);
+  fclose(f);
+  return n == 2 ? (size_t)resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+static size_t _peak_resident(void)
+{
+  FILE *f = g_fopen("/proc/self/status", "r");
+  if(!f) return 0;
+  char line[256];
+  unsigned long kb = 0;
+  while(fgets(line, sizeof(line), f))
+    if(sscanf(line, "VmHWM: %lu kB", &kb) == 1) break;
+  fclose(f);
+  return (size_t)kb * 1024;
+}
+
+// make the peak resident size start over from the current one, since linux 4.0
+static gboolean _reset_peak(void)
+{
+  FILE *f = g_fopen("/proc/self/clear_refs", "w");
+  if(!f) return FALSE;
+  const gboolean ok = fputs("5", f) >= 0;
+  return (fclose(f) == 0) && ok;
+}
+#endif
+
+void dt_tiling_model_begin(struct dt_dev_pixelpipe_iop_t *piece,
+                           dt_tiling_model_sample_t *sample)
+{
+  sample->rss = 0;
+  sample->memory = FALSE;
+  sample->wstart = 0.0;
+  sample->workers = dt_atomic_get_int(&_workers_started);
+  if(!_recording(piece)) return;
+
+#if defined(__linux__)
+  if(dt_atomic_get_int(&_workers) == 1
+     && !dt_pthread_mutex_trylock(&_measure_lock))
+  {
+#ifdef __GLIBC__
+    // freed memory would be reused without showing up in the peak
+    malloc_trim(0);
+#endif
+    if(_reset_peak())
+      sample->rss = _resident();
+    sample->memory = sample->rss > 0;
+    if(!sample->memory)
+      dt_pthread_mutex_unlock(&_measure_lock);
+  }
+#endif
+  sample->wstart = dt_get_wtime();
+}
+
+void dt_tiling_model_end(struct dt_iop_module_t *self,
+                         struct dt_dev_pixelpipe_iop_t *piece,
+                         const dt_iop_roi_t *roi_in,
+                         const dt_iop_roi_t *roi_out,
+                         const int in_bpp,
+                         const int out_bpp,
+                         const dt_develop_tiling_t *tiling,
+                         dt_tiling_model_sample_t *sample)
+{
+  if(sample->wstart == 0.0) return;
+  const double time = dt_get_wtime() - sample->wstart;
+
+  double scratch = -1.0;
+#if defined(__linux__)
+  if(sample->memory)
+  {
+    const size_t peak = _peak_resident();
+    dt_pthread_mutex_unlock(&_measure_lock);
+    // only valid if no other worker ran in between
+    if(peak
+       && dt_atomic_get_int(&_workers) == 1
+       && dt_atomic_get_int(&_workers_started) == sample->workers)
+      scratch = (double)(peak > sample->rss ? peak - sample->rss : 0);
+  }
+#endif
+
+  const int max_bpp = MAX(in_bpp, out_bpp);
+  const double buffer = (double)MAX(roi_in->width, roi_out->width)
+    * MAX(roi_in->height, roi_out->height) * max_bpp / MB;
+  const double mpix = (double)roi_out->width * roi_out->height / 1.0e6;
+
+  // what the module itself reports, tiling might hold the model already
+  dt_develop_tiling_t reported = { 0 };
+  reported.factor_cl = reported.maxbuf_cl = -1;
+  self->tiling_callback(self, piece, roi_in, roi_out, &reported);
+  const double predicted_static = reported.factor * buffer + reported.overhead / MB;
+
+  char key[64];
+  _model_key(self, piece, key, sizeof(key));
+
+  dt_pthread_mutex_lock(&_lock);
+  _model_t *m = _get_model(key);
+
+  double predicted_model = -1.0, predicted_time = -1.0;
+  const gboolean have_model = _fit_predict(&m->memory, buffer, &predicted_model);
+  const gboolean have_time = _fit_predict(&m->time, mpix, &predicted_time);
+
+  m->runs++;
+  double used = -1.0;
+  if(scratch >= 0.0)
+  {
+    // the input and output buffers existed before, the rest was needed by process()
+    used = ((double)roi_in->width * roi_in->height * in_bpp
+            + (double)roi_out->width * roi_out->height * out_bpp
+            + scratch) / MB;
+    m->memory_runs++;
+    m->error_static += fabs(predicted_static - used) / used;
+    if(have_model)
+    {
+      m->model_runs++;
+      m->error_model += fabs(predicted_model - used) / used;
+    }
+    _fit_add(&m->memory, buffer, used);
+  }
+  if(have_time && time > 0.0)
+  {
+    m->time_runs++;
+    m->error_time += fabs(predicted_time - time) / time;
+  }
+  _fit_add(&m->time, mpix, time);
+  _dirty = TRUE;
+  dt_pthread_mutex_unlock(&_lock);
+
+  char model[32] = "-", actual[32] = "-", ptime[32] = "-";
+  if(have_model) snprintf(model, sizeof(model), "%.0fMB", predicted_model);
+  if(used >= 0.0) snprintf(actual, sizeof(actual), "%.0fMB", used);
+  if(have_time) snprintf(ptime, sizeof(ptime), "%.3fs", predicted_time);
+  dt_print(DT_DEBUG_TILING,
+           "[tiling model] [%s] `%s%s' %.1fMP: memory static %.0fMB (factor %.2f), model %s,"
+           " used %s (factor %.2f in plan); time model %s, used %.3fs\n",
+           dt_dev_pixelpipe_type_to_str(piece->pipe->type), self->op, dt_iop_get_instance_id(self),
+           mpix, predicted_static, reported.factor, model, actual, tiling->factor, ptime, time);
+}
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -0,0 +1,85 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "develop/tiling.h"
+
+/**
+ * measured memory and time models of the modules, used to plan tiling on
+ * the CPU.
+ *
+ * the factor and overhead reported by tiling_callback() are estimates by
+ * the module authors. with tiling_planner set to "record" or "on", untiled
+ * runs of a module in export pipes are measured: the memory is the peak
+ * resident size of darktable while process() runs (linux only) plus the
+ * input and output buffers, the time is the wall time of process(). the
+ * resident size covers the whole process, so memory is only measured while
+ * the pipe is the only worker, see dt_tiling_model_worker_enter(). per
+ * module and set of parameters a linear regression in the size of the
+ * image buffer is kept and stored in the cache directory between runs.
+ *
+ * with tiling_planner set to "on" the model raises factor and overhead
+ * once a module has been measured a few times, it never goes below what
+ * tiling_callback() reports. -d tiling compares the predicted with the
+ * measured numbers for every run and prints a summary per module on exit.
+ */
+
+typedef struct dt_tiling_model_sample_t
+{
+  double wstart;
+  size_t rss;            // resident bytes before process(), 0 if not measured
+  gboolean memory;       // we hold the resident size measurement
+  int workers;           // workers started before process(), see below
+} dt_tiling_model_sample_t;
+
+void dt_tiling_model_init(void);
+void dt_tiling_model_cleanup(void);
+
+/** threads running a pipe, an export or decoding an image call these
+ * around their work, nested calls of one thread count once. */
+void dt_tiling_model_worker_enter(void);
+void dt_tiling_model_worker_leave(void);
+
+/** raise factor and overhead of tiling to the model of the module, if
+ * enabled and trusted. max_bpp is the size of a pixel of the larger of the
+ * input and output buffers. returns TRUE if the model was applied */
+gboolean dt_tiling_model_apply(struct dt_iop_module_t *self,
+                               struct dt_dev_pixelpipe_iop_t *piece,
+                               const dt_iop_roi_t *roi_in,
+                               const dt_iop_roi_t *roi_out,
+                               const int max_bpp,
+                               dt_develop_tiling_t *tiling);
+
+/** measure an untiled run of process() between begin and end */
+void dt_tiling_model_begin(struct dt_dev_pixelpipe_iop_t *piece,
+                           dt_tiling_model_sample_t *sample);
+void dt_tiling_model_end(struct dt_iop_module_t *self,
+                         struct dt_dev_pixelpipe_iop_t *piece,
+                         const dt_iop_roi_t *roi_in,
+                         const dt_iop_roi_t *roi_out,
+                         const int in_bpp,
+                         const int out_bpp,
+                         const dt_develop_tiling_t *tiling,
+                         dt_tiling_model_sample_t *sample);
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -1,6 +1,6 @@
 /*
     This file is part of darktable,
-    Copyright (C) 2015-2022 darktable developers.
+    Copyright (C) 2015-2024 darktable developers.
 
     darktable is free software: you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
@@ -45,7 +45,92 @@
 #include "win/main_wrapper.h"
 #endif
 
-static int generate_thumbnail_cache(const dt_mipmap_size_t min_mip, const dt_mipmap_size_t max_mip, const dt_imgid_t min_imgid, const int32_t max_imgid)
+typedef struct _cache_worker_t
+{
+  GArray *imgids;
+  gint next;                 // index of the next image to be claimed
+  gint counter;              // images done, for the progress output
+  dt_mipmap_size_t min_mip, max_mip;
+  GAsyncQueue *written;      // images whose thumbnails are ready to be written to disk
+  int omp_threads;
+} _cache_worker_t;
+
+// sentinel pushed to the writer queue once all workers are done
+#define _WRITER_DONE GINT_TO_POINTER(-1)
+
+static gboolean _mip_on_disk(const dt_imgid_t imgid, const dt_mipmap_size_t mip)
+{
+  return dt_mipmap_cache_on_disk(darktable.mipmap_cache, imgid, mip);
+}
+
+static void _generate_image(_cache_worker_t *w, const dt_imgid_t imgid)
+{
+  // anything to do at all?
+  gboolean missing = FALSE;
+  for(int k = w->max_mip; k >= (int)w->min_mip && k >= 0 && !missing; k--)
+    missing = !_mip_on_disk(imgid, k);
+  if(!missing) return;
+
+  // compute the largest level once (or read it back from disk if it is
+  // there already) and keep it locked, so that all smaller levels get
+  // downsampled from it instead of running the pipe again.
+  dt_mipmap_buffer_t top;
+  dt_mipmap_cache_get(darktable.mipmap_cache, &top, imgid, w->max_mip, DT_MIPMAP_BLOCKING, 'r');
+
+  for(int k = w->max_mip - 1; k >= (int)w->min_mip && k >= 0; k--)
+  {
+    if(_mip_on_disk(imgid, k)) continue;
+
+    dt_mipmap_buffer_t buf;
+    dt_mipmap_cache_get(darktable.mipmap_cache, &buf, imgid, k, DT_MIPMAP_BLOCKING, 'r');
+    dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
+  }
+  dt_mipmap_cache_release(darktable.mipmap_cache, &top);
+
+  // hand over to the writer thread, it encodes the jpegs while we go on
+  g_async_queue_push(w->written, GINT_TO_POINTER(imgid));
+}
+
+static void *_generate_worker(void *ptr)
+{
+  _cache_worker_t *w = (_cache_worker_t *)ptr;
+#ifdef _OPENMP // need to do this in every thread
+  omp_set_num_threads(w->omp_threads);
+#endif
+  const gint count = w->imgids->len;
+  gint i;
+  while((i = g_atomic_int_add(&w->next, 1)) < count)
+  {
+    const dt_imgid_t imgid = g_array_index(w->imgids, dt_imgid_t, i);
+    _generate_image(w, imgid);
+
+    const gint counter = g_atomic_int_add(&w->counter, 1) + 1;
+    fprintf(stderr, "image %d/%d (%.02f%%) (id:%d)\n", counter, count, 100.0 * counter / (float)count, imgid);
+  }
+  return NULL;
+}
+
+static void *_write_worker(void *ptr)
+{
+  _cache_worker_t *w = (_cache_worker_t *)ptr;
+  dt_pthread_setname("cache writer");
+  gpointer item;
+  while((item = g_async_queue_pop(w->written)) != _WRITER_DONE)
+  {
+    const dt_imgid_t imgid = GPOINTER_TO_INT(item);
+    // write thumbs to disc and remove from mipmap cache.
+    dt_mimap_cache_evict(darktable.mipmap_cache, imgid);
+    // thumbnail in sync with image
+    dt_history_hash_set_mipmap(imgid);
+  }
+  return NULL;
+}
+
+static int generate_thumbnail_cache(const dt_mipmap_size_t min_mip,
+                                    const dt_mipmap_size_t max_mip,
+                                    const dt_imgid_t min_imgid,
+                                    const int32_t max_imgid,
+                                    const int jobs)
 {
   fprintf(stderr, _("creating cache directories\n"));
   for(dt_mipmap_size_t k = min_mip; k <= max_mip; k++)
@@ -61,24 +146,21 @@ static int generate_thumbnail_cache(const dt_mipmap_size_t min_mip, const dt_mip
     }
   }
 
-  // some progress counter
+  // collect all images first, the workers pick them from the array
   sqlite3_stmt *stmt;
-  size_t image_count = 0, counter = 0;
+  GArray *imgids = g_array_new(FALSE, FALSE, sizeof(dt_imgid_t));
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT COUNT(*) FROM main.images WHERE id >= ?1 AND id <= ?2", -1, &stmt, 0);
+                              "SELECT id FROM main.images WHERE id >= ?1 AND id <= ?2", -1, &stmt, 0);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, min_imgid);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, max_imgid);
-  if(sqlite3_step(stmt) == SQLITE_ROW)
-  {
-    image_count = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
-  }
-  else
+  while(sqlite3_step(stmt) == SQLITE_ROW)
   {
-    return 1;
+    const dt_imgid_t imgid = sqlite3_column_int(stmt, 0);
+    g_array_append_val(imgids, imgid);
   }
+  sqlite3_finalize(stmt);
 
-  if(!image_count)
+  if(!imgids->len)
   {
     fprintf(stderr, _("warning: no images are matching the requested image id range\n"));
     if(min_imgid > max_imgid)
@@ -87,40 +169,37 @@ static int generate_thumbnail_cache(const dt_mipmap_size_t min_mip, const dt_mip
     }
   }
 
-  // go through all images:
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT id, filename FROM main.images WHERE id >= ?1 AND id <= ?2", -1, &stmt, 0);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, min_imgid);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, max_imgid);
-  while(sqlite3_step(stmt) == SQLITE_ROW)
-  {
-    const dt_imgid_t imgid = sqlite3_column_int(stmt, 0);
-    const char *imgfilename = (const char*)sqlite3_column_text(stmt, 1);
+  _cache_worker_t w = { 0 };
+  w.imgids = imgids;
+  w.min_mip = min_mip;
+  w.max_mip = max_mip;
+  w.written = g_async_queue_new();
+  const int nworkers = CLAMP(jobs, 1, MAX(1, (int)imgids->len));
+  w.omp_threads = MAX(1, (int)dt_get_num_threads() / nworkers);
 
-    counter++;
-    fprintf(stderr, "image %zu/%zu (%.02f%%) (id:%d, file=%s)\n", counter, image_count, 100.0 * counter / (float)image_count, imgid, imgfilename);
+  pthread_t writer;
+  const gboolean async_write = !dt_pthread_create(&writer, _write_worker, &w);
 
-    for(int k = max_mip; k >= min_mip && k >= 0; k--)
-    {
-      char filename[PATH_MAX] = { 0 };
-      snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", darktable.mipmap_cache->cachedir, k, imgid);
+  pthread_t *threads = g_malloc0_n(nworkers, sizeof(pthread_t));
+  int started = 0;
+  for(int k = 0; k < nworkers; k++)
+    if(!dt_pthread_create(&threads[started], _generate_worker, &w)) started++;
 
-      // if a valid thumbnail file is already on disc - do nothing
-      if(dt_util_test_image_file(filename)) continue;
+  // fall back to doing everything here if no thread could be started
+  if(!started) _generate_worker(&w);
 
-      // else, generate thumbnail and store in mipmap cache.
-      dt_mipmap_buffer_t buf;
-      dt_mipmap_cache_get(darktable.mipmap_cache, &buf, imgid, k, DT_MIPMAP_BLOCKING, 'r');
-      dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
-    }
+  for(int k = 0; k < started; k++)
+    pthread_join(threads[k], NULL);
+  g_free(threads);
 
-    // and immediately write thumbs to disc and remove from mipmap cache.
-    dt_mimap_cache_evict(darktable.mipmap_cache, imgid);
-    // thumbnail in sync with image
-    dt_history_hash_set_mipmap(imgid);
-  }
+  g_async_queue_push(w.written, _WRITER_DONE);
+  if(async_write)
+    pthread_join(writer, NULL);
+  else
+    _write_worker(&w);
 
-  sqlite3_finalize(stmt);
+  g_async_queue_unref(w.written);
+  g_array_free(imgids, TRUE);
   fprintf(stderr, "done\n");
 
   return 0;
@@ -132,13 +211,17 @@ static void usage(const char *progname)
           "usage: %s [-h, --help; --version]\n"
           "  [--min-mip <0-8> (default = 0)] [-m, --max-mip <0-8> (default = 2)]\n"
           "  [--min-imgid <N>] [--max-imgid <N>]\n"
+          "  [-j, --jobs <N> (default = number of worker threads)]\n"
           "  [--core <darktable options>]\n"
           "\n"
           "When multiple mipmap sizes are requested, the biggest one is computed\n"
           "while the rest are quickly downsampled.\n"
           "\n"
           "The --min-imgid and --max-imgid specify the range of internal image ID\n"
-          "numbers to work on.\n",
+          "numbers to work on.\n"
+          "\n"
+          "The --jobs option sets the number of images processed in parallel,\n"
+          "the thumbnails are written to disk by a separate thread.\n",
           progname);
 }
 
@@ -164,6 +247,7 @@ int main(int argc, char *arg[])
   dt_mipmap_size_t max_mip = DT_MIPMAP_2;
   dt_imgid_t min_imgid = NO_IMGID;
   int32_t max_imgid = INT32_MAX;
+  int jobs = 0;
 
   int k;
   for(k = 1; k < argc; k++)
@@ -199,6 +283,11 @@ int main(int argc, char *arg[])
       k++;
       max_imgid = (int32_t)MIN(MAX(atoi(arg[k]), 0), INT32_MAX);
     }
+    else if((!strcmp(arg[k], "-j") || !strcmp(arg[k], "--jobs")) && argc > k + 1)
+    {
+      k++;
+      jobs = MAX(atoi(arg[k]), 1);
+    }
     else if(!strcmp(arg[k], "--core"))
     {
       // everything from here on should be passed to the core
@@ -252,7 +341,8 @@ int main(int argc, char *arg[])
 
   fprintf(stderr, _("creating complete lighttable thumbnail cache\n"));
 
-  if(generate_thumbnail_cache(min_mip, max_mip, min_imgid, max_imgid))
+  if(generate_thumbnail_cache(min_mip, max_mip, min_imgid, max_imgid,
+                              jobs ? jobs : dt_worker_threads()))
   {
     free(m_arg);
     exit(EXIT_FAILURE);
@@ -33,6 +33,7 @@
 #include "develop/blend.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
+#include "develop/tiling_model.h"
 #include "imageio/imageio_common.h"
 #include "imageio/imageio_module.h"
 #ifdef HAVE_OPENEXR
@@ -740,6 +741,138 @@ static double _get_pipescale(dt_dev_pixelpipe_t *pipe,
   return fmin(scalex, scaley);
 }
 
+// full images decoded ahead of their export by dt_imageio_export_prefetch()
+typedef struct _export_prefetch_t
+{
+  dt_imgid_t imgid;
+  pthread_t thread;
+  dt_mipmap_buffer_t buf;
+  gboolean ok;
+} _export_prefetch_t;
+
+static GList *_export_prefetches = NULL;
+static pthread_mutex_t _export_prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline gboolean _export_decode_private(void)
+{
+  return dt_conf_get_bool("plugins/lighttable/export/decode_private");
+}
+
+static void *_export_prefetch_run(void *data)
+{
+  _export_prefetch_t *p = (_export_prefetch_t *)data;
+  dt_pthread_setname("export prefetch");
+  const double start = dt_get_wtime();
+  dt_tiling_model_worker_enter();
+  p->ok = dt_mipmap_cache_get_private_full(&p->buf, p->imgid);
+  dt_tiling_model_worker_leave();
+  dt_print(DT_DEBUG_IMAGEIO | DT_DEBUG_PERF,
+           "[export prefetch] decoded image %i in %.3fs\n", p->imgid, dt_get_wtime() - start);
+  return NULL;
+}
+
+gboolean dt_imageio_export_prefetch(const dt_imgid_t imgid)
+{
+  if(!dt_is_valid_imgid(imgid) || !_export_decode_private())
+    return FALSE;
+
+  pthread_mutex_lock(&_export_prefetch_lock);
+  for(GList *l = _export_prefetches; l; l = g_list_next(l))
+  {
+    if(((_export_prefetch_t *)l->data)->imgid == imgid)
+    {
+      pthread_mutex_unlock(&_export_prefetch_lock);
+      return TRUE;
+    }
+  }
+
+  gboolean started = TRUE;
+  _export_prefetch_t *p = g_malloc0(sizeof(_export_prefetch_t));
+  p->imgid = imgid;
+  if(dt_pthread_create(&p->thread, _export_prefetch_run, p))
+  {
+    g_free(p);
+    started = FALSE;
+  }
+  else
+    _export_prefetches = g_list_prepend(_export_prefetches, p);
+  pthread_mutex_unlock(&_export_prefetch_lock);
+  return started;
+}
+
+// wait for the prefetch of the image if there is one. returns TRUE with
+// the private buffer in buf if it succeeded
+static gboolean _export_take_prefetched(const dt_imgid_t imgid,
+                                        dt_mipmap_buffer_t *buf)
+{
+  _export_prefetch_t *p = NULL;
+  pthread_mutex_lock(&_export_prefetch_lock);
+  for(GList *l = _export_prefetches; l; l = g_list_next(l))
+  {
+    if(((_export_prefetch_t *)l->data)->imgid == imgid)
+    {
+      p = (_export_prefetch_t *)l->data;
+      _export_prefetches = g_list_delete_link(_export_prefetches, l);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&_export_prefetch_lock);
+  if(!p) return FALSE;
+
+  pthread_join(p->thread, NULL);
+  const gboolean ok = p->ok;
+  if(ok) *buf = p->buf;
+  g_free(p);
+  return ok;
+}
+
+void dt_imageio_export_prefetch_cleanup(void)
+{
+  pthread_mutex_lock(&_export_prefetch_lock);
+  GList *prefetches = _export_prefetches;
+  _export_prefetches = NULL;
+  pthread_mutex_unlock(&_export_prefetch_lock);
+
+  for(GList *l = prefetches; l; l = g_list_next(l))
+  {
+    _export_prefetch_t *p = (_export_prefetch_t *)l->data;
+    pthread_join(p->thread, NULL);
+    if(p->ok) dt_mipmap_cache_release_private_full(&p->buf);
+    g_free(p);
+  }
+  g_list_free(prefetches);
+}
+
+// get the full image of an export. unless it is in the mipmap cache
+// already, it is decoded into a private buffer, as keeping it in the
+// cache would only push out images that are used again. returns TRUE if
+// buf is private, FALSE if it is a mipmap cache buffer (which may have
+// failed to load)
+static gboolean _export_get_full(const dt_imgid_t imgid,
+                                 dt_mipmap_buffer_t *buf)
+{
+  if(_export_take_prefetched(imgid, buf))
+    return TRUE;
+
+  if(_export_decode_private())
+  {
+    // the image is open in the darkroom or was exported before
+    dt_mipmap_cache_get(darktable.mipmap_cache, buf, imgid,
+                        DT_MIPMAP_FULL, DT_MIPMAP_TESTLOCK, 'r');
+    if(buf->buf && buf->width && buf->height)
+      return FALSE;
+    if(buf->buf)
+      dt_mipmap_cache_release(darktable.mipmap_cache, buf);
+
+    if(dt_mipmap_cache_get_private_full(buf, imgid))
+      return TRUE;
+  }
+
+  dt_mipmap_cache_get(darktable.mipmap_cache, buf, imgid,
+                      DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING, 'r');
+  return FALSE;
+}
+
 // internal function: to avoid exif blob reading + 8-bit byteorder
 // flag + high-quality override
 gboolean dt_imageio_export_with_flags(const dt_imgid_t imgid,
@@ -765,23 +898,29 @@ gboolean dt_imageio_export_with_flags(const dt_imgid_t imgid,
                                  dt_export_metadata_t *metadata,
                                  const int history_end)
 {
-  dt_develop_t dev;
-  dt_dev_init(&dev, FALSE);
-  dt_dev_load_image(&dev, imgid);
-  if(history_end != -1)
-    dt_dev_pop_history_items_ext(&dev, history_end);
-
   const gboolean buf_is_downscaled =
     (thumbnail_export && dt_conf_get_bool("ui/performance"));
 
   if(!thumbnail_export)
     dt_set_backthumb_time(600.0); // make sure we don't interfere
 
-  dt_mipmap_buffer_t buf;
+  dt_tiling_model_worker_enter();
+
+  dt_develop_t dev;
+  dt_dev_init(&dev, FALSE);
+
+  // exports get the full image themselves before loading it into dev,
+  // which would otherwise decode it into the mipmap cache
+  dt_mipmap_buffer_t buf = { 0 };
+  const gboolean private_buf = !thumbnail_export && _export_get_full(imgid, &buf);
+  dt_dev_load_image_ext(&dev, imgid, thumbnail_export);
+  if(history_end != -1)
+    dt_dev_pop_history_items_ext(&dev, history_end);
+
   if(buf_is_downscaled)
     dt_mipmap_cache_get(darktable.mipmap_cache, &buf, imgid,
                         DT_MIPMAP_F, DT_MIPMAP_BLOCKING, 'r');
-  else
+  else if(thumbnail_export)
     dt_mipmap_cache_get(darktable.mipmap_cache, &buf, imgid,
                         DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING, 'r');
 
@@ -1200,7 +1339,10 @@ gboolean dt_imageio_export_with_flags(const dt_imgid_t imgid,
 
   dt_dev_pixelpipe_cleanup(&pipe);
   dt_dev_cleanup(&dev);
-  dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
+  if(private_buf)
+    dt_mipmap_cache_release_private_full(&buf);
+  else
+    dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
 
   if(!thumbnail_export && strcmp(format->mime(format_params), "memory")
     && !(format->flags(format_params) & FORMAT_FLAGS_NO_TMPFILE))
@@ -1232,6 +1374,7 @@ gboolean dt_imageio_export_with_flags(const dt_imgid_t imgid,
                                   format_params, storage, storage_params);
   }
 
+  dt_tiling_model_worker_leave();
   if(!thumbnail_export)
     dt_set_backthumb_time(5.0);
   return FALSE; // success
@@ -1240,8 +1383,12 @@ error:
   dt_dev_pixelpipe_cleanup(&pipe);
 error_early:
   dt_dev_cleanup(&dev);
-  dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
+  if(private_buf)
+    dt_mipmap_cache_release_private_full(&buf);
+  else
+    dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
 
+  dt_tiling_model_worker_leave();
   if(!thumbnail_export)
     dt_set_backthumb_time(5.0);
   return TRUE;
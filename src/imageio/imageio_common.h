@@ -126,6 +126,13 @@ gboolean dt_imageio_export_with_flags(const dt_imgid_t imgid, const char *filena
                                  dt_export_metadata_t *metadata,
                                  const int history_end);
 
+/** start decoding the full image of an upcoming export in the background,
+ * so it overlaps with the processing of the current one. returns FALSE if
+ * the image is not decoded ahead */
+gboolean dt_imageio_export_prefetch(const dt_imgid_t imgid);
+/** wait for and drop prefetched images which were not exported */
+void dt_imageio_export_prefetch_cleanup(void);
+
 size_t dt_imageio_write_pos(const int i,
                             const int j,
                             const int wd,
@@ -28,6 +28,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -73,49 +74,58 @@ dt_imageio_retval_t dt_imageio_open_pfm(dt_image_t *img, const char *filename, d
   if(ret != 1) goto error_corrupt;
   ret = 0;
 
-  int swap_byte_order = (scale_factor >= 0.0) ^ (G_BYTE_ORDER == G_BIG_ENDIAN);
+  // the pixels are converted straight from the mapped file, so a large
+  // pfm doesn't need a second buffer of its size
+  const long offset = ftell(f);
+  fclose(f);
+  if(offset < 0) return DT_IMAGEIO_LOAD_FAILED;
+
+  GMappedFile *map = g_mapped_file_new(filename, FALSE, NULL);
+  if(!map) return DT_IMAGEIO_LOAD_FAILED;
+
+  const size_t width = img->width;
+  const size_t height = img->height;
+  const size_t in_stride = sizeof(float) * cols * width;
+  if(g_mapped_file_get_length(map) < (size_t)offset + in_stride * height)
+  {
+    g_mapped_file_unref(map);
+    return DT_IMAGEIO_LOAD_FAILED;
+  }
+  const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(map) + offset;
+
+  const gboolean swap_byte_order = (scale_factor >= 0.0) ^ (G_BYTE_ORDER == G_BIG_ENDIAN);
 
   img->buf_dsc.channels = 4;
   img->buf_dsc.datatype = TYPE_FLOAT;
   float *buf = (float *)dt_mipmap_cache_alloc(mbuf, img);
-  if(!buf) goto error_cache_full;
-
-  if(cols == 3)
+  if(!buf)
   {
-    ret = fread(buf, 3 * sizeof(float), (size_t)img->width * img->height, f);
-    for(size_t i = (size_t)img->width * img->height; i > 0; i--)
-      for(int c = 0; c < 3; c++)
-      {
-        union { float f; guint32 i; } v;
-        v.f = buf[3 * (i - 1) + c];
-        if(swap_byte_order) v.i = GUINT32_SWAP_LE_BE(v.i);
-        buf[4 * (i - 1) + c] = v.f;
-      }
+    g_mapped_file_unref(map);
+    return DT_IMAGEIO_CACHE_FULL;
   }
-  else
-    for(size_t j = 0; j < img->height; j++)
-      for(size_t i = 0; i < img->width; i++)
+
+  // pfm stores the rows bottom to top
+  DT_OMP_FOR()
+  for(size_t j = 0; j < height; j++)
+  {
+    const uint8_t *in = data + in_stride * (height - 1 - j);
+    float *out = buf + 4 * width * j;
+    for(size_t i = 0; i < width; i++, out += 4)
+    {
+      for(int c = 0; c < cols; c++)
       {
+        // the mapping is only byte aligned past the header
         union { float f; guint32 i; } v;
-        ret = fread(&v.f, sizeof(float), 1, f);
+        memcpy(&v.i, in + sizeof(float) * (cols * i + c), sizeof(float));
         if(swap_byte_order) v.i = GUINT32_SWAP_LE_BE(v.i);
-        buf[4 * (img->width * j + i) + 2] = buf[4 * (img->width * j + i) + 1]
-            = buf[4 * (img->width * j + i) + 0] = v.f;
+        out[c] = v.f;
       }
-
-  float *line = (float *)calloc(4 * img->width, sizeof(float));
-  if(line == NULL) goto error_cache_full;
-
-  for(size_t j = 0; j < img->height / 2; j++)
-  {
-    memcpy(line, buf + img->width * j * 4, sizeof(float) * 4 * img->width);
-    memcpy(buf + img->width * j * 4, buf + img->width * (img->height - 1 - j) * 4,
-           sizeof(float) * 4 * img->width);
-    memcpy(buf + img->width * (img->height - 1 - j) * 4, line, sizeof(float) * 4 * img->width);
+      if(cols == 1) out[1] = out[2] = out[0];
+      out[3] = 0.0f;
+    }
   }
 
-  free(line);
-  fclose(f);
+  g_mapped_file_unref(map);
 
   img->buf_dsc.cst = IOP_CS_RGB;
   img->buf_dsc.filters = 0u;
@@ -129,9 +139,6 @@ dt_imageio_retval_t dt_imageio_open_pfm(dt_image_t *img, const char *filename, d
 error_corrupt:
   fclose(f);
   return DT_IMAGEIO_LOAD_FAILED;
-error_cache_full:
-  fclose(f);
-  return DT_IMAGEIO_CACHE_FULL;
 }
 
 // clang-format off
@@ -34,26 +34,28 @@
 #include <time.h>
 #include <unistd.h>
 
+// the readers convert straight from the mapped file, in parallel rows
+
 // pbm -- portable bit map. values are either 0 or 1, single channel
-static dt_imageio_retval_t _read_pbm(dt_image_t *img, FILE*f, float *buf)
+static dt_imageio_retval_t _read_pbm(dt_image_t *img,
+                                     const uint8_t *data,
+                                     const size_t length,
+                                     float *buf)
 {
-  dt_imageio_retval_t result = DT_IMAGEIO_OK;
-
-  int bytes_needed = (img->width + 7) / 8;
-  uint8_t *line = calloc(bytes_needed, sizeof(uint8_t));
+  const size_t width = img->width;
+  const size_t height = img->height;
+  const size_t bytes_needed = (width + 7) / 8;
+  if(length < bytes_needed * height) return DT_IMAGEIO_LOAD_FAILED;
 
-  float *buf_iter = buf;
-  for(size_t y = 0; y < img->height; y++)
+  DT_OMP_FOR()
+  for(size_t y = 0; y < height; y++)
   {
-    if(fread(line, sizeof(uint8_t), (size_t)bytes_needed, f) != bytes_needed)
-    {
-      result = DT_IMAGEIO_LOAD_FAILED;
-      break;
-    }
+    const uint8_t *line = data + bytes_needed * y;
+    float *buf_iter = buf + 4 * width * y;
     for(size_t x = 0; x < bytes_needed; x++)
     {
       uint8_t byte = line[x] ^ 0xff;
-      for(int bit = 0; bit < 8 && x * 8 + bit < img->width; bit++)
+      for(int bit = 0; bit < 8 && x * 8 + bit < width; bit++)
       {
         float value = ((byte & 0x80) >> 7) * 1.0;
         buf_iter[0] = buf_iter[1] = buf_iter[2] = value;
@@ -64,144 +66,48 @@ static dt_imageio_retval_t _read_pbm(dt_image_t *img, FILE*f, float *buf)
     }
   }
 
-  free(line);
-
-  return result;
+  return DT_IMAGEIO_OK;
 }
 
 // pgm -- portable gray map. values are between 0 and max, single channel
-static dt_imageio_retval_t _read_pgm(dt_image_t *img, FILE*f, float *buf)
-{
-  dt_imageio_retval_t result = DT_IMAGEIO_OK;
-
-  unsigned int max;
-  // We expect at most a 5-digit number (65535) + a newline + '\0', so 7 characters.
-  char maxvalue_string[7];
-  if(fgets(maxvalue_string,7,f))
-    max = atoi(maxvalue_string);
-  else
-    return DT_IMAGEIO_LOAD_FAILED;
-  if(max == 0 || max > 65535) return DT_IMAGEIO_LOAD_FAILED;
-
-  if(max <= 255)
-  {
-    uint8_t *line = calloc(img->width, sizeof(uint8_t));
-
-    float *buf_iter = buf;
-    for(size_t y = 0; y < img->height; y++)
-    {
-      if(fread(line, sizeof(uint8_t), (size_t)img->width, f) != img->width)
-      {
-        result = DT_IMAGEIO_LOAD_FAILED;
-        break;
-      }
-      for(size_t x = 0; x < img->width; x++)
-      {
-        float value = (float)line[x] / (float)max;
-        buf_iter[0] = buf_iter[1] = buf_iter[2] = value;
-        buf_iter[3] = 0.0;
-        buf_iter += 4;
-      }
-    }
-    free(line);
-  }
-  else
-  {
-    uint16_t *line = calloc(img->width, sizeof(uint16_t));
-
-    float *buf_iter = buf;
-    for(size_t y = 0; y < img->height; y++)
-    {
-      if(fread(line, sizeof(uint16_t), (size_t)img->width, f) != img->width)
-      {
-        result = DT_IMAGEIO_LOAD_FAILED;
-        break;
-      }
-      for(size_t x = 0; x < img->width; x++)
-      {
-        uint16_t intvalue = line[x];
-        if(G_BYTE_ORDER != G_BIG_ENDIAN)
-          intvalue = GUINT16_SWAP_LE_BE(intvalue);
-        float value = (float)intvalue / (float)max;
-        buf_iter[0] = buf_iter[1] = buf_iter[2] = value;
-        buf_iter[3] = 0.0;
-        buf_iter += 4;
-      }
-    }
-    free(line);
-  }
-
-  return result;
-}
-
 // ppm -- portable pix map. values are between 0 and max, three channels
-static dt_imageio_retval_t _read_ppm(dt_image_t *img, FILE*f, float *buf)
+static dt_imageio_retval_t _read_pgm_ppm(dt_image_t *img,
+                                         const uint8_t *data,
+                                         const size_t length,
+                                         const unsigned int max,
+                                         const int cols,
+                                         float *buf)
 {
-  dt_imageio_retval_t result = DT_IMAGEIO_OK;
+  const size_t width = img->width;
+  const size_t height = img->height;
+  const size_t bytes = max <= 255 ? 1 : 2;
+  const size_t stride = bytes * cols * width;
+  if(length < stride * height) return DT_IMAGEIO_LOAD_FAILED;
 
-  unsigned int max;
-  // We expect at most a 5-digit number (65535) + a newline + '\0', so 7 characters.
-  char maxvalue_string[7];
-  if(fgets(maxvalue_string,7,f))
-    max = atoi(maxvalue_string);
-  else
-    return DT_IMAGEIO_LOAD_FAILED;
-  if(max == 0 || max > 65535) return DT_IMAGEIO_LOAD_FAILED;
+  const float scale = 1.0f / (float)max;
 
-  if(max <= 255)
+  DT_OMP_FOR()
+  for(size_t y = 0; y < height; y++)
   {
-    uint8_t *line = calloc((size_t)3 * img->width, sizeof(uint8_t));
-
-    float *buf_iter = buf;
-    for(size_t y = 0; y < img->height; y++)
+    const uint8_t *line = data + stride * y;
+    float *buf_iter = buf + 4 * width * y;
+    for(size_t x = 0; x < width; x++, buf_iter += 4)
     {
-      if(fread(line, 3 * sizeof(uint8_t), (size_t)img->width, f) != img->width)
-      {
-        result = DT_IMAGEIO_LOAD_FAILED;
-        break;
-      }
-      for(size_t x = 0; x < img->width; x++)
+      for(int c = 0; c < cols; c++)
       {
-        for(int c = 0; c < 3; c++)
-        {
-          float value = (float)line[x * 3 + c] / (float)max;
-          *buf_iter++ = value;
-        }
-        *buf_iter++ = 0.0;
+        const size_t k = cols * x + c;
+        // 16 bit values are big endian! http://netpbm.sourceforge.net/doc/ppm.html
+        const unsigned int intvalue = bytes == 1
+          ? line[k]
+          : ((unsigned int)line[2 * k] << 8) | line[2 * k + 1];
+        buf_iter[c] = (float)intvalue * scale;
       }
+      if(cols == 1) buf_iter[1] = buf_iter[2] = buf_iter[0];
+      buf_iter[3] = 0.0;
     }
-    free(line);
   }
-  else
-  {
-    uint16_t *line = calloc((size_t)3 * img->width, sizeof(uint16_t));
 
-    float *buf_iter = buf;
-    for(size_t y = 0; y < img->height; y++)
-    {
-      if(fread(line, 3 * sizeof(uint16_t), (size_t)img->width, f) != img->width)
-      {
-        result = DT_IMAGEIO_LOAD_FAILED;
-        break;
-      }
-      for(size_t x = 0; x < img->width; x++)
-      {
-        for(int c = 0; c < 3; c++)
-        {
-          uint16_t intvalue = line[x * 3 + c];
-          // PPM files are big endian! http://netpbm.sourceforge.net/doc/ppm.html
-          if(G_BYTE_ORDER != G_BIG_ENDIAN)
-            intvalue = GUINT16_SWAP_LE_BE(intvalue);
-          float value = (float)intvalue / (float)max;
-          *buf_iter++ = value;
-        }
-        *buf_iter++ = 0.0;
-      }
-    }
-    free(line);
-  }
-
-  return result;
+  return DT_IMAGEIO_OK;
 }
 
 dt_imageio_retval_t dt_imageio_open_pnm(dt_image_t *img, const char *filename, dt_mipmap_buffer_t *mbuf)
@@ -214,11 +120,15 @@ dt_imageio_retval_t dt_imageio_open_pnm(dt_image_t *img, const char *filename, d
   if(!f) return DT_IMAGEIO_LOAD_FAILED;
   int ret = 0;
   dt_imageio_retval_t result = DT_IMAGEIO_LOAD_FAILED;
+  GMappedFile *map = NULL;
 
   char head[2] = { 'X', 'X' };
   ret = fscanf(f, "%c%c ", head, head + 1);
   if(ret != 2 || head[0] != 'P') goto end;
 
+  // we don't support ASCII variants or P7 anymaps! thanks to magic numbers those shouldn't reach us anyway.
+  if(head[1] != '4' && head[1] != '5' && head[1] != '6') goto end;
+
   char width_string[10] = { 0 };
   char height_string[10] = { 0 };
   ret = fscanf(f, "%9s %9s ", width_string, height_string);
@@ -229,6 +139,23 @@ dt_imageio_retval_t dt_imageio_open_pnm(dt_image_t *img, const char *filename, d
   img->height = strtol(height_string, NULL, 0);
   if(errno != 0 || img->width <= 0 || img->height <= 0) goto end;
 
+  unsigned int max = 1;
+  if(head[1] != '4')
+  {
+    // We expect at most a 5-digit number (65535) + a newline + '\0', so 7 characters.
+    char maxvalue_string[7];
+    if(!fgets(maxvalue_string, 7, f)) goto end;
+    max = atoi(maxvalue_string);
+    if(max == 0 || max > 65535) goto end;
+  }
+
+  const long offset = ftell(f);
+  if(offset < 0) goto end;
+  map = g_mapped_file_new(filename, FALSE, NULL);
+  if(!map || g_mapped_file_get_length(map) < (size_t)offset) goto end;
+  const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(map) + offset;
+  const size_t length = g_mapped_file_get_length(map) - offset;
+
   img->buf_dsc.channels = 4;
   img->buf_dsc.datatype = TYPE_FLOAT;
 
@@ -239,15 +166,13 @@ dt_imageio_retval_t dt_imageio_open_pnm(dt_image_t *img, const char *filename, d
     goto end;
   }
 
-  // we don't support ASCII variants or P7 anymaps! thanks to magic numbers those shouldn't reach us anyway.
   if(head[1] == '4')
-    result = _read_pbm(img, f, buf);
-  else if(head[1] == '5')
-    result = _read_pgm(img, f, buf);
-  else if(head[1] == '6')
-    result = _read_ppm(img, f, buf);
+    result = _read_pbm(img, data, length, buf);
+  else
+    result = _read_pgm_ppm(img, data, length, max, head[1] == '5' ? 1 : 3, buf);
 
 end:
+  if(map) g_mapped_file_unref(map);
   fclose(f);
 
   if(result == DT_IMAGEIO_OK)
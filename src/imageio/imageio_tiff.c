@@ -46,6 +46,10 @@ typedef struct tiff_t
   dt_image_t *image;
   float *mipbuf;
   tdata_t buf;
+  // uncompressed strips are converted straight from the mapped file
+  GMappedFile *map;
+  const uint64_t *stripoffsets;
+  uint32_t rowsperstrip;
 } tiff_t;
 
 #ifndef HAVE_IMATH
@@ -84,135 +88,167 @@ static inline float _half_to_float(uint16_t h)
 }
 #endif
 
-static inline int _read_chunky_8(tiff_t *t)
+static inline void _convert_8(const tiff_t *t, const void *data, float *out)
 {
-  for(uint32_t row = 0; row < t->height; row++)
+  const uint8_t *in = (const uint8_t *)data;
+  for(uint32_t i = 0; i < t->width; i++, in += t->spp, out += 4)
   {
-    uint8_t *in = ((uint8_t *)t->buf);
-    float *out = ((float *)t->mipbuf) + (size_t)4 * row * t->width;
-
-    /* read scanline */
-    if(TIFFReadScanline(t->tiff, in, row, 0) == -1) return -1;
+    /* set rgb to first sample from scanline */
+    out[0] = ((float)in[0]) * (1.0f / 255.0f);
 
-    for(uint32_t i = 0; i < t->width; i++, in += t->spp, out += 4)
+    if(t->spp == 1)
     {
-      /* set rgb to first sample from scanline */
-      out[0] = ((float)in[0]) * (1.0f / 255.0f);
-
-      if(t->spp == 1)
-      {
-        out[1] = out[2] = out[0];
-      }
-      else
-      {
-        out[1] = ((float)in[1]) * (1.0f / 255.0f);
-        out[2] = ((float)in[2]) * (1.0f / 255.0f);
-      }
-
-      out[3] = 0;
+      out[1] = out[2] = out[0];
+    }
+    else
+    {
+      out[1] = ((float)in[1]) * (1.0f / 255.0f);
+      out[2] = ((float)in[2]) * (1.0f / 255.0f);
     }
-  }
 
-  return 1;
+    out[3] = 0;
+  }
 }
 
-static inline int _read_chunky_16(tiff_t *t)
+static inline void _convert_16(const tiff_t *t, const void *data, float *out)
 {
-  for(uint32_t row = 0; row < t->height; row++)
+  const uint16_t *in = (const uint16_t *)data;
+  for(uint32_t i = 0; i < t->width; i++, in += t->spp, out += 4)
   {
-    uint16_t *in = ((uint16_t *)t->buf);
-    float *out = ((float *)t->mipbuf) + (size_t)4 * row * t->width;
-
-    /* read scanline */
-    if(TIFFReadScanline(t->tiff, in, row, 0) == -1) return -1;
+    out[0] = ((float)in[0]) * (1.0f / 65535.0f);
 
-    for(uint32_t i = 0; i < t->width; i++, in += t->spp, out += 4)
+    if(t->spp == 1)
     {
-      out[0] = ((float)in[0]) * (1.0f / 65535.0f);
-
-      if(t->spp == 1)
-      {
-        out[1] = out[2] = out[0];
-      }
-      else
-      {
-        out[1] = ((float)in[1]) * (1.0f / 65535.0f);
-        out[2] = ((float)in[2]) * (1.0f / 65535.0f);
-      }
-
-      out[3] = 0;
+      out[1] = out[2] = out[0];
+    }
+    else
+    {
+      out[1] = ((float)in[1]) * (1.0f / 65535.0f);
+      out[2] = ((float)in[2]) * (1.0f / 65535.0f);
     }
-  }
 
-  return 1;
+    out[3] = 0;
+  }
 }
 
-static inline int _read_chunky_h(tiff_t *t)
+static inline void _convert_h(const tiff_t *t, const void *data, float *out)
 {
-  for(uint32_t row = 0; row < t->height; row++)
+  const uint16_t *in = (const uint16_t *)data;
+  for(uint32_t i = 0; i < t->width; i++, in += t->spp, out += 4)
   {
-    uint16_t *in = ((uint16_t *)t->buf);
-    float *out = ((float *)t->mipbuf) + (size_t)4 * row * t->width;
-
-    /* read scanline */
-    if(TIFFReadScanline(t->tiff, in, row, 0) == -1) return -1;
-
-    for(uint32_t i = 0; i < t->width; i++, in += t->spp, out += 4)
-    {
 #ifdef HAVE_IMATH
-      out[0] = imath_half_to_float(in[0]);
+    out[0] = imath_half_to_float(in[0]);
 #else
-      out[0] = _half_to_float(in[0]);
+    out[0] = _half_to_float(in[0]);
 #endif
 
-      if(t->spp == 1)
-      {
-        out[1] = out[2] = out[0];
-      }
-      else
-      {
+    if(t->spp == 1)
+    {
+      out[1] = out[2] = out[0];
+    }
+    else
+    {
 #ifdef HAVE_IMATH
-        out[1] = imath_half_to_float(in[1]);
-        out[2] = imath_half_to_float(in[2]);
+      out[1] = imath_half_to_float(in[1]);
+      out[2] = imath_half_to_float(in[2]);
 #else
-        out[1] = _half_to_float(in[1]);
-        out[2] = _half_to_float(in[2]);
+      out[1] = _half_to_float(in[1]);
+      out[2] = _half_to_float(in[2]);
 #endif
-      }
-
-      out[3] = 0;
     }
-  }
 
-  return 1;
+    out[3] = 0;
+  }
 }
 
-static inline int _read_chunky_f(tiff_t *t)
+static inline void _convert_f(const tiff_t *t, const void *data, float *out)
 {
-  for(uint32_t row = 0; row < t->height; row++)
+  const float *in = (const float *)data;
+  for(uint32_t i = 0; i < t->width; i++, in += t->spp, out += 4)
   {
-    float *in = ((float *)t->buf);
-    float *out = ((float *)t->mipbuf) + (size_t)4 * row * t->width;
+    out[0] = in[0];
 
-    /* read scanline */
-    if(TIFFReadScanline(t->tiff, in, row, 0) == -1) return -1;
+    if(t->spp == 1)
+    {
+      out[1] = out[2] = out[0];
+    }
+    else
+    {
+      out[1] = in[1];
+      out[2] = in[2];
+    }
 
-    for(uint32_t i = 0; i < t->width; i++, in += t->spp, out += 4)
+    out[3] = 0;
+  }
+}
+
+typedef void (*_convert_t)(const tiff_t *t, const void *data, float *out);
+
+// map the file if the image is stored in uncompressed strips in our byte
+// order, so rows can be converted without going through libtiff.
+static gboolean _map_strips(tiff_t *t, const char *filename)
+{
+  uint16_t compression = COMPRESSION_NONE;
+  TIFFGetFieldDefaulted(t->tiff, TIFFTAG_COMPRESSION, &compression);
+  if(compression != COMPRESSION_NONE || TIFFIsTiled(t->tiff)
+     || (t->bpp > 8 && TIFFIsByteSwapped(t->tiff)))
+    return FALSE;
+
+  uint64_t *offsets = NULL;
+  uint32_t rowsperstrip = 0;
+  if(!TIFFGetField(t->tiff, TIFFTAG_STRIPOFFSETS, &offsets) || !offsets)
+    return FALSE;
+  TIFFGetFieldDefaulted(t->tiff, TIFFTAG_ROWSPERSTRIP, &rowsperstrip);
+  rowsperstrip = MIN(rowsperstrip, t->height);
+  if(rowsperstrip == 0) return FALSE;
+
+  GMappedFile *map = g_mapped_file_new(filename, FALSE, NULL);
+  if(!map) return FALSE;
+
+  // the samples are read in place, which needs them aligned
+  const uintptr_t align = t->bpp / 8;
+  const size_t length = g_mapped_file_get_length(map);
+  const uintptr_t base = (uintptr_t)g_mapped_file_get_contents(map);
+  const uint32_t nstrips = (t->height + rowsperstrip - 1) / rowsperstrip;
+  for(uint32_t s = 0; s < nstrips; s++)
+  {
+    const size_t rows = MIN(rowsperstrip, t->height - s * rowsperstrip);
+    if(offsets[s] > length
+       || length - offsets[s] < rows * t->scanlinesize
+       || (base + offsets[s]) % align
+       || (rows > 1 && t->scanlinesize % align))
     {
-      out[0] = in[0];
+      g_mapped_file_unref(map);
+      return FALSE;
+    }
+  }
 
-      if(t->spp == 1)
-      {
-        out[1] = out[2] = out[0];
-      }
-      else
-      {
-        out[1] = in[1];
-        out[2] = in[2];
-      }
+  t->map = map;
+  t->stripoffsets = offsets;
+  t->rowsperstrip = rowsperstrip;
+  return TRUE;
+}
 
-      out[3] = 0;
+static inline int _read_chunky(tiff_t *t, _convert_t convert)
+{
+  if(t->map)
+  {
+    const uint8_t *data = (const uint8_t *)g_mapped_file_get_contents(t->map);
+    DT_OMP_FOR()
+    for(uint32_t row = 0; row < t->height; row++)
+    {
+      const uint8_t *in = data + t->stripoffsets[row / t->rowsperstrip]
+                          + (size_t)(row % t->rowsperstrip) * t->scanlinesize;
+      convert(t, in, ((float *)t->mipbuf) + (size_t)4 * row * t->width);
     }
+    return 1;
+  }
+
+  for(uint32_t row = 0; row < t->height; row++)
+  {
+    /* read scanline */
+    if(TIFFReadScanline(t->tiff, t->buf, row, 0) == -1) return -1;
+    convert(t, t->buf, ((float *)t->mipbuf) + (size_t)4 * row * t->width);
   }
 
   return 1;
@@ -367,6 +403,7 @@ dt_imageio_retval_t dt_imageio_open_tiff(dt_image_t *img, const char *filename,
   uint16_t inkset;
 
   t.image = img;
+  t.map = NULL;
 
 #ifdef _WIN32
   wchar_t *wfilename = g_utf8_to_utf16(filename, -1, NULL, NULL, NULL);
@@ -464,25 +501,28 @@ dt_imageio_retval_t dt_imageio_open_tiff(dt_image_t *img, const char *filename,
   }
 
   int ok = 1;
+  const gboolean lab = photometric == PHOTOMETRIC_CIELAB || photometric == PHOTOMETRIC_ICCLAB;
+  if(!lab) _map_strips(&t, filename);
 
   if((photometric == PHOTOMETRIC_CIELAB || photometric == PHOTOMETRIC_ICCLAB) && t.bpp == 8 && t.sampleformat == SAMPLEFORMAT_UINT)
     ok = _read_chunky_8_Lab(&t, photometric);
   else if((photometric == PHOTOMETRIC_CIELAB || photometric == PHOTOMETRIC_ICCLAB) && t.bpp == 16 && t.sampleformat == SAMPLEFORMAT_UINT)
     ok = _read_chunky_16_Lab(&t, photometric);
   else if(t.bpp == 8 && t.sampleformat == SAMPLEFORMAT_UINT)
-    ok = _read_chunky_8(&t);
+    ok = _read_chunky(&t, _convert_8);
   else if(t.bpp == 16 && t.sampleformat == SAMPLEFORMAT_UINT)
-    ok = _read_chunky_16(&t);
+    ok = _read_chunky(&t, _convert_16);
   else if(t.bpp == 16 && t.sampleformat == SAMPLEFORMAT_IEEEFP)
-    ok = _read_chunky_h(&t);
+    ok = _read_chunky(&t, _convert_h);
   else if(t.bpp == 32 && t.sampleformat == SAMPLEFORMAT_IEEEFP)
-    ok = _read_chunky_f(&t);
+    ok = _read_chunky(&t, _convert_f);
   else
   {
     dt_print(DT_DEBUG_ALWAYS, "[tiff_open] error: not a supported tiff image format.\n");
     ok = 0;
   }
 
+  if(t.map) g_mapped_file_unref(t.map);
   _TIFFfree(t.buf);
   TIFFClose(t.tiff);
 
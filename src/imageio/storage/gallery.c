@@ -277,6 +277,10 @@ int store(dt_imageio_module_storage_t *self,
 
   char tmp_dir[PATH_MAX] = { 0 };
 
+  // we're potentially called in parallel. the filename pattern and the
+  // variables are shared, so have them synchronized:
+  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
+
   // set variable values to expand them afterwards in darktable variables
   dt_variables_set_max_width_height(d->vp, fdata->max_width, fdata->max_height);
   dt_variables_set_upscale(d->vp, upscale);
@@ -324,11 +328,13 @@ int store(dt_imageio_module_storage_t *self,
     dt_print(DT_DEBUG_ALWAYS,
              "[imageio_storage_gallery] could not create directory: `%s'!\n", dirname);
     dt_control_log(_("could not create directory `%s'!"), dirname);
+    dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
     return 1;
   }
 
   // store away dir.
   g_strlcpy(d->cached_dirname, dirname, sizeof(d->cached_dirname));
+  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
 
   c = filename + strlen(filename);
   for(; c > filename && *c != '.' && *c != '/'; c--)
@@ -373,7 +379,7 @@ int store(dt_imageio_module_storage_t *self,
   sprintf(c, "-thumb.%s", ext);
 
   char subfilename[PATH_MAX] = { 0 }, relsubfilename[PATH_MAX] = { 0 };
-  g_strlcpy(subfilename, d->cached_dirname, sizeof(subfilename));
+  g_strlcpy(subfilename, dirname, sizeof(subfilename));
   char *sc = subfilename + strlen(subfilename);
   sprintf(sc, "/img_%d.html", num);
   snprintf(relsubfilename, sizeof(relsubfilename), "img_%d.html", num);
@@ -426,7 +432,9 @@ int store(dt_imageio_module_storage_t *self,
   g_free(esc_relthumbfilename);
 
   pair->pos = num;
+  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
   d->l = g_list_insert_sorted(d->l, pair, (GCompareFunc)sort_pos);
+  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
 
   /* also export thumbnail: */
   // write with reduced resolution:
@@ -1452,8 +1452,7 @@ static gboolean detail_enhance(const float *const in,
 
   if(b != NULL)
   {
-    dt_bilateral_splat(b, out);
-    dt_bilateral_blur(b);
+    dt_bilateral_splat_blur(b, out);
     dt_bilateral_slice_to_output(b, out, out, detail);
     dt_bilateral_free(b);
   }
@@ -94,7 +94,8 @@ const char **description(struct dt_iop_module_t *self)
 // some additional flags (self explanatory i think):
 int flags()
 {
-  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING;
+  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING
+    | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 // where does it appear in the gui?
@@ -356,8 +357,7 @@ void process(struct dt_iop_module_t *self,
     dt_bilateral_t *b = dt_bilateral_init(roi_in->width, roi_in->height, sigma_s, sigma_r);
     if(b)
     {
-      dt_bilateral_splat(b, (float *)i);
-      dt_bilateral_blur(b);
+      dt_bilateral_splat_blur(b, (float *)i);
       dt_bilateral_slice(b, (float *)i, (float *)o, d->detail);
       dt_bilateral_free(b);
     }
@@ -339,7 +339,8 @@ int operation_tags()
 
 int flags()
 {
-  return IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_TILING_FULL_ROI | IOP_FLAGS_GUIDES_WIDGET;
+  return IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_TILING_FULL_ROI | IOP_FLAGS_GUIDES_WIDGET
+    | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 dt_iop_colorspace_type_t default_colorspace(dt_iop_module_t *self,
@@ -17,7 +17,9 @@
 */
 
 /** Note :
- * we use finite-math-only and fast-math because divisions by zero are manually avoided in the code
+ * we use fast-math because divisions by zero are manually avoided in the code
+ * but not finite-math-only: gcc would not inline the helpers of the pixel loop
+ * into its avx2/avx512 variants, see _mix_pixels()
  * fp-contract=fast enables hardware-accelerated Fused Multiply-Add
  * the rest is loop reorganization and vectorization optimization
  **/
@@ -29,7 +31,7 @@
                       "split-ivs-in-unroller", "variable-expansion-in-unroller", \
                       "split-loops", "ivopts", "predictive-commoning",\
                       "tree-loop-linear", "loop-block", "loop-strip-mine", \
-                      "finite-math-only", "fp-contract=fast", "fast-math", \
+                      "fp-contract=fast", "fast-math", "no-finite-math-only", \
                       "tree-vectorize", "no-math-errno")
 #endif
 
@@ -52,6 +54,7 @@
 #include "common/illuminants.h"
 #include "common/imagebuf.h"
 #include "common/iop_profile.h"
+#include "common/vector_math.h"
 #include "develop/imageop_math.h"
 #include "develop/openmp_maths.h"
 #include "gui/accelerators.h"
@@ -243,7 +246,8 @@ const char **description(struct dt_iop_module_t *self)
 
 int flags()
 {
-  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING;
+  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING
+    | IOP_FLAGS_POINTWISE;
 }
 
 int default_group()
@@ -628,11 +632,33 @@ static gboolean _get_white_balance_coeff(struct dt_iop_module_t *self,
 }
 
 
-DT_OMP_DECLARE_SIMD(aligned(input, output:16) uniform(compression, clip))
-static inline void _gamut_mapping(const dt_aligned_pixel_t input,
-                                  const float compression,
-                                  const gboolean clip,
-                                  dt_aligned_pixel_t output)
+// fmaxf() is a call to libm without finite-math-only, these compile to
+// maxps and also map NaN to the second argument
+static inline void _vector_max(dt_aligned_pixel_t max,
+                               const dt_aligned_pixel_t v1,
+                               const dt_aligned_pixel_t v2)
+{
+  for_four_channels(c)
+    max[c] = MAX(v1[c], v2[c]);
+}
+
+static inline void _clipneg(dt_aligned_pixel_t values)
+{
+  for_four_channels(c)
+    values[c] = MAX(values[c], 0.0f);
+}
+
+static inline float _euclidean_norm(const dt_aligned_pixel_t vector)
+{
+  return MAX(sqrtf(sqf(vector[0]) + sqf(vector[1]) + sqf(vector[2])), NORM_MIN);
+}
+
+// white point D50 in u'v'
+static const float _D50_uv[2] DT_ALIGNED_PIXEL = { 0.20915914598542354f, 0.488075320769787f };
+
+DT_OMP_DECLARE_SIMD(aligned(input, uvY:16))
+static inline float _gamut_distance(const dt_aligned_pixel_t input,
+                                    dt_aligned_pixel_t uvY)
 {
   // Get the sum XYZ
   const float sum = input[0] + input[1] + input[2];
@@ -645,35 +671,44 @@ static inline void _gamut_mapping(const dt_aligned_pixel_t input,
                               0.0f };
 
   // Convert to uvY
-  dt_aligned_pixel_t uvY;
   dt_xyY_to_uvY(xyY, uvY);
 
   // Get the chromaticity difference with white point uv
-  const float D50[2] DT_ALIGNED_PIXEL = { 0.20915914598542354f, 0.488075320769787f };
-  const float delta[2] DT_ALIGNED_PIXEL = { D50[0] - uvY[0], D50[1] - uvY[1] };
-  const float Delta = Y * (sqf(delta[0]) + sqf(delta[1]));
+  return Y * (sqf(_D50_uv[0] - uvY[0]) + sqf(_D50_uv[1] - uvY[1]));
+}
+
+// correction is powf(distance, compression), with the distance from
+// _gamut_distance(), or 0 if there is no compression
+DT_OMP_DECLARE_SIMD(aligned(uvY_in, output:16) uniform(clip))
+static inline void _gamut_mapping(const dt_aligned_pixel_t uvY_in,
+                                  const float correction,
+                                  const gboolean clip,
+                                  dt_aligned_pixel_t output)
+{
+  dt_aligned_pixel_t uvY = { uvY_in[0], uvY_in[1], uvY_in[2], 0.0f };
+  const float delta[2] DT_ALIGNED_PIXEL = { _D50_uv[0] - uvY[0], _D50_uv[1] - uvY[1] };
 
   // Compress chromaticity (move toward white point)
-  const float correction = (compression == 0.0f) ? 0.f : powf(Delta, compression);
   for(size_t c = 0; c < 2; c++)
   {
     // Ensure the correction does not bring our uyY vector the other side of D50
     // that would switch to the opposite color, so we clip at D50
     // correction * delta[c] + uvY[c]
     const float tmp = DT_FMA(correction, delta[c], uvY[c]);
-    uvY[c] = (uvY[c] > D50[c])  ? fmaxf(tmp, D50[c])
-                                : fminf(tmp, D50[c]);
+    uvY[c] = (uvY[c] > _D50_uv[c])  ? MAX(tmp, _D50_uv[c])
+                                    : MIN(tmp, _D50_uv[c]);
   }
 
   // Convert back to xyY
+  dt_aligned_pixel_t xyY = { 0.0f };
   dt_uvY_to_xyY(uvY, xyY);
 
   // Clip upon request
-  if(clip) for(size_t c = 0; c < 2; c++) xyY[c] = fmaxf(xyY[c], 0.0f);
+  if(clip) for(size_t c = 0; c < 2; c++) xyY[c] = MAX(xyY[c], 0.0f);
 
   // Check sanity of y
   // since we later divide by y, it can't be zero
-  xyY[1] = fmaxf(xyY[1], NORM_MIN);
+  xyY[1] = MAX(xyY[1], NORM_MIN);
 
   // Check sanity of x and y :
   // since Z = Y (1 - x - y) / y, if x + y >= 1, Z will be negative
@@ -694,8 +729,8 @@ static inline void _luma_chroma(const dt_aligned_pixel_t input,
                                 const dt_iop_channelmixer_rgb_version_t version)
 {
   // Compute euclidean norm
-  float norm = euclidean_norm(input);
-  const float avg = fmaxf((input[0] + input[1] + input[2]) / 3.0f, NORM_MIN);
+  float norm = _euclidean_norm(input);
+  const float avg = MAX((input[0] + input[1] + input[2]) / 3.0f, NORM_MIN);
 
   if(norm > 0.f && avg > 0.f)
   {
@@ -728,17 +763,17 @@ static inline void _luma_chroma(const dt_aligned_pixel_t input,
       // up solid black
       const float min_ratio = (output[c] < 0.0f) ? output[c] : 0.0f;
       const float output_inverse = 1.0f - output[c];
-      output[c] = fmaxf(DT_FMA(output_inverse, coeff_ratio, output[c]),
-                        min_ratio); // output_inverse  * coeff_ratio + output
+      output[c] = MAX(DT_FMA(output_inverse, coeff_ratio, output[c]),
+                      min_ratio); // output_inverse  * coeff_ratio + output
     }
 
     // The above interpolation between original pixel ratios and
     // (1, 1, 1) might change the norm of the ratios. Compensate for that.
-    if(version == CHANNELMIXERRGB_V_3) norm /= euclidean_norm(output) * INVERSE_SQRT_3;
+    if(version == CHANNELMIXERRGB_V_3) norm /= _euclidean_norm(output) * INVERSE_SQRT_3;
 
     // Apply colorfulness adjustment channel-wise and repack with
     // lightness to get LMS back
-    norm *= fmaxf(1.f + mix / avg, 0.f);
+    norm *= MAX(1.f + mix / avg, 0.f);
     for(size_t c = 0; c < 3; c++) output[c] *= norm;
   }
   else
@@ -748,184 +783,137 @@ static inline void _luma_chroma(const dt_aligned_pixel_t input,
   }
 }
 
-DT_OMP_DECLARE_SIMD(aligned(in, out, XYZ_to_RGB, RGB_to_XYZ, MIX : 64) aligned(illuminant, saturation, lightness, grey:16))
-static inline void _loop_switch(const float *const restrict in,
-                                float *const restrict out,
-                                const size_t width,
-                                const size_t height,
-                                const size_t ch,
-                                const dt_colormatrix_t XYZ_to_RGB,
-                                const dt_colormatrix_t RGB_to_XYZ,
-                                const dt_colormatrix_t MIX,
-                                const dt_aligned_pixel_t illuminant,
-                                const dt_aligned_pixel_t saturation,
-                                const dt_aligned_pixel_t lightness,
-                                const dt_aligned_pixel_t grey,
-                                const float p,
-                                const float gamut,
-                                const gboolean clip,
-                                const gboolean apply_grey,
-                                const dt_adaptation_t kind,
-                                const dt_iop_channelmixer_rgb_version_t version)
+// the parameters of the per pixel part of _loop_switch()
+typedef struct _mix_kernel_t
 {
-  dt_colormatrix_t RGB_to_LMS = { { 0.0f, 0.0f, 0.0f, 0.0f } };
-  dt_colormatrix_t MIX_to_XYZ = { { 0.0f, 0.0f, 0.0f, 0.0f } };
-  switch (kind)
-  {
-    case DT_ADAPTATION_FULL_BRADFORD:
-    case DT_ADAPTATION_LINEAR_BRADFORD:
-      make_RGB_to_Bradford_LMS(RGB_to_XYZ, RGB_to_LMS);
-      make_Bradford_LMS_to_XYZ(MIX, MIX_to_XYZ);
-      break;
-    case DT_ADAPTATION_CAT16:
-      make_RGB_to_CAT16_LMS(RGB_to_XYZ, RGB_to_LMS);
-      make_CAT16_LMS_to_XYZ(MIX, MIX_to_XYZ);
-      break;
-    case DT_ADAPTATION_XYZ:
-      dt_colormatrix_copy(RGB_to_LMS, RGB_to_XYZ);
-      dt_colormatrix_copy(MIX_to_XYZ, MIX);
-      break;
-    case DT_ADAPTATION_RGB:
-    case DT_ADAPTATION_LAST:
-    default:
-      // RGB_to_LMS not applied, since we are not adapting WB
-      dt_colormatrix_mul(MIX_to_XYZ, RGB_to_XYZ, MIX);
-      break;
-  }
-  const float minval = clip ? 0.0f : -FLT_MAX;
-  const dt_aligned_pixel_t min_value = { minval, minval, minval, minval };
-
   dt_colormatrix_t RGB_to_XYZ_trans;
-  dt_colormatrix_transpose(RGB_to_XYZ_trans, RGB_to_XYZ);
   dt_colormatrix_t RGB_to_LMS_trans;
-  dt_colormatrix_transpose(RGB_to_LMS_trans, RGB_to_LMS);
   dt_colormatrix_t MIX_to_XYZ_trans;
-  dt_colormatrix_transpose(MIX_to_XYZ_trans, MIX_to_XYZ);
   dt_colormatrix_t XYZ_to_RGB_trans;
-  dt_colormatrix_transpose(XYZ_to_RGB_trans, XYZ_to_RGB);
+  dt_aligned_pixel_t min_value;
+  dt_aligned_pixel_t illuminant;
+  dt_aligned_pixel_t saturation;
+  dt_aligned_pixel_t lightness;
+  dt_aligned_pixel_t grey;
+  float p;
+  float gamut;
+  gboolean clip;
+  gboolean apply_grey;
+  dt_adaptation_t kind;
+  dt_iop_channelmixer_rgb_version_t version;
+} _mix_kernel_t;
 
-  DT_OMP_FOR()
-  for(size_t k = 0; k < height * width * 4; k += 4)
-  {
-    // intermediate temp buffers
-    dt_aligned_pixel_t temp_one;
-    dt_aligned_pixel_t temp_two;
+// pixels are processed in blocks, so the powf() of the gamut mapping is
+// evaluated for the whole block in one plain loop, which the compiler
+// vectorizes at the width of the codepath it is compiled for
+#define MIX_BLOCK 16
 
-    dt_vector_max_nan(temp_two, &in[k], min_value);
+static inline __attribute__((always_inline)) void _mix_pixels(const float *const restrict in,
+                                                              float *const restrict out,
+                                                              const size_t npixels,
+                                                              const _mix_kernel_t *const restrict d)
+{
+  const dt_adaptation_t kind = d->kind;
+  const gboolean clip = d->clip;
+  const float gamut = d->gamut;
 
-    /* WE START IN PIPELINE RGB */
+  for(size_t start = 0; start < npixels; start += MIX_BLOCK)
+  {
+    const size_t n = MIN(MIX_BLOCK, npixels - start);
+    const float *const restrict block_in = in + 4 * start;
+    float *const restrict block_out = out + 4 * start;
+    float DT_ALIGNED_ARRAY uvY[4 * MIX_BLOCK];
+    float DT_ALIGNED_ARRAY correction[MIX_BLOCK];
 
-    switch(kind)
+    for(size_t i = 0; i < n; i++)
     {
-      case DT_ADAPTATION_FULL_BRADFORD:
-      {
-        // Convert from RGB to XYZ
-        dt_apply_transposed_color_matrix(temp_two, RGB_to_XYZ_trans, temp_one);
-        const float Y = temp_one[1];
-
-        // Convert to LMS
-        convert_XYZ_to_bradford_LMS(temp_one, temp_two);
-        // Do white balance
-        downscale_vector(temp_two, Y);
-        bradford_adapt_D50(temp_two, illuminant, p, TRUE, temp_one);
-        upscale_vector(temp_one, Y);
-        copy_pixel(temp_two, temp_one);
-        break;
-      }
-      case DT_ADAPTATION_LINEAR_BRADFORD:
-      {
-        // Convert from RGB to XYZ to LMS
-        dt_apply_transposed_color_matrix(temp_two, RGB_to_LMS_trans, temp_one);
+      // intermediate temp buffers
+      dt_aligned_pixel_t temp_one;
+      dt_aligned_pixel_t temp_two;
 
-        // Do white balance
-        bradford_adapt_D50(temp_one, illuminant, p, FALSE, temp_two);
-        break;
-      }
-      case DT_ADAPTATION_CAT16:
-      {
-        // Convert from RGB to XYZ
-        dt_apply_transposed_color_matrix(temp_two, RGB_to_LMS_trans, temp_one);
+      _vector_max(temp_two, block_in + 4 * i, d->min_value);
 
-        // Do white balance
-        // force full-adaptation
-        CAT16_adapt_D50(temp_one, illuminant, 1.0f, TRUE, temp_two);
-        break;
-      }
-      case DT_ADAPTATION_XYZ:
-      {
-        // Convert from RGB to XYZ
-        dt_apply_transposed_color_matrix(temp_two, RGB_to_XYZ_trans, temp_one);
+      /* WE START IN PIPELINE RGB */
 
-        // Do white balance in XYZ
-        XYZ_adapt_D50(temp_one, illuminant, temp_two);
-        break;
-      }
-      case DT_ADAPTATION_RGB:
-      case DT_ADAPTATION_LAST:
-      default:
+      switch(kind)
       {
-        // No white balance.
-        for_four_channels(c)
-          temp_one[c] = 0.0f; //keep compiler happy by ensuring that always initialized
-      }
-    }
-
-    // Compute the 3D mix - this is a rotation + homothety of the vector base
-    dt_apply_transposed_color_matrix(temp_two, MIX_to_XYZ_trans, temp_one);
+        case DT_ADAPTATION_FULL_BRADFORD:
+        {
+          // Convert from RGB to XYZ
+          dt_apply_transposed_color_matrix(temp_two, d->RGB_to_XYZ_trans, temp_one);
+          const float Y = temp_one[1];
+
+          // Convert to LMS
+          convert_XYZ_to_bradford_LMS(temp_one, temp_two);
+          // Do white balance
+          downscale_vector(temp_two, Y);
+          bradford_adapt_D50(temp_two, d->illuminant, d->p, TRUE, temp_one);
+          upscale_vector(temp_one, Y);
+          copy_pixel(temp_two, temp_one);
+          break;
+        }
+        case DT_ADAPTATION_LINEAR_BRADFORD:
+        {
+          // Convert from RGB to XYZ to LMS
+          dt_apply_transposed_color_matrix(temp_two, d->RGB_to_LMS_trans, temp_one);
 
-    /* FROM HERE WE ARE MANDATORILY IN XYZ - DATA IS IN temp_one */
+          // Do white balance
+          bradford_adapt_D50(temp_one, d->illuminant, d->p, FALSE, temp_two);
+          break;
+        }
+        case DT_ADAPTATION_CAT16:
+        {
+          // Convert from RGB to XYZ
+          dt_apply_transposed_color_matrix(temp_two, d->RGB_to_LMS_trans, temp_one);
 
-    // Gamut mapping happens in XYZ space no matter what, only 0->1 values are defined
-    // for this
-    if(clip)
-      dt_vector_clipneg_nan(temp_one);
-    _gamut_mapping(temp_one, gamut, clip, temp_two);
+          // Do white balance
+          // force full-adaptation
+          CAT16_adapt_D50(temp_one, d->illuminant, 1.0f, TRUE, temp_two);
+          break;
+        }
+        case DT_ADAPTATION_XYZ:
+        {
+          // Convert from RGB to XYZ
+          dt_apply_transposed_color_matrix(temp_two, d->RGB_to_XYZ_trans, temp_one);
 
-    // convert to LMS, XYZ or pipeline RGB
-    switch(kind)
-    {
-      case DT_ADAPTATION_FULL_BRADFORD:
-      case DT_ADAPTATION_LINEAR_BRADFORD:
-      case DT_ADAPTATION_CAT16:
-      case DT_ADAPTATION_XYZ:
-      {
-        convert_any_XYZ_to_LMS(temp_two, temp_one, kind);
-        break;
-      }
-      case DT_ADAPTATION_RGB:
-      case DT_ADAPTATION_LAST:
-      default:
-      {
-        // Convert from XYZ to RGB
-        dt_apply_transposed_color_matrix(temp_two, XYZ_to_RGB_trans, temp_one);
-        break;
+          // Do white balance in XYZ
+          XYZ_adapt_D50(temp_one, d->illuminant, temp_two);
+          break;
+        }
+        case DT_ADAPTATION_RGB:
+        case DT_ADAPTATION_LAST:
+        default:
+        {
+          // No white balance.
+          for_four_channels(c)
+            temp_one[c] = 0.0f; //keep compiler happy by ensuring that always initialized
+        }
       }
-    }
 
-    /* FROM HERE WE ARE IN LMS, XYZ OR PIPELINE RGB depending on user
-       param - DATA IS IN temp_one */
+      // Compute the 3D mix - this is a rotation + homothety of the vector base
+      dt_apply_transposed_color_matrix(temp_two, d->MIX_to_XYZ_trans, temp_one);
 
-    // Clip in LMS
-    if(clip)
-      dt_vector_clipneg_nan(temp_one);
+      /* FROM HERE WE ARE MANDATORILY IN XYZ - DATA IS IN temp_one */
 
-    // Apply lightness / saturation adjustment
-    _luma_chroma(temp_one, saturation, lightness, temp_two, version);
+      // Gamut mapping happens in XYZ space no matter what, only 0->1 values are defined
+      // for this
+      if(clip)
+        _clipneg(temp_one);
+      correction[i] = _gamut_distance(temp_one, uvY + 4 * i);
+    }
 
-    // Clip in LMS
-    if(clip)
-      dt_vector_clipneg_nan(temp_two);
+    // Compress chromaticity
+    for(size_t i = 0; i < n; i++)
+      correction[i] = (gamut == 0.0f) ? 0.f : powf(correction[i], gamut);
 
-    // Save
-    if(apply_grey)
-    {
-      // Turn LMS, XYZ or pipeline RGB into monochrome
-      const float grey_mix = fmaxf(scalar_product(temp_two, grey), 0.0f);
-      temp_two[0] = temp_two[1] = temp_two[2] = grey_mix;
-    }
-    else
+    for(size_t i = 0; i < n; i++)
     {
-      // Convert back to XYZ
+      dt_aligned_pixel_t temp_one;
+      dt_aligned_pixel_t temp_two;
+
+      _gamut_mapping(uvY + 4 * i, correction[i], clip, temp_two);
+
+      // convert to LMS, XYZ or pipeline RGB
       switch(kind)
       {
         case DT_ADAPTATION_FULL_BRADFORD:
@@ -933,35 +921,172 @@ static inline void _loop_switch(const float *const restrict in,
         case DT_ADAPTATION_CAT16:
         case DT_ADAPTATION_XYZ:
         {
-          convert_any_LMS_to_XYZ(temp_two, temp_one, kind);
+          convert_any_XYZ_to_LMS(temp_two, temp_one, kind);
           break;
         }
         case DT_ADAPTATION_RGB:
         case DT_ADAPTATION_LAST:
         default:
         {
-          // Convert from RBG to XYZ
-          dt_apply_transposed_color_matrix(temp_two, RGB_to_XYZ_trans, temp_one);
+          // Convert from XYZ to RGB
+          dt_apply_transposed_color_matrix(temp_two, d->XYZ_to_RGB_trans, temp_one);
           break;
         }
       }
 
-      /* FROM HERE WE ARE MANDATORILY IN XYZ - DATA IS IN temp_one */
+      /* FROM HERE WE ARE IN LMS, XYZ OR PIPELINE RGB depending on user
+         param - DATA IS IN temp_one */
 
-      // Clip in XYZ
+      // Clip in LMS
       if(clip)
-        dt_vector_clipneg_nan(temp_one);
+        _clipneg(temp_one);
 
-      // Convert back to RGB
-      dt_apply_transposed_color_matrix(temp_one, XYZ_to_RGB_trans, temp_two);
+      // Apply lightness / saturation adjustment
+      _luma_chroma(temp_one, d->saturation, d->lightness, temp_two, d->version);
 
+      // Clip in LMS
       if(clip)
-        dt_vector_clipneg_nan(temp_two);
+        _clipneg(temp_two);
+
+      // Save
+      if(d->apply_grey)
+      {
+        // Turn LMS, XYZ or pipeline RGB into monochrome
+        const float grey_mix = MAX(scalar_product(temp_two, d->grey), 0.0f);
+        temp_two[0] = temp_two[1] = temp_two[2] = grey_mix;
+      }
+      else
+      {
+        // Convert back to XYZ
+        switch(kind)
+        {
+          case DT_ADAPTATION_FULL_BRADFORD:
+          case DT_ADAPTATION_LINEAR_BRADFORD:
+          case DT_ADAPTATION_CAT16:
+          case DT_ADAPTATION_XYZ:
+          {
+            convert_any_LMS_to_XYZ(temp_two, temp_one, kind);
+            break;
+          }
+          case DT_ADAPTATION_RGB:
+          case DT_ADAPTATION_LAST:
+          default:
+          {
+            // Convert from RBG to XYZ
+            dt_apply_transposed_color_matrix(temp_two, d->RGB_to_XYZ_trans, temp_one);
+            break;
+          }
+        }
+
+        /* FROM HERE WE ARE MANDATORILY IN XYZ - DATA IS IN temp_one */
+
+        // Clip in XYZ
+        if(clip)
+          _clipneg(temp_one);
+
+        // Convert back to RGB
+        dt_apply_transposed_color_matrix(temp_one, d->XYZ_to_RGB_trans, temp_two);
+
+        if(clip)
+          _clipneg(temp_two);
+      }
+
+      temp_two[3] = block_in[4 * i + 3]; // alpha mask
+      copy_pixel_nontemporal(block_out + 4 * i, temp_two);
     }
+  }
+}
+
+typedef void((*_mix_row_t)(const float *const restrict in, float *const restrict out, const size_t width,
+                           const _mix_kernel_t *const restrict d));
+
+static void _mix_row_generic(const float *const restrict in, float *const restrict out, const size_t width,
+                             const _mix_kernel_t *const restrict d)
+{
+  _mix_pixels(in, out, width, d);
+}
+
+#ifdef DT_CODEPATH_VARIANTS
+__DT_TARGET_AVX2__
+static void _mix_row_avx2(const float *const restrict in, float *const restrict out, const size_t width,
+                          const _mix_kernel_t *const restrict d)
+{
+  _mix_pixels(in, out, width, d);
+}
+
+__DT_TARGET_AVX512__
+static void _mix_row_avx512(const float *const restrict in, float *const restrict out, const size_t width,
+                            const _mix_kernel_t *const restrict d)
+{
+  _mix_pixels(in, out, width, d);
+}
+#endif
+
+static inline void _loop_switch(const float *const restrict in,
+                                float *const restrict out,
+                                const size_t width,
+                                const size_t height,
+                                const size_t ch,
+                                const dt_colormatrix_t XYZ_to_RGB,
+                                const dt_colormatrix_t RGB_to_XYZ,
+                                const dt_colormatrix_t MIX,
+                                const dt_aligned_pixel_t illuminant,
+                                const dt_aligned_pixel_t saturation,
+                                const dt_aligned_pixel_t lightness,
+                                const dt_aligned_pixel_t grey,
+                                const float p,
+                                const float gamut,
+                                const gboolean clip,
+                                const gboolean apply_grey,
+                                const dt_adaptation_t kind,
+                                const dt_iop_channelmixer_rgb_version_t version)
+{
+  dt_colormatrix_t RGB_to_LMS = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+  dt_colormatrix_t MIX_to_XYZ = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+  switch (kind)
+  {
+    case DT_ADAPTATION_FULL_BRADFORD:
+    case DT_ADAPTATION_LINEAR_BRADFORD:
+      make_RGB_to_Bradford_LMS(RGB_to_XYZ, RGB_to_LMS);
+      make_Bradford_LMS_to_XYZ(MIX, MIX_to_XYZ);
+      break;
+    case DT_ADAPTATION_CAT16:
+      make_RGB_to_CAT16_LMS(RGB_to_XYZ, RGB_to_LMS);
+      make_CAT16_LMS_to_XYZ(MIX, MIX_to_XYZ);
+      break;
+    case DT_ADAPTATION_XYZ:
+      dt_colormatrix_copy(RGB_to_LMS, RGB_to_XYZ);
+      dt_colormatrix_copy(MIX_to_XYZ, MIX);
+      break;
+    case DT_ADAPTATION_RGB:
+    case DT_ADAPTATION_LAST:
+    default:
+      // RGB_to_LMS not applied, since we are not adapting WB
+      dt_colormatrix_mul(MIX_to_XYZ, RGB_to_XYZ, MIX);
+      break;
+  }
+  const float minval = clip ? 0.0f : -FLT_MAX;
 
-    temp_two[3] = in[k + 3]; // alpha mask
-    copy_pixel_nontemporal(&out[k], temp_two);
+  _mix_kernel_t d = { .p = p, .gamut = gamut, .clip = clip, .apply_grey = apply_grey,
+                      .kind = kind, .version = version };
+  for_four_channels(c)
+  {
+    d.min_value[c] = minval;
+    d.illuminant[c] = illuminant[c];
+    d.saturation[c] = saturation[c];
+    d.lightness[c] = lightness[c];
+    d.grey[c] = grey[c];
   }
+  dt_colormatrix_transpose(d.RGB_to_XYZ_trans, RGB_to_XYZ);
+  dt_colormatrix_transpose(d.RGB_to_LMS_trans, RGB_to_LMS);
+  dt_colormatrix_transpose(d.MIX_to_XYZ_trans, MIX_to_XYZ);
+  dt_colormatrix_transpose(d.XYZ_to_RGB_trans, XYZ_to_RGB);
+
+  const _mix_row_t mix_row = dt_codepath_select(_mix_row_generic, _mix_row_avx2, _mix_row_avx512);
+
+  DT_OMP_FOR()
+  for(size_t row = 0; row < height; row++)
+    mix_row(in + ch * width * row, out + ch * width * row, width, &d);
 }
 
 // util to shift pixel index without headache
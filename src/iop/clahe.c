@@ -76,7 +76,7 @@ const char *deprecated_msg()
 
 int flags()
 {
-  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_DEPRECATED;
+  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_DEPRECATED | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 dt_iop_colorspace_type_t default_colorspace(dt_iop_module_t *self,
@@ -26,6 +26,7 @@
 #include "common/colorspaces_inline_conversions.h"
 #include "common/gamut_mapping.h"
 #include "common/opencl.h"
+#include "common/vector_math.h"
 #include "develop/blend.h"
 #include "develop/imageop.h"
 #include "develop/imageop_math.h"
@@ -592,8 +593,11 @@ static inline float soft_clip(const float x, const float soft_threshold, const f
 {
   // use an exponential soft clipping above soft_threshold
   // hard threshold must be > soft threshold
+  // the exponential is evaluated in any case, so loops using this have
+  // no branch and can be vectorized
   const float norm = hard_threshold - soft_threshold;
-  return (x > soft_threshold) ? soft_threshold + (1.f - expf(-(x - soft_threshold) / norm)) * norm : x;
+  const float clipped = soft_threshold + (1.f - expf(-(x - soft_threshold) / norm)) * norm;
+  return (x > soft_threshold) ? clipped : x;
 }
 
 
@@ -625,6 +629,430 @@ static inline float lookup_gamut(const float *const gamut_lut, const float x)
   return y_prev + ((xi != xii) ? (x_test - x_prev) * (gamut_lut[xii] - y_prev) : 0.0f);
 }
 
+typedef struct _balance_kernel_t
+{
+  dt_colormatrix_t input_matrix_trans;
+  dt_colormatrix_t output_matrix_trans;
+  float hue_rotation_matrix[2][2];
+  float L_white;
+  size_t checker_1;
+  size_t checker_2;
+  gboolean mask_display;
+  int mask_type;
+} _balance_kernel_t;
+
+// pixels are processed in blocks, in stages split around the powf(),
+// expf() and atan2f() of the luma masks, the contrast and the darktable UCS
+// conversions: these stages are plain loops over the whole block, which the
+// compiler vectorizes at the width of the codepath it is compiled for
+#define BALANCE_BLOCK 16
+
+static inline __attribute__((always_inline)) void _balance_pixels(const float *const restrict in,
+                                                                  float *const restrict out,
+                                                                  const size_t row,
+                                                                  const size_t width,
+                                                                  const dt_iop_colorbalancergb_data_t *const restrict d,
+                                                                  const _balance_kernel_t *const restrict kd)
+{
+  const float *const restrict gamut_LUT = DT_IS_ALIGNED(((const float *const restrict)d->gamut_LUT));
+
+  const float *const restrict global = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->global);
+  const float *const restrict highlights = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->highlights);
+  const float *const restrict shadows = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->shadows);
+  const float *const restrict midtones = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->midtones);
+
+  const float *const restrict chroma = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->chroma);
+  const float *const restrict saturation = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->saturation);
+  const float *const restrict brilliance = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->brilliance);
+
+  const float L_white = kd->L_white;
+  const size_t checker_1 = kd->checker_1;
+  const size_t checker_2 = kd->checker_2;
+
+  for(size_t start = 0; start < width; start += BALANCE_BLOCK)
+  {
+    const size_t n = MIN(BALANCE_BLOCK, width - start);
+    const float *const restrict block_in = in + 4 * start;
+    float *const restrict block_out = out + 4 * start;
+    float DT_ALIGNED_ARRAY Ych_block[4 * BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY opacities_block[4 * BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY opacities_comp_block[4 * BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY vibrance_block[BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY Yrg_block[4 * BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY XYZ_block[4 * BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY xyY_block[4 * BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY UV_block[2 * BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY JCH_block[4 * BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY HCB_block[4 * BALANCE_BLOCK];
+    float DT_ALIGNED_ARRAY colorfulness_block[BALANCE_BLOCK];
+
+    for(size_t i = 0; i < n; i++)
+    {
+      // clip pipeline RGB
+      dt_aligned_pixel_t RGB;
+      copy_pixel(RGB, block_in + 4 * i);
+      dt_vector_clipneg(RGB);
+
+      // go to CIE 2006 LMS D65
+      dt_aligned_pixel_t LMS;
+      dt_apply_transposed_color_matrix(RGB, kd->input_matrix_trans, LMS);
+
+      /* The previous line is equivalent to :
+        // go to CIE 1931 XYZ 2° D50
+        dot_product(RGB, RGB_to_XYZ, XYZ_D50); // matrice product
+
+        // chroma adapt D50 to D65
+        XYZ_D50_to_65(XYZ_D50, XYZ_D65); // matrice product
+
+        // go to CIE 2006 LMS
+        XYZ_to_LMS(XYZ_D65, LMS); // matrice product
+      */
+
+      // go to Filmlight Yrg
+      dt_aligned_pixel_t Yrg = { 0.f };
+      LMS_to_Yrg(LMS, Yrg);
+
+      // go to Ych
+      float *const restrict Ych = Ych_block + 4 * i;
+      Yrg_to_Ych(Yrg, Ych);
+
+      // Sanitize input : no negative luminance
+      Ych[0] = MAX(Ych[0], 0.f);
+
+      // Hue shift - do it now because we need the gamut limit at output hue right after
+      // The hue rotation is implemented as a matrix multiplication.
+      const float cos_h = Ych[2];
+      const float sin_h = Ych[3];
+      Ych[2] = kd->hue_rotation_matrix[0][0] * cos_h + kd->hue_rotation_matrix[0][1] * sin_h;
+      Ych[3] = kd->hue_rotation_matrix[1][0] * cos_h + kd->hue_rotation_matrix[1][1] * sin_h;
+    }
+
+    for(size_t i = 0; i < n; i++)
+    {
+      // Opacities for luma masks
+      opacity_masks(powf(Ych_block[4 * i], 0.4101205819200422f), // center middle grey in 50 %
+                    d->shadows_weight, d->highlights_weight, d->midtones_weight,
+                    d->mask_grey_fulcrum, opacities_block + 4 * i, opacities_comp_block + 4 * i);
+      vibrance_block[i] = d->vibrance * (1.0f - powf(Ych_block[4 * i + 1], fabsf(d->vibrance)));
+    }
+
+    for(size_t i = 0; i < n; i++)
+    {
+      float *const restrict Ych = Ych_block + 4 * i;
+      const float *const restrict opacities = opacities_block + 4 * i;
+      const float *const restrict opacities_comp = opacities_comp_block + 4 * i;
+      float *const restrict Yrg = Yrg_block + 4 * i;
+      dt_aligned_pixel_t RGB, LMS;
+
+      // Linear chroma : distance to achromatic at constant luminance in scene-referred
+      const float chroma_boost = d->chroma_global + scalar_product(opacities, chroma);
+      const float vibrance = vibrance_block[i];
+      const float chroma_factor = MAX(1.f + chroma_boost + vibrance, 0.f);
+      Ych[1] *= chroma_factor;
+
+      // clip chroma at constant hue and Y if needed
+      gamut_check_Yrg(Ych);
+
+      // go to Yrg for real
+      Ych_to_Yrg(Ych, Yrg);
+
+      // Go to LMS
+      Yrg_to_LMS(Yrg, LMS);
+
+      // Go to Filmlight RGB
+      LMS_to_gradingRGB(LMS, RGB);
+
+      // Color balance
+      for_four_channels(c, aligned(RGB, global))
+      {
+        // global : offset
+        RGB[c] += global[c];
+      }
+      for_four_channels(c, aligned(RGB, opacities, opacities_comp, shadows, midtones, highlights:16))
+      {
+        //  highlights, shadows : 2 slopes with masking
+        RGB[c] *= opacities_comp[2] * (opacities_comp[0] + opacities[0] * shadows[c]) + opacities[2] * highlights[c];
+        // factorization of : (RGB[c] * (1.f - alpha) + RGB[c] * d->shadows[c] * alpha) * (1.f - beta)  + RGB[c] * d->highlights[c] * beta;
+      }
+      dt_aligned_pixel_t sign;
+      for_each_channel(c)
+        sign[c] = (RGB[c] < 0.f) ? -1.f : 1.f;
+      dt_aligned_pixel_t abs_RGB;
+      for_each_channel(c)
+        abs_RGB[c] = fabsf(RGB[c]);
+      dt_aligned_pixel_t scaled_RGB;
+      for_each_channel(c)
+        scaled_RGB[c] = abs_RGB[c] /d->white_fulcrum;
+      dt_vector_powf(scaled_RGB, midtones, RGB);
+      for_each_channel(c)
+        RGB[c] = RGB[c] * sign[c] * d->white_fulcrum;
+
+      // for the non-linear ops we need to go in Yrg again because RGB doesn't preserve color
+      gradingRGB_to_LMS(RGB, LMS);
+      LMS_to_Yrg(LMS, Yrg);
+    }
+
+    for(size_t i = 0; i < n; i++)
+    {
+      float *const restrict Yrg = Yrg_block + 4 * i;
+
+      // Y midtones power (gamma)
+      Yrg[0] = powf(MAX(Yrg[0] / d->white_fulcrum, 0.f), d->midtones_Y) * d->white_fulcrum;
+
+      // Y fulcrumed contrast
+      Yrg[0] = d->grey_fulcrum * powf(Yrg[0] / d->grey_fulcrum, d->contrast);
+    }
+
+    for(size_t i = 0; i < n; i++)
+    {
+      const float *const restrict opacities = opacities_block + 4 * i;
+      float *const restrict XYZ_D65 = XYZ_block + 4 * i;
+      dt_aligned_pixel_t LMS;
+
+      Yrg_to_LMS(Yrg_block + 4 * i, LMS);
+      XYZ_D65[3] = 0.f;
+      LMS_to_XYZ(LMS, XYZ_D65);
+
+      // Perceptual color adjustments
+      if(d->saturation_formula == DT_COLORBALANCE_SATURATION_JZAZBZ)
+      {
+        dt_aligned_pixel_t Jab = { 0.f };
+        dt_XYZ_2_JzAzBz(XYZ_D65, Jab);
+
+        // Convert to JCh
+        float JC[2] = { Jab[0], dt_fast_hypotf(Jab[1], Jab[2]) };   // brightness/chroma vector
+        const float h = atan2f(Jab[2], Jab[1]);  // hue : (a, b) angle
+
+        // Project JC onto S, the saturation eigenvector, with orthogonal vector O.
+        // Note : O should be = (C * cosf(T) - J * sinf(T)) = 0 since S is the eigenvector,
+        // so we add the chroma projected along the orthogonal axis to get some control value
+        const float T = atan2f(JC[1], JC[0]); // angle of the eigenvector over the hue plane
+        const float sin_T = sinf(T);
+        const float cos_T = cosf(T);
+        const float DT_ALIGNED_PIXEL M_rot_dir[2][2] = { {  cos_T,  sin_T },
+                                                        { -sin_T,  cos_T } };
+        const float DT_ALIGNED_PIXEL M_rot_inv[2][2] = { {  cos_T, -sin_T },
+                                                        {  sin_T,  cos_T } };
+        float SO[2];
+
+        // brilliance & Saturation : mix of chroma and luminance
+        const float boosts[2] = { 1.f + d->brilliance_global + scalar_product(opacities, brilliance),     // move in S direction
+                                  d->saturation_global + scalar_product(opacities, saturation) }; // move in O direction
+
+        SO[0] = JC[0] * M_rot_dir[0][0] + JC[1] * M_rot_dir[0][1];
+        SO[1] = SO[0] * MIN(MAX(T * boosts[1], -T), DT_M_PI_F / 2.f - T);
+        SO[0] = MAX(SO[0] * boosts[0], 0.f);
+
+        // Project back to JCh, that is rotate back of -T angle
+        JC[0] = MAX(SO[0] * M_rot_inv[0][0] + SO[1] * M_rot_inv[0][1], 0.f);
+        JC[1] = MAX(SO[0] * M_rot_inv[1][0] + SO[1] * M_rot_inv[1][1], 0.f);
+
+        // Gamut mapping
+        const float out_max_sat_h = lookup_gamut(gamut_LUT, h);
+        // if JC[0] == 0.f, the saturation / luminance ratio is infinite - assign the largest practical value we have
+        const float sat = (JC[0] > 0.f) ? soft_clip(JC[1] / JC[0], 0.8f * out_max_sat_h, out_max_sat_h)
+                                        : out_max_sat_h;
+        const float max_C_at_sat = JC[0] * sat;
+        // if sat == 0.f, the chroma is zero - assign the original luminance because there's no need to gamut map
+        const float max_J_at_sat = (sat > 0.f) ? JC[1] / sat : JC[0];
+        JC[0] = (JC[0] + max_J_at_sat) / 2.f;
+        JC[1] = (JC[1] + max_C_at_sat) / 2.f;
+
+        // Gamut-clip in Jch at constant hue and lightness,
+        // e.g. find the max chroma available at current hue that doesn't
+        // yield negative L'M'S' values, which will need to be clipped during conversion
+        const float cos_H = cosf(h);
+        const float sin_H = sinf(h);
+
+        const float d0 = 1.6295499532821566e-11f;
+        const float dd = -0.56f;
+        float Iz = JC[0] + d0;
+        Iz /= (1.f + dd - dd * Iz);
+        Iz = MAX(Iz, 0.f);
+
+        static const dt_colormatrix_t AI_trans
+            = { {  1.0f,                 1.0f,                                1.0f, 0.0f },
+                {  0.1386050432715393f, -0.1386050432715393f, -0.0960192420263190f, 0.0f },
+                {  0.0580473161561189f, -0.0580473161561189f, -0.8118918960560390f, 0.0f } };
+
+        // Do a test conversion to L'M'S'
+        const dt_aligned_pixel_t IzAzBz = { Iz, JC[1] * cos_H, JC[1] * sin_H, 0.f };
+        dt_apply_transposed_color_matrix(IzAzBz, AI_trans, LMS);
+
+        // Clip chroma
+        float max_C = JC[1];
+        if(LMS[0] < 0.f)
+          max_C = MIN(-Iz / (AI_trans[1][0] * cos_H + AI_trans[2][0] * sin_H), max_C);
+
+        if(LMS[1] < 0.f)
+          max_C = MIN(-Iz / (AI_trans[1][1] * cos_H + AI_trans[2][1] * sin_H), max_C);
+
+        if(LMS[2] < 0.f)
+          max_C = MIN(-Iz / (AI_trans[1][2] * cos_H + AI_trans[2][2] * sin_H), max_C);
+
+        // Project back to JzAzBz for real
+        Jab[0] = JC[0];
+        Jab[1] = max_C * cos_H;
+        Jab[2] = max_C * sin_H;
+
+        dt_JzAzBz_2_XYZ(Jab, XYZ_D65);
+      }
+      else
+      {
+        // the darktable UCS adjustments are done for the whole block below
+        dt_D65_XYZ_to_xyY(XYZ_D65, xyY_block + 4 * i);
+        xyY_to_dt_UCS_UV(xyY_block + 4 * i, UV_block + 2 * i);
+      }
+    }
+
+    if(d->saturation_formula != DT_COLORBALANCE_SATURATION_JZAZBZ)
+    {
+      for(size_t i = 0; i < n; i++)
+      {
+        dt_UCS_LUV_to_JCH(Y_to_dt_UCS_L_star(xyY_block[4 * i + 2]), L_white, UV_block + 2 * i, JCH_block + 4 * i);
+        dt_UCS_JCH_to_HCB(JCH_block + 4 * i, HCB_block + 4 * i);
+      }
+
+      for(size_t i = 0; i < n; i++)
+      {
+        const float *const restrict opacities = opacities_block + 4 * i;
+        float *const restrict HCB = HCB_block + 4 * i;
+
+        const float radius = dt_fast_hypotf(HCB[1], HCB[2]);
+        const float sin_T = (radius > 0.f) ? HCB[1] / radius : 0.f;
+        const float cos_T = (radius > 0.f) ? HCB[2] / radius : 0.f;
+        const float DT_ALIGNED_PIXEL M_rot_inv[2][2] = { { cos_T,  sin_T }, { -sin_T, cos_T } };
+        // This would be the full matrice of direct rotation if we didn't need only its last row
+        //const float DT_ALIGNED_PIXEL M_rot_dir[2][2] = { { cos_T, -sin_T }, {  sin_T, cos_T } };
+
+        const float P = MAX(FLT_MIN, HCB[1]); // as HCB[1] is at least zero we don't fiddle with sign
+        const float W = sin_T * HCB[1] + cos_T * HCB[2];
+
+        float a = MAX(1.f + d->saturation_global + scalar_product(opacities, saturation), 0.f);
+        const float b = MAX(1.f + d->brilliance_global + scalar_product(opacities, brilliance), 0.f);
+
+        const float max_a = dt_fast_hypotf(P, W) / P;
+        a = soft_clip(a, 0.5f * max_a, max_a);
+
+        const float P_prime = (a - 1.f) * P;
+        const float W_prime = sqrtf(sqf(P) * (1.f - sqf(a)) + sqf(W)) * b;
+
+        HCB[1] = MAX(M_rot_inv[0][0] * P_prime + M_rot_inv[0][1] * W_prime, 0.f);
+        HCB[2] = MAX(M_rot_inv[1][0] * P_prime + M_rot_inv[1][1] * W_prime, 0.f);
+
+        // Gamut mapping, the hue HCB[0] will be JCH[2]
+        colorfulness_block[i] = lookup_gamut(gamut_LUT, HCB[0]); // WARNING : this is M²
+      }
+
+      for(size_t i = 0; i < n; i++)
+      {
+        const float *const restrict HCB = HCB_block + 4 * i;
+        float *const restrict JCH = JCH_block + 4 * i;
+
+        dt_UCS_HCB_to_JCH(HCB, JCH);
+
+        const float max_colorfulness = colorfulness_block[i];
+        const float max_chroma = (15.932993652962535f * powf(JCH[0] * L_white, 0.6523997524738018f)
+                                  * powf(max_colorfulness, 0.6007557017508491f) / L_white);
+        const dt_aligned_pixel_t JCH_gamut_boundary = { JCH[0], max_chroma, JCH[2], 0.f };
+        dt_aligned_pixel_t HSB_gamut_boundary;
+        dt_UCS_JCH_to_HSB(JCH_gamut_boundary, HSB_gamut_boundary);
+
+        // Clip saturation at constant brightness
+        dt_aligned_pixel_t HSB = { HCB[0], (HCB[2] > 0.f) ? HCB[1] / HCB[2] : 0.f, HCB[2], 0.f };
+        HSB[1] = soft_clip(HSB[1], 0.8f * HSB_gamut_boundary[1], HSB_gamut_boundary[1]);
+
+        dt_UCS_HSB_to_JCH(HSB, JCH);
+      }
+
+      for(size_t i = 0; i < n; i++)
+      {
+        dt_aligned_pixel_t xyY;
+        dt_UCS_JCH_to_xyY(JCH_block + 4 * i, L_white, xyY);
+        dt_xyY_to_XYZ(xyY, XYZ_block + 4 * i);
+      }
+    }
+
+    for(size_t i = 0; i < n; i++)
+    {
+      const float *const restrict opacities = opacities_block + 4 * i;
+      const float *const restrict XYZ_D65 = XYZ_block + 4 * i;
+
+      // Project back to D50 pipeline RGB
+      dt_aligned_pixel_t pix_out;
+      dt_apply_transposed_color_matrix(XYZ_D65, kd->output_matrix_trans, pix_out);
+
+      /* The previous line is equivalent to :
+        XYZ_D65_to_50(XYZ_D65, XYZ_D50);           // matrix product
+        dot_product(XYZ_D50, XYZ_to_RGB, pix_out); // matrix product
+      */
+
+      if(kd->mask_display)
+      {
+        // draw checkerboard
+        dt_aligned_pixel_t color;
+        const size_t j = start + i;
+        if(row % checker_1 < row % checker_2)
+        {
+          if(j % checker_1 < j % checker_2)
+            copy_pixel(color, d->checker_color_2);
+          else
+            copy_pixel(color, d->checker_color_1);
+        }
+        else
+        {
+          if(j % checker_1 < j % checker_2)
+            copy_pixel(color, d->checker_color_1);
+          else
+            copy_pixel(color, d->checker_color_2);
+        }
+
+        float opacity = opacities[kd->mask_type];
+        const float opacity_comp = 1.0f - opacity;
+
+        dt_vector_clipneg(pix_out);
+        for_four_channels(c, aligned(pix_out, color:16))
+          pix_out[c] = opacity_comp * color[c] + opacity * pix_out[c];
+        pix_out[3] = 1.0f; // alpha is opaque, we need to preview it
+      }
+      else
+      {
+        dt_vector_clipneg(pix_out);
+      }
+      copy_pixel_nontemporal(block_out + 4 * i, pix_out);
+    }
+  }
+}
+
+typedef void((*_balance_row_t)(const float *const restrict in, float *const restrict out, const size_t row,
+                               const size_t width, const dt_iop_colorbalancergb_data_t *const restrict d,
+                               const _balance_kernel_t *const restrict kd));
+
+static void _balance_row_generic(const float *const restrict in, float *const restrict out, const size_t row,
+                                 const size_t width, const dt_iop_colorbalancergb_data_t *const restrict d,
+                                 const _balance_kernel_t *const restrict kd)
+{
+  _balance_pixels(in, out, row, width, d, kd);
+}
+
+#ifdef DT_CODEPATH_VARIANTS
+__DT_TARGET_AVX2__
+static void _balance_row_avx2(const float *const restrict in, float *const restrict out, const size_t row,
+                              const size_t width, const dt_iop_colorbalancergb_data_t *const restrict d,
+                              const _balance_kernel_t *const restrict kd)
+{
+  _balance_pixels(in, out, row, width, d, kd);
+}
+
+__DT_TARGET_AVX512__
+static void _balance_row_avx512(const float *const restrict in, float *const restrict out, const size_t row,
+                                const size_t width, const dt_iop_colorbalancergb_data_t *const restrict d,
+                                const _balance_kernel_t *const restrict kd)
+{
+  _balance_pixels(in, out, row, width, d, kd);
+}
+#endif
+
 void process(struct dt_iop_module_t *self,
              dt_dev_pixelpipe_iop_t *piece,
              const void *const ivoid,
@@ -663,8 +1091,6 @@ void process(struct dt_iop_module_t *self,
 
   dt_colormatrix_mul(output_matrix, XYZ_D50_to_D65_CAT16, work_profile->matrix_in); // output_matrix used as temp buffer
   dt_colormatrix_mul(input_matrix, XYZ_D65_to_LMS_2006_D65, output_matrix);
-  dt_colormatrix_t input_matrix_trans;
-  dt_colormatrix_transpose(input_matrix_trans, input_matrix);
 
   // Premultiply the output matrix
 
@@ -674,321 +1100,37 @@ void process(struct dt_iop_module_t *self,
   */
 
   dt_colormatrix_mul(output_matrix, work_profile->matrix_out, XYZ_D65_to_D50_CAT16);
-  dt_colormatrix_t output_matrix_trans;
-  dt_colormatrix_transpose(output_matrix_trans, output_matrix);
 
   const float *const restrict in = DT_IS_ALIGNED(((const float *const restrict)ivoid));
   float *const restrict out = DT_IS_ALIGNED(((float *const restrict)ovoid));
-  const float *const restrict gamut_LUT = DT_IS_ALIGNED(((const float *const restrict)d->gamut_LUT));
-
-  const float *const restrict global = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->global);
-  const float *const restrict highlights = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->highlights);
-  const float *const restrict shadows = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->shadows);
-  const float *const restrict midtones = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->midtones);
-
-  const float *const restrict chroma = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->chroma);
-  const float *const restrict saturation = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->saturation);
-  const float *const restrict brilliance = DT_IS_ALIGNED_PIXEL((const float *const restrict)d->brilliance);
 
   const gint mask_display
       = ((piece->pipe->type & DT_DEV_PIXELPIPE_FULL) && self->dev->gui_attached
          && g && g->mask_display);
 
-  // pixel size of the checker background
-  const size_t checker_1 = (mask_display) ? DT_PIXEL_APPLY_DPI(d->checker_size) : 0;
-  const size_t checker_2 = 2 * checker_1;
-
-  const float L_white = Y_to_dt_UCS_L_star(d->white_fulcrum);
-
-  const float DT_ALIGNED_ARRAY hue_rotation_matrix[2][2] = {
-    { cosf(d->hue_angle), -sinf(d->hue_angle) },
-    { sinf(d->hue_angle),  cosf(d->hue_angle) },
+  _balance_kernel_t kd = {
+    .L_white = Y_to_dt_UCS_L_star(d->white_fulcrum),
+    .hue_rotation_matrix = {
+      { cosf(d->hue_angle), -sinf(d->hue_angle) },
+      { sinf(d->hue_angle),  cosf(d->hue_angle) },
+    },
+    // pixel size of the checker background
+    .checker_1 = (mask_display) ? DT_PIXEL_APPLY_DPI(d->checker_size) : 0,
+    .mask_display = mask_display,
+    .mask_type = (mask_display) ? g->mask_type : 0,
   };
+  kd.checker_2 = 2 * kd.checker_1;
+  dt_colormatrix_transpose(kd.input_matrix_trans, input_matrix);
+  dt_colormatrix_transpose(kd.output_matrix_trans, output_matrix);
 
-  const size_t npixels = (size_t)roi_out->height * roi_out->width;
-  const size_t out_width = roi_out->width;
+  const size_t width = roi_out->width;
+  const size_t height = roi_out->height;
+  const _balance_row_t balance_row
+      = dt_codepath_select(_balance_row_generic, _balance_row_avx2, _balance_row_avx512);
 
   DT_OMP_FOR()
-  for(size_t k  = 0; k < 4 * npixels; k += 4)
-  {
-    // clip pipeline RGB
-    dt_aligned_pixel_t RGB;
-    copy_pixel(RGB, in + k);
-    dt_vector_clipneg(RGB);
-
-    // go to CIE 2006 LMS D65
-    dt_aligned_pixel_t LMS;
-    dt_apply_transposed_color_matrix(RGB, input_matrix_trans, LMS);
-
-    /* The previous line is equivalent to :
-      // go to CIE 1931 XYZ 2° D50
-      dot_product(RGB, RGB_to_XYZ, XYZ_D50); // matrice product
-
-      // chroma adapt D50 to D65
-      XYZ_D50_to_65(XYZ_D50, XYZ_D65); // matrice product
-
-      // go to CIE 2006 LMS
-      XYZ_to_LMS(XYZ_D65, LMS); // matrice product
-    */
-
-    // go to Filmlight Yrg
-    dt_aligned_pixel_t Yrg = { 0.f };
-    LMS_to_Yrg(LMS, Yrg);
-
-    // go to Ych
-    dt_aligned_pixel_t Ych = { 0.f };
-    Yrg_to_Ych(Yrg, Ych);
-
-    // Sanitize input : no negative luminance
-    Ych[0] = MAX(Ych[0], 0.f);
-
-    // Opacities for luma masks
-    dt_aligned_pixel_t opacities;
-    dt_aligned_pixel_t opacities_comp;
-    opacity_masks(powf(Ych[0], 0.4101205819200422f), // center middle grey in 50 %
-                  d->shadows_weight, d->highlights_weight, d->midtones_weight,
-                  d->mask_grey_fulcrum, opacities, opacities_comp);
-
-    // Hue shift - do it now because we need the gamut limit at output hue right after
-    // The hue rotation is implemented as a matrix multiplication.
-    const float cos_h = Ych[2];
-    const float sin_h = Ych[3];
-    Ych[2] = hue_rotation_matrix[0][0] * cos_h + hue_rotation_matrix[0][1] * sin_h;
-    Ych[3] = hue_rotation_matrix[1][0] * cos_h + hue_rotation_matrix[1][1] * sin_h;
-
-    // Linear chroma : distance to achromatic at constant luminance in scene-referred
-    const float chroma_boost = d->chroma_global + scalar_product(opacities, chroma);
-    const float vibrance = d->vibrance * (1.0f - powf(Ych[1], fabsf(d->vibrance)));
-    const float chroma_factor = MAX(1.f + chroma_boost + vibrance, 0.f);
-    Ych[1] *= chroma_factor;
-
-    // clip chroma at constant hue and Y if needed
-    gamut_check_Yrg(Ych);
-
-    // go to Yrg for real
-    Ych_to_Yrg(Ych, Yrg);
-
-    // Go to LMS
-    Yrg_to_LMS(Yrg, LMS);
-
-    // Go to Filmlight RGB
-    LMS_to_gradingRGB(LMS, RGB);
-
-    // Color balance
-    for_four_channels(c, aligned(RGB, global))
-    {
-      // global : offset
-      RGB[c] += global[c];
-    }
-    for_four_channels(c, aligned(RGB, opacities, opacities_comp, shadows, midtones, highlights:16))
-    {
-      //  highlights, shadows : 2 slopes with masking
-      RGB[c] *= opacities_comp[2] * (opacities_comp[0] + opacities[0] * shadows[c]) + opacities[2] * highlights[c];
-      // factorization of : (RGB[c] * (1.f - alpha) + RGB[c] * d->shadows[c] * alpha) * (1.f - beta)  + RGB[c] * d->highlights[c] * beta;
-    }
-    dt_aligned_pixel_t sign;
-    for_each_channel(c)
-      sign[c] = (RGB[c] < 0.f) ? -1.f : 1.f;
-    dt_aligned_pixel_t abs_RGB;
-    for_each_channel(c)
-      abs_RGB[c] = fabsf(RGB[c]);
-    dt_aligned_pixel_t scaled_RGB;
-    for_each_channel(c)
-      scaled_RGB[c] = abs_RGB[c] /d->white_fulcrum;
-    dt_vector_powf(scaled_RGB, midtones, RGB);
-    for_each_channel(c)
-      RGB[c] = RGB[c] * sign[c] * d->white_fulcrum;
-
-    // for the non-linear ops we need to go in Yrg again because RGB doesn't preserve color
-    gradingRGB_to_LMS(RGB, LMS);
-    LMS_to_Yrg(LMS, Yrg);
-
-    // Y midtones power (gamma)
-    Yrg[0] = powf(MAX(Yrg[0] / d->white_fulcrum, 0.f), d->midtones_Y) * d->white_fulcrum;
-
-    // Y fulcrumed contrast
-    Yrg[0] = d->grey_fulcrum * powf(Yrg[0] / d->grey_fulcrum, d->contrast);
-
-    Yrg_to_LMS(Yrg, LMS);
-    dt_aligned_pixel_t XYZ_D65 = { 0.f };
-    LMS_to_XYZ(LMS, XYZ_D65);
-
-    // Perceptual color adjustments
-    if(d->saturation_formula == DT_COLORBALANCE_SATURATION_JZAZBZ)
-    {
-      dt_aligned_pixel_t Jab = { 0.f };
-      dt_XYZ_2_JzAzBz(XYZ_D65, Jab);
-
-      // Convert to JCh
-      float JC[2] = { Jab[0], dt_fast_hypotf(Jab[1], Jab[2]) };   // brightness/chroma vector
-      const float h = atan2f(Jab[2], Jab[1]);  // hue : (a, b) angle
-
-      // Project JC onto S, the saturation eigenvector, with orthogonal vector O.
-      // Note : O should be = (C * cosf(T) - J * sinf(T)) = 0 since S is the eigenvector,
-      // so we add the chroma projected along the orthogonal axis to get some control value
-      const float T = atan2f(JC[1], JC[0]); // angle of the eigenvector over the hue plane
-      const float sin_T = sinf(T);
-      const float cos_T = cosf(T);
-      const float DT_ALIGNED_PIXEL M_rot_dir[2][2] = { {  cos_T,  sin_T },
-                                                      { -sin_T,  cos_T } };
-      const float DT_ALIGNED_PIXEL M_rot_inv[2][2] = { {  cos_T, -sin_T },
-                                                      {  sin_T,  cos_T } };
-      float SO[2];
-
-      // brilliance & Saturation : mix of chroma and luminance
-      const float boosts[2] = { 1.f + d->brilliance_global + scalar_product(opacities, brilliance),     // move in S direction
-                                d->saturation_global + scalar_product(opacities, saturation) }; // move in O direction
-
-      SO[0] = JC[0] * M_rot_dir[0][0] + JC[1] * M_rot_dir[0][1];
-      SO[1] = SO[0] * MIN(MAX(T * boosts[1], -T), DT_M_PI_F / 2.f - T);
-      SO[0] = MAX(SO[0] * boosts[0], 0.f);
-
-      // Project back to JCh, that is rotate back of -T angle
-      JC[0] = MAX(SO[0] * M_rot_inv[0][0] + SO[1] * M_rot_inv[0][1], 0.f);
-      JC[1] = MAX(SO[0] * M_rot_inv[1][0] + SO[1] * M_rot_inv[1][1], 0.f);
-
-      // Gamut mapping
-      const float out_max_sat_h = lookup_gamut(gamut_LUT, h);
-      // if JC[0] == 0.f, the saturation / luminance ratio is infinite - assign the largest practical value we have
-      const float sat = (JC[0] > 0.f) ? soft_clip(JC[1] / JC[0], 0.8f * out_max_sat_h, out_max_sat_h)
-                                      : out_max_sat_h;
-      const float max_C_at_sat = JC[0] * sat;
-      // if sat == 0.f, the chroma is zero - assign the original luminance because there's no need to gamut map
-      const float max_J_at_sat = (sat > 0.f) ? JC[1] / sat : JC[0];
-      JC[0] = (JC[0] + max_J_at_sat) / 2.f;
-      JC[1] = (JC[1] + max_C_at_sat) / 2.f;
-
-      // Gamut-clip in Jch at constant hue and lightness,
-      // e.g. find the max chroma available at current hue that doesn't
-      // yield negative L'M'S' values, which will need to be clipped during conversion
-      const float cos_H = cosf(h);
-      const float sin_H = sinf(h);
-
-      const float d0 = 1.6295499532821566e-11f;
-      const float dd = -0.56f;
-      float Iz = JC[0] + d0;
-      Iz /= (1.f + dd - dd * Iz);
-      Iz = MAX(Iz, 0.f);
-
-      static const dt_colormatrix_t AI_trans
-          = { {  1.0f,                 1.0f,                                1.0f, 0.0f },
-              {  0.1386050432715393f, -0.1386050432715393f, -0.0960192420263190f, 0.0f },
-              {  0.0580473161561189f, -0.0580473161561189f, -0.8118918960560390f, 0.0f } };
-
-      // Do a test conversion to L'M'S'
-      const dt_aligned_pixel_t IzAzBz = { Iz, JC[1] * cos_H, JC[1] * sin_H, 0.f };
-      dt_apply_transposed_color_matrix(IzAzBz, AI_trans, LMS);
-
-      // Clip chroma
-      float max_C = JC[1];
-      if(LMS[0] < 0.f)
-        max_C = MIN(-Iz / (AI_trans[1][0] * cos_H + AI_trans[2][0] * sin_H), max_C);
-
-      if(LMS[1] < 0.f)
-        max_C = MIN(-Iz / (AI_trans[1][1] * cos_H + AI_trans[2][1] * sin_H), max_C);
-
-      if(LMS[2] < 0.f)
-        max_C = MIN(-Iz / (AI_trans[1][2] * cos_H + AI_trans[2][2] * sin_H), max_C);
-
-      // Project back to JzAzBz for real
-      Jab[0] = JC[0];
-      Jab[1] = max_C * cos_H;
-      Jab[2] = max_C * sin_H;
-
-      dt_JzAzBz_2_XYZ(Jab, XYZ_D65);
-    }
-    else
-    {
-      dt_aligned_pixel_t xyY, JCH, HCB;
-      dt_D65_XYZ_to_xyY(XYZ_D65, xyY);
-      xyY_to_dt_UCS_JCH(xyY, L_white, JCH);
-      dt_UCS_JCH_to_HCB(JCH, HCB);
-
-      const float radius = dt_fast_hypotf(HCB[1], HCB[2]);
-      const float sin_T = (radius > 0.f) ? HCB[1] / radius : 0.f;
-      const float cos_T = (radius > 0.f) ? HCB[2] / radius : 0.f;
-      const float DT_ALIGNED_PIXEL M_rot_inv[2][2] = { { cos_T,  sin_T }, { -sin_T, cos_T } };
-      // This would be the full matrice of direct rotation if we didn't need only its last row
-      //const float DT_ALIGNED_PIXEL M_rot_dir[2][2] = { { cos_T, -sin_T }, {  sin_T, cos_T } };
-
-      const float P = MAX(FLT_MIN, HCB[1]); // as HCB[1] is at least zero we don't fiddle with sign
-      const float W = sin_T * HCB[1] + cos_T * HCB[2];
-
-      float a = MAX(1.f + d->saturation_global + scalar_product(opacities, saturation), 0.f);
-      const float b = MAX(1.f + d->brilliance_global + scalar_product(opacities, brilliance), 0.f);
-
-      const float max_a = dt_fast_hypotf(P, W) / P;
-      a = soft_clip(a, 0.5f * max_a, max_a);
-
-      const float P_prime = (a - 1.f) * P;
-      const float W_prime = sqrtf(sqf(P) * (1.f - sqf(a)) + sqf(W)) * b;
-
-      HCB[1] = MAX(M_rot_inv[0][0] * P_prime + M_rot_inv[0][1] * W_prime, 0.f);
-      HCB[2] = MAX(M_rot_inv[1][0] * P_prime + M_rot_inv[1][1] * W_prime, 0.f);
-
-      dt_UCS_HCB_to_JCH(HCB, JCH);
-
-      // Gamut mapping
-      const float max_colorfulness = lookup_gamut(gamut_LUT, JCH[2]); // WARNING : this is M²
-      const float max_chroma = (15.932993652962535f * powf(JCH[0] * L_white, 0.6523997524738018f)
-                                * powf(max_colorfulness, 0.6007557017508491f) / L_white);
-      const dt_aligned_pixel_t JCH_gamut_boundary = { JCH[0], max_chroma, JCH[2], 0.f };
-      dt_aligned_pixel_t HSB_gamut_boundary;
-      dt_UCS_JCH_to_HSB(JCH_gamut_boundary, HSB_gamut_boundary);
-
-      // Clip saturation at constant brightness
-      dt_aligned_pixel_t HSB = { HCB[0], (HCB[2] > 0.f) ? HCB[1] / HCB[2] : 0.f, HCB[2], 0.f };
-      HSB[1] = soft_clip(HSB[1], 0.8f * HSB_gamut_boundary[1], HSB_gamut_boundary[1]);
-
-      dt_UCS_HSB_to_JCH(HSB, JCH);
-      dt_UCS_JCH_to_xyY(JCH, L_white, xyY);
-      dt_xyY_to_XYZ(xyY, XYZ_D65);
-    }
-
-    // Project back to D50 pipeline RGB
-    dt_aligned_pixel_t pix_out;
-    dt_apply_transposed_color_matrix(XYZ_D65, output_matrix_trans, pix_out);
-
-    /* The previous line is equivalent to :
-      XYZ_D65_to_50(XYZ_D65, XYZ_D50);           // matrix product
-      dot_product(XYZ_D50, XYZ_to_RGB, pix_out); // matrix product
-    */
-
-    if(mask_display)
-    {
-      // draw checkerboard
-      dt_aligned_pixel_t color;
-      const size_t i = (k / 4) / out_width;
-      const size_t j = (k / 4) % out_width;
-      if(i % checker_1 < i % checker_2)
-      {
-        if(j % checker_1 < j % checker_2)
-          copy_pixel(color, d->checker_color_2);
-        else
-          copy_pixel(color, d->checker_color_1);
-      }
-      else
-      {
-        if(j % checker_1 < j % checker_2)
-          copy_pixel(color, d->checker_color_1);
-        else
-          copy_pixel(color, d->checker_color_2);
-      }
-
-      float opacity = opacities[g->mask_type];
-      const float opacity_comp = 1.0f - opacity;
-
-      dt_vector_clipneg(pix_out);
-      for_four_channels(c, aligned(pix_out, color:16))
-        pix_out[c] = opacity_comp * color[c] + opacity * pix_out[c];
-      pix_out[3] = 1.0f; // alpha is opaque, we need to preview it
-    }
-    else
-    {
-      dt_vector_clipneg(pix_out);
-    }
-    copy_pixel_nontemporal(out + k, pix_out);
-  }
+  for(size_t row = 0; row < height; row++)
+    balance_row(in + 4 * width * row, out + 4 * width * row, row, width, d, &kd);
   dt_omploop_sfence();	// ensure all nontemporal writes complete before we use them
 }
 
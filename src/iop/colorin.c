@@ -144,7 +144,8 @@ int default_group()
 
 int flags()
 {
-  return IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_ONE_INSTANCE;
+  return IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_ONE_INSTANCE | IOP_FLAGS_POINTWISE
+    | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 dt_iop_colorspace_type_t default_colorspace(dt_iop_module_t *self,
@@ -510,8 +510,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
         free(mapio);
         return;
       }
-      dt_bilateral_splat(b, out);
-      dt_bilateral_blur(b);
+      dt_bilateral_splat_blur(b, out);
       dt_bilateral_slice(b, out, out, -1.0f);
       dt_bilateral_free(b);
     }
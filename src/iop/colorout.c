@@ -25,6 +25,7 @@
 #include "common/dttypes.h"
 #include "common/imagebuf.h"
 #include "common/iop_profile.h"
+#include "common/lut3d.h"
 #include "common/opencl.h"
 #include "control/conf.h"
 #include "control/control.h"
@@ -45,6 +46,11 @@
 // must be in synch with dt_colorspaces_color_profile_t
 #define DT_IOP_COLOR_ICC_LEN 512
 #define LUT_SAMPLES 0x10000
+// grid sizes of the 3D lut baked from lcms transforms
+#define CLUT_LEVEL_EXPORT 65
+#define CLUT_LEVEL 33
+// the baked lut is only used if it stays within half an 8 bit step of lcms
+#define CLUT_MAX_ERROR (0.5f / 255.0f)
 
 DT_MODULE_INTROSPECTION(5, dt_iop_colorout_params_t)
 
@@ -55,6 +61,8 @@ typedef struct dt_iop_colorout_data_t
   float lut[3][LUT_SAMPLES];
   dt_colormatrix_t cmatrix;
   cmsHTRANSFORM *xform;
+  float *clut;                  // xform baked into a 3D lut over Lab, or NULL
+  int clut_level;
   float unbounded_coeffs[3][3]; // for extrapolation of shaper curves
 } dt_iop_colorout_data_t;
 
@@ -100,7 +108,7 @@ int default_group()
 
 int flags()
 {
-  return IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_ONE_INSTANCE;
+  return IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_ONE_INSTANCE | IOP_FLAGS_POINTWISE;
 }
 
 dt_iop_colorspace_type_t default_colorspace(dt_iop_module_t *self,
@@ -528,6 +536,121 @@ static void _transform_lcms(const dt_iop_colorout_data_t *const d,
   dt_omploop_sfence();
 }
 
+// map Lab to the unit cube the 3D lut covers
+static inline void _clut_lab_to_unit(const float *const lab, float *const unit)
+{
+  unit[0] = lab[0] * (1.0f / 100.0f);
+  unit[1] = (lab[1] + 128.0f) * (1.0f / 256.0f);
+  unit[2] = (lab[2] + 128.0f) * (1.0f / 256.0f);
+}
+
+static void _transform_clut(const dt_iop_colorout_data_t *const d,
+                            float *restrict out,
+                            const float *restrict in,
+                            const size_t npixels)
+{
+  const float *const restrict clut = d->clut;
+  const int level = d->clut_level;
+  DT_OMP_FOR()
+  for(size_t k = 0; k < 4 * npixels; k += 4)
+  {
+    dt_aligned_pixel_t unit = { 0.0f };
+    _clut_lab_to_unit(in + k, unit);
+    dt_lut3d_tetrahedral_pixel(unit, out + k, clut, level);
+    out[k + 3] = in[k + 3];
+  }
+}
+
+// sample the lcms transform on a level^3 grid over Lab. the lut is kept
+// only if tetrahedral interpolation at the centers of a subset of its cells
+// stays within CLUT_MAX_ERROR of the transform, otherwise (strongly
+// nonlinear gamut mapping for example) we keep calling lcms.
+static void _bake_clut(dt_iop_colorout_data_t *d,
+                       const int level)
+{
+  const size_t slice = (size_t)level * level;
+  float *clut = dt_alloc_align_float(3 * slice * level);
+  if(!clut) return;
+
+  const double start = dt_get_wtime();
+  const float step = 1.0f / (level - 1);
+  gboolean ok = TRUE;
+
+  DT_OMP_FOR(reduction(&&: ok))
+  for(int b = 0; b < level; b++)
+  {
+    float *const lab = dt_alloc_align_float(4 * slice);
+    float *const rgb = dt_alloc_align_float(4 * slice);
+    if(!lab || !rgb)
+      ok = FALSE;
+    else
+    {
+      for(size_t k = 0; k < slice; k++)
+      {
+        lab[4 * k + 0] = 100.0f * step * (k % level);
+        lab[4 * k + 1] = 256.0f * step * (k / level) - 128.0f;
+        lab[4 * k + 2] = 256.0f * step * b - 128.0f;
+        lab[4 * k + 3] = 0.0f;
+      }
+      cmsDoTransform(d->xform, lab, rgb, slice);
+      for(size_t k = 0; k < slice; k++)
+        for(int c = 0; c < 3; c++)
+          clut[3 * (b * slice + k) + c] = rgb[4 * k + c];
+    }
+    dt_free_align(lab);
+    dt_free_align(rgb);
+  }
+
+  // test the accuracy at the centers of lut cells, where the interpolation
+  // is furthest from the grid. up to 24 cells per axis, spread over the range.
+  const int cells = level - 1;
+  const int tests = MIN(cells, 24);
+  float center[24];
+  for(int j = 0; j < tests; j++)
+    center[j] = ((j * cells) / tests + 0.5f) * step;
+
+  const size_t ntests = (size_t)tests * tests * tests;
+  float *const lab = dt_alloc_align_float(4 * ntests);
+  float *const ref = dt_alloc_align_float(4 * ntests);
+  float max_error = INFINITY;
+  if(ok && lab && ref)
+  {
+    for(size_t k = 0; k < ntests; k++)
+    {
+      lab[4 * k + 0] = 100.0f * center[k % tests];
+      lab[4 * k + 1] = 256.0f * center[(k / tests) % tests] - 128.0f;
+      lab[4 * k + 2] = 256.0f * center[k / tests / tests] - 128.0f;
+      lab[4 * k + 3] = 0.0f;
+    }
+    cmsDoTransform(d->xform, lab, ref, ntests);
+    max_error = 0.0f;
+    for(size_t k = 0; k < ntests; k++)
+    {
+      dt_aligned_pixel_t unit = { 0.0f };
+      dt_aligned_pixel_t rgb = { 0.0f };
+      _clut_lab_to_unit(lab + 4 * k, unit);
+      dt_lut3d_tetrahedral_pixel(unit, rgb, clut, level);
+      for(int c = 0; c < 3; c++)
+        max_error = fmaxf(max_error, fabsf(rgb[c] - ref[4 * k + c]));
+    }
+  }
+  dt_free_align(lab);
+  dt_free_align(ref);
+
+  dt_print(DT_DEBUG_PERF,
+           "[colorout] baked %i^3 lut in %.3fs, max error %g%s\n",
+           level, dt_get_wtime() - start, max_error,
+           max_error <= CLUT_MAX_ERROR ? "" : ", using lcms");
+
+  if(max_error <= CLUT_MAX_ERROR)
+  {
+    d->clut = clut;
+    d->clut_level = level;
+  }
+  else
+    dt_free_align(clut);
+}
+
 void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid,
              void *const ovoid, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
@@ -549,6 +672,10 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const
     if (!_transform_cmatrix(d, out, (float*)ivoid, npixels))
       process_fastpath_apply_tonecurves(self, piece, ovoid, roi_out);
   }
+  else if(d->clut)
+  {
+    _transform_clut(d, out, (const float *)ivoid, npixels);
+  }
   else
   {
     _transform_lcms(d, out, (float*)ivoid, npixels);
@@ -582,6 +709,8 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     cmsDeleteTransform(d->xform);
     d->xform = NULL;
   }
+  dt_free_align(d->clut);
+  d->clut = NULL;
   dt_mark_colormatrix_invalid(&d->cmatrix[0][0]);
   d->lut[0][0] = -1.0f;
   d->lut[1][0] = -1.0f;
@@ -741,6 +870,15 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
   if(out_type == DT_COLORSPACE_DISPLAY || out_type == DT_COLORSPACE_DISPLAY2)
     pthread_rwlock_unlock(&darktable.color_profiles->xprofile_lock);
 
+  // lut based profiles make lcms slow, replace the transform by a baked 3D
+  // lut. not when the user asked for lcms, for softproofing and gamut
+  // check, or for exports at more than 8 bits where the error could show.
+  const gboolean exporting = pipe->type & DT_DEV_PIXELPIPE_EXPORT;
+  if(d->xform && !force_lcms2 && d->mode == DT_PROFILE_NORMAL
+     && output_format == TYPE_RGBA_FLT
+     && (!exporting || (pipe->levels & IMAGEIO_PREC_MASK) == IMAGEIO_INT8))
+    _bake_clut(d, exporting ? CLUT_LEVEL_EXPORT : CLUT_LEVEL);
+
   // now try to initialize unbounded mode:
   // we do extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -772,6 +910,7 @@ void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pi
   piece->data = calloc(1, sizeof(dt_iop_colorout_data_t));
   dt_iop_colorout_data_t *d = (dt_iop_colorout_data_t *)piece->data;
   d->xform = NULL;
+  d->clut = NULL;
 }
 
 void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
@@ -782,6 +921,7 @@ void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev
     cmsDeleteTransform(d->xform);
     d->xform = NULL;
   }
+  dt_free_align(d->clut);
 
   free(piece->data);
   piece->data = NULL;
@@ -77,11 +77,33 @@
 #define epssq 1e-10f
 
 // We might have negative data in input and also want to normalise
-static inline float _safe_in(float a, float scale)
+static inline __attribute__((always_inline)) float _safe_in(float a, float scale)
 {
   return fmaxf(0.0f, a) * scale;
 }
 
+// sqrf(), interpolatef() and FC() for rcd_tile(). gcc doesn't inline the
+// common ones into code compiled with the options above, nor into the
+// avx2/avx512 variants, and calls per pixel would stop the vectorization.
+static inline __attribute__((always_inline)) float _sqrf(const float a)
+{
+  return a * a;
+}
+
+static inline __attribute__((always_inline)) float _interpolatef(const float a,
+                                                                 const float b,
+                                                                 const float c)
+{
+  return a * (b - c) + c;
+}
+
+static inline __attribute__((always_inline)) int _fc(const size_t row,
+                                                     const size_t col,
+                                                     const uint32_t filters)
+{
+  return filters >> (((row << 1 & 14) + (col & 1)) << 1) & 3;
+}
+
 /** This is basically ppg adopted to only write data to RCD_MARGIN */
 static void rcd_ppg_border(
         float *const out,
@@ -270,6 +292,310 @@ static void rcd_ppg_border(
   }
 }
 
+// demosaic one tile into out, with the buffers of the calling thread. the
+// variants below share this code and only differ by the target they are
+// compiled for, the autovectorizer then uses wider vectors and fma.
+static inline __attribute__((always_inline)) void rcd_tile(float *const restrict out, const float *const restrict in,
+                                                           float *const restrict VH_Dir, float *const restrict PQ_Dir,
+                                                           float *const restrict cfa, float *const restrict P_CDiff_Hpf,
+                                                           float *const restrict Q_CDiff_Hpf,
+                                                           float (*const restrict rgb)[DT_RCD_TILESIZE * DT_RCD_TILESIZE],
+                                                           const int width, const int height, const uint32_t filters,
+                                                           const float scaler, const float revscaler,
+                                                           const int tile_vertical, const int tile_horizontal,
+                                                           const int num_vertical, const int num_horizontal)
+{
+  // No overlapping use so re-use same buffer
+  float *const lpf = PQ_Dir;
+
+  const int rowStart = tile_vertical * RCD_TILEVALID;
+  const int rowEnd = MIN(rowStart + DT_RCD_TILESIZE, height);
+
+  const int colStart = tile_horizontal * RCD_TILEVALID;
+  const int colEnd = MIN(colStart + DT_RCD_TILESIZE, width);
+
+  const int tileRows = MIN(rowEnd - rowStart, DT_RCD_TILESIZE);
+  const int tileCols = MIN(colEnd - colStart, DT_RCD_TILESIZE);
+
+  if(rowStart + DT_RCD_TILESIZE > height || colStart + DT_RCD_TILESIZE > width)
+  {
+    // VH_Dir is only filled for(4,4)..(height-4,width-4), but the refinement code reads (3,3)...(h-3,w-3),
+    // so we need to ensure that the border is zeroed for partial tiles to get consistent results
+    memset(VH_Dir, 0, sizeof(*VH_Dir) * DT_RCD_TILESIZE * DT_RCD_TILESIZE);
+    // TODO: figure out what part of rgb is being accessed without initialization on partial tiles
+    memset(rgb, 0, sizeof(float) * 3 * DT_RCD_TILESIZE * DT_RCD_TILESIZE);
+  }
+  // Step 0: fill data and make sure data are not negative.
+  for(int row = rowStart; row < rowEnd; row++)
+  {
+    const int c0 = _fc(row, colStart, filters);
+    const int c1 = _fc(row, colStart + 1, filters);
+    for(int col = colStart, indx = (row - rowStart) * DT_RCD_TILESIZE, in_indx = row * width + colStart; col < colEnd; col++, indx++, in_indx++)
+    {
+      cfa[indx] = rgb[c0][indx] = rgb[c1][indx] = _safe_in(in[in_indx], revscaler);
+    }
+  }
+
+  // STEP 1: Find vertical and horizontal interpolation directions
+  float bufferV[3][DT_RCD_TILESIZE - 8];
+  // Step 1.1: Calculate the square of the vertical and horizontal color difference high pass filter
+  for(int row = 3; row < MIN(tileRows - 3, 5); row++ )
+  {
+    for(int col = 4, indx = row * DT_RCD_TILESIZE + col; col < tileCols - 4; col++, indx++ )
+    {
+      bufferV[row - 3][col - 4] = _sqrf((cfa[indx - w3] - cfa[indx - w1] - cfa[indx + w1] + cfa[indx + w3]) - 3.0f * (cfa[indx - w2] + cfa[indx + w2]) + 6.0f * cfa[indx]);
+    }
+  }
+
+  // Step 1.2: Obtain the vertical and horizontal directional discrimination strength
+  float DT_ALIGNED_PIXEL bufferH[DT_RCD_TILESIZE];
+  // We start with V0, V1 and V2 pointing to row -1, row and row +1
+  // After row is processed V0 must point to the old V1, V1 must point to the old V2 and V2 must point to the old V0
+  // because the old V0 is not used anymore and will be filled with row + 1 data in next iteration
+  float* V0 = bufferV[0];
+  float* V1 = bufferV[1];
+  float* V2 = bufferV[2];
+  for(int row = 4; row < tileRows - 4; row++ )
+  {
+    for(int col = 3, indx = row * DT_RCD_TILESIZE + col; col < tileCols - 3; col++, indx++)
+    {
+      bufferH[col - 3] = _sqrf((cfa[indx -  3] - cfa[indx -  1] - cfa[indx +  1] + cfa[indx +  3]) - 3.0f * (cfa[indx -  2] + cfa[indx +  2]) + 6.0f * cfa[indx]);
+    }
+    for(int col = 4, indx = (row + 1) * DT_RCD_TILESIZE + col; col < tileCols - 4; col++, indx++)
+    {
+      V2[col - 4] = _sqrf((cfa[indx - w3] - cfa[indx - w1] - cfa[indx + w1] + cfa[indx + w3]) - 3.0f * (cfa[indx - w2] + cfa[indx + w2]) + 6.0f * cfa[indx]);
+    }
+    for(int col = 4, indx = row * DT_RCD_TILESIZE + col; col < tileCols - 4; col++, indx++ )
+    {
+      const float V_Stat = fmaxf(epssq,      V0[col - 4] +      V1[col - 4] +      V2[col - 4]);
+      const float H_Stat = fmaxf(epssq, bufferH[col - 4] + bufferH[col - 3] + bufferH[col - 2]);
+      VH_Dir[indx] = V_Stat / ( V_Stat + H_Stat );
+    }
+    // rolling the line pointers
+    float* tmp = V0; V0 = V1; V1 = V2; V2 = tmp;
+  }
+
+  // STEP 2: Calculate the low pass filter
+  // Step 2.1: Low pass filter incorporating green, red and blue local samples from the raw data
+  for(int row = 2; row < tileRows - 2; row++)
+  {
+    for(int col = 2 + (_fc(row, 0, filters) & 1), indx = row * DT_RCD_TILESIZE + col, lp_indx = indx / 2; col < tileCols - 2; col += 2, indx +=2, lp_indx++)
+    {
+      lpf[lp_indx] = cfa[indx]
+                  + 0.5f * (cfa[indx - w1]     + cfa[indx + w1] +     cfa[indx - 1] +      cfa[indx + 1])
+                 + 0.25f * (cfa[indx - w1 - 1] + cfa[indx - w1 + 1] + cfa[indx + w1 - 1] + cfa[indx + w1 + 1]);
+    }
+  }
+
+  // STEP 3: Populate the green channel
+  // Step 3.1: Populate the green channel at blue and red CFA positions
+  for(int row = 4; row < tileRows - 4; row++)
+  {
+    for(int col = 4 + (_fc(row, 0, filters) & 1), indx = row * DT_RCD_TILESIZE + col, lpindx = indx / 2; col < tileCols - 4; col += 2, indx += 2, lpindx++)
+    {
+      const float cfai = cfa[indx];
+
+      // Cardinal gradients
+      const float N_Grad = eps + fabsf(cfa[indx - w1] - cfa[indx + w1]) + fabsf(cfai - cfa[indx - w2]) + fabsf(cfa[indx - w1] - cfa[indx - w3]) + fabsf(cfa[indx - w2] - cfa[indx - w4]);
+      const float S_Grad = eps + fabsf(cfa[indx - w1] - cfa[indx + w1]) + fabsf(cfai - cfa[indx + w2]) + fabsf(cfa[indx + w1] - cfa[indx + w3]) + fabsf(cfa[indx + w2] - cfa[indx + w4]);
+      const float W_Grad = eps + fabsf(cfa[indx -  1] - cfa[indx +  1]) + fabsf(cfai - cfa[indx -  2]) + fabsf(cfa[indx -  1] - cfa[indx -  3]) + fabsf(cfa[indx -  2] - cfa[indx -  4]);
+      const float E_Grad = eps + fabsf(cfa[indx -  1] - cfa[indx +  1]) + fabsf(cfai - cfa[indx +  2]) + fabsf(cfa[indx +  1] - cfa[indx +  3]) + fabsf(cfa[indx +  2] - cfa[indx +  4]);
+
+      // Cardinal pixel estimations
+      const float lpfi = lpf[lpindx];
+      const float N_Est = cfa[indx - w1] * (lpfi + lpfi) / (eps + lpfi + lpf[lpindx - w1]);
+      const float S_Est = cfa[indx + w1] * (lpfi + lpfi) / (eps + lpfi + lpf[lpindx + w1]);
+      const float W_Est = cfa[indx -  1] * (lpfi + lpfi) / (eps + lpfi + lpf[lpindx -  1]);
+      const float E_Est = cfa[indx +  1] * (lpfi + lpfi) / (eps + lpfi + lpf[lpindx +  1]);
+
+      // Vertical and horizontal estimations
+      const float V_Est = (S_Grad * N_Est + N_Grad * S_Est) / (N_Grad + S_Grad);
+      const float H_Est = (W_Grad * E_Est + E_Grad * W_Est) / (E_Grad + W_Grad);
+
+      // G@B and G@R interpolation
+      // Refined vertical and horizontal local discrimination
+      const float VH_Central_Value = VH_Dir[indx];
+      const float VH_Neighbourhood_Value = 0.25f * (VH_Dir[indx - w1 - 1] + VH_Dir[indx - w1 + 1] + VH_Dir[indx + w1 - 1] + VH_Dir[indx + w1 + 1]);
+      const float VH_Disc = (fabsf(0.5f - VH_Central_Value) < fabsf(0.5f - VH_Neighbourhood_Value)) ? VH_Neighbourhood_Value : VH_Central_Value;
+
+      rgb[1][indx] = _interpolatef(VH_Disc, H_Est, V_Est);
+    }
+  }
+
+  // STEP 4: Populate the red and blue channels
+
+  // Step 4.0: Calculate the square of the P/Q diagonals color difference high pass filter
+  for(int row = 3; row < tileRows - 3; row++)
+  {
+    for(int col = 3, indx = row * DT_RCD_TILESIZE + col, indx2 = indx / 2; col < tileCols - 3; col+=2, indx+=2, indx2++)
+    {
+      P_CDiff_Hpf[indx2] = _sqrf((cfa[indx - w3 - 3] - cfa[indx - w1 - 1] - cfa[indx + w1 + 1] + cfa[indx + w3 + 3]) - 3.0f * (cfa[indx - w2 - 2] + cfa[indx + w2 + 2]) + 6.0f * cfa[indx]);
+      Q_CDiff_Hpf[indx2] = _sqrf((cfa[indx - w3 + 3] - cfa[indx - w1 + 1] - cfa[indx + w1 - 1] + cfa[indx + w3 - 3]) - 3.0f * (cfa[indx - w2 + 2] + cfa[indx + w2 - 2]) + 6.0f * cfa[indx]);
+    }
+  }
+  // Step 4.1: Obtain the P/Q diagonals directional discrimination strength
+  for(int row = 4; row < tileRows - 4; row++)
+  {
+    for(int col = 4 + (_fc(row, 0, filters) & 1), indx = row * DT_RCD_TILESIZE + col, indx2 = indx / 2, indx3 = (indx - w1 - 1) / 2, indx4 = (indx + w1 - 1) / 2; col < tileCols - 4; col += 2, indx += 2, indx2++, indx3++, indx4++ )
+    {
+      const float P_Stat = fmaxf(epssq, P_CDiff_Hpf[indx3]     + P_CDiff_Hpf[indx2] + P_CDiff_Hpf[indx4 + 1]);
+      const float Q_Stat = fmaxf(epssq, Q_CDiff_Hpf[indx3 + 1] + Q_CDiff_Hpf[indx2] + Q_CDiff_Hpf[indx4]);
+      PQ_Dir[indx2] = P_Stat / (P_Stat + Q_Stat);
+    }
+  }
+
+  // Step 4.2: Populate the red and blue channels at blue and red CFA positions
+  for(int row = 4; row < tileRows - 4; row++)
+  {
+    for(int col = 4 + (_fc(row, 0, filters) & 1), indx = row * DT_RCD_TILESIZE + col, c = 2 - _fc(row, col, filters), pqindx = indx / 2, pqindx2 = (indx - w1 - 1) / 2, pqindx3 = (indx + w1 - 1) / 2; col < tileCols - 4; col += 2, indx += 2, pqindx++, pqindx2++, pqindx3++)
+    {
+      // Refined P/Q diagonal local discrimination
+      const float PQ_Central_Value   = PQ_Dir[pqindx];
+      const float PQ_Neighbourhood_Value = 0.25f * (PQ_Dir[pqindx2] + PQ_Dir[pqindx2 + 1] + PQ_Dir[pqindx3] + PQ_Dir[pqindx3 + 1]);
+
+      const float PQ_Disc = (fabsf(0.5f - PQ_Central_Value) < fabsf(0.5f - PQ_Neighbourhood_Value)) ? PQ_Neighbourhood_Value : PQ_Central_Value;
+
+      // Diagonal gradients
+      const float NW_Grad = eps + fabsf(rgb[c][indx - w1 - 1] - rgb[c][indx + w1 + 1]) + fabsf(rgb[c][indx - w1 - 1] - rgb[c][indx - w3 - 3]) + fabsf(rgb[1][indx] - rgb[1][indx - w2 - 2]);
+      const float NE_Grad = eps + fabsf(rgb[c][indx - w1 + 1] - rgb[c][indx + w1 - 1]) + fabsf(rgb[c][indx - w1 + 1] - rgb[c][indx - w3 + 3]) + fabsf(rgb[1][indx] - rgb[1][indx - w2 + 2]);
+      const float SW_Grad = eps + fabsf(rgb[c][indx - w1 + 1] - rgb[c][indx + w1 - 1]) + fabsf(rgb[c][indx + w1 - 1] - rgb[c][indx + w3 - 3]) + fabsf(rgb[1][indx] - rgb[1][indx + w2 - 2]);
+      const float SE_Grad = eps + fabsf(rgb[c][indx - w1 - 1] - rgb[c][indx + w1 + 1]) + fabsf(rgb[c][indx + w1 + 1] - rgb[c][indx + w3 + 3]) + fabsf(rgb[1][indx] - rgb[1][indx + w2 + 2]);
+
+      // Diagonal colour differences
+      const float NW_Est = rgb[c][indx - w1 - 1] - rgb[1][indx - w1 - 1];
+      const float NE_Est = rgb[c][indx - w1 + 1] - rgb[1][indx - w1 + 1];
+      const float SW_Est = rgb[c][indx + w1 - 1] - rgb[1][indx + w1 - 1];
+      const float SE_Est = rgb[c][indx + w1 + 1] - rgb[1][indx + w1 + 1];
+
+      // P/Q estimations
+      const float P_Est = (NW_Grad * SE_Est + SE_Grad * NW_Est) / (NW_Grad + SE_Grad);
+      const float Q_Est = (NE_Grad * SW_Est + SW_Grad * NE_Est) / (NE_Grad + SW_Grad);
+
+      // R@B and B@R interpolation
+      rgb[c][indx] = rgb[1][indx] + _interpolatef(PQ_Disc, Q_Est, P_Est);
+    }
+  }
+
+  // Step 4.3: Populate the red and blue channels at green CFA positions
+  for(int row = 4; row < tileRows - 4; row++)
+  {
+    for(int col = 4 + (_fc(row, 1, filters) & 1), indx = row * DT_RCD_TILESIZE + col; col < tileCols - 4; col += 2, indx +=2)
+    {
+      // Refined vertical and horizontal local discrimination
+      const float VH_Central_Value = VH_Dir[indx];
+      const float VH_Neighbourhood_Value = 0.25f * (VH_Dir[indx - w1 - 1] + VH_Dir[indx - w1 + 1] + VH_Dir[indx + w1 - 1] + VH_Dir[indx + w1 + 1]);
+      const float VH_Disc = (fabsf(0.5f - VH_Central_Value) < fabsf(0.5f - VH_Neighbourhood_Value) ) ? VH_Neighbourhood_Value : VH_Central_Value;
+      const float rgb1 = rgb[1][indx];
+      const float N1 = eps + fabsf(rgb1 - rgb[1][indx - w2]);
+      const float S1 = eps + fabsf(rgb1 - rgb[1][indx + w2]);
+      const float W1 = eps + fabsf(rgb1 - rgb[1][indx -  2]);
+      const float E1 = eps + fabsf(rgb1 - rgb[1][indx +  2]);
+
+      const float rgb1mw1 = rgb[1][indx - w1];
+      const float rgb1pw1 = rgb[1][indx + w1];
+      const float rgb1m1 =  rgb[1][indx - 1];
+      const float rgb1p1 =  rgb[1][indx + 1];
+
+      for(int c = 0; c <= 2; c += 2)
+      {
+        const float SNabs = fabs(rgb[c][indx - w1] - rgb[c][indx + w1]);
+        const float EWabs = fabs(rgb[c][indx -  1] - rgb[c][indx +  1]);
+
+        // Cardinal gradients
+        const float N_Grad = N1 + SNabs + fabsf(rgb[c][indx - w1] - rgb[c][indx - w3]);
+        const float S_Grad = S1 + SNabs + fabsf(rgb[c][indx + w1] - rgb[c][indx + w3]);
+        const float W_Grad = W1 + EWabs + fabsf(rgb[c][indx -  1] - rgb[c][indx -  3]);
+        const float E_Grad = E1 + EWabs + fabsf(rgb[c][indx +  1] - rgb[c][indx +  3]);
+
+        // Cardinal colour differences
+        const float N_Est = rgb[c][indx - w1] - rgb1mw1;
+        const float S_Est = rgb[c][indx + w1] - rgb1pw1;
+        const float W_Est = rgb[c][indx -  1] - rgb1m1;
+        const float E_Est = rgb[c][indx +  1] - rgb1p1;
+
+        // Vertical and horizontal estimations
+        const float V_Est = (N_Grad * S_Est + S_Grad * N_Est) / (N_Grad + S_Grad);
+        const float H_Est = (E_Grad * W_Est + W_Grad * E_Est) / (E_Grad + W_Grad);
+
+        // R@G and B@G interpolation
+        rgb[c][indx] = rgb1 + _interpolatef(VH_Disc, H_Est, V_Est);
+      }
+    }
+  }
+
+  // For the outermost tiles in all directions we can use a smaller border margin
+  const int first_vertical =   rowStart + ((tile_vertical == 0) ? RCD_MARGIN : RCD_BORDER);
+  const int last_vertical =    rowEnd   - ((tile_vertical == num_vertical - 1)     ? RCD_MARGIN : RCD_BORDER);
+  const int first_horizontal = colStart + ((tile_horizontal == 0) ? RCD_MARGIN : RCD_BORDER);
+  const int last_horizontal =  colEnd   - ((tile_horizontal == num_horizontal - 1) ? RCD_MARGIN : RCD_BORDER);
+  for(int row = first_vertical; row < last_vertical; row++)
+  {
+    for(int col = first_horizontal, idx = (row - rowStart) * DT_RCD_TILESIZE + col - colStart, o_idx = (row * width + col) * 4; col < last_horizontal; col++, o_idx += 4, idx++)
+    {
+      out[o_idx]   = scaler * fmaxf(0.0f, rgb[0][idx]);
+      out[o_idx+1] = scaler * fmaxf(0.0f, rgb[1][idx]);
+      out[o_idx+2] = scaler * fmaxf(0.0f, rgb[2][idx]);
+      out[o_idx+3] = 0.0f;
+    }
+  }
+}
+
+typedef void((*rcd_tile_t)(float *const restrict out, const float *const restrict in,
+                           float *const restrict VH_Dir, float *const restrict PQ_Dir,
+                           float *const restrict cfa, float *const restrict P_CDiff_Hpf,
+                           float *const restrict Q_CDiff_Hpf,
+                           float (*const restrict rgb)[DT_RCD_TILESIZE * DT_RCD_TILESIZE],
+                           const int width, const int height, const uint32_t filters,
+                           const float scaler, const float revscaler,
+                           const int tile_vertical, const int tile_horizontal,
+                           const int num_vertical, const int num_horizontal));
+
+static void rcd_tile_generic(float *const restrict out, const float *const restrict in,
+                             float *const restrict VH_Dir, float *const restrict PQ_Dir,
+                             float *const restrict cfa, float *const restrict P_CDiff_Hpf,
+                             float *const restrict Q_CDiff_Hpf,
+                             float (*const restrict rgb)[DT_RCD_TILESIZE * DT_RCD_TILESIZE],
+                             const int width, const int height, const uint32_t filters,
+                             const float scaler, const float revscaler,
+                             const int tile_vertical, const int tile_horizontal,
+                             const int num_vertical, const int num_horizontal)
+{
+  rcd_tile(out, in, VH_Dir, PQ_Dir, cfa, P_CDiff_Hpf, Q_CDiff_Hpf, rgb, width, height, filters,
+           scaler, revscaler, tile_vertical, tile_horizontal, num_vertical, num_horizontal);
+}
+
+#ifdef DT_CODEPATH_VARIANTS
+__DT_TARGET_AVX2__
+static void rcd_tile_avx2(float *const restrict out, const float *const restrict in,
+                          float *const restrict VH_Dir, float *const restrict PQ_Dir,
+                          float *const restrict cfa, float *const restrict P_CDiff_Hpf,
+                          float *const restrict Q_CDiff_Hpf,
+                          float (*const restrict rgb)[DT_RCD_TILESIZE * DT_RCD_TILESIZE],
+                          const int width, const int height, const uint32_t filters,
+                          const float scaler, const float revscaler,
+                          const int tile_vertical, const int tile_horizontal,
+                          const int num_vertical, const int num_horizontal)
+{
+  rcd_tile(out, in, VH_Dir, PQ_Dir, cfa, P_CDiff_Hpf, Q_CDiff_Hpf, rgb, width, height, filters,
+           scaler, revscaler, tile_vertical, tile_horizontal, num_vertical, num_horizontal);
+}
+
+__DT_TARGET_AVX512__
+static void rcd_tile_avx512(float *const restrict out, const float *const restrict in,
+                            float *const restrict VH_Dir, float *const restrict PQ_Dir,
+                            float *const restrict cfa, float *const restrict P_CDiff_Hpf,
+                            float *const restrict Q_CDiff_Hpf,
+                            float (*const restrict rgb)[DT_RCD_TILESIZE * DT_RCD_TILESIZE],
+                            const int width, const int height, const uint32_t filters,
+                            const float scaler, const float revscaler,
+                            const int tile_vertical, const int tile_horizontal,
+                            const int num_vertical, const int num_horizontal)
+{
+  rcd_tile(out, in, VH_Dir, PQ_Dir, cfa, P_CDiff_Hpf, Q_CDiff_Hpf, rgb, width, height, filters,
+           scaler, revscaler, tile_vertical, tile_horizontal, num_vertical, num_horizontal);
+}
+#endif
+
 DT_OMP_DECLARE_SIMD(aligned(in, out))
 static void rcd_demosaic(
         dt_dev_pixelpipe_iop_t *piece,
@@ -295,6 +621,8 @@ static void rcd_demosaic(
 
   const int num_vertical = 1 + (height - 2 * RCD_BORDER -1) / RCD_TILEVALID;
   const int num_horizontal = 1 + (width - 2 * RCD_BORDER -1) / RCD_TILEVALID;
+  const rcd_tile_t process_tile =
+    dt_codepath_select(rcd_tile_generic, rcd_tile_avx2, rcd_tile_avx512);
 
   DT_OMP_PRAGMA(parallel firstprivate(width, height, filters, out, in, scaler, revscaler))
   {
@@ -308,244 +636,13 @@ static void rcd_demosaic(
 
     float (*const rgb)[DT_RCD_TILESIZE * DT_RCD_TILESIZE] = (void *)dt_alloc_align_float((size_t)3 * DT_RCD_TILESIZE * DT_RCD_TILESIZE);
 
-    // No overlapping use so re-use same buffer
-    float *const lpf = PQ_Dir;
-
     DT_OMP_PRAGMA(for schedule(simd:static) collapse(2))
     for(int tile_vertical = 0; tile_vertical < num_vertical; tile_vertical++)
     {
       for(int tile_horizontal = 0; tile_horizontal < num_horizontal; tile_horizontal++)
       {
-        const int rowStart = tile_vertical * RCD_TILEVALID;
-        const int rowEnd = MIN(rowStart + DT_RCD_TILESIZE, height);
-
-        const int colStart = tile_horizontal * RCD_TILEVALID;
-        const int colEnd = MIN(colStart + DT_RCD_TILESIZE, width);
-
-        const int tileRows = MIN(rowEnd - rowStart, DT_RCD_TILESIZE);
-        const int tileCols = MIN(colEnd - colStart, DT_RCD_TILESIZE);
-
-        if(rowStart + DT_RCD_TILESIZE > height || colStart + DT_RCD_TILESIZE > width)
-        {
-          // VH_Dir is only filled for(4,4)..(height-4,width-4), but the refinement code reads (3,3)...(h-3,w-3),
-          // so we need to ensure that the border is zeroed for partial tiles to get consistent results
-          memset(VH_Dir, 0, sizeof(*VH_Dir) * DT_RCD_TILESIZE * DT_RCD_TILESIZE);
-          // TODO: figure out what part of rgb is being accessed without initialization on partial tiles
-          memset(rgb, 0, sizeof(float) * 3 * DT_RCD_TILESIZE * DT_RCD_TILESIZE);
-        }
-        // Step 0: fill data and make sure data are not negative.
-        for(int row = rowStart; row < rowEnd; row++)
-        {
-          const int c0 = FC(row, colStart, filters);
-          const int c1 = FC(row, colStart + 1, filters);
-          for(int col = colStart, indx = (row - rowStart) * DT_RCD_TILESIZE, in_indx = row * width + colStart; col < colEnd; col++, indx++, in_indx++)
-          {
-            cfa[indx] = rgb[c0][indx] = rgb[c1][indx] = _safe_in(in[in_indx], revscaler);
-          }
-        }
-
-        // STEP 1: Find vertical and horizontal interpolation directions
-        float bufferV[3][DT_RCD_TILESIZE - 8];
-        // Step 1.1: Calculate the square of the vertical and horizontal color difference high pass filter
-        for(int row = 3; row < MIN(tileRows - 3, 5); row++ )
-        {
-          for(int col = 4, indx = row * DT_RCD_TILESIZE + col; col < tileCols - 4; col++, indx++ )
-          {
-            bufferV[row - 3][col - 4] = sqrf((cfa[indx - w3] - cfa[indx - w1] - cfa[indx + w1] + cfa[indx + w3]) - 3.0f * (cfa[indx - w2] + cfa[indx + w2]) + 6.0f * cfa[indx]);
-          }
-        }
-
-        // Step 1.2: Obtain the vertical and horizontal directional discrimination strength
-        float DT_ALIGNED_PIXEL bufferH[DT_RCD_TILESIZE];
-        // We start with V0, V1 and V2 pointing to row -1, row and row +1
-        // After row is processed V0 must point to the old V1, V1 must point to the old V2 and V2 must point to the old V0
-        // because the old V0 is not used anymore and will be filled with row + 1 data in next iteration
-        float* V0 = bufferV[0];
-        float* V1 = bufferV[1];
-        float* V2 = bufferV[2];
-        for(int row = 4; row < tileRows - 4; row++ )
-        {
-          for(int col = 3, indx = row * DT_RCD_TILESIZE + col; col < tileCols - 3; col++, indx++)
-          {
-            bufferH[col - 3] = sqrf((cfa[indx -  3] - cfa[indx -  1] - cfa[indx +  1] + cfa[indx +  3]) - 3.0f * (cfa[indx -  2] + cfa[indx +  2]) + 6.0f * cfa[indx]);
-          }
-          for(int col = 4, indx = (row + 1) * DT_RCD_TILESIZE + col; col < tileCols - 4; col++, indx++)
-          {
-            V2[col - 4] = sqrf((cfa[indx - w3] - cfa[indx - w1] - cfa[indx + w1] + cfa[indx + w3]) - 3.0f * (cfa[indx - w2] + cfa[indx + w2]) + 6.0f * cfa[indx]);
-          }
-          for(int col = 4, indx = row * DT_RCD_TILESIZE + col; col < tileCols - 4; col++, indx++ )
-          {
-            const float V_Stat = fmaxf(epssq,      V0[col - 4] +      V1[col - 4] +      V2[col - 4]);
-            const float H_Stat = fmaxf(epssq, bufferH[col - 4] + bufferH[col - 3] + bufferH[col - 2]);
-            VH_Dir[indx] = V_Stat / ( V_Stat + H_Stat );
-          }
-          // rolling the line pointers
-          float* tmp = V0; V0 = V1; V1 = V2; V2 = tmp;
-        }
-
-        // STEP 2: Calculate the low pass filter
-        // Step 2.1: Low pass filter incorporating green, red and blue local samples from the raw data
-        for(int row = 2; row < tileRows - 2; row++)
-        {
-          for(int col = 2 + (FC(row, 0, filters) & 1), indx = row * DT_RCD_TILESIZE + col, lp_indx = indx / 2; col < tileCols - 2; col += 2, indx +=2, lp_indx++)
-          {
-            lpf[lp_indx] = cfa[indx]
-                        + 0.5f * (cfa[indx - w1]     + cfa[indx + w1] +     cfa[indx - 1] +      cfa[indx + 1])
-                       + 0.25f * (cfa[indx - w1 - 1] + cfa[indx - w1 + 1] + cfa[indx + w1 - 1] + cfa[indx + w1 + 1]);
-          }
-        }
-
-        // STEP 3: Populate the green channel
-        // Step 3.1: Populate the green channel at blue and red CFA positions
-        for(int row = 4; row < tileRows - 4; row++)
-        {
-          for(int col = 4 + (FC(row, 0, filters) & 1), indx = row * DT_RCD_TILESIZE + col, lpindx = indx / 2; col < tileCols - 4; col += 2, indx += 2, lpindx++)
-          {
-            const float cfai = cfa[indx];
-
-            // Cardinal gradients
-            const float N_Grad = eps + fabsf(cfa[indx - w1] - cfa[indx + w1]) + fabsf(cfai - cfa[indx - w2]) + fabsf(cfa[indx - w1] - cfa[indx - w3]) + fabsf(cfa[indx - w2] - cfa[indx - w4]);
-            const float S_Grad = eps + fabsf(cfa[indx - w1] - cfa[indx + w1]) + fabsf(cfai - cfa[indx + w2]) + fabsf(cfa[indx + w1] - cfa[indx + w3]) + fabsf(cfa[indx + w2] - cfa[indx + w4]);
-            const float W_Grad = eps + fabsf(cfa[indx -  1] - cfa[indx +  1]) + fabsf(cfai - cfa[indx -  2]) + fabsf(cfa[indx -  1] - cfa[indx -  3]) + fabsf(cfa[indx -  2] - cfa[indx -  4]);
-            const float E_Grad = eps + fabsf(cfa[indx -  1] - cfa[indx +  1]) + fabsf(cfai - cfa[indx +  2]) + fabsf(cfa[indx +  1] - cfa[indx +  3]) + fabsf(cfa[indx +  2] - cfa[indx +  4]);
-
-            // Cardinal pixel estimations
-            const float lpfi = lpf[lpindx];
-            const float N_Est = cfa[indx - w1] * (lpfi + lpfi) / (eps + lpfi + lpf[lpindx - w1]);
-            const float S_Est = cfa[indx + w1] * (lpfi + lpfi) / (eps + lpfi + lpf[lpindx + w1]);
-            const float W_Est = cfa[indx -  1] * (lpfi + lpfi) / (eps + lpfi + lpf[lpindx -  1]);
-            const float E_Est = cfa[indx +  1] * (lpfi + lpfi) / (eps + lpfi + lpf[lpindx +  1]);
-
-            // Vertical and horizontal estimations
-            const float V_Est = (S_Grad * N_Est + N_Grad * S_Est) / (N_Grad + S_Grad);
-            const float H_Est = (W_Grad * E_Est + E_Grad * W_Est) / (E_Grad + W_Grad);
-
-            // G@B and G@R interpolation
-            // Refined vertical and horizontal local discrimination
-            const float VH_Central_Value = VH_Dir[indx];
-            const float VH_Neighbourhood_Value = 0.25f * (VH_Dir[indx - w1 - 1] + VH_Dir[indx - w1 + 1] + VH_Dir[indx + w1 - 1] + VH_Dir[indx + w1 + 1]);
-            const float VH_Disc = (fabsf(0.5f - VH_Central_Value) < fabsf(0.5f - VH_Neighbourhood_Value)) ? VH_Neighbourhood_Value : VH_Central_Value;
-
-            rgb[1][indx] = interpolatef(VH_Disc, H_Est, V_Est);
-          }
-        }
-
-        // STEP 4: Populate the red and blue channels
-
-        // Step 4.0: Calculate the square of the P/Q diagonals color difference high pass filter
-        for(int row = 3; row < tileRows - 3; row++)
-        {
-          for(int col = 3, indx = row * DT_RCD_TILESIZE + col, indx2 = indx / 2; col < tileCols - 3; col+=2, indx+=2, indx2++)
-          {
-            P_CDiff_Hpf[indx2] = sqrf((cfa[indx - w3 - 3] - cfa[indx - w1 - 1] - cfa[indx + w1 + 1] + cfa[indx + w3 + 3]) - 3.0f * (cfa[indx - w2 - 2] + cfa[indx + w2 + 2]) + 6.0f * cfa[indx]);
-            Q_CDiff_Hpf[indx2] = sqrf((cfa[indx - w3 + 3] - cfa[indx - w1 + 1] - cfa[indx + w1 - 1] + cfa[indx + w3 - 3]) - 3.0f * (cfa[indx - w2 + 2] + cfa[indx + w2 - 2]) + 6.0f * cfa[indx]);
-          }
-        }
-        // Step 4.1: Obtain the P/Q diagonals directional discrimination strength
-        for(int row = 4; row < tileRows - 4; row++)
-        {
-          for(int col = 4 + (FC(row, 0, filters) & 1), indx = row * DT_RCD_TILESIZE + col, indx2 = indx / 2, indx3 = (indx - w1 - 1) / 2, indx4 = (indx + w1 - 1) / 2; col < tileCols - 4; col += 2, indx += 2, indx2++, indx3++, indx4++ )
-          {
-            const float P_Stat = fmaxf(epssq, P_CDiff_Hpf[indx3]     + P_CDiff_Hpf[indx2] + P_CDiff_Hpf[indx4 + 1]);
-            const float Q_Stat = fmaxf(epssq, Q_CDiff_Hpf[indx3 + 1] + Q_CDiff_Hpf[indx2] + Q_CDiff_Hpf[indx4]);
-            PQ_Dir[indx2] = P_Stat / (P_Stat + Q_Stat);
-          }
-        }
-
-        // Step 4.2: Populate the red and blue channels at blue and red CFA positions
-        for(int row = 4; row < tileRows - 4; row++)
-        {
-          for(int col = 4 + (FC(row, 0, filters) & 1), indx = row * DT_RCD_TILESIZE + col, c = 2 - FC(row, col, filters), pqindx = indx / 2, pqindx2 = (indx - w1 - 1) / 2, pqindx3 = (indx + w1 - 1) / 2; col < tileCols - 4; col += 2, indx += 2, pqindx++, pqindx2++, pqindx3++)
-          {
-            // Refined P/Q diagonal local discrimination
-            const float PQ_Central_Value   = PQ_Dir[pqindx];
-            const float PQ_Neighbourhood_Value = 0.25f * (PQ_Dir[pqindx2] + PQ_Dir[pqindx2 + 1] + PQ_Dir[pqindx3] + PQ_Dir[pqindx3 + 1]);
-
-            const float PQ_Disc = (fabsf(0.5f - PQ_Central_Value) < fabsf(0.5f - PQ_Neighbourhood_Value)) ? PQ_Neighbourhood_Value : PQ_Central_Value;
-
-            // Diagonal gradients
-            const float NW_Grad = eps + fabsf(rgb[c][indx - w1 - 1] - rgb[c][indx + w1 + 1]) + fabsf(rgb[c][indx - w1 - 1] - rgb[c][indx - w3 - 3]) + fabsf(rgb[1][indx] - rgb[1][indx - w2 - 2]);
-            const float NE_Grad = eps + fabsf(rgb[c][indx - w1 + 1] - rgb[c][indx + w1 - 1]) + fabsf(rgb[c][indx - w1 + 1] - rgb[c][indx - w3 + 3]) + fabsf(rgb[1][indx] - rgb[1][indx - w2 + 2]);
-            const float SW_Grad = eps + fabsf(rgb[c][indx - w1 + 1] - rgb[c][indx + w1 - 1]) + fabsf(rgb[c][indx + w1 - 1] - rgb[c][indx + w3 - 3]) + fabsf(rgb[1][indx] - rgb[1][indx + w2 - 2]);
-            const float SE_Grad = eps + fabsf(rgb[c][indx - w1 - 1] - rgb[c][indx + w1 + 1]) + fabsf(rgb[c][indx + w1 + 1] - rgb[c][indx + w3 + 3]) + fabsf(rgb[1][indx] - rgb[1][indx + w2 + 2]);
-
-            // Diagonal colour differences
-            const float NW_Est = rgb[c][indx - w1 - 1] - rgb[1][indx - w1 - 1];
-            const float NE_Est = rgb[c][indx - w1 + 1] - rgb[1][indx - w1 + 1];
-            const float SW_Est = rgb[c][indx + w1 - 1] - rgb[1][indx + w1 - 1];
-            const float SE_Est = rgb[c][indx + w1 + 1] - rgb[1][indx + w1 + 1];
-
-            // P/Q estimations
-            const float P_Est = (NW_Grad * SE_Est + SE_Grad * NW_Est) / (NW_Grad + SE_Grad);
-            const float Q_Est = (NE_Grad * SW_Est + SW_Grad * NE_Est) / (NE_Grad + SW_Grad);
-
-            // R@B and B@R interpolation
-            rgb[c][indx] = rgb[1][indx] + interpolatef(PQ_Disc, Q_Est, P_Est);
-          }
-        }
-
-        // Step 4.3: Populate the red and blue channels at green CFA positions
-        for(int row = 4; row < tileRows - 4; row++)
-        {
-          for(int col = 4 + (FC(row, 1, filters) & 1), indx = row * DT_RCD_TILESIZE + col; col < tileCols - 4; col += 2, indx +=2)
-          {
-            // Refined vertical and horizontal local discrimination
-            const float VH_Central_Value = VH_Dir[indx];
-            const float VH_Neighbourhood_Value = 0.25f * (VH_Dir[indx - w1 - 1] + VH_Dir[indx - w1 + 1] + VH_Dir[indx + w1 - 1] + VH_Dir[indx + w1 + 1]);
-            const float VH_Disc = (fabsf(0.5f - VH_Central_Value) < fabsf(0.5f - VH_Neighbourhood_Value) ) ? VH_Neighbourhood_Value : VH_Central_Value;
-            const float rgb1 = rgb[1][indx];
-            const float N1 = eps + fabsf(rgb1 - rgb[1][indx - w2]);
-            const float S1 = eps + fabsf(rgb1 - rgb[1][indx + w2]);
-            const float W1 = eps + fabsf(rgb1 - rgb[1][indx -  2]);
-            const float E1 = eps + fabsf(rgb1 - rgb[1][indx +  2]);
-
-            const float rgb1mw1 = rgb[1][indx - w1];
-            const float rgb1pw1 = rgb[1][indx + w1];
-            const float rgb1m1 =  rgb[1][indx - 1];
-            const float rgb1p1 =  rgb[1][indx + 1];
-
-            for(int c = 0; c <= 2; c += 2)
-            {
-              const float SNabs = fabs(rgb[c][indx - w1] - rgb[c][indx + w1]);
-              const float EWabs = fabs(rgb[c][indx -  1] - rgb[c][indx +  1]);
-
-              // Cardinal gradients
-              const float N_Grad = N1 + SNabs + fabsf(rgb[c][indx - w1] - rgb[c][indx - w3]);
-              const float S_Grad = S1 + SNabs + fabsf(rgb[c][indx + w1] - rgb[c][indx + w3]);
-              const float W_Grad = W1 + EWabs + fabsf(rgb[c][indx -  1] - rgb[c][indx -  3]);
-              const float E_Grad = E1 + EWabs + fabsf(rgb[c][indx +  1] - rgb[c][indx +  3]);
-
-              // Cardinal colour differences
-              const float N_Est = rgb[c][indx - w1] - rgb1mw1;
-              const float S_Est = rgb[c][indx + w1] - rgb1pw1;
-              const float W_Est = rgb[c][indx -  1] - rgb1m1;
-              const float E_Est = rgb[c][indx +  1] - rgb1p1;
-
-              // Vertical and horizontal estimations
-              const float V_Est = (N_Grad * S_Est + S_Grad * N_Est) / (N_Grad + S_Grad);
-              const float H_Est = (E_Grad * W_Est + W_Grad * E_Est) / (E_Grad + W_Grad);
-
-              // R@G and B@G interpolation
-              rgb[c][indx] = rgb1 + interpolatef(VH_Disc, H_Est, V_Est);
-            }
-          }
-        }
-
-        // For the outermost tiles in all directions we can use a smaller border margin
-        const int first_vertical =   rowStart + ((tile_vertical == 0) ? RCD_MARGIN : RCD_BORDER);
-        const int last_vertical =    rowEnd   - ((tile_vertical == num_vertical - 1)     ? RCD_MARGIN : RCD_BORDER);
-        const int first_horizontal = colStart + ((tile_horizontal == 0) ? RCD_MARGIN : RCD_BORDER);
-        const int last_horizontal =  colEnd   - ((tile_horizontal == num_horizontal - 1) ? RCD_MARGIN : RCD_BORDER);
-        for(int row = first_vertical; row < last_vertical; row++)
-        {
-          for(int col = first_horizontal, idx = (row - rowStart) * DT_RCD_TILESIZE + col - colStart, o_idx = (row * width + col) * 4; col < last_horizontal; col++, o_idx += 4, idx++)
-          {
-            out[o_idx]   = scaler * fmaxf(0.0f, rgb[0][idx]);
-            out[o_idx+1] = scaler * fmaxf(0.0f, rgb[1][idx]);
-            out[o_idx+2] = scaler * fmaxf(0.0f, rgb[2][idx]);
-            out[o_idx+3] = 0.0f;
-          }
-        }
+        process_tile(out, in, VH_Dir, PQ_Dir, cfa, P_CDiff_Hpf, Q_CDiff_Hpf, rgb, width, height, filters,
+                     scaler, revscaler, tile_vertical, tile_horizontal, num_vertical, num_horizontal);
       }
     }
     dt_free_align(cfa);
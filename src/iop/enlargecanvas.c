@@ -93,7 +93,7 @@ const char *aliases()
 
 int flags()
 {
-  return IOP_GROUP_EFFECT | IOP_GROUP_EFFECTS;
+  return IOP_GROUP_EFFECT | IOP_GROUP_EFFECTS | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 // where does it appear in the gui?
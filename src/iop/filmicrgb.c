@@ -17,11 +17,13 @@
 */
 
 /** Note :
- * we use finite-math-only and fast-math because divisions by zero are manually avoided in the code
+ * we use fast-math because divisions by zero are manually avoided in the code
+ * but not finite-math-only: gcc would not inline the helpers of the pixel loop
+ * into its avx2/avx512 variants, see _filmic_v5_pixels()
  * fp-contract=fast enables hardware-accelerated Fused Multiply-Add
 **/
 #if defined(__GNUC__)
-#pragma GCC optimize("finite-math-only", "fp-contract=fast", "fast-math", "no-math-errno")
+#pragma GCC optimize("fp-contract=fast", "fast-math", "no-finite-math-only", "no-math-errno")
 #endif
 
 #ifdef HAVE_CONFIG_H
@@ -34,6 +36,7 @@
 #include "common/gamut_mapping.h"
 #include "common/image.h"
 #include "common/opencl.h"
+#include "common/vector_math.h"
 #include "control/control.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
@@ -858,7 +861,7 @@ static inline float pixel_rgb_norm_power(const dt_aligned_pixel_t pixel)
     denominator += RGB_square;
   }
 
-  return numerator / fmaxf(denominator, 1e-12f); // prevent from division-by-0 (note: (1e-6)^2 = 1e-12
+  return numerator / MAX(denominator, 1e-12f); // prevent from division-by-0 (note: (1e-6)^2 = 1e-12
 }
 
 
@@ -875,7 +878,7 @@ static inline float get_pixel_norm(const dt_aligned_pixel_t pixel, const dt_iop_
   switch(variant)
   {
     case(DT_FILMIC_METHOD_MAX_RGB):
-      return fmaxf(fmaxf(pixel[0], pixel[1]), pixel[2]);
+      return MAX(MAX(pixel[0], pixel[1]), pixel[2]);
 
     case(DT_FILMIC_METHOD_LUMINANCE):
       return (work_profile)
@@ -1619,7 +1622,7 @@ static inline void filmic_chroma_v2_v3(const float *const restrict in,
     {
       for_each_channel(c,aligned(pix_out))
       {
-        ratios[c] = fmaxf(ratios[c] + (1.0f - max_pix), 0.0f);
+        ratios[c] = MAX(ratios[c] + (1.0f - max_pix), 0.0f);
         pix_out[c] = CLIP(ratios[c] * norm);
       }
     }
@@ -1789,6 +1792,19 @@ static int filmic_v4_prepare_matrices(dt_colormatrix_t input_matrix_trans,
   return use_output_profile;
 }
 
+DT_OMP_DECLARE_SIMD(uniform(spline, display_black, display_white))
+static inline float norm_spline_v4(const float norm,
+                                   const dt_iop_filmic_rgb_spline_t spline,
+                                   const float display_black,
+                                   const float display_white)
+{
+  // S curve on the log tone-mapped norm, without the transfer function of the display
+  return CLAMP(filmic_spline(norm, spline.M1, spline.M2, spline.M3, spline.M4, spline.M5,
+                             spline.latitude_min, spline.latitude_max, spline.type),
+               display_black,
+               display_white);
+}
+
 DT_OMP_DECLARE_SIMD(
   uniform(work_profile, data, spline, norm_min, norm_max, display_black, display_white, type)
   aligned(pix_in, pix_out:16))
@@ -1819,27 +1835,21 @@ static inline void norm_tone_mapping_v4(const dt_aligned_pixel_t pix_in,
 
   // Filmic S curve on the max RGB
   // Apply the transfer function of the display
-  norm = powf(CLAMP(filmic_spline(norm, spline.M1, spline.M2, spline.M3, spline.M4, spline.M5,
-                                        spline.latitude_min, spline.latitude_max, spline.type),
-                    display_black,
-                    display_white),
-              data->output_power);
+  norm = powf(norm_spline_v4(norm, spline, display_black, display_white), data->output_power);
 
   // Restore RGB
   for_each_channel(c,aligned(pix_out))
     pix_out[c] = ratios[c] * norm;
 }
 
-DT_OMP_DECLARE_SIMD(uniform(data, spline, display_black, display_white) aligned(pix_in, pix_out:16))
-static inline void RGB_tone_mapping_v4(const dt_aligned_pixel_t pix_in,
-                                       dt_aligned_pixel_t pix_out,
-                                       const dt_iop_filmicrgb_data_t *const data,
-                                       const dt_iop_filmic_rgb_spline_t spline,
-                                       const float display_black,
-                                       const float display_white)
+DT_OMP_DECLARE_SIMD(uniform(data, spline, display_white) aligned(mapped, pix_out:16))
+static inline void RGB_spline_v4(dt_aligned_pixel_t mapped,
+                                 dt_aligned_pixel_t pix_out,
+                                 const dt_iop_filmicrgb_data_t *const data,
+                                 const dt_iop_filmic_rgb_spline_t spline,
+                                 const float display_white)
 {
-  dt_aligned_pixel_t mapped;
-  log_tonemapping_v2(mapped, pix_in, data->grey_source, data->black_source, data->dynamic_range);
+  // S curve and transfer function of the display on log tone-mapped RGB
 //  for_each_channel(c,aligned(mapped))
   for(size_t c = 0; c < 3; c++)
   {
@@ -1854,6 +1864,19 @@ static inline void RGB_tone_mapping_v4(const dt_aligned_pixel_t pix_in,
   dt_vector_pow1(mapped, data->output_power, pix_out);
 }
 
+DT_OMP_DECLARE_SIMD(uniform(data, spline, display_black, display_white) aligned(pix_in, pix_out:16))
+static inline void RGB_tone_mapping_v4(const dt_aligned_pixel_t pix_in,
+                                       dt_aligned_pixel_t pix_out,
+                                       const dt_iop_filmicrgb_data_t *const data,
+                                       const dt_iop_filmic_rgb_spline_t spline,
+                                       const float display_black,
+                                       const float display_white)
+{
+  dt_aligned_pixel_t mapped;
+  log_tonemapping_v2(mapped, pix_in, data->grey_source, data->black_source, data->dynamic_range);
+  RGB_spline_v4(mapped, pix_out, data, spline, display_white);
+}
+
 static inline void filmic_chroma_v4(const float *const restrict in,
                                     float *const restrict out,
                                     const dt_iop_order_iccprofile_info_t *const work_profile,
@@ -1961,63 +1984,158 @@ static inline void filmic_split_v4(const float *const restrict in,
 }
 
 
-static inline void filmic_v5(const float *const restrict in, float *const restrict out,
-                                    const dt_iop_order_iccprofile_info_t *const work_profile,
-                                    const dt_iop_order_iccprofile_info_t *const export_profile,
-                                    const dt_iop_filmicrgb_data_t *const data,
-                                    const dt_iop_filmic_rgb_spline_t spline,
-                                    const size_t width, const size_t height,
-                                    const float display_black, const float display_white)
-
+typedef struct _filmic_v5_kernel_t
 {
-  // See colorbalancergb.c for details
   dt_colormatrix_t input_matrix_trans;         // pipeline RGB -> LMS 2006
   dt_colormatrix_t output_matrix;              // LMS 2006 -> pipeline RGB
   dt_colormatrix_t output_matrix_trans;        // LMS 2006 -> pipeline RGB
   dt_colormatrix_t export_input_matrix_trans;  // output RGB -> LMS 2006
   dt_colormatrix_t export_output_matrix;       // LMS 2006 -> output RGB
   dt_colormatrix_t export_output_matrix_trans; // LMS 2006 -> output RGB
+  const dt_iop_order_iccprofile_info_t *work_profile;
+  const dt_iop_filmicrgb_data_t *data;
+  float norm_min;
+  float norm_max;
+  float display_black;
+  float display_white;
+  int use_output_profile;
+} _filmic_v5_kernel_t;
+
+// pixels are processed in blocks, so the log2f() of the log tone mapping
+// and the powf() of the display transfer function are evaluated for the
+// whole block in plain loops, which the compiler vectorizes at the width
+// of the codepath it is compiled for
+#define FILMIC_BLOCK 16
+
+static inline __attribute__((always_inline)) void _filmic_v5_pixels(const float *const restrict in,
+                                                                    float *const restrict out,
+                                                                    const size_t npixels,
+                                                                    const _filmic_v5_kernel_t *const restrict k)
+{
+  const dt_iop_filmicrgb_data_t *const data = k->data;
 
-  const int use_output_profile
-    = filmic_v4_prepare_matrices(input_matrix_trans, output_matrix, output_matrix_trans,
-                                 export_input_matrix_trans, export_output_matrix, export_output_matrix_trans,
-                                 work_profile, export_profile);
-
-  const float norm_min = exp_tonemapping_v2(0.f, data->grey_source, data->black_source, data->dynamic_range);
-  const float norm_max = exp_tonemapping_v2(1.f, data->grey_source, data->black_source, data->dynamic_range);
-
-  DT_OMP_FOR()
-  for(size_t k = 0; k < height * width * 4; k += 4)
+  for(size_t start = 0; start < npixels; start += FILMIC_BLOCK)
   {
-    const float *const restrict pix_in = in + k;
+    const size_t n = MIN(FILMIC_BLOCK, npixels - start);
+    const float *const restrict block_in = in + 4 * start;
+    float *const restrict block_out = out + 4 * start;
+    float DT_ALIGNED_ARRAY mapped[4 * FILMIC_BLOCK];
+    float DT_ALIGNED_ARRAY naive_rgb[4 * FILMIC_BLOCK];
+    float DT_ALIGNED_ARRAY norm[FILMIC_BLOCK];
+    float DT_ALIGNED_ARRAY norm_mapped[FILMIC_BLOCK];
+
+    for(size_t i = 0; i < n; i++)
+      norm[i] = CLAMPF(get_pixel_norm(block_in + 4 * i, DT_FILMIC_METHOD_MAX_RGB, k->work_profile),
+                       k->norm_min, k->norm_max);
+
+    // Log tone-mapping of the RGB channels and of the max RGB norm, split from
+    // the clamping of log_tonemapping_v2() to keep the log2f() loops branchless
+    for(size_t c = 0; c < 4 * n; c++)
+      mapped[c] = log2f(block_in[c] / data->grey_source);
+    for(size_t i = 0; i < n; i++)
+      norm_mapped[i] = log2f(norm[i] / data->grey_source);
+    for(size_t c = 0; c < 4 * n; c++)
+      mapped[c] = CLAMPF((mapped[c] - data->black_source) / data->dynamic_range, 0.0f, 1.0f);
+    for(size_t i = 0; i < n; i++)
+      norm_mapped[i] = CLAMPF((norm_mapped[i] - data->black_source) / data->dynamic_range, 0.0f, 1.0f);
+
+    // Filmic S curve
+    for(size_t i = 0; i < n; i++)
+    {
+      RGB_spline_v4(mapped + 4 * i, naive_rgb + 4 * i, data, data->spline, k->display_white);
+      norm_mapped[i] = norm_spline_v4(norm_mapped[i], data->spline, k->display_black, k->display_white);
+    }
 
-    dt_aligned_pixel_t max_rgb = { 0.f };
-    dt_aligned_pixel_t naive_rgb = { 0.f };
+    // Transfer function of the display on the max RGB norm
+    for(size_t i = 0; i < n; i++)
+      norm_mapped[i] = powf(norm_mapped[i], data->output_power);
 
-    RGB_tone_mapping_v4(pix_in, naive_rgb, data, spline, display_black, display_white);
-    norm_tone_mapping_v4(pix_in, max_rgb, DT_FILMIC_METHOD_MAX_RGB, work_profile, data,
-                         spline, norm_min, norm_max, display_black, display_white);
+    for(size_t i = 0; i < n; i++)
+    {
+      const float *const restrict pix_in = block_in + 4 * i;
 
-    // Mix max RGB with naive RGB
-    dt_aligned_pixel_t pix_out;
-    for_each_channel(c, aligned(pix_out, max_rgb, naive_rgb))
-      pix_out[c] = (0.5f - data->saturation) * naive_rgb[c] + (0.5f + data->saturation) * max_rgb[c];
+      // Restore RGB from the max RGB ratios
+      dt_aligned_pixel_t max_rgb;
+      for_each_channel(c, aligned(pix_in, max_rgb))
+        max_rgb[c] = (pix_in[c] / norm[i]) * norm_mapped[i];
 
-    // Save Ych in Kirk/Filmlight Yrg
-    dt_aligned_pixel_t Ych_original = { 0.f };
-    RGB_to_Ych(pix_in, input_matrix_trans, Ych_original);
+      // Mix max RGB with naive RGB
+      dt_aligned_pixel_t pix_out;
+      for_each_channel(c, aligned(pix_out, max_rgb))
+        pix_out[c] = (0.5f - data->saturation) * naive_rgb[4 * i + c] + (0.5f + data->saturation) * max_rgb[c];
 
-    // Get final Ych in Kirk/Filmlight Yrg
-    dt_aligned_pixel_t Ych_final = { 0.f };
-    RGB_to_Ych(pix_out, input_matrix_trans, Ych_final);
+      // Save Ych in Kirk/Filmlight Yrg
+      dt_aligned_pixel_t Ych_original = { 0.f };
+      RGB_to_Ych(pix_in, k->input_matrix_trans, Ych_original);
 
-    Ych_final[1] = fminf(Ych_original[1], Ych_final[1]);
+      // Get final Ych in Kirk/Filmlight Yrg
+      dt_aligned_pixel_t Ych_final = { 0.f };
+      RGB_to_Ych(pix_out, k->input_matrix_trans, Ych_final);
 
-    gamut_mapping(Ych_final, Ych_original, pix_out, input_matrix_trans, output_matrix, output_matrix_trans,
-                  export_input_matrix_trans, export_output_matrix, export_output_matrix_trans,
-                  display_black, display_white, 0.0f, use_output_profile);
-    copy_pixel_nontemporal(out + k, pix_out);
+      Ych_final[1] = MIN(Ych_original[1], Ych_final[1]);
+
+      gamut_mapping(Ych_final, Ych_original, pix_out, k->input_matrix_trans, k->output_matrix,
+                    k->output_matrix_trans, k->export_input_matrix_trans, k->export_output_matrix,
+                    k->export_output_matrix_trans, k->display_black, k->display_white, 0.0f,
+                    k->use_output_profile);
+      copy_pixel_nontemporal(block_out + 4 * i, pix_out);
+    }
   }
+}
+
+typedef void((*_filmic_v5_row_t)(const float *const restrict in, float *const restrict out,
+                                 const size_t width, const _filmic_v5_kernel_t *const restrict k));
+
+static void _filmic_v5_row_generic(const float *const restrict in, float *const restrict out,
+                                   const size_t width, const _filmic_v5_kernel_t *const restrict k)
+{
+  _filmic_v5_pixels(in, out, width, k);
+}
+
+#ifdef DT_CODEPATH_VARIANTS
+__DT_TARGET_AVX2__
+static void _filmic_v5_row_avx2(const float *const restrict in, float *const restrict out,
+                                const size_t width, const _filmic_v5_kernel_t *const restrict k)
+{
+  _filmic_v5_pixels(in, out, width, k);
+}
+
+__DT_TARGET_AVX512__
+static void _filmic_v5_row_avx512(const float *const restrict in, float *const restrict out,
+                                  const size_t width, const _filmic_v5_kernel_t *const restrict k)
+{
+  _filmic_v5_pixels(in, out, width, k);
+}
+#endif
+
+static inline void filmic_v5(const float *const restrict in, float *const restrict out,
+                                    const dt_iop_order_iccprofile_info_t *const work_profile,
+                                    const dt_iop_order_iccprofile_info_t *const export_profile,
+                                    const dt_iop_filmicrgb_data_t *const data,
+                                    const size_t width, const size_t height,
+                                    const float display_black, const float display_white)
+
+{
+  // See colorbalancergb.c for details
+  _filmic_v5_kernel_t k = { .work_profile = work_profile,
+                            .data = data,
+                            .display_black = display_black,
+                            .display_white = display_white };
+
+  k.use_output_profile
+    = filmic_v4_prepare_matrices(k.input_matrix_trans, k.output_matrix, k.output_matrix_trans,
+                                 k.export_input_matrix_trans, k.export_output_matrix,
+                                 k.export_output_matrix_trans, work_profile, export_profile);
+
+  k.norm_min = exp_tonemapping_v2(0.f, data->grey_source, data->black_source, data->dynamic_range);
+  k.norm_max = exp_tonemapping_v2(1.f, data->grey_source, data->black_source, data->dynamic_range);
+
+  const _filmic_v5_row_t v5_row
+    = dt_codepath_select(_filmic_v5_row_generic, _filmic_v5_row_avx2, _filmic_v5_row_avx512);
+
+  DT_OMP_FOR()
+  for(size_t row = 0; row < height; row++)
+    v5_row(in + 4 * width * row, out + 4 * width * row, width, &k);
   dt_omploop_sfence();	// ensure that nontemporal writes complete before we attempt to read output
 }
 
@@ -2204,8 +2322,8 @@ void process(dt_iop_module_t *self,
 
   if(data->version == DT_FILMIC_COLORSCIENCE_V5)
   {
-    filmic_v5(in, out, work_profile, export_profile, data, data->spline, roi_out->width,
-              roi_out->height, black_display, white_display);
+    filmic_v5(in, out, work_profile, export_profile, data, roi_out->width, roi_out->height,
+              black_display, white_display);
   }
   else
   {
@@ -147,7 +147,7 @@ int default_group()
 
 int flags()
 {
-  return IOP_FLAGS_ONE_INSTANCE | IOP_FLAGS_DEPRECATED;
+  return IOP_FLAGS_ONE_INSTANCE | IOP_FLAGS_DEPRECATED | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 dt_iop_colorspace_type_t default_colorspace(dt_iop_module_t *self,
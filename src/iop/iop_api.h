@@ -275,6 +275,15 @@ DEFAULT(void, process_tiling, struct dt_iop_module_t *self,
                               const struct dt_iop_roi_t *const roi_in,
                               const struct dt_iop_roi_t *const roi_out,
                               const int bpp);
+/** a variant of process() working on 4 channel float buffers stored as one
+  * plane of width * height floats per channel. used by export pipes on the
+  * CPU instead of process() if possible, see process_planar_ready. */
+OPTIONAL(void, process_planar, struct dt_iop_module_t *self,
+                               struct dt_dev_pixelpipe_iop_t *piece,
+                               const float *const i,
+                               float *const o,
+                               const struct dt_iop_roi_t *const roi_in,
+                               const struct dt_iop_roi_t *const roi_out);
 
 #ifdef HAVE_OPENCL
 /** the opencl equivalent of process().
@@ -111,7 +111,8 @@ const char **description(struct dt_iop_module_t *self)
 
 int flags()
 {
-  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING;
+  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING
+    | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 int default_group()
@@ -436,8 +437,7 @@ void process(struct dt_iop_module_t *self,
       dt_iop_copy_image_roi(out, in, piece->colors, roi_in, roi_out);
       return;
     }
-    dt_bilateral_splat(b, in);
-    dt_bilateral_blur(b);
+    dt_bilateral_splat_blur(b, in);
     dt_bilateral_slice(b, in, out, detail);
     dt_bilateral_free(b);
   }
@@ -463,6 +463,74 @@ void process(struct dt_iop_module_t *self,
   }
 }
 
+void process_planar(struct dt_iop_module_t *self,
+                    dt_dev_pixelpipe_iop_t *piece,
+                    const float *const in,
+                    float *const out,
+                    const dt_iop_roi_t *const roi_in,
+                    const dt_iop_roi_t *const roi_out)
+{
+  dt_iop_lowpass_data_t *data = (dt_iop_lowpass_data_t *)piece->data;
+
+  const size_t width = roi_in->width;
+  const size_t height = roi_in->height;
+  const size_t npixels = width * height;
+
+  const float radius = fmax(0.1f, data->radius);
+  const float sigma = radius * roi_in->scale / piece->iscale;
+
+  dt_aligned_pixel_t Labmax = { 100.0f, 128.0f, 128.0f, 1.0f };
+  dt_aligned_pixel_t Labmin = { 0.0f, -128.0f, -128.0f, 0.0f };
+
+  if(data->unbound)
+  {
+    for_four_channels(c)
+    {
+      Labmax[c] = FLT_MAX;
+      Labmin[c] = -FLT_MAX;
+    }
+  }
+
+  // only the gaussian is channel-separable, see commit_params(). the
+  // alpha plane is copied, not blurred.
+  dt_gaussian_t *g = dt_gaussian_init(width, height, 3, Labmax, Labmin, sigma, data->order);
+  if(!g)
+  {
+    dt_iop_image_copy_by_size(out, in, width, height, 4);
+    return;
+  }
+  dt_gaussian_blur_planar(g, in, out);
+  dt_gaussian_free(g);
+
+  float *const restrict L = out;
+  float *const restrict a = out + npixels;
+  float *const restrict b = out + 2 * npixels;
+  const float saturation = data->saturation;
+
+  // apply contrast and brightness curves to the L plane
+  DT_OMP_FOR()
+  for(size_t k = 0; k < npixels; k++)
+  {
+    const float l = (L[k] < 100.0f)
+                    ? data->ctable[CLAMP((int)(L[k] / 100.0f * 0x10000ul), 0, 0xffff)]
+                    : dt_iop_eval_exp(data->cunbounded_coeffs, L[k] / 100.0f);
+    L[k] = (l < 100.0f)
+           ? data->ltable[CLAMP((int)(l / 100.0f * 0x10000ul), 0, 0xffff)]
+           : dt_iop_eval_exp(data->lunbounded_coeffs, l / 100.0f);
+  }
+
+  // the following will not clip in unbound case (see definition of Labmax/Labmin)
+  DT_OMP_FOR_SIMD()
+  for(size_t k = 0; k < npixels; k++)
+  {
+    a[k] = CLAMPF(a[k] * saturation, Labmin[1], Labmax[1]);
+    b[k] = CLAMPF(b[k] * saturation, Labmin[2], Labmax[2]);
+  }
+
+  // copy alpha plane to output
+  dt_iop_image_copy(out + 3 * npixels, in + 3 * npixels, npixels);
+}
+
 void commit_params(struct dt_iop_module_t *self,
                    dt_iop_params_t *p1,
                    dt_dev_pixelpipe_t *pipe,
@@ -483,6 +551,10 @@ void commit_params(struct dt_iop_module_t *self,
     piece->process_cl_ready = (piece->process_cl_ready && !dt_opencl_avoid_atomics(pipe->devid));
 #endif
 
+  // the bilateral filter works on all channels of a pixel together
+  if(d->lowpass_algo != LOWPASS_ALGO_GAUSSIAN)
+    piece->process_planar_ready = FALSE;
+
 
   // generate precomputed contrast curve
   if(fabs(d->contrast) <= 1.0f)
@@ -3598,8 +3598,7 @@ static void _retouch_blur(dt_iop_module_t *self,
       else
         image_rgb2lab(img_dest, roi_mask_scaled->width, roi_mask_scaled->height);
 
-      dt_bilateral_splat(b, img_dest);
-      dt_bilateral_blur(b);
+      dt_bilateral_splat_blur(b, img_dest);
       dt_bilateral_slice(b, img_dest, img_dest, detail);
       dt_bilateral_free(b);
 
@@ -122,7 +122,8 @@ const char *name()
 
 int flags()
 {
-  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING;
+  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING
+    | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 int default_group()
@@ -398,8 +399,7 @@ void process(struct dt_iop_module_t *self,
 
     dt_bilateral_t *b = dt_bilateral_init(width, height, sigma_s, sigma_r);
     if(!b) return;
-    dt_bilateral_splat(b, in);
-    dt_bilateral_blur(b);
+    dt_bilateral_splat_blur(b, in);
     dt_bilateral_slice(b, in, out, detail);
     dt_bilateral_free(b);
   }
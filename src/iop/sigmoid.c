@@ -24,6 +24,7 @@
 #include "common/custom_primaries.h"
 #include "common/math.h"
 #include "common/matrices.h"
+#include "common/vector_math.h"
 #include "develop/imageop.h"
 #include "develop/imageop_gui.h"
 #include "develop/openmp_maths.h"
@@ -212,7 +213,8 @@ const char **description(struct dt_iop_module_t *self)
 
 int flags()
 {
-  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING;
+  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_POINTWISE
+    | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 int default_group()
@@ -309,7 +311,7 @@ static inline float _generalized_loglogistic_sigmoid(const float value,
                                                      const float film_power,
                                                      const float paper_power)
 {
-  const float clamped_value = fmaxf(value, 0.0f);
+  const float clamped_value = MAX(value, 0.0f);
   // The following equation can be derived as a model for film + paper but it has a pole at 0
   // magnitude * powf(1.0f + paper_exp * powf(film_fog + value, -film_power), -paper_power);
   // Rewritten on a stable around zero form:
@@ -705,6 +707,110 @@ static inline void _preserve_hue_and_energy(const dt_aligned_pixel_t pix_in,
   }
 }
 
+// the per channel path works on blocks of pixels: the curve of a whole
+// block is evaluated in one plain loop, which the compiler vectorizes
+// together with its powf() calls (using the vector math library where the
+// c library has one) at the width of the codepath it is compiled for
+#define SIGMOID_BLOCK 16
+
+static inline __attribute__((always_inline)) void _per_channel_pixels(const float *const restrict in,
+                                                                      float *const restrict out,
+                                                                      const size_t npixels,
+                                                                      const dt_colormatrix_t pipe_to_base,
+                                                                      const dt_colormatrix_t base_to_rendering,
+                                                                      const dt_colormatrix_t rendering_to_pipe,
+                                                                      const float white_target,
+                                                                      const float paper_exp,
+                                                                      const float film_fog,
+                                                                      const float contrast_power,
+                                                                      const float skew_power,
+                                                                      const float hue_preservation)
+{
+  for(size_t start = 0; start < npixels; start += SIGMOID_BLOCK)
+  {
+    const size_t n = MIN(SIGMOID_BLOCK, npixels - start);
+    const float *const restrict block_in = in + 4 * start;
+    float *const restrict block_out = out + 4 * start;
+    float DT_ALIGNED_ARRAY rendering_RGB[4 * SIGMOID_BLOCK];
+    float DT_ALIGNED_ARRAY per_channel[4 * SIGMOID_BLOCK];
+
+    for(size_t i = 0; i < n; i++)
+    {
+      dt_aligned_pixel_t pix_in_base, pix_in_strict_positive;
+
+      // Convert to "base primaries"
+      dt_apply_transposed_color_matrix(block_in + 4 * i, pipe_to_base, pix_in_base);
+
+      // Force negative values to zero
+      _desaturate_negative_values(pix_in_base, pix_in_strict_positive);
+
+      dt_apply_transposed_color_matrix(pix_in_strict_positive, base_to_rendering, rendering_RGB + 4 * i);
+    }
+
+    for(size_t k = 0; k < 4 * n; k++)
+      per_channel[k] = _generalized_loglogistic_sigmoid(rendering_RGB[k], white_target, paper_exp, film_fog,
+                                                        contrast_power, skew_power);
+
+    for(size_t i = 0; i < n; i++)
+    {
+      // Hue correction by scaling the middle value relative to the max and min values.
+      dt_iop_sigmoid_value_order_t pixel_value_order;
+      dt_aligned_pixel_t per_channel_hue_corrected;
+      _pixel_channel_order(rendering_RGB + 4 * i, &pixel_value_order);
+      _preserve_hue_and_energy(rendering_RGB + 4 * i, per_channel + 4 * i, per_channel_hue_corrected,
+                               pixel_value_order, hue_preservation);
+      dt_apply_transposed_color_matrix(per_channel_hue_corrected, rendering_to_pipe, block_out + 4 * i);
+
+      // Copy over the alpha channel
+      block_out[4 * i + 3] = block_in[4 * i + 3];
+    }
+  }
+}
+
+typedef void((*_per_channel_row_t)(const float *const restrict in, float *const restrict out,
+                                   const size_t npixels, const dt_colormatrix_t pipe_to_base,
+                                   const dt_colormatrix_t base_to_rendering,
+                                   const dt_colormatrix_t rendering_to_pipe, const float white_target,
+                                   const float paper_exp, const float film_fog, const float contrast_power,
+                                   const float skew_power, const float hue_preservation));
+
+static void _per_channel_row_generic(const float *const restrict in, float *const restrict out,
+                                     const size_t npixels, const dt_colormatrix_t pipe_to_base,
+                                     const dt_colormatrix_t base_to_rendering,
+                                     const dt_colormatrix_t rendering_to_pipe, const float white_target,
+                                     const float paper_exp, const float film_fog, const float contrast_power,
+                                     const float skew_power, const float hue_preservation)
+{
+  _per_channel_pixels(in, out, npixels, pipe_to_base, base_to_rendering, rendering_to_pipe, white_target,
+                      paper_exp, film_fog, contrast_power, skew_power, hue_preservation);
+}
+
+#ifdef DT_CODEPATH_VARIANTS
+__DT_TARGET_AVX2__
+static void _per_channel_row_avx2(const float *const restrict in, float *const restrict out,
+                                  const size_t npixels, const dt_colormatrix_t pipe_to_base,
+                                  const dt_colormatrix_t base_to_rendering,
+                                  const dt_colormatrix_t rendering_to_pipe, const float white_target,
+                                  const float paper_exp, const float film_fog, const float contrast_power,
+                                  const float skew_power, const float hue_preservation)
+{
+  _per_channel_pixels(in, out, npixels, pipe_to_base, base_to_rendering, rendering_to_pipe, white_target,
+                      paper_exp, film_fog, contrast_power, skew_power, hue_preservation);
+}
+
+__DT_TARGET_AVX512__
+static void _per_channel_row_avx512(const float *const restrict in, float *const restrict out,
+                                    const size_t npixels, const dt_colormatrix_t pipe_to_base,
+                                    const dt_colormatrix_t base_to_rendering,
+                                    const dt_colormatrix_t rendering_to_pipe, const float white_target,
+                                    const float paper_exp, const float film_fog, const float contrast_power,
+                                    const float skew_power, const float hue_preservation)
+{
+  _per_channel_pixels(in, out, npixels, pipe_to_base, base_to_rendering, rendering_to_pipe, white_target,
+                      paper_exp, film_fog, contrast_power, skew_power, hue_preservation);
+}
+#endif
+
 void process_loglogistic_per_channel(struct dt_develop_t *dev,
                                      dt_dev_pixelpipe_iop_t *piece,
                                      const void *const ivoid, void *const ovoid,
@@ -715,7 +821,8 @@ void process_loglogistic_per_channel(struct dt_develop_t *dev,
 
   const float *const in = (const float *)ivoid;
   float *const out = (float *)ovoid;
-  const size_t npixels = (size_t)roi_in->width * roi_in->height;
+  const size_t width = roi_in->width;
+  const size_t height = roi_in->height;
 
   const float white_target = module_data->white_target;
   const float paper_exp = module_data->paper_exposure;
@@ -729,40 +836,14 @@ void process_loglogistic_per_channel(struct dt_develop_t *dev,
   dt_colormatrix_t pipe_to_base, base_to_rendering, rendering_to_pipe;
   _calculate_adjusted_primaries(module_data, pipe_work_profile, base_profile, pipe_to_base, base_to_rendering, rendering_to_pipe);
 
-  DT_OMP_FOR()
-  for(size_t k = 0; k < 4 * npixels; k += 4)
-  {
-    const float *const restrict pix_in = in + k;
-    float *const restrict pix_out = out + k;
-    dt_aligned_pixel_t pix_in_base, pix_in_strict_positive;
-    dt_aligned_pixel_t per_channel;
-
-    // Convert to "base primaries"
-    dt_apply_transposed_color_matrix(pix_in, pipe_to_base, pix_in_base);
-
-    // Force negative values to zero
-    _desaturate_negative_values(pix_in_base, pix_in_strict_positive);
+  const _per_channel_row_t per_channel_row =
+    dt_codepath_select(_per_channel_row_generic, _per_channel_row_avx2, _per_channel_row_avx512);
 
-    dt_aligned_pixel_t rendering_RGB;
-    dt_apply_transposed_color_matrix(pix_in_strict_positive, base_to_rendering, rendering_RGB);
-
-    for_each_channel(c, aligned(rendering_RGB, per_channel))
-    {
-      per_channel[c] = _generalized_loglogistic_sigmoid(rendering_RGB[c], white_target, paper_exp, film_fog,
-                                                        contrast_power, skew_power);
-    }
-
-    // Hue correction by scaling the middle value relative to the max and min values.
-    dt_iop_sigmoid_value_order_t pixel_value_order;
-    dt_aligned_pixel_t per_channel_hue_corrected;
-    _pixel_channel_order(rendering_RGB, &pixel_value_order);
-    _preserve_hue_and_energy(rendering_RGB, per_channel, per_channel_hue_corrected, pixel_value_order,
-                             hue_preservation);
-    dt_apply_transposed_color_matrix(per_channel_hue_corrected, rendering_to_pipe, pix_out);
-
-    // Copy over the alpha channel
-    pix_out[3] = pix_in[3];
-  }
+  DT_OMP_FOR()
+  for(size_t row = 0; row < height; row++)
+    per_channel_row(in + 4 * width * row, out + 4 * width * row, width, pipe_to_base, base_to_rendering,
+                    rendering_to_pipe, white_target, paper_exp, film_fog, contrast_power, skew_power,
+                    hue_preservation);
 }
 
 /** process, all real work is done here. */
@@ -126,7 +126,7 @@ const char **description(struct dt_iop_module_t *self)
 int flags()
 {
   return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING
-         | IOP_FLAGS_TILING_FULL_ROI;
+         | IOP_FLAGS_TILING_FULL_ROI | IOP_FLAGS_PIPE_SHAREABLE;
 }
 
 int default_group()
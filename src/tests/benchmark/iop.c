@@ -0,0 +1,345 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * darktable-bench-iop runs the cpu process() of single modules in
+ * isolation on synthetic images of several sizes and with several thread
+ * counts, and reports the throughput in Mpix/s. the input images are
+ * generated from the unit test helpers and don't depend on any file, so
+ * the numbers are reproducible for a given build and machine.
+ *
+ * see README.txt for usage.
+ */
+
+#include "common/darktable.h"
+#include "common/iop_profile.h"
+#include "develop/develop.h"
+#include "develop/imageop.h"
+#include "develop/imageop_math.h"
+#include "develop/pixelpipe_hb.h"
+
+#include "../unittests/util/testimg.h"
+
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_MODULES "demosaic,exposure,colorbalancergb,channelmixerrgb,filmicrgb,sigmoid,denoiseprofile"
+#define DEFAULT_SIZES "1,4,16"
+#define DEFAULT_RUNS 5
+
+static void _usage(const char *prog)
+{
+  printf("usage: %s [options] [--core <darktable options>]\n"
+         "\n"
+         "  --modules OP1,OP2,...  modules to benchmark (default %s)\n"
+         "  --sizes S1,S2,...      image sizes in megapixels (default %s)\n"
+         "  --threads T1,T2,...    thread counts, 0 for all (default 1,half,all)\n"
+         "  --runs N               timed runs per measurement, best is reported (default %d)\n"
+         "  --codepaths C1,C2,...  kernel variants to compare: generic, avx2, avx512\n"
+         "                         (default the one selected at startup)\n",
+         prog, DEFAULT_MODULES, DEFAULT_SIZES, DEFAULT_RUNS);
+}
+
+// the bayer pattern of the mosaic given to modules working on raw data
+#define BENCH_FILTERS 0x94949494u
+
+// fill a float4 buffer by tiling a 16x256 rgb cube gradient, which covers
+// a wide range of colours and luminances without being uniform. with
+// filters, sample it through the cfa into a one channel mosaic instead.
+static float *_alloc_input(const int width,
+                           const int height,
+                           const uint32_t filters)
+{
+  Testimg *ti = testimg_gen_rgb_space(16);
+  const size_t ch = filters ? 1 : 4;
+  float *buf = dt_alloc_align_float(ch * width * height);
+  if(buf)
+  {
+    const size_t palette = (size_t)ti->width * ti->height;
+    for(size_t k = 0; k < (size_t)width * height; k++)
+    {
+      const float *p = ti->pixels + 4 * (k % palette);
+      if(filters)
+        buf[k] = p[FC(k / width, k % width, filters)];
+      else
+        for_four_channels(c)
+          buf[4 * k + c] = c == 3 ? 1.0f : p[c];
+    }
+  }
+  testimg_free(ti);
+  return buf;
+}
+
+// make the dummy pipe look like one processing a bayer raw
+static void _set_raw_input(dt_develop_t *dev,
+                           dt_dev_pixelpipe_t *pipe,
+                           dt_dev_pixelpipe_iop_t *piece)
+{
+  dev->image_storage.flags |= DT_IMAGE_RAW;
+  dev->image_storage.buf_dsc.filters = BENCH_FILTERS;
+  pipe->image = dev->image_storage;
+  pipe->dsc.filters = BENCH_FILTERS;
+  pipe->dsc.channels = 1;
+  pipe->dsc.datatype = TYPE_FLOAT;
+  for_four_channels(c)
+    pipe->dsc.processed_maximum[c] = 1.0f;
+  piece->colors = 1;
+}
+
+static const char *_codepath_name(void)
+{
+  return darktable.codepath.AVX512 ? "avx512" : darktable.codepath.AVX2 ? "avx2" : "generic";
+}
+
+// restrict the kernels to the named variant. returns FALSE if the cpu or
+// the build doesn't have it
+static gboolean _set_codepath(const dt_codepath_t detected,
+                              const char *name)
+{
+  darktable.codepath = detected;
+  if(!strcmp(name, "generic"))
+    darktable.codepath.AVX2 = darktable.codepath.AVX512 = 0;
+  else if(!strcmp(name, "avx2"))
+  {
+    darktable.codepath.AVX512 = 0;
+    return detected.AVX2;
+  }
+  else if(strcmp(name, "avx512") || !detected.AVX512)
+    return FALSE;
+  return TRUE;
+}
+
+static void _bench_module(dt_develop_t *dev,
+                          const char *op,
+                          const int *sizes,
+                          const int nsizes,
+                          const int *threads,
+                          const int nthreads,
+                          const int runs)
+{
+  dt_iop_module_so_t *so = dt_iop_get_module_so(op);
+  if(!so)
+  {
+    printf("%-16s not found\n", op);
+    return;
+  }
+
+  // dt_iop_load_module() frees the module on failure
+  dt_iop_module_t *module = calloc(1, sizeof(dt_iop_module_t));
+  if(dt_iop_load_module(module, so, dev))
+  {
+    printf("%-16s can't be loaded\n", op);
+    return;
+  }
+
+  for(int s = 0; s < nsizes; s++)
+  {
+    // roughly 3:2 images of the requested size
+    const int height = (int)sqrtf(sizes[s] * 1.0e6f / 1.5f);
+    const int width = (int)(1.5f * height);
+
+    dt_dev_pixelpipe_t pipe;
+    dt_dev_pixelpipe_init_dummy(&pipe, width, height);
+    pipe.iwidth = pipe.processed_width = width;
+    pipe.iheight = pipe.processed_height = height;
+    pipe.iscale = 1.0f;
+    dt_ioppr_set_pipe_work_profile_info(dev, &pipe, DT_COLORSPACE_LIN_REC2020, "",
+                                        DT_INTENT_PERCEPTUAL);
+    dt_ioppr_set_pipe_output_profile_info(dev, &pipe, DT_COLORSPACE_SRGB, "",
+                                          DT_INTENT_PERCEPTUAL);
+
+    // set up the piece the same way dt_dev_pixelpipe_create_nodes() does
+    dt_dev_pixelpipe_iop_t *piece = calloc(1, sizeof(dt_dev_pixelpipe_iop_t));
+    piece->enabled = TRUE;
+    piece->colors = 4;
+    piece->iscale = 1.0f;
+    piece->iwidth = width;
+    piece->iheight = height;
+    piece->module = module;
+    piece->pipe = &pipe;
+    piece->raster_masks = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                NULL, dt_free_align_ptr);
+    dt_iop_init_pipe(module, &pipe, piece);
+
+    const dt_image_t image = dev->image_storage;
+    const gboolean raw = module->default_colorspace(module, &pipe, piece) == IOP_CS_RAW;
+    if(raw) _set_raw_input(dev, &pipe, piece);
+    dt_iop_commit_params(module, module->default_params, module->default_blendop_params,
+                         &pipe, piece);
+
+    const dt_iop_roi_t roi_out = { 0, 0, width, height, 1.0f };
+    dt_iop_roi_t roi_in = roi_out;
+    module->modify_roi_in(module, piece, &roi_out, &roi_in);
+    piece->buf_in = roi_in;
+    piece->buf_out = roi_out;
+    piece->dsc_in = piece->dsc_out = pipe.dsc;
+
+    float *in = _alloc_input(roi_in.width, roi_in.height, raw ? BENCH_FILTERS : 0);
+    float *out = dt_alloc_align_float((size_t)4 * roi_out.width * roi_out.height);
+    const double mpix = roi_out.width * roi_out.height / 1.0e6;
+
+    for(int t = 0; in && out && t < nthreads; t++)
+    {
+      const int nt = threads[t] > 0 ? MIN(threads[t], dt_get_num_procs()) : dt_get_num_procs();
+      darktable.num_openmp_threads = nt;
+#ifdef _OPENMP
+      omp_set_num_threads(nt);
+#endif
+      // one untimed run to fault in the buffers and warm up the caches
+      module->process(module, piece, in, out, &roi_in, &roi_out);
+
+      double best = DBL_MAX;
+      for(int r = 0; r < runs; r++)
+      {
+        const double start = dt_get_wtime();
+        module->process(module, piece, in, out, &roi_in, &roi_out);
+        best = MIN(best, dt_get_wtime() - start);
+      }
+      printf("%-16s %-7s %5dx%-5d %3d threads %9.5fs %10.2f Mpix/s\n",
+             op, _codepath_name(), roi_out.width, roi_out.height, nt, best, mpix / best);
+      fflush(stdout);
+    }
+
+    dt_free_align(in);
+    dt_free_align(out);
+
+    module->cleanup_pipe(module, &pipe, piece);
+    dev->image_storage = image;
+    free(piece->blendop_data);
+    g_hash_table_destroy(piece->raster_masks);
+    free(piece);
+    dt_dev_pixelpipe_cleanup(&pipe);
+  }
+
+  dt_iop_cleanup_module(module);
+  free(module);
+}
+
+static int _parse_list(const char *str,
+                       int *list,
+                       const int max)
+{
+  gchar **tokens = g_strsplit(str, ",", -1);
+  int n = 0;
+  for(gchar **t = tokens; *t && n < max; t++)
+    if(**t) list[n++] = atoi(*t);
+  g_strfreev(tokens);
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *modules = DEFAULT_MODULES;
+  const char *sizes_str = DEFAULT_SIZES;
+  const char *threads_str = NULL;
+  const char *codepaths = NULL;
+  int runs = DEFAULT_RUNS;
+
+  int k = 1;
+  for(; k < argc; k++)
+  {
+    if(!strcmp(argv[k], "--modules") && argc > k + 1)
+      modules = argv[++k];
+    else if(!strcmp(argv[k], "--sizes") && argc > k + 1)
+      sizes_str = argv[++k];
+    else if(!strcmp(argv[k], "--threads") && argc > k + 1)
+      threads_str = argv[++k];
+    else if(!strcmp(argv[k], "--runs") && argc > k + 1)
+      runs = MAX(1, atoi(argv[++k]));
+    else if(!strcmp(argv[k], "--codepaths") && argc > k + 1)
+      codepaths = argv[++k];
+    else if(!strcmp(argv[k], "--core"))
+    {
+      k++;
+      break;
+    }
+    else
+    {
+      _usage(argv[0]);
+      exit(!strcmp(argv[k], "--help") || !strcmp(argv[k], "-h") ? 0 : 1);
+    }
+  }
+
+  // init dt without gui and without data.db, remaining arguments go to dt_init()
+  const int core_argc = argc - k;
+  char **dt_argv = calloc(core_argc + 6, sizeof(char *));
+  int dt_argc = 0;
+  dt_argv[dt_argc++] = argv[0];
+  dt_argv[dt_argc++] = "--library";
+  dt_argv[dt_argc++] = ":memory:";
+  dt_argv[dt_argc++] = "--conf";
+  dt_argv[dt_argc++] = "write_sidecar_files=never";
+  for(int i = 0; i < core_argc; i++)
+    dt_argv[dt_argc++] = argv[k + i];
+
+  if(dt_init(dt_argc, dt_argv, FALSE, FALSE, NULL)) exit(1);
+
+  int sizes[16];
+  const int nsizes = _parse_list(sizes_str, sizes, 16);
+
+  int threads[16];
+  int nthreads;
+  if(threads_str)
+    nthreads = _parse_list(threads_str, threads, 16);
+  else
+  {
+    const int procs = dt_get_num_procs();
+    nthreads = 0;
+    threads[nthreads++] = 1;
+    if(procs > 3) threads[nthreads++] = procs / 2;
+    if(procs > 1) threads[nthreads++] = procs;
+  }
+  const int all_threads = darktable.num_openmp_threads;
+
+  dt_develop_t dev;
+  dt_dev_init(&dev, FALSE);
+
+  const dt_codepath_t detected = darktable.codepath;
+  gchar **paths = g_strsplit(codepaths ? codepaths : _codepath_name(), ",", -1);
+  gchar **ops = g_strsplit(modules, ",", -1);
+  for(gchar **op = ops; *op; op++)
+    for(gchar **path = paths; **op && *path; path++)
+    {
+      if(!_set_codepath(detected, *path))
+        printf("%-16s %-7s not available\n", *op, *path);
+      else
+        _bench_module(&dev, *op, sizes, nsizes, threads, nthreads, runs);
+    }
+  g_strfreev(ops);
+  g_strfreev(paths);
+  darktable.codepath = detected;
+
+  darktable.num_openmp_threads = all_threads;
+#ifdef _OPENMP
+  omp_set_num_threads(all_threads);
+#endif
+
+  dt_dev_cleanup(&dev);
+  dt_cleanup();
+  free(dt_argv);
+
+  return 0;
+}
+
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on
@@ -0,0 +1,202 @@
+/*
+    This file is part of darktable,
+    Copyright (C) 2024 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * cmocka unit tests for common/halffloat.h, the storage format of the
+ * pixelpipe caches with pixelpipe_cache_half
+ *
+ * Please see README.md for more detailed documentation.
+ */
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "common/darktable.h"
+#include "common/halffloat.h"
+
+#ifdef _WIN32
+#include "win/main_wrapper.h"
+#endif
+
+// every finite half float survives the way through float unchanged
+static void test_roundtrip(void **state)
+{
+  for(uint32_t h = 0; h < 0x10000; h++)
+  {
+    if((h & 0x7c00) == 0x7c00) continue; // inf and nan
+    assert_int_equal(dt_float_to_half(dt_half_to_float((dt_half_t)h)), h);
+  }
+}
+
+// the error of pixel values stays below what 16 bit output can resolve
+static void test_precision(void **state)
+{
+  // from 2^-14 to 65504 in small relative steps
+  for(float x = 6.103515625e-05f; x <= 65504.0f; x *= 1.0001f)
+  {
+    const float y = dt_half_to_float(dt_float_to_half(x));
+    assert_true(fabsf(y - x) <= x * 0x1p-11f);
+    assert_true(dt_half_to_float(dt_float_to_half(-x)) == -y);
+  }
+
+  // below that the absolute error is at most half the smallest denormal
+  for(float x = 0.0f; x < 6.103515625e-05f; x += 1.0e-7f)
+  {
+    const float y = dt_half_to_float(dt_float_to_half(x));
+    assert_true(fabsf(y - x) <= 0x1p-25f);
+  }
+
+  // linear sRGB mid grey and typical 16 bit steps
+  for(int k = 0; k <= 65535; k += 257)
+  {
+    const float x = k / 65535.0f;
+    const float y = dt_half_to_float(dt_float_to_half(x));
+    assert_true(fabsf(y - x) < 0.5f / 65535.0f + 0x1p-11f * x);
+  }
+}
+
+static void test_specials(void **state)
+{
+  assert_int_equal(dt_float_to_half(0.0f), 0x0000);
+  assert_int_equal(dt_float_to_half(-0.0f), 0x8000);
+  assert_int_equal(dt_float_to_half(1.0f), 0x3c00);
+  assert_int_equal(dt_float_to_half(-2.0f), 0xc000);
+  assert_int_equal(dt_float_to_half(65504.0f), 0x7bff);
+
+  // saturation instead of infinity
+  assert_int_equal(dt_float_to_half(65520.0f), 0x7bff);
+  assert_int_equal(dt_float_to_half(1.0e10f), 0x7bff);
+  assert_int_equal(dt_float_to_half(-1.0e10f), 0xfbff);
+  assert_int_equal(dt_float_to_half(INFINITY), 0x7bff);
+  assert_int_equal(dt_float_to_half(-INFINITY), 0xfbff);
+
+  assert_true(isnan(dt_half_to_float(dt_float_to_half(NAN))));
+  assert_true(isinf(dt_half_to_float(0x7c00)));
+
+  // smallest denormal and ties to even
+  assert_true(dt_half_to_float(0x0001) == 0x1p-24f);
+  assert_int_equal(dt_float_to_half(0x1p-25f), 0x0000);
+  assert_int_equal(dt_float_to_half(0x1.8p-24f), 0x0002);
+  assert_int_equal(dt_float_to_half(1.0f + 0x1p-11f), 0x3c00);
+  assert_int_equal(dt_float_to_half(1.0f + 0x3p-11f), 0x3c02);
+}
+
+// more than a few chunks of the parallel converters, and a tail that
+// doesn't fill a vector
+#define BULK_N (3 * 64 * 1024 + 13)
+
+// the bulk converters give the same bits as the scalar ones, only NaN
+// payloads may differ
+static void _bulk_matches_scalar(void)
+{
+  float *in = malloc(sizeof(float) * BULK_N);
+  dt_half_t *half = malloc(sizeof(dt_half_t) * BULK_N);
+  float *out = malloc(sizeof(float) * BULK_N);
+  assert_non_null(in);
+  assert_non_null(half);
+  assert_non_null(out);
+
+  // floats from denormals to beyond the half range, both signs, and the
+  // specials at the start
+  const float specials[] = { 0.0f, -0.0f, NAN, INFINITY, -INFINITY, 65504.0f,
+                             65520.0f, -1.0e10f, 0x1p-25f, 0x1.8p-24f, 1.0f + 0x1p-11f };
+  const int nspecials = sizeof(specials) / sizeof(specials[0]);
+  for(int k = 0; k < BULK_N; k++)
+  {
+    const float x = 0x1p-26f * powf(1.00021f, (float)(k / 2));
+    in[k] = k < nspecials ? specials[k] : (k & 1) ? -x : x;
+  }
+
+  dt_float_to_half_buf(half, in, BULK_N);
+  for(int k = 0; k < BULK_N; k++)
+  {
+    if(isnan(in[k]))
+      assert_true(isnan(dt_half_to_float(half[k])));
+    else
+      assert_int_equal(half[k], dt_float_to_half(in[k]));
+  }
+
+  // every half float pattern
+  for(int k = 0; k < BULK_N; k++)
+    half[k] = (dt_half_t)(k * 0x10001u / 3);
+  for(uint32_t h = 0; h < 0x10000; h++)
+    half[h] = (dt_half_t)h;
+
+  dt_half_to_float_buf(out, half, BULK_N);
+  for(int k = 0; k < BULK_N; k++)
+  {
+    const float expected = dt_half_to_float(half[k]);
+    if(isnan(expected))
+      assert_true(isnan(out[k]));
+    else
+      assert_memory_equal(&out[k], &expected, sizeof(float));
+  }
+
+  free(in);
+  free(half);
+  free(out);
+}
+
+static void test_bulk_generic(void **state)
+{
+  const dt_codepath_t codepath = darktable.codepath;
+  darktable.codepath.AVX2 = darktable.codepath.AVX512 = 0;
+  _bulk_matches_scalar();
+  darktable.codepath = codepath;
+}
+
+// the F16C instructions, used on the avx2 codepath
+static void test_bulk_f16c(void **state)
+{
+#ifdef DT_CODEPATH_VARIANTS
+  if(!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("f16c"))
+    skip();
+
+  const dt_codepath_t codepath = darktable.codepath;
+  darktable.codepath.AVX2 = 1;
+  darktable.codepath.AVX512 = 0;
+  _bulk_matches_scalar();
+  darktable.codepath = codepath;
+#else
+  skip();
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_roundtrip),
+    cmocka_unit_test(test_precision),
+    cmocka_unit_test(test_specials),
+    cmocka_unit_test(test_bulk_generic),
+    cmocka_unit_test(test_bulk_f16c)
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
+// clang-format off
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.py
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-spaces modified;
+// clang-format on